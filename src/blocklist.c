@@ -0,0 +1,379 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+#include "hashlib.h"
+#include "log.h"
+
+/* Bloom filter sizing: ~10 bits per key and 7 probes is ~1% false positives */
+#define BLOCKLIST_BLOOM_BITS_PER_KEY 10
+#define BLOCKLIST_BLOOM_HASHES 7
+
+struct blocklist_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_keys;
+    uint32_t num_slots;     /* power of 2 */
+    uint32_t bloom_words;   /* 64 bit words, power of 2 */
+    uint32_t bloom_hashes;
+    uint32_t blob_size;
+    uint32_t reserved;
+};
+
+/* An empty slot has len == 0, empty keys are never stored */
+struct blocklist_slot {
+    uint32_t hash;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct blocklist {
+    void *base;
+    size_t size;
+    bool mapped;
+
+    const struct blocklist_header *header;
+    const uint64_t *bloom;
+    const struct blocklist_slot *slots;
+    const char *blob;
+};
+
+static uint32_t next_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/* Second hash for double hashing the Bloom filter, derived from the first */
+static inline uint32_t blocklist_hash2(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h | 1;
+}
+
+static size_t blocklist_layout(const struct blocklist_header *h) {
+    return sizeof(struct blocklist_header) +
+        (size_t)h->bloom_words * sizeof(uint64_t) +
+        (size_t)h->num_slots * sizeof(struct blocklist_slot) +
+        h->blob_size;
+}
+
+static void blocklist_attach(blocklist_t *bl) {
+    const char *p = bl->base;
+    bl->header = (const struct blocklist_header *)p;
+    p += sizeof(struct blocklist_header);
+    bl->bloom = (const uint64_t *)p;
+    p += bl->header->bloom_words * sizeof(uint64_t);
+    bl->slots = (const struct blocklist_slot *)p;
+    p += bl->header->num_slots * sizeof(struct blocklist_slot);
+    bl->blob = p;
+}
+
+bool blocklist_contains(const blocklist_t *bl, const char *key, size_t key_len, uint32_t hash) {
+    const struct blocklist_header *h = bl->header;
+    if (h->num_keys == 0) {
+        return false;
+    }
+
+    uint32_t bit_mask = h->bloom_words * 64 - 1;
+    uint32_t h2 = blocklist_hash2(hash);
+    uint32_t bit = hash;
+    for (uint32_t i = 0; i < h->bloom_hashes; i++) {
+        uint32_t b = bit & bit_mask;
+        if ((bl->bloom[b >> 6] & (1ULL << (b & 63))) == 0) {
+            return false;
+        }
+        bit += h2;
+    }
+
+    uint32_t slot_mask = h->num_slots - 1;
+    for (uint32_t i = hash & slot_mask; ; i = (i + 1) & slot_mask) {
+        const struct blocklist_slot *s = &bl->slots[i];
+        if (s->len == 0) {
+            return false;
+        }
+        if (s->hash == hash && s->len == key_len &&
+                memcmp(bl->blob + s->offset, key, key_len) == 0) {
+            return true;
+        }
+    }
+}
+
+size_t blocklist_size(const blocklist_t *bl) {
+    return bl->header->num_keys;
+}
+
+/**
+ * Insert a key into a blocklist under construction. Returns false if the
+ * key was already present.
+ */
+static bool blocklist_insert(blocklist_t *bl, const char *key, uint32_t key_len) {
+    struct blocklist_header *h = (struct blocklist_header *)bl->header;
+    struct blocklist_slot *slots = (struct blocklist_slot *)bl->slots;
+    char *blob = (char *)bl->blob;
+    uint32_t hash = stats_hash_key(key, key_len);
+
+    uint32_t slot_mask = h->num_slots - 1;
+    uint32_t i = hash & slot_mask;
+    while (slots[i].len != 0) {
+        if (slots[i].hash == hash && slots[i].len == key_len &&
+                memcmp(blob + slots[i].offset, key, key_len) == 0) {
+            return false;
+        }
+        i = (i + 1) & slot_mask;
+    }
+
+    slots[i].hash = hash;
+    slots[i].offset = h->blob_size;
+    slots[i].len = key_len;
+    memcpy(blob + h->blob_size, key, key_len);
+    h->blob_size += key_len;
+    h->num_keys++;
+
+    uint64_t *bloom = (uint64_t *)bl->bloom;
+    uint32_t bit_mask = h->bloom_words * 64 - 1;
+    uint32_t h2 = blocklist_hash2(hash);
+    uint32_t bit = hash;
+    for (uint32_t k = 0; k < h->bloom_hashes; k++) {
+        uint32_t b = bit & bit_mask;
+        bloom[b >> 6] |= 1ULL << (b & 63);
+        bit += h2;
+    }
+    return true;
+}
+
+/* Find the next key in a text buffer, trimming whitespace and comments */
+static const char *blocklist_next_key(const char **cursor, const char *end, size_t *key_len) {
+    while (*cursor < end) {
+        const char *line = *cursor;
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        *cursor = eol < end ? eol + 1 : end;
+
+        while (line < eol && (*line == ' ' || *line == '\t')) {
+            line++;
+        }
+        const char *last = eol;
+        while (last > line && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) {
+            last--;
+        }
+        if (last == line || *line == '#') {
+            continue;
+        }
+        *key_len = last - line;
+        return line;
+    }
+    return NULL;
+}
+
+int blocklist_parse(blocklist_t **bl, const char *text, size_t len) {
+    const char *end = text + len;
+    const char *cursor = text;
+    const char *key;
+    size_t key_len;
+    size_t num_lines = 0;
+    size_t blob_size = 0;
+
+    while ((key = blocklist_next_key(&cursor, end, &key_len)) != NULL) {
+        num_lines++;
+        blob_size += key_len;
+    }
+    if (num_lines > UINT32_MAX / 2 / BLOCKLIST_BLOOM_BITS_PER_KEY || blob_size > UINT32_MAX) {
+        stats_error_log("blocklist: too many keys");
+        return -1;
+    }
+
+    struct blocklist_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BLOCKLIST_MAGIC, sizeof(h.magic));
+    h.version = BLOCKLIST_VERSION;
+    h.num_slots = next_pow2(num_lines * 2 < 16 ? 16 : num_lines * 2);
+    h.bloom_words = next_pow2((num_lines * BLOCKLIST_BLOOM_BITS_PER_KEY + 63) / 64);
+    h.bloom_hashes = BLOCKLIST_BLOOM_HASHES;
+    h.blob_size = blob_size;
+
+    blocklist_t *b = calloc(1, sizeof(blocklist_t));
+    if (b == NULL) {
+        return -1;
+    }
+    b->size = blocklist_layout(&h);
+    b->base = calloc(1, b->size);
+    if (b->base == NULL) {
+        free(b);
+        return -1;
+    }
+
+    /* Keys are appended to the blob as they are inserted */
+    h.blob_size = 0;
+    memcpy(b->base, &h, sizeof(h));
+    blocklist_attach(b);
+
+    cursor = text;
+    while ((key = blocklist_next_key(&cursor, end, &key_len)) != NULL) {
+        blocklist_insert(b, key, key_len);
+    }
+
+    /* Duplicates leave unused space at the end of the blob */
+    b->size = blocklist_layout(b->header);
+    *bl = b;
+    return 0;
+}
+
+static int blocklist_map(blocklist_t **bl, int fd, size_t size, const char *path) {
+    if (size < sizeof(struct blocklist_header)) {
+        stats_error_log("blocklist: %s is truncated", path);
+        return -1;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        stats_error_log("blocklist: failed to map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const struct blocklist_header *h = base;
+    if (h->version != BLOCKLIST_VERSION ||
+            h->num_slots == 0 || (h->num_slots & (h->num_slots - 1)) != 0 ||
+            h->bloom_words == 0 || (h->bloom_words & (h->bloom_words - 1)) != 0 ||
+            h->bloom_hashes != BLOCKLIST_BLOOM_HASHES ||
+            h->num_keys >= h->num_slots ||
+            blocklist_layout(h) != size) {
+        stats_error_log("blocklist: %s has an invalid header", path);
+        munmap(base, size);
+        return -1;
+    }
+
+    blocklist_t *b = calloc(1, sizeof(blocklist_t));
+    if (b == NULL) {
+        munmap(base, size);
+        return -1;
+    }
+    b->base = base;
+    b->size = size;
+    b->mapped = true;
+    blocklist_attach(b);
+
+    /* Never trust offsets from disk */
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->num_slots; i++) {
+        const struct blocklist_slot *s = &b->slots[i];
+        if (s->len == 0) {
+            continue;
+        }
+        if ((uint64_t)s->offset + s->len > h->blob_size) {
+            stats_error_log("blocklist: %s has an invalid slot %u", path, i);
+            blocklist_destroy(b);
+            return -1;
+        }
+        used++;
+    }
+
+    /* Probes stop at an empty slot, which num_keys < num_slots leaves */
+    if (used != h->num_keys) {
+        stats_error_log("blocklist: %s has %u keys in its slots, expected %u",
+                        path, used, h->num_keys);
+        blocklist_destroy(b);
+        return -1;
+    }
+
+    *bl = b;
+    return 0;
+}
+
+int blocklist_load(blocklist_t **bl, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        stats_error_log("blocklist: failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        stats_error_log("blocklist: failed to stat %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+
+    char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n == sizeof(magic) && memcmp(magic, BLOCKLIST_MAGIC, sizeof(magic)) == 0) {
+        int rc = blocklist_map(bl, fd, size, path);
+        close(fd);
+        return rc;
+    }
+
+    char *text = malloc(size + 1);
+    if (text == NULL) {
+        close(fd);
+        return -1;
+    }
+    size_t off = 0;
+    while (off < size) {
+        n = pread(fd, text + off, size - off, off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += n;
+    }
+    close(fd);
+
+    int rc = blocklist_parse(bl, text, off);
+    free(text);
+    return rc;
+}
+
+int blocklist_save(const blocklist_t *bl, const char *path) {
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(tmp_len);
+    if (tmp == NULL) {
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        stats_error_log("blocklist: failed to open %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+    size_t written = fwrite(bl->base, 1, bl->size, f);
+    if (fclose(f) != 0 || written != bl->size || rename(tmp, path) != 0) {
+        stats_error_log("blocklist: failed to write %s: %s", path, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+void blocklist_destroy(blocklist_t *bl) {
+    if (bl == NULL) {
+        return;
+    }
+    if (bl->mapped) {
+        munmap(bl->base, bl->size);
+    } else {
+        free(bl->base);
+    }
+    free(bl);
+}
@@ -0,0 +1,62 @@
+#ifndef STATSRELAY_BLOCKLIST_H
+#define STATSRELAY_BLOCKLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A static set of exact metric names to drop. The set is an open
+ * addressing table of key hashes in front of a blob of key bytes, with a
+ * Bloom filter ahead of it so that the common "not blocked" answer only
+ * touches a few cache lines.
+ *
+ * The in-memory layout is also the on-disk format, so a compiled
+ * blocklist file is simply mmap'ed:
+ *
+ *   header | bloom words | slots | key blob
+ *
+ * Slots and the Bloom filter are keyed by stats_hash_key(), the same hash
+ * used to pick a backend, so a lookup never hashes the key again.
+ */
+
+#define BLOCKLIST_MAGIC "SRBL"
+#define BLOCKLIST_VERSION 1
+
+typedef struct blocklist blocklist_t;
+
+/**
+ * Load a blocklist from a file. Files starting with BLOCKLIST_MAGIC are
+ * mapped as compiled blocklists; anything else is read as text with one
+ * key per line, ignoring blank lines and lines starting with '#'.
+ * Returns 0 on success.
+ */
+int blocklist_load(blocklist_t **bl, const char *path);
+
+/**
+ * Build a blocklist from a text buffer in the format accepted by
+ * blocklist_load. Returns 0 on success.
+ */
+int blocklist_parse(blocklist_t **bl, const char *text, size_t len);
+
+/**
+ * Write the compiled form of a blocklist. The file is written next to
+ * path and renamed into place, so a running relay never reads a partial
+ * file. Returns 0 on success.
+ */
+int blocklist_save(const blocklist_t *bl, const char *path);
+
+/**
+ * Test a key against the blocklist. hash must be
+ * stats_hash_key(key, key_len).
+ */
+bool blocklist_contains(const blocklist_t *bl, const char *key, size_t key_len, uint32_t hash);
+
+/**
+ * Number of distinct keys in the blocklist
+ */
+size_t blocklist_size(const blocklist_t *bl);
+
+void blocklist_destroy(blocklist_t *bl);
+
+#endif  // STATSRELAY_BLOCKLIST_H
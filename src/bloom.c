@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+
+struct bloom {
+    /* a power of two number of bits */
+    uint64_t *bits;
+    uint32_t mask;
+};
+
+int bloom_init(bloom_t **bloom, size_t keys) {
+    if (keys == 0 || keys > (1U << 31) / BLOOM_BITS_PER_KEY) {
+        return -1;
+    }
+    bloom_t *b = calloc(1, sizeof(bloom_t));
+    if (b == NULL) {
+        return -1;
+    }
+    size_t nbits = 64;
+    while (nbits < keys * BLOOM_BITS_PER_KEY) {
+        nbits <<= 1;
+    }
+    b->mask = nbits - 1;
+    b->bits = calloc(nbits / 64, sizeof(uint64_t));
+    if (b->bits == NULL) {
+        free(b);
+        return -1;
+    }
+    *bloom = b;
+    return 0;
+}
+
+bool bloom_check_add(bloom_t *bloom, uint32_t hash) {
+    // Key hashes are not mixed well enough in their high bits to be split
+    // in two, so the second probe hash is a remix of the first, made odd
+    // to visit distinct bits
+    uint32_t h1 = hash;
+    uint32_t h2 = hash * 0x9e3779b1U;
+    h2 = (h2 ^ (h2 >> 15)) | 1;
+
+    bool present = true;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) & bloom->mask;
+        uint64_t word = 1ULL << (bit & 63);
+        if ((bloom->bits[bit >> 6] & word) == 0) {
+            present = false;
+            bloom->bits[bit >> 6] |= word;
+        }
+    }
+    return present;
+}
+
+void bloom_clear(bloom_t *bloom) {
+    memset(bloom->bits, 0, ((size_t)bloom->mask + 1) / 8);
+}
+
+size_t bloom_memory(bloom_t *bloom) {
+    return sizeof(bloom_t) + ((size_t)bloom->mask + 1) / 8;
+}
+
+void bloom_destroy(bloom_t *bloom) {
+    if (bloom == NULL) {
+        return;
+    }
+    free(bloom->bits);
+    free(bloom);
+}
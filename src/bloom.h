@@ -0,0 +1,42 @@
+#ifndef STATSRELAY_BLOOM_H
+#define STATSRELAY_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A Bloom filter over 32 bit key hashes, with BLOOM_BITS_PER_KEY bits
+ * and BLOOM_HASHES probes per expected key for a false positive rate
+ * near 1% at that many keys. The probes are derived from the one hash
+ * by double hashing (Kirsch and Mitzenmacher).
+ */
+typedef struct bloom bloom_t;
+
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+/**
+ * Size a filter for keys distinct hashes. Returns 0 on success.
+ */
+int bloom_init(bloom_t **bloom, size_t keys);
+
+/**
+ * Add a hash to the filter. Returns whether it was possibly in the
+ * filter already; false means it certainly was not.
+ */
+bool bloom_check_add(bloom_t *bloom, uint32_t hash);
+
+/**
+ * Empty the filter
+ */
+void bloom_clear(bloom_t *bloom);
+
+/**
+ * Bytes held by the filter
+ */
+size_t bloom_memory(bloom_t *bloom);
+
+void bloom_destroy(bloom_t *bloom);
+
+#endif  // STATSRELAY_BLOOM_H
@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pcre.h>
 
 #include "./filter.h"
@@ -7,8 +12,25 @@
 /* PCRE output vector buffer */
 #define OVECCOUNT 30    /* should be a multiple of 3 */
 
+/**
+ * Marker bytes used while expanding a simple regex into rules. They can
+ * never appear in a valid UTF-8 metric name, and regexes containing them
+ * are handed to PCRE instead.
+ */
+#define RULE_WILDCARD ((char)0xff)
+#define RULE_ANCHOR_START ((char)0xfe)
+#define RULE_ANCHOR_END ((char)0xfd)
+
+/* Upper bound on the rules a single regex may expand to */
+#define RULES_MAX_PATTERNS 4096
+
+/* Trie node flags */
+#define RULE_PREFIX 0x1
+#define RULE_EXACT 0x2
+
 typedef enum  {
     RE = 1,
+    RULES = 2,
 } FILTER_TYPE;
 
 typedef bool (*filter_f)(filter_t* filter, const char* input, int input_len);
@@ -22,8 +44,48 @@ typedef struct  {
 typedef struct {
     filter_common_t common;
     pcre* re;
+    pcre_extra* extra;
 } re_filter_t;
 
+typedef struct {
+    unsigned char c;
+    unsigned char flags;
+    int32_t child;
+    int32_t sibling;
+} rule_trie_node_t;
+
+typedef struct {
+    rule_trie_node_t* nodes;
+    size_t len;
+    size_t cap;
+} rule_trie_t;
+
+typedef struct {
+    char* s;
+    size_t len;
+} rule_str_t;
+
+typedef struct {
+    rule_str_t* v;
+    size_t n;
+} rule_set_t;
+
+typedef struct {
+    bool anchor_start;
+    bool anchor_end;
+    size_t nsegs;
+    rule_str_t* segs;
+} rule_glob_t;
+
+typedef struct {
+    filter_common_t common;
+    bool match_all;
+    rule_trie_t prefixes;   /* '^foo' and '^foo$' rules */
+    rule_trie_t suffixes;   /* 'foo$' rules, stored reversed */
+    rule_glob_t* globs;     /* everything with an inner '.*' or no anchor */
+    size_t nglobs;
+} rules_filter_t;
+
 /**
  * The matcher function for PCRE - one or more matches is a filter success.
  * and would allow the action given.
@@ -32,7 +94,7 @@ static bool re_match(filter_t* filter, const char* input, int input_len) {
     re_filter_t* ref = (re_filter_t*)filter;
     int ovector[OVECCOUNT];
 
-    int rc = pcre_exec(ref->re, NULL, input, input_len, 0, 0, ovector, OVECCOUNT);
+    int rc = pcre_exec(ref->re, ref->extra, input, input_len, 0, 0, ovector, OVECCOUNT);
     if (rc < 0) {
         switch (rc) {
             case PCRE_ERROR_NOMATCH:
@@ -59,21 +121,434 @@ int filter_re_create(filter_t** filter, const char* re, filter_t* next_filter) {
         return -1;
     }
 
+    /* Studying is best effort; without it pcre_exec simply runs slower */
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_extra* extra = pcre_study(pcre, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+    pcre_extra* extra = pcre_study(pcre, 0, &error);
+#endif
+    if (error != NULL) {
+        stats_log("Filter study failed: '%s' (regexp: '%s')", error, re);
+        extra = NULL;
+    }
+
     re_filter_t* ref = calloc(1, sizeof(re_filter_t));
     ref->common.type = RE;
     ref->common.filter = re_match;
     ref->common.next = next_filter;
     ref->re = pcre;
+    ref->extra = extra;
     *filter = (filter_t*)ref;
 
     return 0;
 }
 
+static int32_t rule_trie_node(rule_trie_t* trie, unsigned char c) {
+    if (trie->len == trie->cap) {
+        size_t cap = trie->cap ? trie->cap * 2 : 64;
+        rule_trie_node_t* nodes = realloc(trie->nodes, cap * sizeof(rule_trie_node_t));
+        if (nodes == NULL)
+            return -1;
+        trie->nodes = nodes;
+        trie->cap = cap;
+    }
+    rule_trie_node_t* n = &trie->nodes[trie->len];
+    n->c = c;
+    n->flags = 0;
+    n->child = -1;
+    n->sibling = -1;
+    return (int32_t)trie->len++;
+}
+
+static inline int32_t rule_trie_child(const rule_trie_t* trie, int32_t node, unsigned char c) {
+    int32_t i = trie->nodes[node].child;
+    while (i >= 0 && trie->nodes[i].c != c)
+        i = trie->nodes[i].sibling;
+    return i;
+}
+
+static bool rule_trie_insert(rule_trie_t* trie, const char* s, size_t len,
+        bool reversed, unsigned char flag) {
+    if (trie->len == 0 && rule_trie_node(trie, 0) < 0)
+        return false;
+
+    int32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[reversed ? len - i - 1 : i];
+        int32_t next = rule_trie_child(trie, node, c);
+        if (next < 0) {
+            next = rule_trie_node(trie, c);
+            if (next < 0)
+                return false;
+            trie->nodes[next].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = next;
+        }
+        node = next;
+    }
+    trie->nodes[node].flags |= flag;
+    return true;
+}
+
+/**
+ * Walk the input (backwards for the suffix trie) and stop at the first
+ * node that terminates a prefix rule.
+ */
+static bool rule_trie_match(const rule_trie_t* trie, const char* input, int input_len, bool reversed) {
+    if (trie->len == 0)
+        return false;
+
+    int32_t node = 0;
+    for (int i = 0; i < input_len; i++) {
+        unsigned char c = (unsigned char)input[reversed ? input_len - i - 1 : i];
+        node = rule_trie_child(trie, node, c);
+        if (node < 0)
+            return false;
+        if (trie->nodes[node].flags & RULE_PREFIX)
+            return true;
+    }
+    return (trie->nodes[node].flags & RULE_EXACT) != 0;
+}
+
+/**
+ * Leftmost placement of each segment is enough to decide whether the
+ * segments occur in order, so globs never need to backtrack.
+ */
+static bool rule_glob_match(const rule_glob_t* g, const char* input, int input_len) {
+    size_t first = 0, last = g->nsegs;
+    size_t pos = 0, end = (size_t)input_len;
+
+    if (g->anchor_start) {
+        const rule_str_t* seg = &g->segs[0];
+        if (seg->len > end || memcmp(input, seg->s, seg->len) != 0)
+            return false;
+        pos = seg->len;
+        first = 1;
+    }
+    if (g->anchor_end) {
+        const rule_str_t* seg = &g->segs[g->nsegs - 1];
+        if (seg->len > end - pos || memcmp(input + end - seg->len, seg->s, seg->len) != 0)
+            return false;
+        end -= seg->len;
+        last--;
+    }
+    for (size_t i = first; i < last; i++) {
+        const rule_str_t* seg = &g->segs[i];
+        const char* p = memmem(input + pos, end - pos, seg->s, seg->len);
+        if (p == NULL)
+            return false;
+        pos = (size_t)(p - input) + seg->len;
+    }
+    return true;
+}
+
+/**
+ * Metric names never contain a newline, so '$' and '.*' behave the same
+ * here as they do in PCRE for every key that reaches a filter.
+ */
+static bool rules_match(filter_t* filter, const char* input, int input_len) {
+    rules_filter_t* rf = (rules_filter_t*)filter;
+
+    if (rf->match_all)
+        return true;
+    if (rule_trie_match(&rf->prefixes, input, input_len, false))
+        return true;
+    if (rule_trie_match(&rf->suffixes, input, input_len, true))
+        return true;
+    for (size_t i = 0; i < rf->nglobs; i++) {
+        if (rule_glob_match(&rf->globs[i], input, input_len))
+            return true;
+    }
+    return false;
+}
+
+static void rule_set_free(rule_set_t* set) {
+    for (size_t i = 0; i < set->n; i++)
+        free(set->v[i].s);
+    free(set->v);
+    set->v = NULL;
+    set->n = 0;
+}
+
+static bool rule_set_add(rule_set_t* set, char* s, size_t len) {
+    if (set->n >= RULES_MAX_PATTERNS) {
+        free(s);
+        return false;
+    }
+    rule_str_t* v = realloc(set->v, (set->n + 1) * sizeof(rule_str_t));
+    if (v == NULL) {
+        free(s);
+        return false;
+    }
+    set->v = v;
+    set->v[set->n].s = s;
+    set->v[set->n].len = len;
+    set->n++;
+    return true;
+}
+
+static bool rule_set_append(rule_set_t* set, char c) {
+    for (size_t i = 0; i < set->n; i++) {
+        rule_str_t* r = &set->v[i];
+        if (c == RULE_WILDCARD && r->len > 0 && r->s[r->len - 1] == RULE_WILDCARD)
+            continue;
+        char* s = realloc(r->s, r->len + 1);
+        if (s == NULL)
+            return false;
+        s[r->len++] = c;
+        r->s = s;
+    }
+    return true;
+}
+
+/* Replace every string in set with its concatenation with each tail */
+static bool rule_set_product(rule_set_t* set, const rule_set_t* tails) {
+    if (set->n * tails->n > RULES_MAX_PATTERNS)
+        return false;
+
+    rule_set_t out = { NULL, 0 };
+    for (size_t i = 0; i < set->n; i++) {
+        for (size_t j = 0; j < tails->n; j++) {
+            const rule_str_t* a = &set->v[i];
+            const rule_str_t* b = &tails->v[j];
+            size_t skip = (a->len > 0 && b->len > 0 &&
+                    a->s[a->len - 1] == RULE_WILDCARD && b->s[0] == RULE_WILDCARD) ? 1 : 0;
+            char* s = malloc(a->len + b->len + 1);
+            if (s == NULL) {
+                rule_set_free(&out);
+                return false;
+            }
+            memcpy(s, a->s, a->len);
+            memcpy(s + a->len, b->s + skip, b->len - skip);
+            if (!rule_set_add(&out, s, a->len + b->len - skip)) {
+                rule_set_free(&out);
+                return false;
+            }
+        }
+    }
+    rule_set_free(set);
+    *set = out;
+    return true;
+}
+
+static bool rule_parse_alt(const char** p, int depth, rule_set_t* out);
+
+/**
+ * Parse one branch of an alternation. Only literals, escaped
+ * punctuation, '.*', groups and anchors at the very start or end of a
+ * top-level branch are accepted; anything else makes the regex complex.
+ */
+static bool rule_parse_seq(const char** p, int depth, rule_set_t* out) {
+    char* empty_str = malloc(1);
+    if (empty_str == NULL || !rule_set_add(out, empty_str, 0))
+        return false;
+
+    bool empty = true;
+    while (**p != '\0' && **p != '|' && **p != ')') {
+        char c = *(*p)++;
+        bool ok = true;
+        switch (c) {
+            case '^':
+                ok = depth == 0 && empty && rule_set_append(out, RULE_ANCHOR_START);
+                break;
+            case '$':
+                ok = depth == 0 && (**p == '\0' || **p == '|') &&
+                    rule_set_append(out, RULE_ANCHOR_END);
+                break;
+            case '\\':
+                c = *(*p)++;
+                ok = c != '\0' && !isalnum((unsigned char)c) &&
+                    (unsigned char)c < (unsigned char)RULE_ANCHOR_END &&
+                    rule_set_append(out, c);
+                break;
+            case '.':
+                if (**p != '*')
+                    return false;
+                (*p)++;
+                ok = rule_set_append(out, RULE_WILDCARD);
+                break;
+            case '(':
+                {
+                    if (**p == '?') {
+                        if ((*p)[1] != ':')
+                            return false;
+                        *p += 2;
+                    }
+                    rule_set_t sub = { NULL, 0 };
+                    ok = rule_parse_alt(p, depth + 1, &sub) && **p == ')';
+                    if (ok) {
+                        (*p)++;
+                        ok = rule_set_product(out, &sub);
+                    }
+                    rule_set_free(&sub);
+                }
+                break;
+            case '[':
+            case ']':
+            case '{':
+            case '}':
+            case '*':
+            case '+':
+            case '?':
+                return false;
+            default:
+                ok = (unsigned char)c < (unsigned char)RULE_ANCHOR_END && rule_set_append(out, c);
+                break;
+        }
+        if (!ok)
+            return false;
+        empty = false;
+    }
+    return true;
+}
+
+static bool rule_parse_alt(const char** p, int depth, rule_set_t* out) {
+    for (;;) {
+        rule_set_t seq = { NULL, 0 };
+        bool ok = rule_parse_seq(p, depth, &seq);
+        for (size_t i = 0; i < seq.n; i++) {
+            if (ok) {
+                ok = rule_set_add(out, seq.v[i].s, seq.v[i].len);
+            } else {
+                free(seq.v[i].s);
+            }
+        }
+        free(seq.v);
+        if (!ok)
+            return false;
+        if (**p != '|')
+            return true;
+        (*p)++;
+    }
+}
+
+static bool rules_add_glob(rules_filter_t* rf, const char* s, size_t len, bool start, bool end) {
+    rule_glob_t g = { start, end, 0, NULL };
+    size_t i = 0;
+    while (i < len) {
+        const char* w = memchr(s + i, RULE_WILDCARD, len - i);
+        size_t seg_len = (w ? (size_t)(w - s) : len) - i;
+        if (seg_len > 0) {
+            rule_str_t* segs = realloc(g.segs, (g.nsegs + 1) * sizeof(rule_str_t));
+            char* seg = malloc(seg_len);
+            if (segs == NULL || seg == NULL) {
+                free(seg);
+                g.segs = segs ? segs : g.segs;
+                goto fail;
+            }
+            memcpy(seg, s + i, seg_len);
+            g.segs = segs;
+            g.segs[g.nsegs].s = seg;
+            g.segs[g.nsegs].len = seg_len;
+            g.nsegs++;
+        }
+        i += seg_len + 1;
+    }
+
+    rule_glob_t* globs = realloc(rf->globs, (rf->nglobs + 1) * sizeof(rule_glob_t));
+    if (globs == NULL)
+        goto fail;
+    rf->globs = globs;
+    rf->globs[rf->nglobs++] = g;
+    return true;
+
+fail:
+    for (size_t j = 0; j < g.nsegs; j++)
+        free(g.segs[j].s);
+    free(g.segs);
+    return false;
+}
+
+/**
+ * Sort one expanded rule into the prefix trie, the suffix trie or the
+ * glob list. Leading and trailing '.*' only drop the matching anchor.
+ */
+static bool rules_add(rules_filter_t* rf, const char* s, size_t len) {
+    bool start = len > 0 && s[0] == RULE_ANCHOR_START;
+    if (start) {
+        s++;
+        len--;
+    }
+    bool end = len > 0 && s[len - 1] == RULE_ANCHOR_END;
+    if (end)
+        len--;
+    while (len > 0 && s[0] == RULE_WILDCARD) {
+        s++;
+        len--;
+        start = false;
+    }
+    while (len > 0 && s[len - 1] == RULE_WILDCARD) {
+        len--;
+        end = false;
+    }
+
+    if (len == 0 && !(start && end)) {
+        rf->match_all = true;
+        return true;
+    }
+    if (memchr(s, RULE_WILDCARD, len) != NULL || (!start && !end))
+        return rules_add_glob(rf, s, len, start, end);
+    if (start)
+        return rule_trie_insert(&rf->prefixes, s, len, false, end ? RULE_EXACT : RULE_PREFIX);
+    return rule_trie_insert(&rf->suffixes, s, len, true, RULE_PREFIX);
+}
+
+static void rules_free(rules_filter_t* rf) {
+    free(rf->prefixes.nodes);
+    free(rf->suffixes.nodes);
+    for (size_t i = 0; i < rf->nglobs; i++) {
+        for (size_t j = 0; j < rf->globs[i].nsegs; j++)
+            free(rf->globs[i].segs[j].s);
+        free(rf->globs[i].segs);
+    }
+    free(rf->globs);
+    free(rf);
+}
+
+int filter_rules_create(filter_t** filter, const char* re, filter_t* next_filter) {
+    rule_set_t rules = { NULL, 0 };
+    const char* p = re;
+
+    if (!rule_parse_alt(&p, 0, &rules) || *p != '\0') {
+        rule_set_free(&rules);
+        return 1;
+    }
+
+    rules_filter_t* rf = calloc(1, sizeof(rules_filter_t));
+    if (rf == NULL) {
+        rule_set_free(&rules);
+        return -1;
+    }
+    rf->common.type = RULES;
+    rf->common.filter = rules_match;
+    rf->common.next = next_filter;
+
+    for (size_t i = 0; i < rules.n; i++) {
+        if (!rules_add(rf, rules.v[i].s, rules.v[i].len)) {
+            stats_error_log("Unable to allocate filter rules (regexp: '%s')", re);
+            rule_set_free(&rules);
+            rules_free(rf);
+            return -1;
+        }
+    }
+    stats_debug_log("compiled filter '%s' into %zu rules", re, rules.n);
+    rule_set_free(&rules);
+
+    *filter = (filter_t*)rf;
+    return 0;
+}
+
+int filter_create(filter_t** filter, const char* re, filter_t* next_filter) {
+    int st = filter_rules_create(filter, re, next_filter);
+    if (st <= 0)
+        return st;
+    return filter_re_create(filter, re, next_filter);
+}
+
 bool filter_exec(filter_t* filter, const char* input, int input_len) {
     filter_common_t* cf = (filter_common_t*)filter;
     bool ret = true;
     while (cf != NULL) {
-        ret &= cf->filter(filter, input, input_len);
+        ret &= cf->filter((filter_t*)cf, input, input_len);
         cf = (filter_common_t*)cf->next;
     }
     return ret;
@@ -88,9 +563,19 @@ void filter_free(filter_t* filter) {
         case RE:
             {
                 re_filter_t* r = (re_filter_t*)filter;
+                if (r->extra != NULL) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+                    pcre_free_study(r->extra);
+#else
+                    pcre_free(r->extra);
+#endif
+                }
                 pcre_free(r->re);
                 free(filter);
             }
             break;
+        case RULES:
+            rules_free((rules_filter_t*)filter);
+            break;
     }
 }
@@ -15,6 +15,23 @@ typedef struct filter filter_t;
  */
 int filter_re_create(filter_t** filter, const char* re, filter_t* next_filter);
 
+/**
+ * Create a rule-list filter from a regex made only of literal
+ * prefixes, suffixes, exact names and '.*' globs, optionally
+ * grouped into alternations, e.g. "^(foo\.|bar\.baz)" or "\.count$".
+ * All rules are compiled into a prefix trie, a suffix trie and a
+ * short list of globs, so matching never backtracks.
+ * Returns 0 on success and 1 if the regex uses anything beyond that
+ * subset, in which case no filter is created.
+ */
+int filter_rules_create(filter_t** filter, const char* re, filter_t* next_filter);
+
+/**
+ * Create the cheapest filter able to evaluate the regex: a rule-list
+ * filter when the regex is simple enough, PCRE otherwise.
+ */
+int filter_create(filter_t** filter, const char* re, filter_t* next_filter);
+
 /**
  * Destroy a filter chain
  */
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter_cache.h"
+
+#define FILTER_CACHE_WAYS 2
+
+typedef struct filter_cache_entry {
+    uint32_t hash;
+    uint32_t key_len;
+    uint32_t key_alloc;
+    filter_cache_decision decision;
+    char *key; /* NULL when the slot is empty */
+} filter_cache_entry;
+
+/**
+ * A 2-way set associative table. Each set remembers which way was
+ * used last so that a miss replaces the older of the two entries.
+ */
+struct filter_cache {
+    size_t num_sets;
+    filter_cache_entry *entries;
+    unsigned char *last_used;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+int filter_cache_init(filter_cache_t **cache, size_t size) {
+    size_t num_sets = 1;
+    while (num_sets * FILTER_CACHE_WAYS < size) {
+        num_sets <<= 1;
+    }
+
+    struct filter_cache *c = calloc(1, sizeof(struct filter_cache));
+    if (c == NULL) {
+        return -1;
+    }
+    c->num_sets = num_sets;
+    c->entries = calloc(num_sets * FILTER_CACHE_WAYS, sizeof(filter_cache_entry));
+    c->last_used = calloc(num_sets, sizeof(unsigned char));
+    if (c->entries == NULL || c->last_used == NULL) {
+        free(c->entries);
+        free(c->last_used);
+        free(c);
+        return -1;
+    }
+
+    *cache = c;
+    return 0;
+}
+
+static inline size_t filter_cache_set(filter_cache_t *cache, uint32_t hash) {
+    return hash & (cache->num_sets - 1);
+}
+
+bool filter_cache_get(filter_cache_t *cache, const char *key, size_t key_len,
+        uint32_t hash, filter_cache_decision *decision) {
+    size_t set = filter_cache_set(cache, hash);
+    filter_cache_entry *ways = cache->entries + set * FILTER_CACHE_WAYS;
+
+    for (int w = 0; w < FILTER_CACHE_WAYS; w++) {
+        filter_cache_entry *e = &ways[w];
+        if (e->key != NULL && e->hash == hash && e->key_len == key_len &&
+                memcmp(e->key, key, key_len) == 0) {
+            cache->last_used[set] = w;
+            cache->hits++;
+            *decision = e->decision;
+            return true;
+        }
+    }
+    cache->misses++;
+    return false;
+}
+
+void filter_cache_put(filter_cache_t *cache, const char *key, size_t key_len,
+        uint32_t hash, filter_cache_decision decision) {
+    if (key_len > FILTER_CACHE_MAX_KEY_LEN) {
+        return;
+    }
+
+    size_t set = filter_cache_set(cache, hash);
+    filter_cache_entry *ways = cache->entries + set * FILTER_CACHE_WAYS;
+
+    /* Prefer an empty way, otherwise evict the one not used last */
+    int victim = !cache->last_used[set];
+    for (int w = 0; w < FILTER_CACHE_WAYS; w++) {
+        if (ways[w].key == NULL) {
+            victim = w;
+            break;
+        }
+    }
+
+    filter_cache_entry *e = &ways[victim];
+    if (e->key_alloc < key_len + 1) {
+        /* Round up so that the slot can be reused by most keys */
+        uint32_t alloc = (key_len + 64) & ~63u;
+        char *k = realloc(e->key, alloc);
+        if (k == NULL) {
+            return;
+        }
+        e->key = k;
+        e->key_alloc = alloc;
+    }
+    memcpy(e->key, key, key_len);
+    e->key[key_len] = '\0';
+    e->key_len = key_len;
+    e->hash = hash;
+    e->decision = decision;
+    cache->last_used[set] = victim;
+}
+
+void filter_cache_clear(filter_cache_t *cache) {
+    size_t n = cache->num_sets * FILTER_CACHE_WAYS;
+    for (size_t i = 0; i < n; i++) {
+        free(cache->entries[i].key);
+    }
+    memset(cache->entries, 0, n * sizeof(filter_cache_entry));
+    memset(cache->last_used, 0, cache->num_sets);
+}
+
+uint64_t filter_cache_hits(filter_cache_t *cache) {
+    return cache->hits;
+}
+
+uint64_t filter_cache_misses(filter_cache_t *cache) {
+    return cache->misses;
+}
+
+size_t filter_cache_capacity(filter_cache_t *cache) {
+    return cache->num_sets * FILTER_CACHE_WAYS;
+}
+
+void filter_cache_destroy(filter_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    filter_cache_clear(cache);
+    free(cache->entries);
+    free(cache->last_used);
+    free(cache);
+}
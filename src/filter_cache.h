@@ -0,0 +1,63 @@
+#ifndef STATSRELAY_FILTER_CACHE_H
+#define STATSRELAY_FILTER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Keys longer than this are never cached, which bounds the memory
+ * of a cache to roughly size * FILTER_CACHE_MAX_KEY_LEN bytes.
+ */
+#define FILTER_CACHE_MAX_KEY_LEN 256
+
+typedef struct filter_cache filter_cache_t;
+
+/**
+ * Outcome of running a group's ingress blacklist and filter over a key
+ */
+typedef enum {
+    FILTER_CACHE_PASS = 0,
+    FILTER_CACHE_REJECTED = 1,
+    FILTER_CACHE_FILTERED = 2
+} filter_cache_decision;
+
+/**
+ * Create a bounded decision cache holding at most 'size' keys
+ * (rounded up to a power of 2). Returns 0 on success.
+ */
+int filter_cache_init(filter_cache_t **cache, size_t size);
+
+/**
+ * Look up the cached decision for a key. The hash is the caller's
+ * precomputed key hash; the key itself is compared to rule out
+ * collisions. Returns true on a hit.
+ */
+bool filter_cache_get(filter_cache_t *cache, const char *key, size_t key_len,
+        uint32_t hash, filter_cache_decision *decision);
+
+/**
+ * Store a decision for a key, evicting an older entry if needed
+ */
+void filter_cache_put(filter_cache_t *cache, const char *key, size_t key_len,
+        uint32_t hash, filter_cache_decision decision);
+
+/**
+ * Drop every cached decision, e.g. when the filters are replaced
+ */
+void filter_cache_clear(filter_cache_t *cache);
+
+/**
+ * Number of lookups answered from / missing the cache
+ */
+uint64_t filter_cache_hits(filter_cache_t *cache);
+uint64_t filter_cache_misses(filter_cache_t *cache);
+
+/**
+ * Number of keys the cache can hold
+ */
+size_t filter_cache_capacity(filter_cache_t *cache);
+
+void filter_cache_destroy(filter_cache_t *cache);
+
+#endif  // STATSRELAY_FILTER_CACHE_H
@@ -3,25 +3,118 @@
 #include "hashmap.h"
 #include "hashlib.h"
 
-#define MAX_CAPACITY 0.75
+#define MAX_CAPACITY 0.8
 #define DEFAULT_CAPACITY 128
 
-// Basic hash entry.
+/**
+ * Keys shorter than this are stored inside the entry itself (with their
+ * terminating NUL), which keeps an entry at exactly one cache line.
+ */
+#define HASHMAP_INLINE_KEY 40
+
+/* Long keys are carved out of chunks of this size */
+#define HASHMAP_CHUNK_SIZE 65536
+
+/**
+ * Number of slots of the old table migrated by each put or delete while
+ * the map is growing. A table is doubled at MAX_CAPACITY, so the
+ * migration finishes long before the new table needs to grow again.
+ */
+#define HASHMAP_MIGRATE_SLOTS 64
+
+/**
+ * Open addressing entry. A stored hash of 0 marks an empty slot, real
+ * hashes of 0 are stored as 1 (see hashmap_fix_hash).
+ */
 typedef struct hashmap_entry {
-    size_t key_len;
-    char *key;
+    uint32_t hash;
+    uint32_t key_len;
     void *value;
     void *metadata;
-    struct hashmap_entry *next; // Support linking.
+    union {
+        char inline_key[HASHMAP_INLINE_KEY];
+        char *key;
+    } k;
 } hashmap_entry;
 
+typedef struct hashmap_table {
+    hashmap_entry *entries;
+    uint32_t size;  // Slots, a power of 2
+    uint32_t count; // Entries stored in this table
+} hashmap_table;
+
+typedef struct hashmap_chunk {
+    struct hashmap_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} hashmap_chunk;
+
+/**
+ * Growing the map allocates a table twice the size and then moves the
+ * entries of the old table over a few slots at a time, so no single put
+ * pays for rehashing the whole map. Until the old table is empty, lookups
+ * check both tables and new entries only go into the new one.
+ */
 struct hashmap {
     int count;      // Number of entries
-    int table_size; // Size of table in nodes
     int max_size;   // Max size before we resize
-    hashmap_entry *table; // Pointer to an array of hashmap_entry objects
+    hashmap_table table;
+    hashmap_table old;  // Table being migrated, entries == NULL if none
+    uint32_t migrate_start; // An empty slot of the old table
+    uint32_t migrate_done;  // Slots of the old table migrated so far
+
+    /* Arena holding keys of HASHMAP_INLINE_KEY bytes or more */
+    hashmap_chunk *arena;
+    size_t arena_size;  // bytes reserved in all chunks
+    size_t arena_live;  // bytes used by keys still in the map
+
+    /* Set while hashmap_iter runs, entries must not be relocated */
+    int iterating;
 };
 
+uint32_t hashmap_hash(const char *key, size_t key_len) {
+    return stats_hash_key(key, key_len);
+}
+
+static inline uint32_t hashmap_fix_hash(uint32_t hash) {
+    return hash == 0 ? 1 : hash;
+}
+
+static inline int hashmap_inline(size_t key_len) {
+    return key_len < HASHMAP_INLINE_KEY;
+}
+
+static inline const char *hashmap_entry_key(const hashmap_entry *entry) {
+    return hashmap_inline(entry->key_len) ? entry->k.inline_key : entry->k.key;
+}
+
+/**
+ * Distance of an entry from its home slot
+ */
+static inline uint32_t hashmap_probe_distance(const hashmap_table *t, uint32_t hash, uint32_t slot) {
+    uint32_t mask = t->size - 1;
+    return (slot - (hash & mask)) & mask;
+}
+
+static int hashmap_round_size(int initial_size) {
+    int size = 1;
+    while (size < initial_size) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static int hashmap_table_init(hashmap_table *t, uint32_t size) {
+    t->entries = (hashmap_entry *) calloc(size, sizeof(hashmap_entry));
+    if (t->entries == NULL) {
+        return -1;
+    }
+    t->size = size;
+    t->count = 0;
+    return 0;
+}
+
 /**
  * Creates a new hashmap and allocates space for it.
  * @arg initial_size The minimim initial size. 0 for default (64).
@@ -29,68 +122,47 @@ struct hashmap {
  * @return 0 on success.
  */
 int hashmap_init(int initial_size, hashmap **map) {
-    // Default to 64 if no size
+    // Default to 64 if no size, otherwise round up to a power of 2
     if (initial_size <= 0) {
         initial_size = DEFAULT_CAPACITY;
-
-        // Round up to power of 2
     } else {
-        int most_sig_bit = 0;
-        for (int idx = 0; idx < sizeof(initial_size) * 8; idx++) {
-            if ((initial_size >> idx) & 0x1)
-                most_sig_bit = idx;
-        }
-
-        // Round up if not a power of 2
-        if ((1 << most_sig_bit) != initial_size) {
-            most_sig_bit += 1;
-        }
-        initial_size = 1 << most_sig_bit;
+        initial_size = hashmap_round_size(initial_size);
     }
 
     // Allocate the map
     hashmap *m = calloc(1, sizeof(hashmap));
-    m->table_size = initial_size;
+    if (m == NULL) {
+        return -1;
+    }
     m->max_size = MAX_CAPACITY * initial_size;
 
     // Allocate the table
-    m->table = (hashmap_entry *) calloc(initial_size, sizeof(hashmap_entry));
+    if (hashmap_table_init(&m->table, initial_size) != 0) {
+        free(m);
+        return -1;
+    }
 
     // Return the table
     *map = m;
     return 0;
 }
 
+static void hashmap_arena_free(hashmap_chunk *chunk) {
+    while (chunk != NULL) {
+        hashmap_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
 /**
  * Destroys a map and cleans up all associated memory
  * @arg map The hashmap to destroy. Frees memory.
  */
 int hashmap_destroy(hashmap *map) {
-    // Free each entry
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i = 0; i < map->table_size; i++) {
-        entry = map->table + i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Clear the objects
-            free(old->key);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            }
-            in_table = 0;
-        }
-    }
-
-    // Free the table and hash map
-    free(map->table);
+    hashmap_arena_free(map->arena);
+    free(map->table.entries);
+    free(map->old.entries);
     free(map);
     return 0;
 }
@@ -102,169 +174,356 @@ int hashmap_size(hashmap *map) {
     return map->count;
 }
 
+double hashmap_load_factor(hashmap *map) {
+    return (double)map->table.count / map->table.size;
+}
+
+double hashmap_resize_progress(hashmap *map) {
+    if (map->old.entries == NULL) {
+        return 1.0;
+    }
+    return (double)map->migrate_done / map->old.size;
+}
+
+static char *hashmap_arena_alloc(hashmap *map, size_t len) {
+    hashmap_chunk *chunk = map->arena;
+    if (chunk == NULL || chunk->size - chunk->used < len) {
+        size_t size = len > HASHMAP_CHUNK_SIZE ? len : HASHMAP_CHUNK_SIZE;
+        chunk = malloc(sizeof(hashmap_chunk) + size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = map->arena;
+        map->arena = chunk;
+        map->arena_size += size;
+    }
+    char *p = chunk->data + chunk->used;
+    chunk->used += len;
+    map->arena_live += len;
+    return p;
+}
+
+static void hashmap_table_move_keys(hashmap_table *t, hashmap_chunk *chunk) {
+    for (uint32_t i = 0; i < t->size; i++) {
+        hashmap_entry *entry = t->entries + i;
+        if (entry->hash == 0 || entry->key_len < HASHMAP_INLINE_KEY) {
+            continue;
+        }
+        char *key = chunk->data + chunk->used;
+        memcpy(key, entry->k.key, entry->key_len + 1);
+        chunk->used += entry->key_len + 1;
+        entry->k.key = key;
+    }
+}
+
 /**
- * Returns the hash entry for key.
+ * Copy every long key into a fresh arena once most of the old one is
+ * held by deleted keys. This walks the whole map, so it is left to the
+ * owner to call from a timer rather than done on deletes.
  */
-static hashmap_entry *hashmap_index(hashmap_entry *table, int table_size,
-                                    const char *key, size_t key_len) {
-    // Mod the lower 64bits of the hash function with the table
-    // size to get the index
-    return table + (uint32_t)(murmur3_32(key, key_len, 0) % table_size);
+int hashmap_compact(hashmap *map) {
+    if (map->iterating || map->arena_size <= 4 * HASHMAP_CHUNK_SIZE ||
+            map->arena_size <= 2 * map->arena_live) {
+        return 0;
+    }
+
+    size_t live = map->arena_live;
+    hashmap_chunk *chunk = malloc(sizeof(hashmap_chunk) + live);
+    if (chunk == NULL) {
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->size = live;
+    chunk->used = 0;
+
+    hashmap_table_move_keys(&map->table, chunk);
+    if (map->old.entries != NULL) {
+        hashmap_table_move_keys(&map->old, chunk);
+    }
+
+    hashmap_arena_free(map->arena);
+    map->arena = chunk;
+    map->arena_size = live;
+    return 1;
+}
+
+static int hashmap_entry_set_key(hashmap *map, hashmap_entry *entry, const char *key, size_t key_len) {
+    char *dst;
+    if (hashmap_inline(key_len)) {
+        dst = entry->k.inline_key;
+    } else {
+        dst = hashmap_arena_alloc(map, key_len + 1);
+        if (dst == NULL) {
+            return -1;
+        }
+        entry->k.key = dst;
+    }
+    memcpy(dst, key, key_len);
+    dst[key_len] = '\0';
+    entry->key_len = key_len;
+    return 0;
 }
 
 /**
- * Returns if key equals the hashmap entry key.
+ * Returns the entry holding key in a table, or NULL.
  */
-static inline int hashmap_keys_equal(const hashmap_entry *entry, const char *key,
-                                     size_t key_len) {
-    return entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0;
+static hashmap_entry *hashmap_table_find(hashmap_table *t, const char *key, size_t key_len, uint32_t hash) {
+    uint32_t mask = t->size - 1;
+    uint32_t slot = hash & mask;
+
+    for (uint32_t dist = 0; ; dist++, slot = (slot + 1) & mask) {
+        hashmap_entry *entry = t->entries + slot;
+        // An empty slot or a richer entry ends the probe sequence
+        if (entry->hash == 0 || hashmap_probe_distance(t, entry->hash, slot) < dist) {
+            return NULL;
+        }
+        if (entry->hash == hash && entry->key_len == key_len &&
+                memcmp(hashmap_entry_key(entry), key, key_len) == 0) {
+            return entry;
+        }
+    }
 }
 
 /**
- * Gets a value.
- * @arg key The key to look for
- * @arg key_len The key length
- * @arg value Output. Set to the value of th key.
- * 0 on success. -1 if not found.
+ * Returns the entry holding value under a key hashing to hash, or NULL.
  */
-int hashmap_get(hashmap *map, const char *key, void **value) {
-    // Compute the hash value of the key
-    const size_t key_len = strlen(key);
-    hashmap_entry *entry = hashmap_index(map->table, map->table_size, key, key_len);
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it
-        if (hashmap_keys_equal(entry, key, key_len)) {
-            *value = entry->value;
-            return 0;
+static hashmap_entry *hashmap_table_find_value(hashmap_table *t, uint32_t hash, const void *value) {
+    uint32_t mask = t->size - 1;
+    uint32_t slot = hash & mask;
+
+    for (uint32_t dist = 0; ; dist++, slot = (slot + 1) & mask) {
+        hashmap_entry *entry = t->entries + slot;
+        if (entry->hash == 0 || hashmap_probe_distance(t, entry->hash, slot) < dist) {
+            return NULL;
+        }
+        if (entry->hash == hash && entry->value == value) {
+            return entry;
         }
+    }
+}
 
-        // Walk the chain
-        entry = entry->next;
+/**
+ * Find a key in the map, reporting which table holds it.
+ */
+static hashmap_entry *hashmap_find(hashmap *map, const char *key, size_t key_len, uint32_t hash,
+        hashmap_table **table) {
+    hashmap_entry *entry = hashmap_table_find(&map->table, key, key_len, hash);
+    *table = &map->table;
+    if (entry == NULL && map->old.entries != NULL) {
+        entry = hashmap_table_find(&map->old, key, key_len, hash);
+        *table = &map->old;
     }
+    return entry;
+}
 
-    // Not found
-    return -1;
+/**
+ * Robin Hood insert of an entry known to be absent from the table
+ */
+static void hashmap_table_insert(hashmap_table *t, const hashmap_entry *insert) {
+    uint32_t mask = t->size - 1;
+    uint32_t slot = insert->hash & mask;
+    uint32_t dist = 0;
+    hashmap_entry carry = *insert;
+
+    t->count++;
+    for (;; slot = (slot + 1) & mask, dist++) {
+        hashmap_entry *entry = t->entries + slot;
+        if (entry->hash == 0) {
+            *entry = carry;
+            return;
+        }
+        uint32_t existing = hashmap_probe_distance(t, entry->hash, slot);
+        if (existing < dist) {
+            hashmap_entry tmp = *entry;
+            *entry = carry;
+            carry = tmp;
+            dist = existing;
+        }
+    }
+}
+
+/**
+ * Remove the entry at slot, shifting the following cluster back by one.
+ * The key storage is left alone.
+ */
+static void hashmap_table_remove(hashmap_table *t, uint32_t slot) {
+    uint32_t mask = t->size - 1;
+
+    uint32_t next = (slot + 1) & mask;
+    while (t->entries[next].hash != 0 &&
+            hashmap_probe_distance(t, t->entries[next].hash, next) > 0) {
+        t->entries[slot] = t->entries[next];
+        slot = next;
+        next = (next + 1) & mask;
+    }
+    memset(t->entries + slot, 0, sizeof(hashmap_entry));
+    t->count--;
+}
+
+static void hashmap_remove_entry(hashmap *map, hashmap_table *t, hashmap_entry *entry) {
+    if (!hashmap_inline(entry->key_len)) {
+        map->arena_live -= entry->key_len + 1;
+    }
+    hashmap_table_remove(t, entry - t->entries);
+    map->count -= 1;
+}
+
+/**
+ * Returns a slot of the table right after which no entry wraps around,
+ * i.e. an empty slot.
+ */
+static uint32_t hashmap_table_empty_slot(const hashmap_table *t) {
+    uint32_t slot = 0;
+    while (t->entries[slot].hash != 0) {
+        slot++;
+    }
+    return slot;
+}
+
+static void hashmap_finish_migration(hashmap *map) {
+    free(map->old.entries);
+    memset(&map->old, 0, sizeof(hashmap_table));
+    map->migrate_done = 0;
 }
 
 /**
- * Internal method to insert into a hash table
- * @arg table The table to insert into
- * @arg table_size The size of the table
- * @arg key The key to insert
- * @arg key_len The length of the key
- * @arg value The value to associate
- * @arg metadata
- * @arg should_cmp Should keys be compared to existing ones.
- * @return 1 if the key is new, 0 if updated.
+ * Move up to 'slots' slots of the old table into the new one. Entries
+ * are popped from the old table with a backward shift, which keeps the
+ * remaining part of the old table a valid Robin Hood table for lookups.
  */
-static int hashmap_insert_table(hashmap_entry *table,
-        int table_size,
-        const char *key,
-        int key_len,
-        void *value,
-        void *metadata,
-        int should_cmp) {
-    // Look for an entry
-    hashmap_entry *entry = hashmap_index(table, table_size, key, key_len);
-    // last_entry governs if we saw any nodes with keys
-    hashmap_entry *last_entry = NULL;
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it, update the value
-        if (should_cmp && hashmap_keys_equal(entry, key, key_len)) {
-            entry->value = value;
-            return 0;
+static void hashmap_migrate(hashmap *map, uint32_t slots) {
+    if (map->old.entries == NULL || map->iterating) {
+        return;
+    }
+
+    hashmap_table *old = &map->old;
+    uint32_t mask = old->size - 1;
+    while (slots-- > 0 && map->migrate_done < old->size && old->count > 0) {
+        uint32_t slot = (map->migrate_start + 1 + map->migrate_done) & mask;
+        // Each popped entry may pull the next one of its cluster into slot
+        while (old->entries[slot].hash != 0) {
+            hashmap_table_insert(&map->table, old->entries + slot);
+            hashmap_table_remove(old, slot);
         }
+        map->migrate_done++;
+    }
 
-        // Walk the chain
-        last_entry = entry;
-        entry = entry->next;
+    if (old->count == 0 || map->migrate_done == old->size) {
+        hashmap_finish_migration(map);
     }
+}
 
-    if (entry == NULL && last_entry == NULL) {
+/**
+ * Start growing the map into a table twice the size
+ */
+static int hashmap_grow(hashmap *map) {
+    hashmap_table table;
+    if (hashmap_table_init(&table, map->table.size * 2) != 0) {
         return -1;
     }
+    map->old = map->table;
+    map->table = table;
+    map->max_size = MAX_CAPACITY * table.size;
+    map->migrate_start = hashmap_table_empty_slot(&map->old);
+    map->migrate_done = 0;
 
-    // We already know the key length - no point using strdup
-    char *insert_key = malloc(key_len + 1);
-    if (insert_key == NULL) {
+    hashmap_migrate(map, HASHMAP_MIGRATE_SLOTS);
+    return 0;
+}
+
+int hashmap_get_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash, void **value) {
+    hashmap_table *t;
+    hashmap_entry *entry = hashmap_find(map, key, key_len, hashmap_fix_hash(hash), &t);
+    if (entry == NULL) {
         return -1;
     }
-    memcpy(insert_key, key, key_len + 1);
+    *value = entry->value;
+    return 0;
+}
 
-    // If last entry is NULL, we can just insert directly into the
-    // table slot since it is empty
-    if (last_entry == NULL) {
-        entry->key_len = key_len;
-        entry->key = insert_key;
-        entry->value = value;
-        entry->metadata = metadata;
-        entry->next = NULL;
+int hashmap_put_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash,
+        void *value, void *metadata) {
+    hash = hashmap_fix_hash(hash);
 
-    // We have a last value, need to link against it with our new
-    // value.
-    } else {
-        entry = calloc(1, sizeof(hashmap_entry));
-        if (entry == NULL) {
-            free(insert_key);
+    hashmap_table *t;
+    hashmap_entry *found = hashmap_find(map, key, key_len, hash, &t);
+    if (found != NULL) {
+        found->value = value;
+        return 0;
+    }
+
+    // Check if we need to grow, otherwise help an ongoing migration along
+    if (map->count + 1 > map->max_size && !map->iterating && map->old.entries == NULL) {
+        if (hashmap_grow(map) != 0) {
             return -1;
         }
-        entry->key_len = key_len;
-        entry->key = insert_key;
-        entry->value = value;
-        entry->metadata = metadata;
-        last_entry->next = entry;
+    } else {
+        hashmap_migrate(map, HASHMAP_MIGRATE_SLOTS);
+    }
+
+    hashmap_entry entry;
+    entry.hash = hash;
+    entry.value = value;
+    entry.metadata = metadata;
+    if (hashmap_entry_set_key(map, &entry, key, key_len) != 0) {
+        return -1;
     }
+    hashmap_table_insert(&map->table, &entry);
+    map->count += 1;
     return 1;
 }
 
-/**
- * Internal method to double the size of a hashmap
- */
-static void hashmap_double_size(hashmap *map) {
-    // Calculate the new sizes
-    int new_size = map->table_size * 2;
-    int new_max_size = map->max_size * 2;
+int hashmap_delete_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash) {
+    hashmap_table *t;
+    hashmap_entry *entry = hashmap_find(map, key, key_len, hashmap_fix_hash(hash), &t);
+    if (entry == NULL) {
+        return -1;
+    }
+    hashmap_remove_entry(map, t, entry);
+    hashmap_migrate(map, HASHMAP_MIGRATE_SLOTS);
+    return 0;
+}
 
-    // Allocate the table
-    hashmap_entry *new_table = (hashmap_entry *) calloc(new_size, sizeof(hashmap_entry));
-
-    // Move each entry
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i = 0; i < map->table_size; i++) {
-        entry = map->table + i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Insert the value in the new map
-            // Do not compare keys or duplicate since we are just doubling our
-            // size, and we have unique keys and duplicates already.
-            hashmap_insert_table(new_table, new_size, old->key, strlen(old->key),
-                                 old->value, old->metadata, 0);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            }
-            in_table = 0;
-        }
+int hashmap_delete_value(hashmap *map, uint32_t hash, const void *value) {
+    hash = hashmap_fix_hash(hash);
+    hashmap_table *t = &map->table;
+    hashmap_entry *entry = hashmap_table_find_value(t, hash, value);
+    if (entry == NULL && map->old.entries != NULL) {
+        t = &map->old;
+        entry = hashmap_table_find_value(t, hash, value);
     }
+    if (entry == NULL) {
+        return -1;
+    }
+    hashmap_remove_entry(map, t, entry);
+    hashmap_migrate(map, HASHMAP_MIGRATE_SLOTS);
+    return 0;
+}
 
-    // Free the old table
-    free(map->table);
+const char *hashmap_value_key(hashmap *map, uint32_t hash, const void *value, size_t *key_len) {
+    hash = hashmap_fix_hash(hash);
+    hashmap_entry *entry = hashmap_table_find_value(&map->table, hash, value);
+    if (entry == NULL && map->old.entries != NULL) {
+        entry = hashmap_table_find_value(&map->old, hash, value);
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    *key_len = entry->key_len;
+    return hashmap_entry_key(entry);
+}
 
-    // Update the pointers
-    map->table = new_table;
-    map->table_size = new_size;
-    map->max_size = new_max_size;
+/**
+ * Gets a value.
+ * @arg key The key to look for
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get(hashmap *map, const char *key, void **value) {
+    const size_t key_len = strlen(key);
+    return hashmap_get_hashed(map, key, key_len, hashmap_hash(key, key_len), value);
 }
 
 /**
@@ -272,26 +531,13 @@ static void hashmap_double_size(hashmap *map) {
  * @arg key The key to set. This is copied, and a seperate
  * version is owned by the hashmap. The caller the key at will.
  * @notes This method is not thread safe.
- * @arg key_len The key length
  * @arg value The value to set.
  * @arg metadata arbitrary information
  * 0 if updated, 1 if added.
  */
 int hashmap_put(hashmap *map, const char *key, void *value, void *metadata) {
-    // Check if we need to double the size
-    if (map->count + 1 > map->max_size) {
-        // Doubles the size of the hashmap, re-try the insert
-        hashmap_double_size(map);
-        return hashmap_put(map, key, value, metadata);
-    }
-
-    // Insert into the map, comparing keys and duplicating keys
-    int new = hashmap_insert_table(map->table, map->table_size, key,
-                                   strlen(key), value, metadata, 1);
-    if (new > 0) {
-        map->count += 1;
-    }
-    return new;
+    const size_t key_len = strlen(key);
+    return hashmap_put_hashed(map, key, key_len, hashmap_hash(key, key_len), value, metadata);
 }
 
 /**
@@ -301,56 +547,8 @@ int hashmap_put(hashmap *map, const char *key, void *value, void *metadata) {
  * 0 on success. -1 if not found.
  */
 int hashmap_delete(hashmap *map, const char *key) {
-    // Compute the hash value of the key
     const size_t key_len = strlen(key);
-    hashmap_entry *entry = hashmap_index(map->table, map->table_size, key, key_len);
-    hashmap_entry *last_entry = NULL;
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it
-        if (hashmap_keys_equal(entry, key, key_len)) {
-            // Free the key
-            free(entry->key);
-            map->count -= 1;
-
-            // Check if we are in the table
-            if (last_entry == NULL) {
-                // Copy the keys from the node, and free it
-                if (entry->next) {
-                    hashmap_entry *n = entry->next;
-                    entry->key_len = n->key_len;
-                    entry->key = n->key;
-                    entry->value = n->value;
-                    entry->next = n->next;
-                    entry->metadata = n->metadata;
-                    free(n);
-
-                    // Zero everything out
-                } else {
-                    entry->key_len = 0;
-                    entry->key = NULL;
-                    entry->value = NULL;
-                    entry->next = NULL;
-                    entry->metadata = NULL;
-                }
-
-            } else {
-                // Skip us in the list
-                last_entry->next = entry->next;
-
-                // Free ourself
-                free(entry);
-            }
-            return 0;
-        }
-        last_entry = entry;
-        // Walk the chain
-        entry = entry->next;
-    }
-
-    // Not found
-    return -1;
+    return hashmap_delete_hashed(map, key, key_len, hashmap_hash(key, key_len));
 }
 
 /**
@@ -359,41 +557,57 @@ int hashmap_delete(hashmap *map, const char *key) {
  * 0 on success. -1 if not found.
  */
 int hashmap_clear(hashmap *map) {
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i = 0; i < map->table_size; i++) {
-        entry = map->table + i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Clear the objects
-            free(old->key);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            } else {
-                old->key = NULL;
-            }
-            in_table = 0;
-        }
+    memset(map->table.entries, 0, map->table.size * sizeof(hashmap_entry));
+    map->table.count = 0;
+    if (map->old.entries != NULL) {
+        hashmap_finish_migration(map);
     }
+    hashmap_arena_free(map->arena);
+    map->arena = NULL;
+    map->arena_size = 0;
+    map->arena_live = 0;
 
     // Reset the sizes
     map->count = 0;
     return 0;
 }
 
+/**
+ * Iterate over one table. Iteration starts just after an empty slot:
+ * deleting shifts the following entries back by one slot, and starting
+ * there guarantees that no entry is shifted from the unvisited part of
+ * the table into the visited part.
+ */
+static int hashmap_table_iter(hashmap *map, hashmap_table *t, hashmap_callback cb, void *data) {
+    uint32_t mask = t->size - 1;
+    uint32_t start = hashmap_table_empty_slot(t);
+
+    int should_break = 0;
+    for (uint32_t n = 1; n <= mask + 1 && should_break != 1; n++) {
+        uint32_t slot = (start + n) & mask;
+        hashmap_entry *entry = t->entries + slot;
+
+        while (entry->hash != 0 && !should_break) {
+            int cb_ret = cb(data, hashmap_entry_key(entry), entry->value, entry->metadata);
+            if (cb_ret == HASHMAP_ITER_DELETE) {
+                // The next entry of the cluster may now sit in this slot
+                hashmap_remove_entry(map, t, entry);
+            } else {
+                should_break = cb_ret;
+                break;
+            }
+        }
+    }
+    return should_break;
+}
+
 /**
  * Iterates through the key/value pairs in the map, invoking a
  * callback for each. The call back gets a key, value for each and
  * returns an integer stop value.  If the callback returns
  * HASHMAP_ITER_STOP, then the iteration stops. The current key can be
- * removed by return HASHMAP_ITER_DELETE.
+ * removed by return HASHMAP_ITER_DELETE. A migration in progress is
+ * paused while iterating, so every entry is visited exactly once.
  *
  * @arg map The hashmap to iterate over
  * @arg cb The callback function to invoke
@@ -401,66 +615,15 @@ int hashmap_clear(hashmap *map) {
  * @return 0 on success
  */
 int hashmap_iter(hashmap *map, hashmap_callback cb, void *data) {
-    hashmap_entry *entry;
-
-    int should_break = 0;
-    for (int i = 0; i < map->table_size && should_break != 1; i++) {
-
-        hashmap_entry *last_entry = NULL;
-        entry = map->table + i;
-
-        while (entry != NULL && entry->key && !should_break) {
-
-            int cb_ret = cb(data, entry->key, entry->value, entry->metadata);
-            if (cb_ret == HASHMAP_ITER_DELETE) { /* Delete this node */
-                /* Free the key buffer */
-                free(entry->key);
-                entry->key = NULL;
-                /**
-                 * decrement item count to reflect delete completion
-                 */
-                map->count -= 1;
-
-                if (last_entry == NULL) {
-                    /* This is the first item in the table, we zip
-                     * left to right and copy next to the first slot */
-                    if (entry->next) {
-                        hashmap_entry *n = entry->next;
-                        entry->key = n->key;
-                        entry->value = n->value;
-                        entry->next = n->next;
-                        entry->metadata = n->metadata;
-                        free(n);
-                        /* Do not record last_entry - we moved
-                         * everything one left, and could do so
-                         * again */
-
-                    } else {
-                        /* This is the only item in the chain, zero
-                         * the item slot with no zipping */
-                        entry->key = NULL;
-                        entry->value = NULL;
-                        entry->next = NULL;
-                        entry->metadata = NULL;
-                    }
-                } else {
-                    /* We are in the middle or end of a chain, remove
-                     * the element and advance forward one */
-                    last_entry->next = entry->next;
-                    free(entry);
-                    entry = last_entry->next;
-                    /* Do not move last_entry - it didn't change */
-                }
-            } else {
-                /* No delete, move forward in the list */
-                should_break = cb_ret;
-                /* Move last_entry to allow removals in the list */
-                last_entry = entry;
-                entry = entry->next;
-            }
-
+    map->iterating++;
+    int should_break = hashmap_table_iter(map, &map->table, cb, data);
+    if (should_break != 1 && map->old.entries != NULL) {
+        should_break = hashmap_table_iter(map, &map->old, cb, data);
+    }
+    map->iterating--;
 
-        }
+    if (map->old.entries != NULL && map->old.count == 0 && !map->iterating) {
+        hashmap_finish_migration(map);
     }
     return should_break;
 }
@@ -1,6 +1,9 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "./log.h"
 
 enum {
@@ -34,6 +37,19 @@ int hashmap_destroy(hashmap *map);
  */
 int hashmap_size(hashmap *map);
 
+/**
+ * Returns the number of items divided by the number of slots of the
+ * table new items go into.
+ */
+double hashmap_load_factor(hashmap *map);
+
+/**
+ * The map grows by migrating its entries into a table twice the size a
+ * few slots per put or delete. Returns the migrated fraction of the old
+ * table, or 1.0 when no resize is in progress.
+ */
+double hashmap_resize_progress(hashmap *map);
+
 /**
  * Gets a value.
  * @arg key The key to look for. Must be null terminated.
@@ -63,6 +79,35 @@ int hashmap_put(hashmap *map, const char *key, void *value, void *metadata);
  */
 int hashmap_delete(hashmap *map, const char *key);
 
+/**
+ * Hash a key the way the hashmap does. This is stats_hash_key(), so the
+ * hash a caller already computed to route a line can be reused.
+ */
+uint32_t hashmap_hash(const char *key, size_t key_len);
+
+/**
+ * Variants of get/put/delete taking the key length and a precomputed
+ * hashmap_hash() of the key, so the key is neither measured nor hashed
+ * again. Return values are the same as for the plain versions.
+ */
+int hashmap_get_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash, void **value);
+int hashmap_put_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash,
+        void *value, void *metadata);
+int hashmap_delete_hashed(hashmap *map, const char *key, size_t key_len, uint32_t hash);
+
+/**
+ * Deletes the entry holding value under a key with the given hash, for
+ * callers that keep track of their values but not of the keys.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_delete_value(hashmap *map, uint32_t hash, const void *value);
+
+/**
+ * The key holding value under the given hash, NULL if not found. Valid
+ * until the next change to the map.
+ */
+const char *hashmap_value_key(hashmap *map, uint32_t hash, const void *value, size_t *key_len);
+
 /**
  * Clears all the key/value pairs.
  * @notes This method is not thread safe.
@@ -70,11 +115,20 @@ int hashmap_delete(hashmap *map, const char *key);
  */
 int hashmap_clear(hashmap *map);
 
+/**
+ * Moves the long keys into a fresh arena if most of it is held by
+ * deleted keys. Takes time in the size of the map, so it is meant for
+ * timers rather than the path of each operation; a no-op while iterating.
+ * 1 if compacted, 0 if not needed, -1 on allocation failure.
+ */
+int hashmap_compact(hashmap *map);
+
 /**
  * Iterates through the key/value pairs in the map,
  * invoking a callback for each. The call back gets a
  * key, value for each and returns an integer stop value.
  * If the callback returns 1, then the iteration stops.
+ * The key passed to the callback is only valid during the call.
  * @arg map The hashmap to iterate over
  * @arg cb The callback function to invoke
  * @arg data Opaque handle passed to the callback
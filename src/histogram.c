@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static inline int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int index = shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+/* The largest value falling in a bucket */
+static uint64_t bucket_upper(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value) {
+    histogram->buckets[bucket_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+uint64_t histogram_quantile(const histogram_t *histogram, double q) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    uint64_t value = histogram->max;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            value = bucket_upper(i);
+            break;
+        }
+    }
+    return value < histogram->max ? value : histogram->max;
+}
+
+uint64_t histogram_count_below(const histogram_t *histogram, double value) {
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && bucket_upper(i) <= value; i++) {
+        count += histogram->buckets[i];
+    }
+    return count;
+}
+
+void histogram_reset(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(histogram_t));
+}
@@ -0,0 +1,42 @@
+#ifndef STATSRELAY_HISTOGRAM_H
+#define STATSRELAY_HISTOGRAM_H
+
+#include <stdint.h>
+
+/**
+ * Log-linear histogram of unsigned values, HdrHistogram style: each
+ * power of two is split in HISTOGRAM_SUB_BUCKETS linear buckets, so any
+ * recorded value is known to within 1 / HISTOGRAM_SUB_BUCKETS of itself.
+ * Values are in whatever unit the caller records them in.
+ */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+/* powers of two above the sub buckets, for values up to 2^44 */
+#define HISTOGRAM_MAGNITUDES 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAGNITUDES + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+/**
+ * The q quantile of the values, 0 <= q <= 1, as the upper bound of the
+ * bucket it falls in, and never above the largest value recorded. 0 when
+ * nothing was recorded.
+ */
+uint64_t histogram_quantile(const histogram_t *histogram, double q);
+
+/**
+ * Number of values of at most value, to the resolution of the buckets
+ */
+uint64_t histogram_count_below(const histogram_t *histogram, double value);
+
+void histogram_reset(histogram_t *histogram);
+
+#endif  // STATSRELAY_HISTOGRAM_H
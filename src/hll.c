@@ -0,0 +1,45 @@
+#include <math.h>
+#include <string.h>
+
+#include "hll.h"
+
+void hll_init(hll_t *hll) {
+    memset(hll->registers, 0, sizeof(hll->registers));
+}
+
+void hll_add(hll_t *hll, uint64_t hash) {
+    uint32_t index = (uint32_t)(hash >> (64 - HLL_PRECISION));
+    // The sentinel bit caps the rank for hashes with no bit set past the index
+    uint64_t rest = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    if (rank > hll->registers[index]) {
+        hll->registers[index] = rank;
+    }
+}
+
+void hll_merge(hll_t *dst, const hll_t *src) {
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (src->registers[i] > dst->registers[i]) {
+            dst->registers[i] = src->registers[i];
+        }
+    }
+}
+
+uint64_t hll_count(const hll_t *hll) {
+    const double m = HLL_REGISTERS;
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll->registers[i]);
+        if (hll->registers[i] == 0) {
+            zeros++;
+        }
+    }
+
+    double alpha = 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
+    return (uint64_t)(estimate + 0.5);
+}
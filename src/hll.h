@@ -0,0 +1,39 @@
+#ifndef STATSRELAY_HLL_H
+#define STATSRELAY_HLL_H
+
+#include <stdint.h>
+
+/**
+ * A HyperLogLog distinct counter (Flajolet et al.) over 64 bit hashes.
+ * 2^HLL_PRECISION one byte registers give a standard error of about
+ * 1.04 / sqrt(2^HLL_PRECISION), 3.3%, whatever the number of distinct
+ * values. Small cardinalities are estimated by linear counting.
+ *
+ * Counters are mergeable: merging two gives the counter of both streams.
+ */
+
+#define HLL_PRECISION 10
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+typedef struct hll {
+    uint8_t registers[HLL_REGISTERS];
+} hll_t;
+
+void hll_init(hll_t *hll);
+
+/**
+ * Add a value by its hash. The hash must be well mixed over all 64 bits.
+ */
+void hll_add(hll_t *hll, uint64_t hash);
+
+/**
+ * Add all values of src to dst
+ */
+void hll_merge(hll_t *dst, const hll_t *src);
+
+/**
+ * Estimate the number of distinct values added
+ */
+uint64_t hll_count(const hll_t *hll);
+
+#endif  // STATSRELAY_HLL_H
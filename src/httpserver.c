@@ -0,0 +1,291 @@
+#include "httpserver.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <ev.h>
+
+/* environment variable handing the listening socket to a new master */
+#define HTTP_LISTENER_ENV "STATSRELAY_LISTENER_HTTP_SD"
+
+struct httpserver_t {
+    struct ev_loop *loop;
+    int sd;
+    ev_io watcher;
+    bool listening;
+    void *data;
+    httpserver_handler handler;
+};
+
+typedef struct {
+    httpserver_t *server;
+    int sd;
+    ev_io watcher;
+    char request[HTTP_REQUEST_MAX + 1];
+    size_t request_len;
+    buffer_t response;
+} httpsession_t;
+
+static const char *status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Internal Server Error";
+    }
+}
+
+static void httpsession_destroy(httpsession_t *session) {
+    ev_io_stop(session->server->loop, &session->watcher);
+    close(session->sd);
+    buffer_destroy(&session->response);
+    free(session);
+}
+
+static void httpsession_send_callback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    httpsession_t *session = (httpsession_t *)watcher->data;
+
+    while (buffer_datacount(&session->response) > 0) {
+        ssize_t sent = send(session->sd, buffer_head(&session->response),
+                buffer_datacount(&session->response), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            stats_debug_log("httpserver: error sending response: %s", strerror(errno));
+            break;
+        }
+        buffer_consume(&session->response, sent);
+    }
+    httpsession_destroy(session);
+}
+
+/* Whether the request headers are all in */
+static bool httpsession_complete(httpsession_t *session) {
+    return strstr(session->request, "\r\n\r\n") != NULL || strstr(session->request, "\n\n") != NULL;
+}
+
+/* Build the whole response, then send it as the socket lets us */
+static void httpsession_respond(httpsession_t *session) {
+    httpserver_t *server = session->server;
+    const char *content_type = "text/plain; charset=utf-8";
+    int status;
+
+    buffer_t body;
+    if (buffer_init(&body) != 0) {
+        httpsession_destroy(session);
+        return;
+    }
+
+    char method[8], path[256];
+    if (!httpsession_complete(session)) {
+        stats_debug_log("httpserver: request headers too large");
+        status = 431;
+    } else if (sscanf(session->request, "%7s %255s", method, path) != 2) {
+        status = 400;
+    } else if (strcmp(method, "GET") != 0) {
+        status = 405;
+    } else {
+        status = server->handler(path, &body, &content_type, server->data);
+    }
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            status, status_text(status), content_type, buffer_datacount(&body));
+
+    if (buffer_newsize(&session->response, header_len + buffer_datacount(&body) + 1) != 0) {
+        buffer_destroy(&body);
+        httpsession_destroy(session);
+        return;
+    }
+    memcpy(buffer_tail(&session->response), header, header_len);
+    buffer_produced(&session->response, header_len);
+    memcpy(buffer_tail(&session->response), buffer_head(&body), buffer_datacount(&body));
+    buffer_produced(&session->response, buffer_datacount(&body));
+    buffer_destroy(&body);
+
+    ev_io_stop(server->loop, &session->watcher);
+    ev_io_init(&session->watcher, httpsession_send_callback, session->sd, EV_WRITE);
+    ev_io_start(server->loop, &session->watcher);
+}
+
+static void httpsession_recv_callback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    httpsession_t *session = (httpsession_t *)watcher->data;
+
+    ssize_t len = recv(session->sd, session->request + session->request_len,
+            HTTP_REQUEST_MAX - session->request_len, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (len <= 0) {
+        httpsession_destroy(session);
+        return;
+    }
+    session->request_len += len;
+    session->request[session->request_len] = '\0';
+
+    if (httpsession_complete(session) || session->request_len == HTTP_REQUEST_MAX) {
+        httpsession_respond(session);
+    }
+}
+
+static void httpserver_accept_callback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    httpserver_t *server = (httpserver_t *)watcher->data;
+
+    int sd = accept(server->sd, NULL, NULL);
+    if (sd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stats_error_log("httpserver: error accepting connection: %s", strerror(errno));
+        }
+        return;
+    }
+    if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0) {
+        stats_error_log("httpserver: error setting socket to non-blocking: %s", strerror(errno));
+        close(sd);
+        return;
+    }
+
+    httpsession_t *session = malloc(sizeof(httpsession_t));
+    if (session == NULL || buffer_init(&session->response) != 0) {
+        stats_error_log("httpserver: unable to allocate session");
+        free(session);
+        close(sd);
+        return;
+    }
+    session->server = server;
+    session->sd = sd;
+    session->request_len = 0;
+    session->watcher.data = session;
+    ev_io_init(&session->watcher, httpsession_recv_callback, sd, EV_READ);
+    ev_io_start(loop, &session->watcher);
+}
+
+httpserver_t *httpserver_create(struct ev_loop *loop, void *data, httpserver_handler handler) {
+    httpserver_t *server = malloc(sizeof(httpserver_t));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->loop = loop;
+    server->sd = -1;
+    server->listening = false;
+    server->data = data;
+    server->handler = handler;
+    return server;
+}
+
+static int httpserver_listen(httpserver_t *server, struct addrinfo *addr, bool rebind) {
+    int yes = 1;
+    int sd;
+
+    if (rebind) {
+        sd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sd < 0) {
+            stats_error_log("httpserver: error creating socket: %s", strerror(errno));
+            return -1;
+        }
+        if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) != 0 ||
+                bind(sd, addr->ai_addr, addr->ai_addrlen) != 0) {
+            stats_error_log("httpserver: error binding socket: %s", strerror(errno));
+            close(sd);
+            return -1;
+        }
+    } else {
+        sd = atoi(getenv(HTTP_LISTENER_ENV));
+        stats_log("httpserver: new master reusing socket descriptor %d", sd);
+    }
+
+    if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0 ||
+            listen(sd, 16) != 0) {
+        stats_error_log("httpserver: error listening on socket: %s", strerror(errno));
+        close(sd);
+        return -1;
+    }
+
+    /** setenv for hotrestart **/
+    char sd_buffer[16];
+    snprintf(sd_buffer, sizeof(sd_buffer), "%d", sd);
+    setenv(HTTP_LISTENER_ENV, sd_buffer, 1);
+    return sd;
+}
+
+int httpserver_bind(httpserver_t *server, const char *address_and_port, bool rebind) {
+    struct addrinfo hints;
+    struct addrinfo *addrs, *p;
+
+    char *address = strdup(address_and_port);
+    if (address == NULL) {
+        stats_error_log("httpserver: strdup(3) failed");
+        return 1;
+    }
+    char *ptr = strrchr(address, ':');
+    if (ptr == NULL) {
+        free(address);
+        stats_error_log("httpserver: missing port");
+        return 1;
+    }
+    *ptr = '\0';
+    const char *port = ptr + 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int err = getaddrinfo(address, port, &hints, &addrs);
+    if (err != 0) {
+        free(address);
+        stats_error_log("httpserver: getaddrinfo error: %s", gai_strerror(err));
+        return 1;
+    }
+
+    // Only one socket is handed over on a hot restart, so listen on the
+    // first address that works
+    for (p = addrs; p != NULL && server->sd < 0; p = p->ai_next) {
+        server->sd = httpserver_listen(server, p, rebind);
+        rebind = true;
+    }
+    freeaddrinfo(addrs);
+
+    if (server->sd < 0) {
+        free(address);
+        return 1;
+    }
+    ev_io_init(&server->watcher, httpserver_accept_callback, server->sd, EV_READ);
+    server->watcher.data = server;
+    ev_io_start(server->loop, &server->watcher);
+    server->listening = true;
+    stats_log("httpserver: Listening on %s:%s, fd = %d", address, port, server->sd);
+    free(address);
+    return 0;
+}
+
+void httpserver_stop_accepting_connections(httpserver_t *server) {
+    if (server->listening) {
+        ev_io_stop(server->loop, &server->watcher);
+        server->listening = false;
+    }
+}
+
+void httpserver_destroy(httpserver_t *server) {
+    httpserver_stop_accepting_connections(server);
+    // A new master on a hot restart holds its own copy of the socket,
+    // forked before this one is closed
+    if (server->sd >= 0) {
+        close(server->sd);
+    }
+    free(server);
+}
@@ -0,0 +1,37 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include "buffer.h"
+#include <stdbool.h>
+#include <ev.h>
+
+/* Requests with longer headers are refused */
+#define HTTP_REQUEST_MAX 4096
+
+/**
+ * A minimal HTTP/1.0 server for introspection, on the relay's own event
+ * loop. Only GET is served, one request per connection. Requests are
+ * handed to a single handler, which writes the body of the response.
+ */
+typedef struct httpserver_t httpserver_t;
+
+/**
+ * Fill body with the response to a GET of path, and point content_type
+ * at its media type. Returns the HTTP status code.
+ */
+typedef int (*httpserver_handler)(const char *path, buffer_t *body, const char **content_type, void *data);
+
+httpserver_t *httpserver_create(struct ev_loop *loop, void *data, httpserver_handler handler);
+
+/**
+ * Listen on address_and_port. With rebind false, the listening socket
+ * is inherited from the old master on a hot restart instead. Returns 0
+ * on success.
+ */
+int httpserver_bind(httpserver_t *server, const char *address_and_port, bool rebind);
+
+void httpserver_stop_accepting_connections(httpserver_t *server);
+
+void httpserver_destroy(httpserver_t *server);
+
+#endif
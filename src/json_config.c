@@ -13,11 +13,18 @@ static void init_proto_config(struct proto_config *protoc) {
     protoc->initialized = false;
     protoc->send_health_metrics = false;
     protoc->bind = NULL;
+    protoc->http_bind = NULL;
     protoc->enable_validation = true;
     protoc->enable_tcp_cork = true;
     protoc->max_send_queue = 134217728;
     protoc->auto_reconnect = false;
     protoc->reconnect_threshold = 1.0;
+    protoc->sampling_high_watermark = 0;
+    protoc->sampling_low_watermark = 0;
+    protoc->latency_sample_every = 0;
+    protoc->top_keys = 0;
+    protoc->top_sample_every = 10;
+    protoc->top_window = 10;
     protoc->ring = statsrelay_list_new();
     protoc->dupl = statsrelay_list_new();
     protoc->sstats = statsrelay_list_new();
@@ -36,7 +43,7 @@ static double get_real_orelse(json_t* json, const char *key, double def) {
     json_t* v = json_object_get(json, key);
     if (v == NULL || json_is_null(v))
         return def;
-    return json_real_value(v);
+    return json_number_value(v);
 }
 
 static char* get_string(const json_t* json, const char* key) {
@@ -103,6 +110,8 @@ static int parse_additional_config(const json_t* additional_config, struct proto
         }
         aconfig->ingress_filter = get_string(additional_config, "input_filter");
         aconfig->ingress_blacklist = get_string(additional_config, "input_blacklist");
+        aconfig->blocklist_file = get_string(additional_config, "blocklist_file");
+        aconfig->filter_cache_size = get_int_orelse(additional_config, "filter_cache_size", 65536);
 
         aconfig->sampling_threshold = get_int_orelse(additional_config, "sampling_threshold", -1);
         aconfig->sampling_window = get_int_orelse(additional_config, "sampling_window", -1);
@@ -111,21 +120,68 @@ static int parse_additional_config(const json_t* additional_config, struct proto
         aconfig->timer_sampling_window = get_int_orelse(additional_config, "timer_sampling_window", -1);
         aconfig->timer_flush_min_max = get_bool_orelse(additional_config, "timer_flush_min_max", false);
         aconfig->reservoir_size = get_int_orelse(additional_config, "reservoir_size", 100);
+        aconfig->timer_sketch_points = get_int_orelse(additional_config, "timer_sketch_points", 10);
+
+        char* timer_summary = get_string(additional_config, "timer_summary");
+        aconfig->timer_summary_sketch = false;
+        if (timer_summary != NULL) {
+            if (strcmp(timer_summary, "sketch") == 0) {
+                aconfig->timer_summary_sketch = true;
+            } else if (strcmp(timer_summary, "reservoir") != 0) {
+                stats_error_log("unknown timer_summary '%s', expected 'reservoir' or 'sketch'", timer_summary);
+                free(timer_summary);
+                return -1;
+            }
+            free(timer_summary);
+        }
+        if (aconfig->timer_summary_sketch && aconfig->timer_sketch_points < 1) {
+            stats_error_log("timer_sketch_points must be at least 1");
+            return -1;
+        }
 
         aconfig->gauge_sampling_threshold = get_int_orelse(additional_config, "gauge_sampling_threshold", -1);
         aconfig->gauge_sampling_window = get_int_orelse(additional_config, "gauge_sampling_window", -1);
 
+        aconfig->set_sampling_threshold = get_int_orelse(additional_config, "set_sampling_threshold", -1);
+        aconfig->set_sampling_window = get_int_orelse(additional_config, "set_sampling_window", -1);
+        aconfig->set_flush_cardinality = get_bool_orelse(additional_config, "set_flush_cardinality", false);
+
+        aconfig->aggregate_all = get_bool_orelse(additional_config, "aggregate_all", false);
+        aconfig->aggregate_window = get_int_orelse(additional_config, "aggregate_window", 10);
+        if (aconfig->aggregate_all && aconfig->aggregate_window < 1) {
+            stats_error_log("aggregate_window must be at least 1 second");
+            return -1;
+        }
+
         // parse the cardinality limits (only applied when sampling is enabled)
         aconfig->max_counters = get_int_orelse(additional_config, "counter_cardinality", 10000);
         aconfig->max_timers = get_int_orelse(additional_config, "timer_cardinality", 10000);
         aconfig->max_gauges = get_int_orelse(additional_config, "gauge_cardinality", 10000);
+        aconfig->max_sets = get_int_orelse(additional_config, "set_cardinality", 10000);
+
+        aconfig->flush_slices = get_int_orelse(additional_config, "flush_slices", 1);
+        if (aconfig->flush_slices < 1 || aconfig->flush_slices > 64) {
+            stats_error_log("flush_slices must be between 1 and 64");
+            return -1;
+        }
+        aconfig->sampler_memory_budget = get_int_orelse(additional_config, "sampler_memory_budget", 0);
+        aconfig->doorkeeper_keys = get_int_orelse(additional_config, "doorkeeper_keys", 0);
+        aconfig->prefix_depth = get_int_orelse(additional_config, "prefix_depth", 0);
+        aconfig->prefix_quota = get_int_orelse(additional_config, "prefix_quota", -1);
+        aconfig->prefix_tracker_size = get_int_orelse(additional_config, "prefix_tracker_size", 256);
+        if (aconfig->prefix_depth > 0 && aconfig->prefix_tracker_size < 1) {
+            stats_error_log("prefix_tracker_size must be at least 1");
+            return -1;
+        }
 
         // run purge timer at hourly rate (default)
         aconfig->hm_key_expiration_frequency_in_seconds = get_int_orelse(additional_config, "hm_key_expiration_frequency", 3600);
         // purge entries older than a day! (default)
         aconfig->hm_key_ttl_in_seconds = get_int_orelse(additional_config, "hm_key_ttl", 21600);
 
-        if ((aconfig->sampling_threshold > 0 || aconfig->timer_sampling_threshold > 0) && !config->enable_validation) {
+        if ((aconfig->sampling_threshold > 0 || aconfig->timer_sampling_threshold > 0 ||
+                    aconfig->set_sampling_threshold > 0 || aconfig->aggregate_all) &&
+                !config->enable_validation) {
             stats_error_log("enabling sampling requires turning on validation of the statsd packet format. sorry.");
             return -1;
         }
@@ -156,8 +212,35 @@ static int parse_proto(json_t* json, struct proto_config* config) {
         config->bind = jbind;
     }
 
+    char* jhttp_bind = get_string(json, "http_bind");
+    if (jhttp_bind != NULL) {
+        free(config->http_bind);
+        config->http_bind = jhttp_bind;
+    }
+
     config->max_send_queue = get_int_orelse(json, "max_send_queue", 134217728);
     config->reconnect_threshold = get_real_orelse(json, "reconnect_threshold", 1.0);
+    config->sampling_high_watermark = get_real_orelse(json, "sampling_high_watermark", 0);
+    config->sampling_low_watermark = get_real_orelse(json, "sampling_low_watermark",
+                                                     config->sampling_high_watermark / 4);
+    if (config->sampling_high_watermark > 0 &&
+            (config->sampling_high_watermark > 1 || config->sampling_low_watermark < 0 ||
+             config->sampling_low_watermark >= config->sampling_high_watermark)) {
+        stats_error_log("sampling watermarks must satisfy 0 <= sampling_low_watermark < sampling_high_watermark <= 1");
+        return -1;
+    }
+    config->latency_sample_every = get_int_orelse(json, "latency_sample_every", 0);
+    if (config->latency_sample_every < 0) {
+        stats_error_log("latency_sample_every must be 0 or more");
+        return -1;
+    }
+    config->top_keys = get_int_orelse(json, "top_keys", 0);
+    config->top_sample_every = get_int_orelse(json, "top_sample_every", 10);
+    config->top_window = get_int_orelse(json, "top_window", 10);
+    if (config->top_keys < 0 || config->top_sample_every < 1 || config->top_window < 1) {
+        stats_error_log("top_keys must be 0 or more, top_sample_every and top_window 1 or more");
+        return -1;
+    }
 
     const json_t* jshards = json_object_get(json, "shard_map");
     /**
@@ -253,6 +336,7 @@ static void destroy_proto_config(struct proto_config *config) {
         statsrelay_list_destroy_full(sstats->ring);
     }
     free(config->bind);
+    free(config->http_bind);
 }
 
 void destroy_json_config(struct config *config) {
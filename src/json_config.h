@@ -28,6 +28,20 @@ struct additional_config {
      */
     char* ingress_blacklist;
 
+    /**
+     * blocklist_file: path to a list of exact metric names to drop, either
+     * one name per line or compiled with statblocklist. The file is
+     * reloaded whenever it changes.
+     */
+    char* blocklist_file;
+
+    /**
+     * filter_cache_size: number of keys whose ingress_blacklist/ingress_filter
+     * outcome is remembered, so that repeated keys skip the regex engine.
+     * 0 disables the cache.
+     */
+    int filter_cache_size;
+
     /**
      * sampling_threshold: start sampling messages received at a rate greater than
      * this quantity over the sampling_window
@@ -57,6 +71,49 @@ struct additional_config {
      */
     int max_gauges;
 
+    /**
+     * max_sets: Max number of unique sets we will allow (and flush) before
+     * flagging and dropping sets
+     */
+    int max_sets;
+
+    /**
+     * flush_slices: number of slices the sampled keys are split in, each
+     * flushed in turn over the window so flushes do not come in bursts
+     */
+    int flush_slices;
+
+    /**
+     * sampler_memory_budget: bytes of buckets each sampler may hold before it
+     * evicts cold keys for new ones, instead of flagging new keys once at its
+     * cardinality; 0 disables eviction
+     */
+    int sampler_memory_budget;
+
+    /**
+     * doorkeeper_keys: number of new keys per window the samplers' doorkeeper
+     * is sized for; a new key only gets a bucket once seen twice in a window.
+     * 0 disables the doorkeeper
+     */
+    int doorkeeper_keys;
+
+    /**
+     * prefix_depth: count sampled keys per prefix of this many dot separated
+     * components, listed by "status prefixes"; 0 disables
+     */
+    int prefix_depth;
+
+    /**
+     * prefix_quota: Max number of unique keys per prefix before flagging and
+     * dropping new keys of that prefix; -1 for no quota
+     */
+    int prefix_quota;
+
+    /**
+     * prefix_tracker_size: number of heaviest prefixes counted
+     */
+    int prefix_tracker_size;
+
     /**
      * timer_sampling_threshold: start sampling messages received at a rate greater than
      * this quantity over the timer_sampling_window
@@ -80,6 +137,20 @@ struct additional_config {
      */
     int reservoir_size;
 
+    /**
+     * timer_summary: how sampled timers are relayed each window. "reservoir"
+     * (default) relays up to reservoir_size raw values; "sketch" keeps a
+     * quantile sketch per timer and relays timer_sketch_points values read
+     * off it.
+     */
+    bool timer_summary_sketch;
+
+    /**
+     * timer_sketch_points: values relayed per sampled timer and window
+     * when timer_summary is "sketch"
+     */
+    int timer_sketch_points;
+
     /**
      * gauge_sampling_threshold: start sampling messages received at a rate greater than
      * this quantity over the gauge_sampling_window
@@ -91,6 +162,37 @@ struct additional_config {
      */
     int gauge_sampling_window;
 
+    /**
+     * set_sampling_threshold: start sampling sets received at a rate greater than
+     * this quantity over the set_sampling_window
+     */
+    int set_sampling_threshold;
+
+    /**
+     * set_sampling_window: number of seconds to sample sets before flushing internally
+     */
+    int set_sampling_window;
+
+    /**
+     * set_flush_cardinality: relay sampled sets as a gauge of their distinct
+     * member count rather than as their members
+     */
+    bool set_flush_cardinality;
+
+    /**
+     * aggregate_all: sum every counter and keep the last value of every
+     * gauge, relaying one line per key every aggregate_window seconds,
+     * whatever the key's rate. Overrides the counter and gauge sampling
+     * thresholds.
+     */
+    bool aggregate_all;
+
+    /**
+     * aggregate_window: seconds between flushes in aggregate_all mode,
+     * aligned to the wall clock
+     */
+    int aggregate_window;
+
     /**
      * hm_key_expiration_frequency_in_seconds: frequency with which purging of expired items in hashmap
      * happens (in seconds) (currently only applies to timer sampling hashmap)
@@ -112,11 +214,35 @@ struct proto_config {
     bool initialized;
     bool send_health_metrics;
     char *bind;
+    /** address to serve OpenMetrics on over HTTP, NULL to disable */
+    char *http_bind;
     bool enable_validation;
     bool enable_tcp_cork;
     bool auto_reconnect; /* drop connections to backend and reconnect on full buffer */
     double reconnect_threshold; /* initiate auto reconnect when send buffer hits this threshold */
     uint64_t max_send_queue;
+    /**
+     * adaptive sampling: while a backend's send queue is above the high
+     * watermark and not draining, the sampling thresholds of its keys are
+     * halved every second; below the low watermark they are doubled back.
+     * Both are fractions of max_send_queue, a high watermark of 0 disables.
+     */
+    double sampling_high_watermark;
+    double sampling_low_watermark;
+    /**
+     * time the stages of one in every latency_sample_every relayed
+     * lines, flushes and writes; 0 disables
+     */
+    int latency_sample_every;
+    /**
+     * heaviest keys by lines and bytes per group and backend, for the
+     * "top" command: top_keys are tracked per window of top_window
+     * seconds, from one in every top_sample_every relayed lines; a
+     * top_keys of 0 disables
+     */
+    int top_keys;
+    int top_sample_every;
+    int top_window;
     list_t ring;
     list_t dupl; /* struct additional_config */
     list_t sstats; /* struct additional_config */
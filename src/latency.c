@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "histogram.h"
+#include "latency.h"
+
+int latency_sample_every = 0;
+int latency_countdown = 0;
+
+static histogram_t histograms[LATENCY_STAGES];
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "validate", "parse", "hash", "filter", "sample", "enqueue", "flush", "write"
+};
+
+/* Ticks and monotonic time at init, to convert ticks to nanoseconds */
+static uint64_t start_ticks;
+static struct timespec start_time;
+
+static time_t reset_time;
+
+void latency_init(int sample_every) {
+    latency_sample_every = sample_every;
+    latency_countdown = sample_every;
+    start_ticks = latency_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    latency_reset();
+}
+
+void latency_record(latency_stage stage, uint64_t start) {
+    histogram_record(&histograms[stage], latency_ticks() - start);
+}
+
+const char *latency_stage_name(latency_stage stage) {
+    return stage_names[stage];
+}
+
+uint64_t latency_count(latency_stage stage) {
+    return histograms[stage].count;
+}
+
+/* Nanoseconds per tick, measured over the time since init */
+static double ns_per_tick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ns = (now.tv_sec - start_time.tv_sec) * 1e9 + (now.tv_nsec - start_time.tv_nsec);
+    uint64_t ticks = latency_ticks() - start_ticks;
+    if (ticks == 0 || ns < 1e6) {
+        return 1.0;
+    }
+    return ns / ticks;
+#else
+    return 1.0;
+#endif
+}
+
+uint64_t latency_quantile_ns(latency_stage stage, double q) {
+    return (uint64_t)(histogram_quantile(&histograms[stage], q) * ns_per_tick() + 0.5);
+}
+
+uint64_t latency_count_below_ns(latency_stage stage, uint64_t ns) {
+    return histogram_count_below(&histograms[stage], ns / ns_per_tick());
+}
+
+uint64_t latency_sum_ns(latency_stage stage) {
+    return (uint64_t)(histograms[stage].sum * ns_per_tick() + 0.5);
+}
+
+void latency_reset(void) {
+    memset(histograms, 0, sizeof(histograms));
+    reset_time = time(NULL);
+}
+
+time_t latency_since(void) {
+    return reset_time;
+}
@@ -0,0 +1,102 @@
+#ifndef STATSRELAY_LATENCY_H
+#define STATSRELAY_LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Timing of the stages of the relay pipeline. One in every
+ * sample_every events is timed with the cycle counter and recorded in a
+ * log-linear histogram per stage, see histogram.h.
+ *
+ * The state is global: there is a single event loop per process.
+ */
+
+typedef enum {
+    LATENCY_VALIDATE,
+    LATENCY_PARSE,
+    LATENCY_HASH,
+    LATENCY_FILTER,
+    LATENCY_SAMPLE,
+    LATENCY_ENQUEUE,
+    LATENCY_FLUSH,
+    LATENCY_WRITE,
+    LATENCY_STAGES
+} latency_stage;
+
+extern int latency_sample_every;
+extern int latency_countdown;
+
+/**
+ * Time one in every sample_every events, none for 0
+ */
+void latency_init(int sample_every);
+
+/**
+ * Whether to time this event
+ */
+static inline bool latency_sample(void) {
+    if (latency_sample_every <= 0 || --latency_countdown > 0) {
+        return false;
+    }
+    latency_countdown = latency_sample_every;
+    return true;
+}
+
+/**
+ * The cycle counter where there is one, else monotonic nanoseconds
+ */
+static inline uint64_t latency_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Record the ticks elapsed since start for a stage
+ */
+void latency_record(latency_stage stage, uint64_t start);
+
+const char *latency_stage_name(latency_stage stage);
+
+/**
+ * Number of timings recorded for a stage
+ */
+uint64_t latency_count(latency_stage stage);
+
+/**
+ * The q quantile of a stage's timings in nanoseconds, 0 <= q <= 1, as
+ * the upper bound of the bucket it falls in
+ */
+uint64_t latency_quantile_ns(latency_stage stage, double q);
+
+/**
+ * Number of a stage's timings of at most ns nanoseconds, to the
+ * resolution of the buckets
+ */
+uint64_t latency_count_below_ns(latency_stage stage, uint64_t ns);
+
+/**
+ * Sum of a stage's timings in nanoseconds
+ */
+uint64_t latency_sum_ns(latency_stage stage);
+
+/**
+ * Start the histograms afresh
+ */
+void latency_reset(void);
+
+/**
+ * When the histograms were last started afresh
+ */
+time_t latency_since(void);
+
+#endif  // STATSRELAY_LATENCY_H
@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include "loopstats.h"
+
+static histogram_t histograms[LOOPSTATS_METRICS];
+
+static const char *metric_names[LOOPSTATS_METRICS] = {
+    "iteration", "poll", "callbacks", "timer_lag"
+};
+
+static ev_prepare prepare_watcher;
+static ev_check check_watcher;
+static ev_timer probe_watcher;
+
+/* Start of the current iteration, 0 before the first */
+static uint64_t prepare_ns;
+static uint64_t callbacks;
+static ev_tstamp probe_due;
+
+static time_t reset_time;
+
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void loopstats_invoke_pending(struct ev_loop *loop) {
+    callbacks += ev_pending_count(loop);
+    ev_invoke_pending(loop);
+}
+
+static void loopstats_prepare(struct ev_loop *loop, ev_prepare *w, int revents) {
+    uint64_t now = monotonic_ns();
+    if (prepare_ns != 0) {
+        histogram_record(&histograms[LOOPSTATS_ITERATION], now - prepare_ns);
+        // leave out the prepare and check watchers themselves
+        histogram_record(&histograms[LOOPSTATS_CALLBACKS], callbacks > 2 ? callbacks - 2 : 0);
+    }
+    prepare_ns = now;
+    callbacks = 0;
+}
+
+static void loopstats_check(struct ev_loop *loop, ev_check *w, int revents) {
+    if (prepare_ns != 0) {
+        histogram_record(&histograms[LOOPSTATS_POLL], monotonic_ns() - prepare_ns);
+    }
+}
+
+static void loopstats_probe(struct ev_loop *loop, ev_timer *w, int revents) {
+    ev_tstamp lag = ev_time() - probe_due;
+    histogram_record(&histograms[LOOPSTATS_TIMER_LAG], lag > 0 ? (uint64_t)(lag * 1e9) : 0);
+
+    // a repeating timer falling behind is rescheduled from now, not caught up
+    probe_due += LOOPSTATS_PROBE_INTERVAL;
+    if (probe_due < ev_now(loop)) {
+        probe_due = ev_now(loop);
+    }
+}
+
+void loopstats_init(struct ev_loop *loop) {
+    loopstats_reset();
+    ev_set_invoke_pending_cb(loop, loopstats_invoke_pending);
+
+    ev_prepare_init(&prepare_watcher, loopstats_prepare);
+    ev_prepare_start(loop, &prepare_watcher);
+    ev_unref(loop);
+
+    // the check runs ahead of the other callbacks, so the poll time is the poll alone
+    ev_check_init(&check_watcher, loopstats_check);
+    ev_set_priority(&check_watcher, EV_MAXPRI);
+    ev_check_start(loop, &check_watcher);
+    ev_unref(loop);
+
+    ev_now_update(loop);
+    ev_timer_init(&probe_watcher, loopstats_probe, LOOPSTATS_PROBE_INTERVAL, LOOPSTATS_PROBE_INTERVAL);
+    probe_due = ev_now(loop) + LOOPSTATS_PROBE_INTERVAL;
+    ev_timer_start(loop, &probe_watcher);
+    ev_unref(loop);
+}
+
+const char *loopstats_name(loopstats_metric metric) {
+    return metric_names[metric];
+}
+
+bool loopstats_is_time(loopstats_metric metric) {
+    return metric != LOOPSTATS_CALLBACKS;
+}
+
+const histogram_t *loopstats_histogram(loopstats_metric metric) {
+    return &histograms[metric];
+}
+
+void loopstats_reset(void) {
+    memset(histograms, 0, sizeof(histograms));
+    reset_time = time(NULL);
+}
+
+time_t loopstats_since(void) {
+    return reset_time;
+}
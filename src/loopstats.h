@@ -0,0 +1,59 @@
+#ifndef STATSRELAY_LOOPSTATS_H
+#define STATSRELAY_LOOPSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <ev.h>
+
+#include "histogram.h"
+
+/**
+ * Saturation of the event loop. Each iteration is timed from one
+ * prepare watcher to the next, along with the time spent blocked waiting
+ * for events (prepare to check) and the number of callbacks it invoked.
+ * A probe timer records how late timers fire behind their schedule.
+ * An iteration growing while the poll time shrinks to nothing is a loop
+ * that can no longer keep up.
+ *
+ * The state is global: there is a single event loop per process.
+ */
+
+typedef enum {
+    LOOPSTATS_ITERATION,
+    LOOPSTATS_POLL,
+    LOOPSTATS_CALLBACKS,
+    LOOPSTATS_TIMER_LAG,
+    LOOPSTATS_METRICS
+} loopstats_metric;
+
+/* Seconds between two runs of the timer lag probe */
+#define LOOPSTATS_PROBE_INTERVAL 0.25
+
+/**
+ * Start instrumenting a loop, once per process. The watchers do not
+ * keep the loop running on their own.
+ */
+void loopstats_init(struct ev_loop *loop);
+
+const char *loopstats_name(loopstats_metric metric);
+
+/**
+ * Whether a metric's values are nanoseconds, else they are counts
+ */
+bool loopstats_is_time(loopstats_metric metric);
+
+const histogram_t *loopstats_histogram(loopstats_metric metric);
+
+/**
+ * Start the histograms afresh
+ */
+void loopstats_reset(void);
+
+/**
+ * When the histograms were last started afresh
+ */
+time_t loopstats_since(void);
+
+#endif  // STATSRELAY_LOOPSTATS_H
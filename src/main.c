@@ -3,9 +3,11 @@
 #include "tcpserver.h"
 #include "server.h"
 #include "pidfile.h"
+#include "loopstats.h"
 
 #include <ctype.h>
 #include <getopt.h>
+#include <poll.h>
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
 #endif
@@ -61,6 +63,17 @@ static void quick_shutdown(struct ev_loop *loop, ev_signal *w, int revents) {
 }
 
 
+/* Wait up to timeout_ms for the new master to confirm restoring the snapshot */
+static bool wait_for_handover(int fd, int timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char confirmed;
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0 && read(fd, &confirmed, 1) == 1;
+}
+
 static void hot_restart(struct ev_loop *loop, ev_signal *w, int revents) {
     pid_t pid, old_pid;
 
@@ -71,11 +84,37 @@ static void hot_restart(struct ev_loop *loop, ev_signal *w, int revents) {
      */
     old_pid = read_pid(pid_file);
 
+    /**
+     * hand the samplers over to the new master, so hot keys
+     * stay sampled across the restart
+     */
+    FILE *snapshot = snapshot_server_collection(&servers);
+
+    /**
+     * the new master confirms on this pipe that it restored the
+     * snapshot, the sums are kept and flushed here until then
+     */
+    int handover[2] = { -1, -1 };
+    if (snapshot != NULL && pipe(handover) != 0) {
+        stats_error_log("main: failed to create the handover pipe: %s", strerror(errno));
+        fclose(snapshot);
+        snapshot = NULL;
+    }
+
     /**
      * handle re-exec
      */
     pid = reexec_pid = fork();
 
+    if (pid != 0 && snapshot != NULL) {
+        fclose(snapshot);
+        close(handover[1]);
+        if (pid < 0) {
+            close(handover[0]);
+            handover[0] = -1;
+        }
+    }
+
     if (pid < 0) {
         stats_error_log("main: failed to fork() on SIGUSR2!");
         stats_log("main: shutting down master.");
@@ -109,6 +148,16 @@ static void hot_restart(struct ev_loop *loop, ev_signal *w, int revents) {
          */
         shutdown_client_sockets(&servers);
 
+        if (handover[0] >= 0) {
+            if (wait_for_handover(handover[0], QUIET_WAIT / 1000)) {
+                stats_log("main: new master restored the samplers");
+                handed_over_server_collection(&servers);
+            } else {
+                stats_error_log("main: new master did not restore the samplers, flushing them here");
+            }
+            close(handover[0]);
+        }
+
         /**
          *  Sleep for 5 seconds to allow
          *  sesssion_t buffer to be flushed fully
@@ -130,6 +179,14 @@ static void hot_restart(struct ev_loop *loop, ev_signal *w, int revents) {
         /**
          *  execv a copy of new master
          */
+        if (snapshot != NULL) {
+            char fd[16];
+            snprintf(fd, sizeof(fd), "%d", fileno(snapshot));
+            setenv(SNAPSHOT_FD_ENV, fd, 1);
+            close(handover[0]);
+            snprintf(fd, sizeof(fd), "%d", handover[1]);
+            setenv(HANDOVER_FD_ENV, fd, 1);
+        }
         stats_log("main: reexec %s.", argv_ptr[0]);
         execv(argv_ptr[0],  argv_ptr);
 
@@ -281,12 +338,15 @@ int main(int argc, char **argv, char **envp) {
     if (!worked) {
         goto err;
     }
+    restore_server_collection(&servers);
 
     if (pid_file != NULL) {
         write_pid(pid_file, getpid());
     }
 
     struct ev_loop *loop = ev_default_loop(0);
+    loopstats_init(loop);
+
     ev_signal_init(&sigint_watcher, quick_shutdown, SIGINT);
     ev_signal_start(loop, &sigint_watcher);
 
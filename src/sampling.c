@@ -1,24 +1,49 @@
 #include <float.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include "sampling.h"
+#include "bloom.h"
 #include "hashmap.h"
+#include "hll.h"
+#include "sketch.h"
+#include "slab.h"
 #include "stats.h"
-
-#ifdef __APPLE__
-#include <mach/clock.h>
-#include <mach/mach.h>
-#endif
+#include "topk.h"
 
 #define HM_SIZE 32768
 
+/**
+ * Keys expire on a wheel of generations, one generation being
+ * hm_expiry_frequency seconds of loop time. A bucket sits in the slot
+ * of the generation it may expire in; buckets seen again since are
+ * moved on when their slot comes up instead of on every line.
+ */
+#define EXPIRY_WHEEL_SLOTS 64
+
+/* Buckets examined per expiry slice before yielding to the loop */
+#define EXPIRY_SLICE 1024
+
+/* Buckets the CLOCK hand passes over looking for one to evict */
+#define EVICTION_SCAN 1024
+
 typedef struct expiring_entry {
     int hm_expiry_frequency;
     int hm_ttl;
     ev_timer map_expiry_timer; //timer to clear out expired elements from map
+
+    /* generation of the loop time, and the one expiry has reached */
+    uint32_t generation;
+    uint32_t expiry_generation;
+    /* generations a bucket lives without events */
+    uint32_t ttl_generations;
+    /* buckets of the generation being expired, then the wheel */
+    struct sample_bucket *expiring;
+    struct sample_bucket *wheel[EXPIRY_WHEEL_SLOTS];
 } expiring_entry_t;
 
 struct sampler {
@@ -27,32 +52,144 @@ struct sampler {
     int cardinality;
     int reservoir_size;
     bool timer_flush_min_max;
-#ifdef __APPLE__
-    unsigned short randbuf[3];
-#else
-    struct drand48_data randbuf;
-#endif
-    hashmap *map;
+    /* xoroshiro128+ state */
+    uint64_t rng[2];
+    /* slot of this sampler's buckets in the table entries */
+    int slot;
+    int num_buckets;
+    /* buckets of this sampler, sized for its type and reservoir */
+    slab_t *buckets;
+    /**
+     * summaries of keys in sampling mode: quantile sketches of timers,
+     * NULL unless summarizing with sketches, and sets' members
+     */
+    slab_t *sketches;
+    int sketch_points;
+    /* relay sets as their member count */
+    bool set_cardinality;
+    /* every key is sampled from its first line, see sampler_aggregate_all() */
+    bool aggregate_all;
+    /* new keys seen this window, NULL unless every key gets a bucket */
+    bloom_t *doorkeeper;
+    uint64_t doorkeeper_lines;
+    /**
+     * bytes of buckets and summaries past which cold buckets are evicted
+     * for new keys, 0 to flag new keys instead; see sampler_set_memory_budget()
+     */
+    size_t memory_budget;
+    /* every bucket, in no order, swept by the CLOCK hand */
+    struct sample_bucket **clock;
+    size_t clock_capacity;
+    size_t clock_hand;
+    uint64_t evictions;
+    sampler_table_t *table;
+    bool owns_table;
+    /**
+     * keys are split in flush_slices slices by hash, each flushed in turn
+     * at an even fraction of the window, see sampler_set_flush_slices()
+     */
+    int flush_slices;
+    int next_slice;
+    /* buckets in sampling mode, per slice */
+    struct active_node *active[SAMPLER_MAX_SLICES];
+    int num_active;
+    /* current window per slice; a bucket's last_window_count is stale if its epoch differs */
+    uint32_t epoch[SAMPLER_MAX_SLICES];
     expiring_entry_t base;
 };
 
-struct sampler_flush_data {
-    sampler_t* sampler;
-    void* data;
-    sampler_flush_cb *cb;
+/**
+ * One entry per metric name, shared by the samplers of a group. The
+ * entry remembers the routing hash of its key so a flush never hashes
+ * the key again.
+ */
+struct sampler_entry {
+    uint32_t hash;
+    struct sample_bucket *buckets[SAMPLER_SLOTS];
 };
 
+struct sampler_table {
+    hashmap *map;
+    slab_t *entries;
+    sampler_t *samplers[SAMPLER_SLOTS];
+
+    /* keys per prefix of prefix_depth components, NULL if not tracked */
+    topk_t *prefixes;
+    int prefix_depth;
+    int prefix_quota;
+};
+
+/**
+ * A bucket in sampling mode. Flushes only visit these, so the node keeps
+ * its own copy of the key: keys in the table move as it is resized.
+ */
+struct active_node {
+    struct active_node *next;
+    struct sample_bucket *bucket;
+    uint32_t hash;
+    uint32_t key_len;
+    char key[];
+};
+
+/**
+ * State kept for every sampled key. Counters and gauges use this layout
+ * as is, timers extend it with struct timer_bucket.
+ */
 struct sample_bucket {
     bool sampling;
+
+    /**
+     * Halvings of the sampling threshold asked for by the key's backend,
+     * as of the key's last line
+     */
+    uint8_t threshold_shift;
+
+    /**
+     * CLOCK reference bit, set by each line and cleared by the hand
+     */
+    bool referenced;
+
+    /**
+     * Metric type (COUNTER, TIMER, GAUGE etc.)
+     */
+    metric_type type;
+
+    /**
+     * Window in which last_window_count was last updated
+     */
+    uint32_t epoch;
+
+    /**
+     * Hash of the key's prefix, when the table tracks prefixes
+     */
+    uint32_t prefix_hash;
+
+    /**
+     * Position in the sampler's CLOCK, when it has a memory budget
+     */
+    uint32_t clock_index;
+
     /**
      * A record of the number of events received
      */
     uint64_t last_window_count;
 
     /**
-     * Unix timestamp of bucket last modification
+     * Expiry generation of bucket last modification
+     */
+    uint32_t touched;
+
+    /**
+     * Entry of the key in the sampler table
+     */
+    struct sampler_entry *entry;
+
+    /**
+     * Next bucket in the same expiry wheel slot, and the link pointing
+     * to this one
      */
-    time_t last_modified_at;
+    struct sample_bucket *expiry_next;
+    struct sample_bucket **expiry_pprev;
 
     /**
      * Accumulated sum
@@ -63,16 +200,32 @@ struct sample_bucket {
      * Accumulated count (which may differ from last_window_count due to sampling)
      */
     uint64_t count;
+};
+
+struct timer_bucket {
+    struct sample_bucket base;
 
     /**
-     * Metric type (COUNTER, TIMER, GAUGE etc.)
+     * Number of values held in the reservoir
      */
-    metric_type type;
+    int reservoir_index;
 
     /**
-     * Index of recent item in the reservoir
+     * Values to pass over before the next one replaces a reservoir
+     * entry, once the reservoir is full (Algorithm L)
      */
-    int reservoir_index;
+    uint64_t reservoir_skip;
+
+    /**
+     * Algorithm L weight, the largest of the reservoir's random keys
+     */
+    double reservoir_w;
+
+    /**
+     * Quantile sketch replacing the reservoir in sketch mode, only
+     * allocated while the timer is sampled
+     */
+    sketch_t *sketch;
 
     /**
      * Upper value of timer seen in the sampling period
@@ -97,11 +250,61 @@ struct sample_bucket {
     double upper_sample_rate;
 
     /**
-     * Maintain a reservoir of 'threshold' timer values
+     * Maintain a reservoir of 'reservoir_size' timer values
      */
     double reservoir[];
 };
 
+/**
+ * A gauge also keeps the relative (signed) lines since its last absolute
+ * one apart: they change the value downstream rather than replace it.
+ */
+struct gauge_bucket {
+    struct sample_bucket base;
+
+    /**
+     * Sum of the relative lines since the last absolute one
+     */
+    double delta;
+
+    /**
+     * Number of relative lines since the last absolute one
+     */
+    uint64_t deltas;
+};
+
+/* Distinct members a set keeps exactly, and bytes for their text, in the space of its HyperLogLog */
+#define SET_EXACT_MEMBERS 32
+#define SET_MEMBER_BYTES (sizeof(hll_t) - SET_EXACT_MEMBERS * (sizeof(uint64_t) + sizeof(uint16_t)))
+
+/**
+ * Members of a sampled set in the current window, as the opaque text
+ * they were sent as: exactly while they fit, and when relaying the
+ * cardinality, as a HyperLogLog over the same memory past that.
+ */
+struct set_summary {
+    uint32_t members;
+    bool estimated;
+    union {
+        struct {
+            uint64_t hashes[SET_EXACT_MEMBERS];
+            /* where each member's text ends in text */
+            uint16_t ends[SET_EXACT_MEMBERS];
+            char text[SET_MEMBER_BYTES];
+        } exact;
+        hll_t hll;
+    };
+};
+
+struct set_bucket {
+    struct sample_bucket base;
+
+    /**
+     * Only allocated while the set is sampled
+     */
+    struct set_summary *summary;
+};
+
 /**
  * Boolean flag that sampler flush callback uses to decide
  * if the calculated true upper and lower values for a sampled
@@ -111,81 +314,555 @@ static bool flush_upper_lower(sampler_t* sampler) {
     return sampler->timer_flush_min_max;
 }
 
-static time_t timestamp() {
-    struct timespec current_time;
-    time_t timestamp_sec;
-#ifdef __APPLE__
-    clock_serv_t cclock;
-    mach_timespec_t mts;
-    host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
-    clock_get_time(cclock, &mts);
-    mach_port_deallocate(mach_task_self(), cclock);
-    timestamp_sec = mts.tv_sec;
-#else
-    clock_gettime(CLOCK_REALTIME_COARSE, &current_time);
-    timestamp_sec = current_time.tv_sec;
-#endif
+static inline uint64_t rotl(const uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* xoroshiro128+ (Blackman and Vigna) */
+static inline uint64_t sampler_rand(sampler_t* sampler) {
+    uint64_t s0 = sampler->rng[0];
+    uint64_t s1 = sampler->rng[1];
+    uint64_t result = s0 + s1;
 
-    return timestamp_sec;
+    s1 ^= s0;
+    sampler->rng[0] = rotl(s0, 24) ^ s1 ^ (s1 << 16);
+    sampler->rng[1] = rotl(s1, 37);
+    return result;
 }
 
-static int sampler_update_callback(void* _s, const char* key, void* _value, void *metadata) {
-    sampler_t* sampler = (sampler_t*)_s;
-    struct sample_bucket* bucket = (struct sample_bucket*)_value;
+/* A uniform double in (0, 1], safe to take the log of */
+static inline double sampler_rand_unit(sampler_t* sampler) {
+    return ((sampler_rand(sampler) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
 
-    if (bucket->last_window_count > sampler->threshold) {
-        bucket->sampling = true;
-    } else if (bucket->sampling && bucket->last_window_count <= sampler->threshold) {
-        bucket->sampling = false;
-        bucket->reservoir_index = 0;
-        char *type;
-        switch (bucket->type) {
-        case METRIC_COUNTER:
-            type = "counter";
-            break;
-        case METRIC_TIMER:
-            type = "timer";
-            break;
-        case METRIC_GAUGE:
-            type = "gauge";
-            break;
-        default:
-            type = "unknown/other";
-            break;
-        }
-        stats_debug_log("stopped %s sampling '%s'",
-                        type,
-                        key);
-    }
-
-    bucket->last_window_count = 0;
+/* A uniform integer in [0, n) */
+static inline uint32_t sampler_rand_below(sampler_t* sampler, uint32_t n) {
+    return (uint32_t)(((sampler_rand(sampler) >> 32) * n) >> 32);
+}
+
+static void sampler_seed(sampler_t* sampler, uint64_t seed) {
+    // splitmix64 spreads the seed over both words
+    for (int i = 0; i < 2; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        sampler->rng[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Draw the number of values to skip before the next reservoir
+ * replacement, advancing the Algorithm L weight.
+ */
+static void sampler_reservoir_skip(sampler_t* sampler, struct timer_bucket* timer) {
+    int k = sampler->reservoir_size;
+    timer->reservoir_w *= exp(log(sampler_rand_unit(sampler)) / k);
+
+    double skip = floor(log(sampler_rand_unit(sampler)) / log1p(-timer->reservoir_w));
+    if (!(skip < (double)UINT64_MAX)) {
+        // w rounds to 1 for huge streams, or the log came out NaN
+        skip = skip >= 0 ? (double)UINT64_MAX : 0;
+    }
+    timer->reservoir_skip = (uint64_t)skip;
+}
+
+/**
+ * Offer a value to a timer's reservoir. Filling the reservoir takes the
+ * first reservoir_size values; after that Algorithm L draws how many
+ * values to skip before the next replacement, so most values only
+ * decrement a counter.
+ */
+static void sampler_reservoir_add(sampler_t* sampler, struct timer_bucket* timer, double value) {
+    int k = sampler->reservoir_size;
+    if (timer->reservoir_index < k) {
+        timer->reservoir[timer->reservoir_index++] = value;
+        if (timer->reservoir_index == k) {
+            timer->reservoir_w = 1.0;
+            sampler_reservoir_skip(sampler, timer);
+        }
+    } else if (timer->reservoir_skip > 0) {
+        timer->reservoir_skip--;
+    } else {
+        timer->reservoir[sampler_rand_below(sampler, k)] = value;
+        sampler_reservoir_skip(sampler, timer);
+    }
+}
+
+static bool sampler_expires(sampler_t* sampler) {
+    return sampler->base.hm_ttl != -1;
+}
+
+static uint32_t sampler_generation(sampler_t* sampler) {
+    struct ev_loop *loop = ev_default_loop(0);
+    int frequency = sampler->base.hm_expiry_frequency > 0 ? sampler->base.hm_expiry_frequency : 1;
+    return (uint32_t)(ev_now(loop) / frequency);
+}
+
+static void sampler_wheel_insert(sampler_t* sampler, struct sample_bucket* bucket, uint32_t generation) {
+    struct sample_bucket** slot = &sampler->base.wheel[generation % EXPIRY_WHEEL_SLOTS];
+    bucket->expiry_next = *slot;
+    bucket->expiry_pprev = slot;
+    if (*slot != NULL) {
+        (*slot)->expiry_pprev = &bucket->expiry_next;
+    }
+    *slot = bucket;
+}
+
+static void sampler_wheel_remove(struct sample_bucket* bucket) {
+    *bucket->expiry_pprev = bucket->expiry_next;
+    if (bucket->expiry_next != NULL) {
+        bucket->expiry_next->expiry_pprev = bucket->expiry_pprev;
+    }
+}
+
+/* Slice of a key, by its hash mixed away from the bits that pick its backend */
+static inline int sampler_slice(sampler_t* sampler, uint32_t hash) {
+    return ((uint64_t)(hash * 0x9e3779b1U) * sampler->flush_slices) >> 32;
+}
+
+static inline uint32_t sampler_epoch(sampler_t* sampler, uint32_t hash) {
+    return sampler->epoch[sampler_slice(sampler, hash)];
+}
+
+static void sampler_touch(sampler_t* sampler, struct sample_bucket* bucket) {
+    bucket->touched = sampler->base.generation;
+    bucket->referenced = true;
+}
+
+static int sampler_slot(metric_type type) {
+    switch (type) {
+    case METRIC_COUNTER:
+        return 0;
+    case METRIC_TIMER:
+        return 1;
+    case METRIC_GAUGE:
+        return 2;
+    case METRIC_S:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+static bool sampler_entry_empty(struct sampler_entry *entry) {
+    for (int i = 0; i < SAMPLER_SLOTS; i++) {
+        if (entry->buckets[i] != NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Find the bucket of a key for this sampler. *entry is set to the shared
+ * entry of the key, or NULL if no sampler has seen it yet.
+ */
+static struct sample_bucket *sampler_find(sampler_t *sampler, const char *key, size_t key_len,
+        uint32_t hash, struct sampler_entry **entry) {
+    *entry = NULL;
+    hashmap_get_hashed(sampler->table->map, key, key_len, hash, (void**)entry);
+    return *entry != NULL ? (*entry)->buckets[sampler->slot] : NULL;
+}
+
+/* Length of the first prefix_depth dot separated components of a key */
+static size_t sampler_prefix_len(sampler_table_t* table, const char* key, size_t key_len) {
+    int dots = 0;
+    for (size_t i = 0; i < key_len; i++) {
+        if (key[i] == '.' && ++dots == table->prefix_depth) {
+            return i;
+        }
+    }
+    return key_len;
+}
+
+/**
+ * Attach a new bucket to the entry of a key, creating the entry if
+ * needed. Returns 0 on success.
+ */
+static int sampler_attach(sampler_t *sampler, struct sampler_entry *entry, const char *key,
+        size_t key_len, uint32_t hash, struct sample_bucket *bucket) {
+    if (sampler->memory_budget > 0 && sampler->num_buckets == sampler->clock_capacity) {
+        size_t capacity = sampler->clock_capacity > 0 ? 2 * sampler->clock_capacity : 64;
+        struct sample_bucket** clock = realloc(sampler->clock, capacity * sizeof(*clock));
+        if (clock == NULL) {
+            return -1;
+        }
+        sampler->clock = clock;
+        sampler->clock_capacity = capacity;
+    }
+    if (entry == NULL) {
+        entry = slab_alloc(sampler->table->entries);
+        if (entry == NULL) {
+            return -1;
+        }
+        memset(entry, 0, sizeof(struct sampler_entry));
+        entry->hash = hash;
+        if (hashmap_put_hashed(sampler->table->map, key, key_len, hash, entry, NULL) != 1) {
+            slab_free(sampler->table->entries, entry);
+            return -1;
+        }
+    }
+    entry->buckets[sampler->slot] = bucket;
+    if (sampler->memory_budget > 0) {
+        bucket->clock_index = sampler->num_buckets;
+        sampler->clock[bucket->clock_index] = bucket;
+    }
+    sampler->num_buckets++;
+
+    if (sampler->table->prefixes != NULL) {
+        size_t prefix_len = sampler_prefix_len(sampler->table, key, key_len);
+        bucket->prefix_hash = hashmap_hash(key, prefix_len);
+        topk_add(sampler->table->prefixes, key, prefix_len, bucket->prefix_hash, 1);
+    }
+
+    bucket->entry = entry;
+    if (sampler_expires(sampler)) {
+        sampler_wheel_insert(sampler, bucket,
+                sampler->base.generation + sampler->base.ttl_generations + 1);
+    }
     return 0;
 }
 
-static int expiry_callback(void* _s, const char* key, void* _value, void *metadata) {
-    sampler_t* sampler = (sampler_t*)_s;
-    struct sample_bucket* bucket = (struct sample_bucket*)_value;
-    int* ttl = (int*)metadata;
+/**
+ * Count an event in the current window, starting the count afresh if
+ * the bucket was last seen in an earlier window.
+ */
+static void sampler_count_event(sampler_t* sampler, struct sample_bucket* bucket) {
+    uint32_t epoch = sampler_epoch(sampler, bucket->entry->hash);
+    if (bucket->epoch != epoch) {
+        bucket->epoch = epoch;
+        bucket->last_window_count = 0;
+    }
+    bucket->last_window_count++;
+}
+
+/**
+ * Put a bucket in sampling mode. Returns false, leaving the bucket
+ * unsampled, if it cannot be tracked.
+ */
+static bool sampler_activate(sampler_t* sampler, struct sample_bucket* bucket, const char* key,
+        size_t key_len, uint32_t hash) {
+    struct active_node* node = malloc(sizeof(struct active_node) + key_len + 1);
+    if (node == NULL) {
+        return false;
+    }
+    node->bucket = bucket;
+    node->hash = hash;
+    node->key_len = key_len;
+    memcpy(node->key, key, key_len);
+    node->key[key_len] = '\0';
+
+    int slice = sampler_slice(sampler, hash);
+    node->next = sampler->active[slice];
+    sampler->active[slice] = node;
+    sampler->num_active++;
+    bucket->sampling = true;
+    return true;
+}
 
-    // simply return if the bucket is being sampled!
-    if (bucket->sampling) return 0;
+static void sampler_deactivate(sampler_t* sampler, struct active_node* node) {
+    struct sample_bucket* bucket = node->bucket;
+    bucket->sampling = false;
+    if (bucket->type == METRIC_TIMER) {
+        struct timer_bucket* timer = (struct timer_bucket*)bucket;
+        timer->reservoir_index = 0;
+        if (timer->sketch != NULL) {
+            slab_free(sampler->sketches, timer->sketch);
+            timer->sketch = NULL;
+        }
+    } else if (bucket->type == METRIC_S) {
+        struct set_bucket* set = (struct set_bucket*)bucket;
+        slab_free(sampler->sketches, set->summary);
+        set->summary = NULL;
+    }
+    char *type;
+    switch (bucket->type) {
+    case METRIC_COUNTER:
+        type = "counter";
+        break;
+    case METRIC_TIMER:
+        type = "timer";
+        break;
+    case METRIC_GAUGE:
+        type = "gauge";
+        break;
+    case METRIC_S:
+        type = "set";
+        break;
+    default:
+        type = "unknown/other";
+        break;
+    }
+    stats_debug_log("stopped %s sampling '%s'",
+                    type,
+                    node->key);
+    free(node);
+    sampler->num_active--;
+}
 
-    time_t now = timestamp();
+/**
+ * Drop this sampler's bucket from an entry, and the entry itself once
+ * no sampler holds a bucket in it.
+ */
+static int sampler_release(sampler_t* sampler, struct sampler_entry* entry, bool free_bucket) {
+    if (sampler->table->prefixes != NULL) {
+        size_t key_len;
+        const char* key = hashmap_value_key(sampler->table->map, entry->hash, entry, &key_len);
+        if (key != NULL) {
+            topk_sub(sampler->table->prefixes, key, sampler_prefix_len(sampler->table, key, key_len),
+                    entry->buckets[sampler->slot]->prefix_hash, 1);
+        }
+    }
+    if (sampler->memory_budget > 0) {
+        // the last bucket of the clock takes the place of this one
+        struct sample_bucket* last = sampler->clock[sampler->num_buckets - 1];
+        last->clock_index = entry->buckets[sampler->slot]->clock_index;
+        sampler->clock[last->clock_index] = last;
+    }
+    if (free_bucket) {
+        slab_free(sampler->buckets, entry->buckets[sampler->slot]);
+    }
+    entry->buckets[sampler->slot] = NULL;
+    sampler->num_buckets--;
 
-    if ((now - bucket->last_modified_at) > (*ttl)) {
-        if (_value)
-            free(_value);
+    if (sampler_entry_empty(entry)) {
+        slab_free(sampler->table->entries, entry);
         return HASHMAP_ITER_DELETE;
     }
-
     return HASHMAP_ITER_CONTINUE;
 }
 
-static int sampler_flush_callback(void* _s, const char* key, void* _value, void* metadata) {
-    struct sampler_flush_data* flush_data = (struct sampler_flush_data*)_s;
-    struct sample_bucket* bucket = (struct sample_bucket*)_value;
+/**
+ * Expire or reschedule a bucket whose wheel slot came up in the given
+ * generation.
+ */
+static void sampler_expire_bucket(sampler_t* sampler, struct sample_bucket* bucket, uint32_t generation) {
+    uint32_t due = bucket->touched + sampler->base.ttl_generations + 1;
+
+    // buckets being sampled never expire, look again next generation
+    if (bucket->sampling && (int32_t)(due - generation) <= 0) {
+        due = generation + 1;
+    }
+    if ((int32_t)(due - generation) > 0) {
+        sampler_wheel_insert(sampler, bucket, due);
+        return;
+    }
+
+    struct sampler_entry* entry = bucket->entry;
+    uint32_t hash = entry->hash;
+    if (sampler_release(sampler, entry, true) == HASHMAP_ITER_DELETE) {
+        // the entry is already back in its slab, only its address is used
+        hashmap_delete_value(sampler->table->map, hash, entry);
+    }
+}
+
+/**
+ * Work through at most EXPIRY_SLICE buckets of the generations that
+ * came due. Returns true if work is left for another slice.
+ */
+static bool sampler_expire_slice(sampler_t* sampler) {
+    expiring_entry_t* base = &sampler->base;
+    base->generation = sampler_generation(sampler);
+
+    // After a long stall each slot needs to be visited only once
+    if (base->generation - base->expiry_generation > EXPIRY_WHEEL_SLOTS) {
+        base->expiry_generation = base->generation - EXPIRY_WHEEL_SLOTS;
+    }
+
+    int budget = EXPIRY_SLICE;
+    while (budget > 0) {
+        if (base->expiring == NULL) {
+            if ((int32_t)(base->expiry_generation - base->generation) > 0) {
+                return false;
+            }
+            struct sample_bucket** slot = &base->wheel[base->expiry_generation % EXPIRY_WHEEL_SLOTS];
+            base->expiring = *slot;
+            if (base->expiring != NULL) {
+                base->expiring->expiry_pprev = &base->expiring;
+            }
+            *slot = NULL;
+            base->expiry_generation++;
+            continue;
+        }
+
+        struct sample_bucket* bucket = base->expiring;
+        sampler_wheel_remove(bucket);
+        sampler_expire_bucket(sampler, bucket, base->expiry_generation - 1);
+        budget--;
+    }
+    return true;
+}
+
+static int sampler_destroy_callback(void* _s, const char* key, void* _value, void *metadata) {
+    sampler_t* sampler = (sampler_t*)_s;
+    struct sampler_entry* entry = (struct sampler_entry*)_value;
+
+    if (entry->buckets[sampler->slot] == NULL) {
+        return HASHMAP_ITER_CONTINUE;
+    }
+    /* the buckets themselves go with the slab */
+    return sampler_release(sampler, entry, false);
+}
+
+/**
+ * Relay a sketched timer as sketch_points values spread over its
+ * distribution, with a sample rate that makes them count for the whole
+ * window. With timer_flush_min_max the first and last are the exact
+ * minimum and maximum.
+ */
+static void sampler_flush_sketch(sampler_t* sampler, struct active_node* node,
+        sampler_flush_cb cb, void* data) {
+    struct timer_bucket* timer = (struct timer_bucket*)node->bucket;
+    sketch_t* sketch = timer->sketch;
+    if (sketch == NULL || sketch_count(sketch) == 0) {
+        return;
+    }
+
+    uint64_t points = sampler->sketch_points;
+    if (points > sketch_count(sketch)) {
+        points = sketch_count(sketch);
+    }
+    double sample_rate = (double)points / timer->base.count;
+
+    char line_buffer[MAX_UDP_LENGTH];
+    for (uint64_t i = 0; i < points; i++) {
+        double q;
+        if (flush_upper_lower(sampler) && points > 1) {
+            q = (double)i / (points - 1);
+        } else {
+            q = (i + 0.5) / points;
+        }
+        int len = sprintf(line_buffer, "%s:%g|ms@%g\n", node->key, sketch_quantile(sketch, q), sample_rate);
+        len -= 1;
+        cb(data, node->key, node->key_len, node->hash, line_buffer, len);
+    }
+    sketch_clear(sketch);
+}
+
+/* Hash of a set member's text, mixed over all bits as the HyperLogLog needs */
+static uint64_t sampler_member_hash(const char* member, size_t len) {
+    // FNV-1a, then the splitmix64 finalizer
+    uint64_t z = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        z = (z ^ (unsigned char)member[i]) * 0x100000001b3ULL;
+    }
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Add a member to a set. Returns false if the member was not kept, for
+ * a set relaying its members that has no room left: the line is to be
+ * relayed as is.
+ */
+static bool sampler_set_add(sampler_t* sampler, struct set_summary* summary,
+        const char* member, size_t len) {
+    uint64_t hash = sampler_member_hash(member, len);
+    if (!summary->estimated) {
+        size_t start = 0;
+        for (uint32_t i = 0; i < summary->members; i++) {
+            size_t end = summary->exact.ends[i];
+            if (summary->exact.hashes[i] == hash && end - start == len &&
+                    memcmp(summary->exact.text + start, member, len) == 0) {
+                return true;
+            }
+            start = end;
+        }
+        if (summary->members < SET_EXACT_MEMBERS && start + len <= SET_MEMBER_BYTES) {
+            memcpy(summary->exact.text + start, member, len);
+            summary->exact.hashes[summary->members] = hash;
+            summary->exact.ends[summary->members] = start + len;
+            summary->members++;
+            return true;
+        }
+        if (!sampler->set_cardinality) {
+            return false;
+        }
+
+        // Out of room, count the members seen so far in the HyperLogLog
+        uint64_t hashes[SET_EXACT_MEMBERS];
+        memcpy(hashes, summary->exact.hashes, sizeof(hashes));
+        hll_init(&summary->hll);
+        for (uint32_t i = 0; i < summary->members; i++) {
+            hll_add(&summary->hll, hashes[i]);
+        }
+        summary->estimated = true;
+    }
+    hll_add(&summary->hll, hash);
+    return true;
+}
+
+/**
+ * Relay a set's distinct members, or their count as a gauge if the
+ * sampler is configured so.
+ */
+static void sampler_flush_set(sampler_t* sampler, struct active_node* node,
+        sampler_flush_cb cb, void* data) {
+    struct set_summary* summary = ((struct set_bucket*)node->bucket)->summary;
+    if (summary == NULL) {
+        return;
+    }
 
-    if (!bucket->sampling || bucket->count == 0) goto exit;
+    char line_buffer[MAX_UDP_LENGTH];
+    int len;
+    if (sampler->set_cardinality) {
+        uint64_t count = summary->estimated ? hll_count(&summary->hll) : summary->members;
+        len = sprintf(line_buffer, "%s:%" PRIu64 "|g\n", node->key, count);
+        len -= 1;
+        cb(data, node->key, node->key_len, node->hash, line_buffer, len);
+    } else {
+        size_t start = 0;
+        for (uint32_t i = 0; i < summary->members; i++) {
+            size_t end = summary->exact.ends[i];
+            len = sprintf(line_buffer, "%s:%.*s|s\n", node->key, (int)(end - start), summary->exact.text + start);
+            start = end;
+            len -= 1;
+            cb(data, node->key, node->key_len, node->hash, line_buffer, len);
+        }
+    }
+    summary->members = 0;
+    summary->estimated = false;
+}
+
+/**
+ * Relay a gauge's value, then the relative lines since as one signed
+ * line, so that downstream applies them on top of the value.
+ */
+static void sampler_flush_gauge(struct active_node* node, sampler_flush_cb cb, void* data) {
+    struct gauge_bucket* gauge = (struct gauge_bucket*)node->bucket;
+    struct sample_bucket* bucket = &gauge->base;
+    char line_buffer[MAX_UDP_LENGTH];
+    int len;
+
+    if (bucket->count > 0) {
+        len = sprintf(line_buffer, "%s:%g|g\n", node->key, bucket->sum / bucket->count);
+        len -= 1; /* \n is not part of the length */
+        cb(data, node->key, node->key_len, node->hash, line_buffer, len);
+    }
+    if (gauge->deltas > 0) {
+        len = sprintf(line_buffer, "%s:%+g|g\n", node->key, gauge->delta);
+        len -= 1;
+        cb(data, node->key, node->key_len, node->hash, line_buffer, len);
+    }
+    bucket->count = 0;
+    bucket->sum = 0;
+    gauge->delta = 0;
+    gauge->deltas = 0;
+}
+
+static void sampler_flush_bucket(sampler_t* sampler, struct active_node* node,
+        sampler_flush_cb cb, void* data) {
+    struct sample_bucket* bucket = node->bucket;
+    const char* key = node->key;
+    size_t key_len = node->key_len;
+    uint32_t hash = node->hash;
+
+    if (bucket->type == METRIC_GAUGE) {
+        sampler_flush_gauge(node, cb, data);
+        return;
+    }
+    if (bucket->count == 0) return;
     char line_buffer[MAX_UDP_LENGTH];
     int len;
     line_buffer[0] = '\0';
@@ -193,86 +870,289 @@ static int sampler_flush_callback(void* _s, const char* key, void* _value, void*
     if (bucket->type == METRIC_COUNTER) {
         len = sprintf(line_buffer, "%s:%g|c@%g\n", key, bucket->sum / bucket->count, 1.0 / bucket->count);
         len -= 1; /* \n is not part of the length */
-        flush_data->cb(flush_data->data, key, line_buffer, len);
-    } else if (bucket->type == METRIC_GAUGE) {
-        len = sprintf(line_buffer, "%s:%g|g\n", key, bucket->sum / bucket->count);
-        len -= 1; /* \n is not part of the length */
-        flush_data->cb(flush_data->data, key, line_buffer, len);
+        cb(data, key, key_len, hash, line_buffer, len);
+    } else if (bucket->type == METRIC_S) {
+        sampler_flush_set(sampler, node, cb, data);
+    } else if (bucket->type == METRIC_TIMER && sampler->sketches != NULL) {
+        sampler_flush_sketch(sampler, node, cb, data);
     } else if (bucket->type == METRIC_TIMER) {
-        int num_samples = 0;
-        for (int j = 0; j < flush_data->sampler->threshold; j++) {
-            if (!isnan(bucket->reservoir[j])) {
-                num_samples++;
-            }
-        }
+        struct timer_bucket* timer = (struct timer_bucket*)bucket;
+        int num_samples = timer->reservoir_index;
 
         // Flush the max and min for the well-being of timer.upper and timer.lower respectively
         // iff, client has explicitly requested a flush of .upper and .lower
-        if (bucket->upper > DBL_MIN && flush_upper_lower(flush_data->sampler)) {
-            len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, bucket->upper, bucket->upper_sample_rate);
+        if (timer->upper > DBL_MIN && flush_upper_lower(sampler)) {
+            len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, timer->upper, timer->upper_sample_rate);
             len -= 1;
-            flush_data->cb(flush_data->data, key, line_buffer, len);
-            bucket->upper = DBL_MIN;
+            cb(data, key, key_len, hash, line_buffer, len);
+            timer->upper = DBL_MIN;
         }
 
-        if (bucket->lower < DBL_MAX && flush_upper_lower(flush_data->sampler)) {
-            len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, bucket->lower, bucket->lower_sample_rate);
+        if (timer->lower < DBL_MAX && flush_upper_lower(sampler)) {
+            len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, timer->lower, timer->lower_sample_rate);
             len -= 1;
-            flush_data->cb(flush_data->data, key, line_buffer, len);
-            bucket->lower = DBL_MAX;
+            cb(data, key, key_len, hash, line_buffer, len);
+            timer->lower = DBL_MAX;
         }
 
         double sample_rate = (double)(1.0 * num_samples) / bucket->count;
-        for (int j = 0; j < flush_data->sampler->threshold; j++) {
-            if (!isnan(bucket->reservoir[j])) {
-                len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, bucket->reservoir[j], sample_rate);
-                len -= 1;
-                flush_data->cb(flush_data->data, key, line_buffer, len);
-                bucket->reservoir[j] = NAN;
-            }
+        for (int j = 0; j < num_samples; j++) {
+            len = sprintf(line_buffer, "%s:%g|ms@%g\n", key, timer->reservoir[j], sample_rate);
+            len -= 1;
+            cb(data, key, key_len, hash, line_buffer, len);
         }
+        // Each window samples afresh
+        timer->reservoir_index = 0;
     }
     bucket->count = 0;
     bucket->sum = 0;
+}
 
-    exit:
-    /* Also call update */
-    sampler_update_callback(flush_data->sampler, key, _value, metadata);
-    return 0;
+/**
+ * Walk the buckets of a slice in sampling mode, flushing them if cb is
+ * set, and drop the ones that fell back under the threshold in the
+ * window that just ended. Buckets not in sampling mode are never
+ * visited: their counts are reset lazily by the epoch change.
+ */
+static void sampler_end_window(sampler_t* sampler, int slice, sampler_flush_cb cb, void* data) {
+    struct active_node** link = &sampler->active[slice];
+    while (*link != NULL) {
+        struct active_node* node = *link;
+        struct sample_bucket* bucket = node->bucket;
+
+        if (cb != NULL) {
+            sampler_flush_bucket(sampler, node, cb, data);
+        }
+
+        uint64_t window_count = bucket->epoch == sampler->epoch[slice] ? bucket->last_window_count : 0;
+        if (window_count <= sampler_effective_threshold(sampler, bucket->threshold_shift)) {
+            *link = node->next;
+            sampler_deactivate(sampler, node);
+        } else {
+            link = &node->next;
+        }
+    }
+    sampler->epoch[slice]++;
+    // the doorkeeper remembers keys for a whole window
+    if (sampler->doorkeeper != NULL && slice == sampler->flush_slices - 1) {
+        bloom_clear(sampler->doorkeeper);
+    }
+}
+
+
+/* Bytes held by live buckets and summaries, against the memory budget */
+static size_t sampler_live_memory(sampler_t* sampler) {
+    size_t memory = sampler->num_buckets * slab_object_size(sampler->buckets);
+    if (sampler->sketches != NULL) {
+        memory += slab_count(sampler->sketches) * slab_object_size(sampler->sketches);
+    }
+    return memory;
+}
+
+static bool sampler_full(sampler_t* sampler) {
+    return sampler->num_buckets >= sampler->cardinality ||
+        (sampler->memory_budget > 0 && sampler_live_memory(sampler) >= sampler->memory_budget);
 }
 
 /**
- * Decides whether the metric should be flagged as being over
- * cardinality
+ * Free a bucket not seen since the CLOCK hand last passed it, leaving
+ * sampled buckets alone. Returns false if none turned up within
+ * EVICTION_SCAN buckets.
  */
-static bool flag_incoming_metric(sampler_t* sampler) {
-    return hashmap_size(sampler->map) >= sampler->cardinality;
+static bool sampler_evict(sampler_t* sampler) {
+    if (sampler->memory_budget == 0) {
+        return false;
+    }
+    for (int i = 0; i < EVICTION_SCAN && sampler->num_buckets > 0; i++) {
+        if (sampler->clock_hand >= sampler->num_buckets) {
+            sampler->clock_hand = 0;
+        }
+        struct sample_bucket* bucket = sampler->clock[sampler->clock_hand];
+        if (bucket->referenced || bucket->sampling) {
+            bucket->referenced = false;
+            sampler->clock_hand++;
+            continue;
+        }
+
+        // the hand stays put, on the bucket moved into this place
+        if (sampler_expires(sampler)) {
+            sampler_wheel_remove(bucket);
+        }
+        struct sampler_entry* entry = bucket->entry;
+        uint32_t hash = entry->hash;
+        if (sampler_release(sampler, entry, true) == HASHMAP_ITER_DELETE) {
+            hashmap_delete_value(sampler->table->map, hash, entry);
+        }
+        sampler->evictions++;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Decides whether a new metric gets a bucket. Behind a doorkeeper, only
+ * metrics already seen in the window do, so one-off keys are relayed as
+ * they are without holding a bucket until they expire.
+ */
+static bool admit_incoming_metric(sampler_t* sampler, uint32_t hash) {
+    if (sampler->doorkeeper == NULL || bloom_check_add(sampler->doorkeeper, hash)) {
+        return true;
+    }
+    sampler->doorkeeper_lines++;
+    return false;
+}
+
+/**
+ * Decides whether a new metric should be flagged: the metric's prefix is
+ * certain to be over its quota, or the sampler is full and no cold
+ * bucket can be evicted to make room. Flagged lines are counted against
+ * the prefix if it is tracked. admitted is set to whether the doorkeeper
+ * lets the metric have a bucket; room is only made for one that does.
+ */
+static bool flag_incoming_metric(sampler_t* sampler, const char* name, size_t key_len,
+        uint32_t hash, bool* admitted) {
+    sampler_table_t* table = sampler->table;
+    topk_entry_t* prefix = NULL;
+    if (table->prefixes != NULL) {
+        size_t prefix_len = sampler_prefix_len(table, name, key_len);
+        prefix = topk_find(table->prefixes, name, prefix_len, hashmap_hash(name, prefix_len));
+    }
+
+    *admitted = true;
+    bool flag = prefix != NULL && table->prefix_quota > 0 &&
+        prefix->count - prefix->error >= table->prefix_quota;
+    if (!flag) {
+        *admitted = admit_incoming_metric(sampler, hash);
+        flag = *admitted && sampler_full(sampler) && !sampler_evict(sampler);
+    }
+    if (flag && prefix != NULL) {
+        prefix->user++;
+    }
+    return flag;
 }
 
 static void expiry_callback_handler(struct ev_loop *loop, struct ev_timer *timer, int events) {
     sampler_t* sampler = (sampler_t*)timer->data;
 
-    // Iterate over items and callback.
-    hashmap_iter(sampler->map, expiry_callback, (void *)timer->data);
-    ev_timer_set(&sampler->base.map_expiry_timer, sampler->base.hm_expiry_frequency, 0.0);
+    if (sampler_expire_slice(sampler)) {
+        // Let the loop serve lines before the next slice
+        ev_timer_set(&sampler->base.map_expiry_timer, 0.0, 0.0);
+    } else {
+        slab_trim(sampler->buckets);
+        slab_trim(sampler->table->entries);
+        hashmap_compact(sampler->table->map);
+        ev_timer_set(&sampler->base.map_expiry_timer, sampler->base.hm_expiry_frequency, 0.0);
+    }
     ev_timer_start(loop, &sampler->base.map_expiry_timer);
 }
 
-int sampler_init(sampler_t** sampler, int threshold, int window, int cardinality, int reservoir_size,
-                 bool timer_flush_min_max, int hm_expiry_frequency, int hm_ttl) {
+int sampler_table_init(sampler_table_t** table) {
+    sampler_table_t *t = calloc(1, sizeof(sampler_table_t));
+    if (t == NULL) {
+        return -1;
+    }
+    if (hashmap_init(HM_SIZE, &t->map) != 0) {
+        free(t);
+        return -1;
+    }
+    if (slab_init(&t->entries, sizeof(struct sampler_entry)) != 0) {
+        hashmap_destroy(t->map);
+        free(t);
+        return -1;
+    }
+    *table = t;
+    return 0;
+}
+
+void sampler_table_destroy(sampler_table_t* table) {
+    if (table == NULL) {
+        return;
+    }
+    hashmap_destroy(table->map);
+    slab_destroy(table->entries);
+    topk_destroy(table->prefixes);
+    free(table);
+}
+
+int sampler_table_track_prefixes(sampler_table_t* table, int depth, int quota, int size) {
+    if (depth < 1 || size < 1 || table->prefixes != NULL || hashmap_size(table->map) > 0) {
+        return -1;
+    }
+    if (topk_init(&table->prefixes, size) != 0) {
+        return -1;
+    }
+    table->prefix_depth = depth;
+    table->prefix_quota = quota;
+    return 0;
+}
+
+size_t sampler_table_prefixes(sampler_table_t* table, const topk_entry_t** prefixes, size_t max) {
+    if (table->prefixes == NULL) {
+        return 0;
+    }
+    return topk_list(table->prefixes, prefixes, max);
+}
+
+int sampler_init(sampler_t** sampler, sampler_table_t* table, metric_type type, int threshold,
+                 int window, int cardinality, int reservoir_size, bool timer_flush_min_max,
+                 int hm_expiry_frequency, int hm_ttl) {
+    int slot = sampler_slot(type);
+    if (slot < 0 || (table != NULL && table->samplers[slot] != NULL)) {
+        return -1;
+    }
 
     struct sampler *sam = calloc(1, sizeof(struct sampler));
+    if (sam == NULL) {
+        return -1;
+    }
+
+    size_t bucket_size = sizeof(struct sample_bucket);
+    if (type == METRIC_TIMER) {
+        if (reservoir_size <= 0) {
+            reservoir_size = threshold > 0 ? threshold : 1;
+        }
+        bucket_size = sizeof(struct timer_bucket) + sizeof(double) * reservoir_size;
+    } else if (type == METRIC_GAUGE) {
+        bucket_size = sizeof(struct gauge_bucket);
+    } else if (type == METRIC_S) {
+        bucket_size = sizeof(struct set_bucket);
+    }
+    if (slab_init(&sam->buckets, bucket_size) != 0) {
+        free(sam);
+        return -1;
+    }
+    if (type == METRIC_S && slab_init(&sam->sketches, sizeof(struct set_summary)) != 0) {
+        slab_destroy(sam->buckets);
+        free(sam);
+        return -1;
+    }
 
-    hashmap_init(HM_SIZE, &sam->map);
+    if (table == NULL) {
+        if (sampler_table_init(&table) != 0) {
+            slab_destroy(sam->buckets);
+            slab_destroy(sam->sketches);
+            free(sam);
+            return -1;
+        }
+        sam->owns_table = true;
+    }
+    sam->table = table;
+    sam->slot = slot;
+    table->samplers[slot] = sam;
 
     sam->threshold = threshold;
     sam->window = window;
+    sam->flush_slices = 1;
     sam->cardinality = cardinality;
     sam->reservoir_size = reservoir_size;
     sam->timer_flush_min_max = timer_flush_min_max;
     sam->base.hm_expiry_frequency = hm_expiry_frequency;
-    // save this to pass into hashmap_put
     sam->base.hm_ttl = hm_ttl;
+    sam->base.generation = sampler_generation(sam);
+    sam->base.expiry_generation = sam->base.generation;
+    if (hm_ttl > 0 && hm_expiry_frequency > 0) {
+        sam->base.ttl_generations = (hm_ttl + hm_expiry_frequency - 1) / hm_expiry_frequency;
+    }
 
     if (hm_ttl != -1) {
         struct ev_loop *loop = ev_default_loop(0);
@@ -281,32 +1161,41 @@ int sampler_init(sampler_t** sampler, int threshold, int window, int cardinality
         ev_timer_start(loop, &sam->base.map_expiry_timer);
     }
 
-#ifdef __APPLE__
-    time_t t = time(NULL);
-    sam->randbuf[0] = t & 0xFFFF;
-    sam->randbuf[1] = (t >> 16) & 0xFFFF;
-    sam->randbuf[2] = (t >> 32) & 0xFFFF;
-#else
-    srand48_r(time(NULL), &sam->randbuf);
-#endif
+    sampler_seed(sam, (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)sam);
 
     *sampler = sam;
     return 0;
 }
 
 void sampler_flush(sampler_t* sampler, sampler_flush_cb cb, void* data) {
-    struct sampler_flush_data fd = {
-            .data = data,
-            .sampler = sampler,
-            .cb = cb
-    };
-    hashmap_iter(sampler->map, sampler_flush_callback, (void*)&fd);
+    for (int i = 0; i < sampler->flush_slices; i++) {
+        sampler_end_window(sampler, i, cb, data);
+    }
+    sampler->next_slice = 0;
 }
 
-sampling_result sampler_is_sampling(sampler_t* sampler, const char* name, metric_type type) {
-    struct sample_bucket* bucket = NULL;
+void sampler_flush_slice(sampler_t* sampler, sampler_flush_cb cb, void* data) {
+    sampler_end_window(sampler, sampler->next_slice, cb, data);
+    sampler->next_slice = (sampler->next_slice + 1) % sampler->flush_slices;
+}
+
+int sampler_set_flush_slices(sampler_t* sampler, int slices) {
+    if (slices < 1 || slices > SAMPLER_MAX_SLICES || sampler->num_buckets > 0) {
+        return -1;
+    }
+    sampler->flush_slices = slices;
+    sampler->next_slice = 0;
+    return 0;
+}
+
+double sampler_flush_interval(sampler_t* sampler) {
+    return (double)sampler->window / sampler->flush_slices;
+}
 
-    hashmap_get(sampler->map, name, (void**)&bucket);
+sampling_result sampler_is_sampling(sampler_t* sampler, const char* name, metric_type type) {
+    struct sampler_entry* entry;
+    size_t key_len = strlen(name);
+    struct sample_bucket* bucket = sampler_find(sampler, name, key_len, hashmap_hash(name, key_len), &entry);
 
     if (bucket == NULL) {
         return SAMPLER_NOT_SAMPLING;
@@ -319,105 +1208,148 @@ sampling_result sampler_is_sampling(sampler_t* sampler, const char* name, metric
 }
 
 void sampler_update_flags(sampler_t* sampler) {
-    hashmap_iter(sampler->map, sampler_update_callback, (void*)sampler);
+    sampler_flush(sampler, NULL, NULL);
 }
 
-sampling_result sampler_consider_counter(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+static sampling_result sampler_consider_counter_hashed(sampler_t* sampler, const char* name, size_t key_len,
+        uint32_t hash, validate_parsed_result_t* parsed, int shift) {
     // safety check, also checked for in stats.c
     if (parsed->type != METRIC_COUNTER) {
         return SAMPLER_NOT_SAMPLING;
     }
 
-    struct sample_bucket* bucket = NULL;
-    hashmap_get(sampler->map, name, (void**)&bucket);
+    struct sampler_entry* entry;
+    struct sample_bucket* bucket = sampler_find(sampler, name, key_len, hash, &entry);
     if (bucket == NULL) {
         // Only flag if its a new metric
-        if (flag_incoming_metric(sampler)) {
-            stats_error_log("flagging counter: %s", name);
+        bool admitted;
+        if (flag_incoming_metric(sampler, name, key_len, hash, &admitted)) {
+            stats_error_log("flagging counter: %.*s", (int)key_len, name);
             return SAMPLER_FLAGGED;
         }
+        if (!admitted) {
+            return SAMPLER_NOT_SAMPLING;
+        }
         /* Intialize a new bucket */
-        bucket = malloc(sizeof(struct sample_bucket));
+        bucket = slab_alloc(sampler->buckets);
         if (bucket == NULL) {
             // Memory allocation has failed - fail by flagging metrics
             return SAMPLER_FLAGGED;
         }
         bucket->sampling = false;
+        bucket->epoch = sampler_epoch(sampler, hash);
         bucket->last_window_count = 1;
         bucket->type = parsed->type;
         bucket->sum = 0;
         bucket->count = 0;
-        bucket->last_modified_at = timestamp();
-        hashmap_put(sampler->map, name, (void*)bucket, (void*)&sampler->base.hm_ttl);
+        if (sampler_attach(sampler, entry, name, key_len, hash, bucket) != 0) {
+            slab_free(sampler->buckets, bucket);
+            return SAMPLER_FLAGGED;
+        }
     } else {
-        bucket->last_window_count++;
-        bucket->last_modified_at = timestamp();
+        sampler_count_event(sampler, bucket);
+    }
+    sampler_touch(sampler, bucket);
 
-        /* Circuit break and enable sampling mode */
-        if (!bucket->sampling && bucket->last_window_count > sampler->threshold) {
-            stats_debug_log("started counter sampling '%s'", name);
-            bucket->sampling = true;
-        }
+    bucket->threshold_shift = shift;
 
-        if (bucket->sampling) {
-            double value = parsed->value;
-            double count = 1.0;
-            if (parsed->presampling_value > 0.0 && parsed->presampling_value < 1.0) {
-                value = value * (1.0 / parsed->presampling_value);
-                count = 1 * (1.0 / parsed->presampling_value);
-            }
-            bucket->sum += value;
-            bucket->count += count;
+    /* Circuit break and enable sampling mode */
+    if (!bucket->sampling &&
+            bucket->last_window_count > sampler_effective_threshold(sampler, bucket->threshold_shift) &&
+            sampler_activate(sampler, bucket, name, key_len, hash)) {
+        stats_debug_log("started counter sampling '%.*s'", (int)key_len, name);
+    }
 
-            return SAMPLER_SAMPLING;
+    if (bucket->sampling) {
+        double value = parsed->value;
+        double count = 1.0;
+        if (parsed->presampling_value > 0.0 && parsed->presampling_value < 1.0) {
+            value = value * (1.0 / parsed->presampling_value);
+            count = 1 * (1.0 / parsed->presampling_value);
         }
+        bucket->sum += value;
+        bucket->count += count;
+
+        return SAMPLER_SAMPLING;
     }
     return SAMPLER_NOT_SAMPLING;
 }
 
-sampling_result sampler_consider_timer(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+static sampling_result sampler_consider_timer_hashed(sampler_t* sampler, const char* name, size_t key_len,
+        uint32_t hash, validate_parsed_result_t* parsed, int shift) {
     // safety check, also checked for in stats.c
     if (parsed->type != METRIC_TIMER) {
         return SAMPLER_NOT_SAMPLING;
     }
 
-    struct sample_bucket* bucket = NULL;
-    hashmap_get(sampler->map, name, (void**)&bucket);
+    struct sampler_entry* entry;
+    struct sample_bucket* bucket = sampler_find(sampler, name, key_len, hash, &entry);
+    struct timer_bucket* timer = (struct timer_bucket*)bucket;
     if (bucket == NULL) {
         // Only flag if its a new metric
-        if (flag_incoming_metric(sampler)) {
-            stats_error_log("flagging timer: %s", name);
+        bool admitted;
+        if (flag_incoming_metric(sampler, name, key_len, hash, &admitted)) {
+            stats_error_log("flagging timer: %.*s", (int)key_len, name);
             return SAMPLER_FLAGGED;
         }
+        if (!admitted) {
+            return SAMPLER_NOT_SAMPLING;
+        }
         /* Intialize a new bucket */
-        bucket = malloc(sizeof(struct sample_bucket) + (sizeof(double) * sampler->reservoir_size));
-        if (bucket == NULL) {
+        timer = slab_alloc(sampler->buckets);
+        if (timer == NULL) {
             // Memory allocation has failed - fail by flagging metrics
             return SAMPLER_FLAGGED;
         }
+        bucket = &timer->base;
         bucket->sampling = false;
-        bucket->reservoir_index = 0;
+        bucket->epoch = sampler_epoch(sampler, hash);
+        timer->reservoir_index = 0;
         bucket->last_window_count = 0;
         bucket->type = parsed->type;
-        bucket->upper = DBL_MIN;
-        bucket->lower = DBL_MAX;
+        timer->upper = DBL_MIN;
+        timer->lower = DBL_MAX;
+        timer->sketch = NULL;
         bucket->sum = 0;
         bucket->count = 0;
-        bucket->last_modified_at = timestamp();
-
-        for (int k = 0; k < sampler_threshold(sampler); k++) {
-            bucket->reservoir[k] = NAN;
-        }
+        bucket->threshold_shift = shift;
+        sampler_touch(sampler, bucket);
         bucket->last_window_count += 1;
-        hashmap_put(sampler->map, name, (void*)bucket, (void*)&sampler->base.hm_ttl);
+        if (sampler_attach(sampler, entry, name, key_len, hash, bucket) != 0) {
+            slab_free(sampler->buckets, bucket);
+            return SAMPLER_FLAGGED;
+        }
     } else {
-        bucket->last_window_count++;
-        bucket->last_modified_at = timestamp();
+        sampler_count_event(sampler, bucket);
+        sampler_touch(sampler, bucket);
+
+        bucket->threshold_shift = shift;
 
         /* Circuit break and enable sampling mode */
-        if (!bucket->sampling && bucket->last_window_count > sampler->threshold) {
-            stats_debug_log("started timer sampling '%s'", name);
-            bucket->sampling = true;
+        if (!bucket->sampling &&
+                bucket->last_window_count > sampler_effective_threshold(sampler, bucket->threshold_shift) &&
+                sampler_activate(sampler, bucket, name, key_len, hash)) {
+            stats_debug_log("started timer sampling '%.*s'", (int)key_len, name);
+        }
+
+        if (bucket->sampling && sampler->sketches != NULL) {
+            if (timer->sketch == NULL) {
+                timer->sketch = slab_alloc(sampler->sketches);
+                if (timer->sketch == NULL) {
+                    // Out of memory, relay the line as is
+                    return SAMPLER_NOT_SAMPLING;
+                }
+                sketch_init(timer->sketch);
+            }
+            sketch_add(timer->sketch, parsed->value);
+
+            double count = 1.0;
+            if (parsed->presampling_value > 0.0 && parsed->presampling_value < 1.0) {
+                count = 1 * (1.0 / parsed->presampling_value);
+            }
+            bucket->sum += parsed->value;
+            bucket->count += count;
+            return SAMPLER_SAMPLING;
         }
 
         if (bucket->sampling) {
@@ -427,55 +1359,41 @@ sampling_result sampler_consider_timer(sampler_t* sampler, const char* name, val
              * update the upper and lower
              * timer values.
              */
-            if (value > bucket->upper) {
+            if (value > timer->upper) {
                 // keep the sampling rate in sync with the value
-                bucket->upper_sample_rate = parsed->presampling_value;
+                timer->upper_sample_rate = parsed->presampling_value;
 
-                if (bucket->upper != DBL_MIN) {
+                if (timer->upper != DBL_MIN) {
                     // add previous_max to reservoir
                     // update current_max
-                    double old_max = bucket->upper;
-                    bucket->upper = value;
+                    double old_max = timer->upper;
+                    timer->upper = value;
                     value = old_max;
                 } else {
                     // dont include it in the reservoir
-                    bucket->upper = value;
+                    timer->upper = value;
                     return SAMPLER_SAMPLING;
                 }
             }
 
-            if (value < bucket->lower) {
+            if (value < timer->lower) {
                 // keep the sampling rate in sync with the value
-                bucket->lower_sample_rate = parsed->presampling_value;
+                timer->lower_sample_rate = parsed->presampling_value;
 
-                if (bucket->lower != DBL_MAX) {
+                if (timer->lower != DBL_MAX) {
                     // add previous_min to reservoir
                     // update current_min
-                    double old_min = bucket->lower;
-                    bucket->lower = value;
+                    double old_min = timer->lower;
+                    timer->lower = value;
                     value = old_min;
                 } else {
                     // dont include it in the reservoir
-                    bucket->lower = value;
+                    timer->lower = value;
                     return SAMPLER_SAMPLING;
                 }
             }
 
-            if (bucket->reservoir_index < sampler_threshold(sampler)) {
-                bucket->reservoir[bucket->reservoir_index++] = value;
-            } else {
-                long int i, k;
-#ifdef __APPLE__
-                i = nrand48(sampler->randbuf);
-#else
-                lrand48_r(&sampler->randbuf, &i);
-#endif
-                k = i % (bucket->last_window_count);
-
-                if (k < sampler_threshold(sampler)) {
-                    bucket->reservoir[k] = value;
-                }
-            }
+            sampler_reservoir_add(sampler, timer, value);
 
             double count = 1.0;
             if (parsed->presampling_value > 0.0 && parsed->presampling_value < 1.0) {
@@ -491,54 +1409,85 @@ sampling_result sampler_consider_timer(sampler_t* sampler, const char* name, val
     return SAMPLER_NOT_SAMPLING;
 }
 
-sampling_result sampler_consider_gauge(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
-    struct sample_bucket* bucket = NULL;
-
+static sampling_result sampler_consider_gauge_hashed(sampler_t* sampler, const char* name, size_t key_len,
+        uint32_t hash, validate_parsed_result_t* parsed, int shift) {
     if (parsed->type != METRIC_GAUGE) {
         return SAMPLER_NOT_SAMPLING;
     }
 
-    hashmap_get(sampler->map, name, (void**)&bucket);
+    struct sampler_entry* entry;
+    struct sample_bucket* bucket = sampler_find(sampler, name, key_len, hash, &entry);
+    struct gauge_bucket* gauge = (struct gauge_bucket*)bucket;
     if (bucket == NULL) {
         // Only flag if its a new metric
-        if (flag_incoming_metric(sampler)) {
-            stats_error_log("flagging gauge: %s", name);
+        bool admitted;
+        if (flag_incoming_metric(sampler, name, key_len, hash, &admitted)) {
+            stats_error_log("flagging gauge: %.*s", (int)key_len, name);
             return SAMPLER_FLAGGED;
         }
+        if (!admitted) {
+            return SAMPLER_NOT_SAMPLING;
+        }
         /* Intialize a new bucket */
-        bucket = malloc(sizeof(struct sample_bucket));
-        if (bucket == NULL) {
+        gauge = slab_alloc(sampler->buckets);
+        if (gauge == NULL) {
             // Memory allocation has failed - fail by flagging metrics
             return SAMPLER_FLAGGED;
         }
+        bucket = &gauge->base;
+        gauge->delta = 0;
+        gauge->deltas = 0;
         bucket->sampling = false;
+        bucket->epoch = sampler_epoch(sampler, hash);
         bucket->last_window_count = 0;
         bucket->type = parsed->type;
         bucket->sum = 0;
         bucket->count = 0;
-        bucket->last_modified_at = timestamp();
-        hashmap_put(sampler->map, name, (void*)bucket, (void*)&sampler->base.hm_ttl);
+        sampler_touch(sampler, bucket);
+        if (sampler_attach(sampler, entry, name, key_len, hash, bucket) != 0) {
+            slab_free(sampler->buckets, bucket);
+            return SAMPLER_FLAGGED;
+        }
     }
 
-    bucket->last_modified_at = timestamp();
-    if (sampler->threshold <= 0) {
+    sampler_touch(sampler, bucket);
+    if (sampler->threshold <= 0 && !sampler->aggregate_all) {
         return SAMPLER_NOT_SAMPLING;
     }
 
-    bucket->last_window_count++;
+    sampler_count_event(sampler, bucket);
+
+    bucket->threshold_shift = shift;
 
     /* Circuit break and enable sampling mode */
-    if (!bucket->sampling && bucket->last_window_count > sampler->threshold) {
-        stats_debug_log("started gauge sampling '%s'", name);
-        bucket->sampling = true;
+    if (!bucket->sampling &&
+            bucket->last_window_count > sampler_effective_threshold(sampler, bucket->threshold_shift) &&
+            sampler_activate(sampler, bucket, name, key_len, hash)) {
+        stats_debug_log("started gauge sampling '%.*s'", (int)key_len, name);
     }
 
     if (bucket->sampling) {
         double value = parsed->value;
         double count = 1.0;
 
-        bucket->sum += value;
-        bucket->count += count;
+        if (parsed->value_text[0] == '+' || parsed->value_text[0] == '-') {
+            // A relative line changes the value rather than sets it
+            gauge->delta += value;
+            gauge->deltas++;
+            return SAMPLER_SAMPLING;
+        }
+        // An absolute value replaces the changes made before it
+        gauge->delta = 0;
+        gauge->deltas = 0;
+
+        if (sampler->aggregate_all) {
+            // Relay the last value of the window rather than the mean
+            bucket->sum = value;
+            bucket->count = count;
+        } else {
+            bucket->sum += value;
+            bucket->count += count;
+        }
 
         return SAMPLER_SAMPLING;
     }
@@ -546,6 +1495,128 @@ sampling_result sampler_consider_gauge(sampler_t* sampler, const char* name, val
     return SAMPLER_NOT_SAMPLING;
 }
 
+static sampling_result sampler_consider_set_hashed(sampler_t* sampler, const char* name, size_t key_len,
+        uint32_t hash, validate_parsed_result_t* parsed, int shift) {
+    if (parsed->type != METRIC_S) {
+        return SAMPLER_NOT_SAMPLING;
+    }
+
+    struct sampler_entry* entry;
+    struct sample_bucket* bucket = sampler_find(sampler, name, key_len, hash, &entry);
+    struct set_bucket* set = (struct set_bucket*)bucket;
+    if (bucket == NULL) {
+        // Only flag if its a new metric
+        bool admitted;
+        if (flag_incoming_metric(sampler, name, key_len, hash, &admitted)) {
+            stats_error_log("flagging set: %.*s", (int)key_len, name);
+            return SAMPLER_FLAGGED;
+        }
+        if (!admitted) {
+            return SAMPLER_NOT_SAMPLING;
+        }
+        /* Intialize a new bucket */
+        set = slab_alloc(sampler->buckets);
+        if (set == NULL) {
+            // Memory allocation has failed - fail by flagging metrics
+            return SAMPLER_FLAGGED;
+        }
+        bucket = &set->base;
+        bucket->sampling = false;
+        bucket->epoch = sampler_epoch(sampler, hash);
+        bucket->last_window_count = 1;
+        bucket->type = parsed->type;
+        bucket->sum = 0;
+        bucket->count = 0;
+        set->summary = NULL;
+        if (sampler_attach(sampler, entry, name, key_len, hash, bucket) != 0) {
+            slab_free(sampler->buckets, bucket);
+            return SAMPLER_FLAGGED;
+        }
+    } else {
+        sampler_count_event(sampler, bucket);
+    }
+    sampler_touch(sampler, bucket);
+
+    bucket->threshold_shift = shift;
+
+    /* Circuit break and enable sampling mode */
+    if (!bucket->sampling &&
+            bucket->last_window_count > sampler_effective_threshold(sampler, bucket->threshold_shift) &&
+            sampler_activate(sampler, bucket, name, key_len, hash)) {
+        stats_debug_log("started set sampling '%.*s'", (int)key_len, name);
+    }
+
+    if (bucket->sampling) {
+        if (set->summary == NULL) {
+            set->summary = slab_alloc(sampler->sketches);
+            if (set->summary == NULL) {
+                // Out of memory, relay the line as is
+                return SAMPLER_NOT_SAMPLING;
+            }
+            set->summary->members = 0;
+            set->summary->estimated = false;
+        }
+        if (!sampler_set_add(sampler, set->summary, parsed->value_text, parsed->value_len)) {
+            // No room for another member, pass it on
+            return SAMPLER_NOT_SAMPLING;
+        }
+        bucket->count++;
+        return SAMPLER_SAMPLING;
+    }
+    return SAMPLER_NOT_SAMPLING;
+}
+
+sampling_result sampler_consider_counter(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+    size_t key_len = strlen(name);
+    return sampler_consider_counter_hashed(sampler, name, key_len, hashmap_hash(name, key_len), parsed, 0);
+}
+
+sampling_result sampler_consider_timer(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+    size_t key_len = strlen(name);
+    return sampler_consider_timer_hashed(sampler, name, key_len, hashmap_hash(name, key_len), parsed, 0);
+}
+
+sampling_result sampler_consider_gauge(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+    size_t key_len = strlen(name);
+    return sampler_consider_gauge_hashed(sampler, name, key_len, hashmap_hash(name, key_len), parsed, 0);
+}
+
+sampling_result sampler_consider_set(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed) {
+    size_t key_len = strlen(name);
+    return sampler_consider_set_hashed(sampler, name, key_len, hashmap_hash(name, key_len), parsed, 0);
+}
+
+sampling_result sampler_table_consider(sampler_table_t* table, const char* key, size_t key_len,
+        uint32_t hash, validate_parsed_result_t* parsed, int threshold_shift) {
+    int slot = sampler_slot(parsed->type);
+    if (slot < 0 || table->samplers[slot] == NULL) {
+        return SAMPLER_NOT_SAMPLING;
+    }
+
+    sampler_t* sampler = table->samplers[slot];
+    switch (parsed->type) {
+    case METRIC_COUNTER:
+        return sampler_consider_counter_hashed(sampler, key, key_len, hash, parsed, threshold_shift);
+    case METRIC_TIMER:
+        return sampler_consider_timer_hashed(sampler, key, key_len, hash, parsed, threshold_shift);
+    case METRIC_GAUGE:
+        return sampler_consider_gauge_hashed(sampler, key, key_len, hash, parsed, threshold_shift);
+    case METRIC_S:
+        return sampler_consider_set_hashed(sampler, key, key_len, hash, parsed, threshold_shift);
+    default:
+        return SAMPLER_NOT_SAMPLING;
+    }
+}
+
+int sampler_effective_threshold(sampler_t* sampler, int shift) {
+    int threshold = sampler->threshold >> shift;
+    // Never all the way down to sampling every key
+    if (threshold < 1 && sampler->threshold > 0) {
+        threshold = 1;
+    }
+    return threshold;
+}
+
 int sampler_window(sampler_t* sampler) {
     return sampler->window;
 }
@@ -554,13 +1625,350 @@ int sampler_threshold(sampler_t* sampler) {
     return sampler->threshold;
 }
 
+int sampler_load_percent(sampler_t* sampler) {
+    return (int)(hashmap_load_factor(sampler->table->map) * 100);
+}
+
+int sampler_resize_percent(sampler_t* sampler) {
+    return (int)(hashmap_resize_progress(sampler->table->map) * 100);
+}
+
+size_t sampler_buckets(sampler_t* sampler) {
+    return slab_count(sampler->buckets);
+}
+
+int sampler_use_sketch(sampler_t* sampler, int points) {
+    if (sampler->slot != sampler_slot(METRIC_TIMER) || points < 1 || sampler->num_buckets > 0) {
+        return -1;
+    }
+    if (sampler->sketches == NULL && slab_init(&sampler->sketches, sizeof(sketch_t)) != 0) {
+        return -1;
+    }
+
+    // Buckets no longer need room for a reservoir
+    slab_t* buckets;
+    if (slab_init(&buckets, sizeof(struct timer_bucket)) == 0) {
+        slab_destroy(sampler->buckets);
+        sampler->buckets = buckets;
+    }
+    sampler->sketch_points = points;
+    return 0;
+}
+
+int sampler_aggregate_all(sampler_t* sampler) {
+    if (sampler->slot == sampler_slot(METRIC_TIMER)) {
+        return -1;
+    }
+    // A bucket now enters sampling mode on its first line, and leaves it
+    // after a window without any
+    sampler->threshold = 0;
+    sampler->aggregate_all = true;
+    return 0;
+}
+
+int sampler_use_doorkeeper(sampler_t* sampler, int keys) {
+    if (keys < 1 || sampler->doorkeeper != NULL) {
+        return -1;
+    }
+    return bloom_init(&sampler->doorkeeper, keys);
+}
+
+uint64_t sampler_doorkeeper_lines(sampler_t* sampler) {
+    return sampler->doorkeeper_lines;
+}
+
+int sampler_set_memory_budget(sampler_t* sampler, size_t bytes) {
+    if (bytes == 0 || sampler->num_buckets > 0) {
+        return -1;
+    }
+    sampler->memory_budget = bytes;
+    return 0;
+}
+
+uint64_t sampler_evictions(sampler_t* sampler) {
+    return sampler->evictions;
+}
+
+int sampler_flush_set_cardinality(sampler_t* sampler) {
+    if (sampler->slot != sampler_slot(METRIC_S)) {
+        return -1;
+    }
+    sampler->set_cardinality = true;
+    return 0;
+}
+
+int sampler_active(sampler_t* sampler) {
+    return sampler->num_active;
+}
+
+size_t sampler_memory(sampler_t* sampler) {
+    size_t memory = slab_memory(sampler->buckets);
+    if (sampler->sketches != NULL) {
+        memory += slab_memory(sampler->sketches);
+    }
+    if (sampler->doorkeeper != NULL) {
+        memory += bloom_memory(sampler->doorkeeper);
+    }
+    memory += sampler->clock_capacity * sizeof(struct sample_bucket*);
+    return memory;
+}
+
+/**
+ * A key in a snapshot, followed by its key_len bytes and its
+ * reservoir_len reservoir values
+ */
+struct snapshot_record {
+    metric_type type;
+    uint32_t key_len;
+    uint32_t reservoir_len;
+    bool sampling;
+    uint64_t window_count;
+    uint64_t count;
+    double sum;
+    double upper;
+    double lower;
+    double upper_sample_rate;
+    double lower_sample_rate;
+    double delta;
+    uint64_t deltas;
+};
+
+/* Whether a bucket's sums are handed over in snapshots, or flushed where they are */
+static bool sampler_hands_over_sums(sampler_t* sampler, struct sample_bucket* bucket) {
+    return bucket->type == METRIC_COUNTER || bucket->type == METRIC_GAUGE ||
+        (bucket->type == METRIC_TIMER && sampler->sketches == NULL);
+}
+
+struct snapshot_context {
+    sampler_t* sampler;
+    FILE* out;
+};
+
+static int sampler_snapshot_callback(void* _c, const char* key, void* _value, void *metadata) {
+    struct snapshot_context* context = (struct snapshot_context*)_c;
+    sampler_t* sampler = context->sampler;
+    FILE* out = context->out;
+    struct sampler_entry* entry = (struct sampler_entry*)_value;
+    struct sample_bucket* bucket = entry->buckets[sampler->slot];
+    if (bucket == NULL) {
+        return HASHMAP_ITER_CONTINUE;
+    }
+
+    struct snapshot_record record;
+    memset(&record, 0, sizeof(record));
+    record.type = bucket->type;
+    record.key_len = strlen(key);
+    record.sampling = bucket->sampling;
+    record.window_count = bucket->epoch == sampler_epoch(sampler, entry->hash) ? bucket->last_window_count : 0;
+
+    struct timer_bucket* timer = NULL;
+    if (sampler_hands_over_sums(sampler, bucket)) {
+        record.count = bucket->count;
+        record.sum = bucket->sum;
+        if (bucket->type == METRIC_GAUGE) {
+            struct gauge_bucket* gauge = (struct gauge_bucket*)bucket;
+            record.delta = gauge->delta;
+            record.deltas = gauge->deltas;
+        }
+        if (bucket->type == METRIC_TIMER) {
+            timer = (struct timer_bucket*)bucket;
+            record.reservoir_len = timer->reservoir_index;
+            record.upper = timer->upper;
+            record.lower = timer->lower;
+            record.upper_sample_rate = timer->upper_sample_rate;
+            record.lower_sample_rate = timer->lower_sample_rate;
+        }
+    }
+
+    if (fwrite(&record, sizeof(record), 1, out) != 1 ||
+            fwrite(key, record.key_len, 1, out) != 1 ||
+            (timer != NULL && record.reservoir_len > 0 &&
+             fwrite(timer->reservoir, sizeof(double), record.reservoir_len, out) != record.reservoir_len)) {
+        return HASHMAP_ITER_STOP;
+    }
+    return HASHMAP_ITER_CONTINUE;
+}
+
+int sampler_snapshot(sampler_t* sampler, FILE* out) {
+    uint64_t buckets = sampler->num_buckets;
+    if (fwrite(&buckets, sizeof(buckets), 1, out) != 1) {
+        return -1;
+    }
+    struct snapshot_context context = { sampler, out };
+    return hashmap_iter(sampler->table->map, sampler_snapshot_callback, &context) == HASHMAP_ITER_STOP ? -1 : 0;
+}
+
+static int sampler_handed_over_callback(void* _s, const char* key, void* _value, void *metadata) {
+    sampler_t* sampler = (sampler_t*)_s;
+    struct sampler_entry* entry = (struct sampler_entry*)_value;
+    struct sample_bucket* bucket = entry->buckets[sampler->slot];
+    if (bucket == NULL || !sampler_hands_over_sums(sampler, bucket)) {
+        return HASHMAP_ITER_CONTINUE;
+    }
+
+    bucket->count = 0;
+    bucket->sum = 0;
+    if (bucket->type == METRIC_GAUGE) {
+        struct gauge_bucket* gauge = (struct gauge_bucket*)bucket;
+        gauge->delta = 0;
+        gauge->deltas = 0;
+    }
+    if (bucket->type == METRIC_TIMER) {
+        struct timer_bucket* timer = (struct timer_bucket*)bucket;
+        timer->upper = DBL_MIN;
+        timer->lower = DBL_MAX;
+        timer->reservoir_index = 0;
+    }
+    return HASHMAP_ITER_CONTINUE;
+}
+
+void sampler_handed_over(sampler_t* sampler) {
+    hashmap_iter(sampler->table->map, sampler_handed_over_callback, sampler);
+}
+
+/* Recreate one key from its snapshot record */
+static void sampler_restore_bucket(sampler_t* sampler, const struct snapshot_record* record,
+        const char* key, const char* reservoir) {
+    uint32_t hash = hashmap_hash(key, record->key_len);
+    struct sampler_entry* entry;
+    if (sampler_find(sampler, key, record->key_len, hash, &entry) != NULL || sampler_full(sampler)) {
+        return;
+    }
+
+    struct sample_bucket* bucket = slab_alloc(sampler->buckets);
+    if (bucket == NULL) {
+        return;
+    }
+    memset(bucket, 0, slab_object_size(sampler->buckets));
+    bucket->type = record->type;
+    bucket->epoch = sampler_epoch(sampler, hash);
+    bucket->last_window_count = record->window_count;
+    sampler_touch(sampler, bucket);
+
+    struct timer_bucket* timer = NULL;
+    if (bucket->type == METRIC_TIMER) {
+        timer = (struct timer_bucket*)bucket;
+        timer->upper = DBL_MIN;
+        timer->lower = DBL_MAX;
+    }
+    if (sampler_hands_over_sums(sampler, bucket)) {
+        bucket->count = record->count;
+        bucket->sum = record->sum;
+    }
+    if (bucket->type == METRIC_GAUGE) {
+        struct gauge_bucket* gauge = (struct gauge_bucket*)bucket;
+        gauge->delta = record->delta;
+        gauge->deltas = record->deltas;
+    }
+    if (timer != NULL && sampler->sketches == NULL) {
+        timer->upper = record->upper;
+        timer->lower = record->lower;
+        timer->upper_sample_rate = record->upper_sample_rate;
+        timer->lower_sample_rate = record->lower_sample_rate;
+        // A smaller reservoir keeps the first values; the sample rate still
+        // comes out of the count
+        uint32_t values = record->reservoir_len;
+        if (values > sampler->reservoir_size) {
+            values = sampler->reservoir_size;
+        }
+        memcpy(timer->reservoir, reservoir, values * sizeof(double));
+        timer->reservoir_index = values;
+        if (timer->reservoir_index == sampler->reservoir_size) {
+            timer->reservoir_w = 1.0;
+            sampler_reservoir_skip(sampler, timer);
+        }
+    }
+
+    // key is not NUL terminated, the table needs it to be
+    char name[record->key_len + 1];
+    memcpy(name, key, record->key_len);
+    name[record->key_len] = '\0';
+    if (sampler_attach(sampler, entry, name, record->key_len, hash, bucket) != 0) {
+        slab_free(sampler->buckets, bucket);
+        return;
+    }
+    if (record->sampling) {
+        sampler_activate(sampler, bucket, name, record->key_len, hash);
+    }
+}
+
+/**
+ * Walk the records of a snapshot, recreating their keys if apply is
+ * set. Returns the bytes of data read, 0 if the snapshot is malformed.
+ */
+static size_t sampler_restore_records(sampler_t* sampler, const char* data, size_t len, bool apply) {
+    uint64_t buckets;
+    size_t offset = sizeof(buckets);
+    if (len < offset) {
+        return 0;
+    }
+    memcpy(&buckets, data, sizeof(buckets));
+
+    for (uint64_t i = 0; i < buckets; i++) {
+        struct snapshot_record record;
+        if (len - offset < sizeof(record)) {
+            return 0;
+        }
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+
+        size_t reservoir_bytes = (size_t)record.reservoir_len * sizeof(double);
+        if (sampler_slot(record.type) != sampler->slot || record.key_len == 0 ||
+                record.key_len > MAX_UDP_LENGTH || len - offset < record.key_len ||
+                (len - offset - record.key_len) < reservoir_bytes) {
+            return 0;
+        }
+        const char* key = data + offset;
+        offset += record.key_len;
+        const char* reservoir = data + offset;
+        offset += reservoir_bytes;
+
+        if (apply) {
+            sampler_restore_bucket(sampler, &record, key, reservoir);
+        }
+    }
+    return offset;
+}
+
+size_t sampler_restore(sampler_t* sampler, const char* data, size_t len) {
+    // A truncated or corrupt snapshot is ignored as a whole
+    size_t read = sampler_restore_records(sampler, data, len, false);
+    if (read == 0) {
+        return 0;
+    }
+    return sampler_restore_records(sampler, data, read, true);
+}
+
 void sampler_destroy(sampler_t* sampler) {
     if (sampler->base.hm_ttl != -1) {
         stats_debug_log("Stopping passive hashmap expiry timer.");
         struct ev_loop* loop = ev_default_loop(0);
         ev_timer_stop(loop, &sampler->base.map_expiry_timer);
     }
-    hashmap_destroy(sampler->map);
+    for (int i = 0; i < SAMPLER_MAX_SLICES; i++) {
+        while (sampler->active[i] != NULL) {
+            struct active_node* next = sampler->active[i]->next;
+            free(sampler->active[i]);
+            sampler->active[i] = next;
+        }
+    }
+    sampler->num_active = 0;
+    hashmap_iter(sampler->table->map, sampler_destroy_callback, (void*)sampler);
+    slab_destroy(sampler->buckets);
+    sampler->buckets = NULL;
+    slab_destroy(sampler->sketches);
+    sampler->sketches = NULL;
+    bloom_destroy(sampler->doorkeeper);
+    sampler->doorkeeper = NULL;
+    free(sampler->clock);
+    sampler->clock = NULL;
+    sampler->clock_capacity = 0;
+    slab_trim(sampler->table->entries);
+    sampler->table->samplers[sampler->slot] = NULL;
+    if (sampler->owns_table) {
+        sampler_table_destroy(sampler->table);
+    }
+    sampler->table = NULL;
 }
 
 int sampler_expiration_timer_frequency(sampler_t* sampler) {
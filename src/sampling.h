@@ -2,25 +2,144 @@
 #define STATSRELAY_SAMPLING_H
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <ev.h>
 #include "protocol.h"
 #include "hashmap.h"
+#include "topk.h"
 #include "validate.h"
 
 typedef struct sampler sampler_t;
 
+/* Most slices a sampler's keys can be flushed in */
+#define SAMPLER_MAX_SLICES 64
+
+/**
+ * A metric table shared by the samplers of a group. There is one entry
+ * per metric name holding a bucket for each sampler type that has seen
+ * it, so a line costs a single lookup whatever its type.
+ */
+typedef struct sampler_table sampler_table_t;
+
+/** Counter, timer, gauge and set buckets */
+#define SAMPLER_SLOTS 4
+
 typedef enum {
     SAMPLER_NOT_SAMPLING = 0,
     SAMPLER_SAMPLING = 1,
     SAMPLER_FLAGGED = 2
 } sampling_result;
 
-typedef void(sampler_flush_cb)(void* data, const char* key, const char* line, int len);
+/**
+ * Receives flushed lines. hash is the stats_hash_key() of key, as
+ * passed to sampler_table_consider().
+ */
+typedef void(sampler_flush_cb)(void* data, const char* key, size_t key_len, uint32_t hash,
+                               const char* line, int len);
+
+int sampler_table_init(sampler_table_t** table);
+
+/**
+ * Destroy a table. The samplers attached to it must be destroyed first.
+ */
+void sampler_table_destroy(sampler_table_t* table);
+
+/**
+ * Create a sampler for one metric type. The sampler keeps its buckets in
+ * table, which can hold one sampler per type; a NULL table gives the
+ * sampler a private one.
+ */
+int sampler_init(sampler_t** sampler, sampler_table_t* table, metric_type type, int threshold,
+                 int window, int cardinality, int reservoir_size, bool timer_flush_min_max,
+                 int hm_expiry_frequency, int hm_ttl);
+
+/**
+ * Count the keys of the table per prefix, a prefix being the first depth
+ * dot separated components of a key, in a tracker of the 'size' heaviest
+ * prefixes. With quota > 0, new keys of a prefix already holding quota
+ * keys are flagged, leaving room under the samplers' cardinality for
+ * other prefixes. Only valid on a table holding no keys yet. Returns 0
+ * on success.
+ */
+int sampler_table_track_prefixes(sampler_table_t* table, int depth, int quota, int size);
+
+/**
+ * Fill prefixes with up to max of the prefixes holding the most keys,
+ * largest first. The user field of an entry counts the lines flagged for
+ * the prefix. Returns the number filled in, 0 if prefixes are not tracked.
+ */
+size_t sampler_table_prefixes(sampler_table_t* table, const topk_entry_t** prefixes, size_t max);
+
+/**
+ * Consider a line for the sampler of its type in the table. hash must be
+ * stats_hash_key(key, key_len), and key NUL terminated. threshold_shift
+ * halves the sampling threshold for this key that many times, down to 1,
+ * so a backend that falls behind has more of its keys sampled.
+ */
+sampling_result sampler_table_consider(sampler_table_t* table, const char* key, size_t key_len,
+                                       uint32_t hash, validate_parsed_result_t* parsed, int threshold_shift);
+
+
+/**
+ * Summarize sampled timers with a quantile sketch instead of a reservoir,
+ * relaying 'points' values per timer and window. Only valid for a timer
+ * sampler that holds no keys yet. Returns 0 on success.
+ */
+int sampler_use_sketch(sampler_t* sampler, int points);
+
+/**
+ * Aggregate every key of a counter or gauge sampler, not just the busy
+ * ones: a key is sampled from its first line, counters are summed and
+ * gauges keep their last value, giving one line per key and window.
+ * Returns -1 for timer samplers.
+ */
+int sampler_aggregate_all(sampler_t* sampler);
+
+/**
+ * Only give a new key a bucket the second time it is seen in a window,
+ * keeping one-off keys out of the sampler. Keys seen once are remembered
+ * in a Bloom filter sized for 'keys' new keys per window, cleared at the
+ * end of each window. Returns 0 on success.
+ */
+int sampler_use_doorkeeper(sampler_t* sampler, int keys);
+
+/**
+ * Number of lines of new keys the doorkeeper relayed without a bucket
+ */
+uint64_t sampler_doorkeeper_lines(sampler_t* sampler);
+
+/**
+ * Split the keys of the sampler in slices flushed one at a time, each
+ * sampler_flush_interval() seconds, rather than all at the end of the
+ * window. Every key still covers a whole window per flush. Only valid
+ * on a sampler holding no keys yet. Returns 0 on success.
+ */
+int sampler_set_flush_slices(sampler_t* sampler, int slices);
+
+/**
+ * Seconds between flushes of slices, the window for a single slice
+ */
+double sampler_flush_interval(sampler_t* sampler);
+
+/**
+ * Cap the bytes held by the sampler's buckets and summaries. Once over
+ * the budget or its cardinality, a new key evicts a bucket that is not
+ * sampled and was not seen lately, picked by the CLOCK algorithm, and
+ * is only flagged if there is none. Only valid on a sampler holding no
+ * keys yet. Returns 0 on success.
+ */
+int sampler_set_memory_budget(sampler_t* sampler, size_t bytes);
 
-int sampler_init(sampler_t** sampler, int threshold, int window, int cardinality,
-                 int reservoir_size, bool timer_flush_min_max, int hm_expiry_frequency,
-                 int hm_ttl);
+/**
+ * Number of buckets evicted for new keys
+ */
+uint64_t sampler_evictions(sampler_t* sampler);
 
+/**
+ * Relay sampled sets as a gauge of their distinct member count instead
+ * of their members. Returns -1 unless sampler is a set sampler.
+ */
+int sampler_flush_set_cardinality(sampler_t* sampler);
 
 /**
  * Consider a statsd counter for sampling - based on its name and validation
@@ -34,6 +153,15 @@ sampling_result sampler_consider_counter(sampler_t* sampler, const char* name, v
  */
 sampling_result sampler_consider_timer(sampler_t* sampler, const char* name, validate_parsed_result_t*);
 
+/**
+ * Consider a statsd set member for sampling. Members are opaque text,
+ * taken from parsed->value_text. Sampled sets keep their distinct
+ * members exactly up to a small bound; past it, further members are
+ * relayed as they come, or counted in a HyperLogLog when relaying the
+ * cardinality.
+ */
+sampling_result sampler_consider_set(sampler_t* sampler, const char* name, validate_parsed_result_t* parsed);
+
 /**
  * Currently only used for tracking the number of gauges active in the system
  * no sampling will be performed on the gauges
@@ -52,6 +180,11 @@ void sampler_update_flags(sampler_t* sampler);
  */
 void sampler_flush(sampler_t* sampler, sampler_flush_cb cb, void* data);
 
+/**
+ * Flush the next slice of the keys, ending the window of that slice
+ */
+void sampler_flush_slice(sampler_t* sampler, sampler_flush_cb cb, void* data);
+
 /*
  * Introspect if a key (of any type) is in sampling mode or not.
  * This is mainly used for unit tests
@@ -63,11 +196,67 @@ sampling_result sampler_is_sampling(sampler_t* sampler, const char* name, metric
  */
 int sampler_window(sampler_t* sampler);
 
+/*
+ * Get the sampling threshold in effect for keys considered with the
+ * given threshold_shift
+ */
+int sampler_effective_threshold(sampler_t* sampler, int shift);
+
 /*
  * Get the sampling threshold
  */
 int sampler_threshold(sampler_t* sampler);
 
+/**
+ * Load factor of the sampler's key map, in percent. The map is shared
+ * with the other samplers of the table.
+ */
+int sampler_load_percent(sampler_t* sampler);
+
+/**
+ * Progress of an incremental resize of the sampler's key map, in percent.
+ * 100 when no resize is in progress.
+ */
+int sampler_resize_percent(sampler_t* sampler);
+
+/**
+ * Number of keys the sampler holds a bucket for
+ */
+size_t sampler_buckets(sampler_t* sampler);
+
+/**
+ * Number of keys currently in sampling mode
+ */
+int sampler_active(sampler_t* sampler);
+
+/**
+ * Bytes allocated for the sampler's buckets
+ */
+size_t sampler_memory(sampler_t* sampler);
+
+/**
+ * Write the keys of the sampler to out, for sampler_restore() in another
+ * process: whether each key is sampled, its lines in the current window,
+ * and the sums and reservoirs of counters, gauges and reservoir sampled
+ * timers. Timer sketches and set members stay behind. The sums are left
+ * in place until sampler_handed_over(). Returns 0 on success.
+ */
+int sampler_snapshot(sampler_t* sampler, FILE* out);
+
+/**
+ * Clear the sums written by sampler_snapshot(), once the process that
+ * restored them has confirmed it, so they are flushed there only.
+ */
+void sampler_handed_over(sampler_t* sampler);
+
+/**
+ * Recreate the keys of a snapshot taken by sampler_snapshot() from a
+ * sampler of the same type, as far as the cardinality allows. Nothing is
+ * recreated from a truncated or malformed snapshot. Returns the bytes of
+ * data read, 0 if the snapshot is malformed.
+ */
+size_t sampler_restore(sampler_t* sampler, const char* data, size_t len);
+
 /**
  * Destroy the sampler
  */
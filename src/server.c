@@ -2,8 +2,13 @@
 
 #include "./log.h"
 
+#include <errno.h>
 #include <ev.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static void init_server(struct server *server) {
     server->enabled = false;
@@ -11,6 +16,7 @@ static void init_server(struct server *server) {
     server->server = NULL;
     server->ts = NULL;
     server->us = NULL;
+    server->hs = NULL;
 }
 
 static bool connect_server(struct server *server,
@@ -62,6 +68,19 @@ static bool connect_server(struct server *server,
         stats_error_log("unable to bind udp %s", config->bind);
         return false;
     }
+    server->server->udp = server->us;
+
+    if (config->http_bind != NULL) {
+        server->hs = httpserver_create(loop, server->server, stats_http_handler);
+        if (server->hs == NULL) {
+            stats_error_log("failed to create httpserver");
+            return false;
+        }
+        if (httpserver_bind(server->hs, config->http_bind, !getenv("STATSRELAY_LISTENER_HTTP_SD") ? true: false) != 0) {
+            stats_error_log("unable to bind http %s", config->http_bind);
+            return false;
+        }
+    }
     return true;
 }
 
@@ -75,6 +94,9 @@ static void destroy_server(struct server *server) {
     if (server->us != NULL) {
         udpserver_destroy(server->us);
     }
+    if (server->hs != NULL) {
+        httpserver_destroy(server->hs);
+    }
     if (server->server != NULL) {
         stats_server_destroy(server->server);
     }
@@ -90,6 +112,9 @@ static void destroy_server_watchers(struct server *server) {
     if (server->us != NULL) {
         udpserver_stop_accepting_connections(server->us);
     }
+    if (server->hs != NULL) {
+        httpserver_stop_accepting_connections(server->hs);
+    }
 }
 
 static void destroy_session_sockets(struct server *server) {
@@ -164,3 +189,66 @@ void destroy_server_collection(struct server_collection *server_collection) {
         server_collection->initialized = false;
     }
 }
+
+FILE *snapshot_server_collection(struct server_collection *server_collection) {
+    struct server *server = &server_collection->statsd_server;
+    if (!server_collection->initialized || !server->enabled || server->server == NULL) {
+        return NULL;
+    }
+    FILE *snapshot = tmpfile();
+    if (snapshot == NULL) {
+        stats_error_log("snapshot: failed to create file: %s", strerror(errno));
+        return NULL;
+    }
+    if (stats_server_snapshot(server->server, snapshot) != 0) {
+        stats_error_log("snapshot: failed to write sampler state");
+        fclose(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void handed_over_server_collection(struct server_collection *server_collection) {
+    struct server *server = &server_collection->statsd_server;
+    if (server_collection->initialized && server->enabled && server->server != NULL) {
+        stats_server_handed_over(server->server);
+    }
+}
+
+void restore_server_collection(struct server_collection *server_collection) {
+    const char *fd_env = getenv(SNAPSHOT_FD_ENV);
+    if (fd_env == NULL) {
+        return;
+    }
+    int fd = atoi(fd_env);
+    unsetenv(SNAPSHOT_FD_ENV);
+
+    int handover_fd = -1;
+    const char *handover_env = getenv(HANDOVER_FD_ENV);
+    if (handover_env != NULL) {
+        handover_fd = atoi(handover_env);
+        unsetenv(HANDOVER_FD_ENV);
+    }
+
+    bool restored = false;
+    struct server *server = &server_collection->statsd_server;
+    struct stat st;
+    if (server->enabled && server->server != NULL && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            restored = stats_server_restore(server->server, data, st.st_size) == 0;
+            munmap(data, st.st_size);
+        } else {
+            stats_error_log("snapshot: failed to map: %s", strerror(errno));
+        }
+    }
+    close(fd);
+
+    // Without the confirmation the old master flushes the sums itself
+    if (handover_fd >= 0) {
+        if (restored && write(handover_fd, "1", 1) != 1) {
+            stats_error_log("snapshot: failed to confirm the handover: %s", strerror(errno));
+        }
+        close(handover_fd);
+    }
+}
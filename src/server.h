@@ -1,11 +1,18 @@
 #ifndef STATSRELAY_SERVER_H
 #define STATSRELAY_SERVER_H
 
+#include "./httpserver.h"
 #include "./stats.h"
 #include "./tcpserver.h"
 #include "./udpserver.h"
 
 #include <stdbool.h>
+#include <stdio.h>
+
+/* environment variable handing the sampler snapshot to a new master */
+#define SNAPSHOT_FD_ENV "STATSRELAY_SAMPLER_SNAPSHOT_FD"
+/* environment variable naming the pipe the new master confirms the restore on */
+#define HANDOVER_FD_ENV "STATSRELAY_SAMPLER_HANDOVER_FD"
 
 struct server {
     bool enabled;
@@ -13,6 +20,8 @@ struct server {
     stats_server_t *server;
     tcpserver_t *ts;
     udpserver_t *us;
+    /** serves OpenMetrics, NULL unless http_bind is configured */
+    httpserver_t *hs;
     struct ev_loop *loop;
 };
 
@@ -36,4 +45,24 @@ void tcpserver_destroy_session_sockets(tcpserver_t *);
 
 void shutdown_client_sockets(struct server_collection *server_collection);
 
+/**
+ * Snapshot the samplers into an unlinked temporary file, to be handed to
+ * a new master across a hot restart. Returns NULL if there is nothing to
+ * hand over or the snapshot failed.
+ */
+FILE *snapshot_server_collection(struct server_collection *server_collection);
+
+/**
+ * Clear the sums of the snapshot once the new master has confirmed
+ * restoring it, see stats_server_handed_over().
+ */
+void handed_over_server_collection(struct server_collection *server_collection);
+
+/**
+ * Load the snapshot handed over by the old master, if any, from the file
+ * descriptor named by SNAPSHOT_FD_ENV, and confirm a successful restore
+ * on the pipe named by HANDOVER_FD_ENV.
+ */
+void restore_server_collection(struct server_collection *server_collection);
+
 #endif  // STATSRELAY_SERVER_H
@@ -0,0 +1,148 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "sketch.h"
+
+/* (1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA), and 1 / ln of it */
+#define SKETCH_GAMMA 1.0408163265306123
+#define SKETCH_INV_LOG_GAMMA 24.996666311036567
+
+/* Bin of a value: gamma^(key - 1) < value <= gamma^key */
+static inline int32_t sketch_key(double value) {
+    return (int32_t)ceil(log(value) * SKETCH_INV_LOG_GAMMA);
+}
+
+/* The value with the least relative error to every value of a bin */
+static inline double sketch_value(int32_t key) {
+    return 2.0 * pow(SKETCH_GAMMA, key) / (1.0 + SKETCH_GAMMA);
+}
+
+void sketch_init(sketch_t *sketch) {
+    sketch_clear(sketch);
+}
+
+void sketch_clear(sketch_t *sketch) {
+    memset(sketch, 0, sizeof(sketch_t));
+    sketch->min = DBL_MAX;
+    sketch->max = -DBL_MAX;
+    sketch->lo = INT32_MAX;
+    sketch->hi = INT32_MIN;
+}
+
+/**
+ * Move the window of bins to start at offset. Bins that fall below it
+ * are collapsed into the new lowest bin; callers make sure none fall
+ * above it.
+ */
+static void sketch_shift(sketch_t *sketch, int32_t offset) {
+    uint32_t bins[SKETCH_BINS];
+    memset(bins, 0, sizeof(bins));
+
+    for (int32_t key = sketch->lo; key <= sketch->hi; key++) {
+        uint32_t n = sketch->bins[key - sketch->offset];
+        if (n == 0) {
+            continue;
+        }
+        int32_t to = key < offset ? offset : key;
+        bins[to - offset] += n;
+    }
+
+    memcpy(sketch->bins, bins, sizeof(bins));
+    sketch->offset = offset;
+    if (sketch->lo < offset) {
+        sketch->lo = offset;
+    }
+}
+
+static void sketch_add_key(sketch_t *sketch, int32_t key, uint32_t n) {
+    if (sketch->lo > sketch->hi) {
+        // First binned value, center the window on it
+        sketch->offset = key - SKETCH_BINS / 2;
+    } else if (key < sketch->offset) {
+        if (sketch->hi - key < SKETCH_BINS) {
+            sketch_shift(sketch, key);
+        } else {
+            key = sketch->offset;
+        }
+    } else if (key >= sketch->offset + SKETCH_BINS) {
+        sketch_shift(sketch, key - SKETCH_BINS + 1);
+    }
+
+    if (key < sketch->lo) {
+        sketch->lo = key;
+    }
+    if (key > sketch->hi) {
+        sketch->hi = key;
+    }
+    sketch->bins[key - sketch->offset] += n;
+}
+
+void sketch_add(sketch_t *sketch, double value) {
+    sketch->count++;
+    if (value < sketch->min) {
+        sketch->min = value;
+    }
+    if (value > sketch->max) {
+        sketch->max = value;
+    }
+
+    if (value <= SKETCH_MIN_VALUE) {
+        sketch->zero_count++;
+    } else {
+        sketch_add_key(sketch, sketch_key(value), 1);
+    }
+}
+
+void sketch_merge(sketch_t *dst, const sketch_t *src) {
+    if (src->count == 0) {
+        return;
+    }
+    for (int32_t key = src->lo; key <= src->hi; key++) {
+        uint32_t n = src->bins[key - src->offset];
+        if (n != 0) {
+            sketch_add_key(dst, key, n);
+        }
+    }
+    dst->count += src->count;
+    dst->zero_count += src->zero_count;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+double sketch_quantile(const sketch_t *sketch, double q) {
+    if (sketch->count == 0) {
+        return 0;
+    }
+    if (q <= 0) {
+        return sketch->min;
+    }
+    if (q >= 1) {
+        return sketch->max;
+    }
+
+    double rank = q * (sketch->count - 1);
+    double value = 0;
+    uint64_t seen = sketch->zero_count;
+    if (seen <= rank) {
+        for (int32_t key = sketch->lo; key <= sketch->hi; key++) {
+            seen += sketch->bins[key - sketch->offset];
+            if (seen > rank) {
+                value = sketch_value(key);
+                break;
+            }
+        }
+    }
+
+    if (value < sketch->min) {
+        value = sketch->min;
+    }
+    if (value > sketch->max) {
+        value = sketch->max;
+    }
+    return value;
+}
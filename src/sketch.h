@@ -0,0 +1,61 @@
+#ifndef STATSRELAY_SKETCH_H
+#define STATSRELAY_SKETCH_H
+
+#include <stdint.h>
+
+/**
+ * A DDSketch quantile sketch (Masson, Rim and Lee) with a fixed number
+ * of bins. Values land in logarithmic bins whose bounds are within
+ * SKETCH_ALPHA of each other, so any quantile is answered with that
+ * relative accuracy. The bins cover a window of SKETCH_BINS consecutive
+ * indexes, about 8 decades; when values span more than that, the lowest
+ * bins are collapsed, trading accuracy of the low quantiles for bounded
+ * memory.
+ *
+ * Sketches are mergeable: merging two sketches gives the sketch of both
+ * streams.
+ */
+
+#define SKETCH_ALPHA 0.02
+#define SKETCH_BINS 512
+
+/* Values at or below this, negative ones included, share one bin */
+#define SKETCH_MIN_VALUE 1e-9
+
+typedef struct sketch {
+    uint64_t count;
+    uint64_t zero_count;
+    double min;
+    double max;
+    /* index of bins[0], and the range of indexes holding values */
+    int32_t offset;
+    int32_t lo;
+    int32_t hi;
+    uint32_t bins[SKETCH_BINS];
+} sketch_t;
+
+void sketch_init(sketch_t *sketch);
+
+/**
+ * Forget all values
+ */
+void sketch_clear(sketch_t *sketch);
+
+void sketch_add(sketch_t *sketch, double value);
+
+/**
+ * Add all values of src to dst
+ */
+void sketch_merge(sketch_t *dst, const sketch_t *src);
+
+/**
+ * Estimate the q-quantile, 0 <= q <= 1. q = 0 and q = 1 return the exact
+ * minimum and maximum. Returns 0 for an empty sketch.
+ */
+double sketch_quantile(const sketch_t *sketch, double q);
+
+static inline uint64_t sketch_count(const sketch_t *sketch) {
+    return sketch->count;
+}
+
+#endif  // STATSRELAY_SKETCH_H
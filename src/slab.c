@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define SLAB_MIN_PAGE (64 * 1024)
+#define SLAB_MIN_OBJECTS 16
+#define SLAB_ALIGN 16
+
+/* Each page starts with its header, followed by the objects */
+struct slab_page {
+    struct slab_page *prev;
+    struct slab_page *next;
+    /* objects released back to this page, linked through their first word */
+    void *free;
+    /* objects in use */
+    size_t live;
+    /* objects ever handed out from the untouched end of the page */
+    size_t carved;
+};
+
+struct slab {
+    size_t object_size;
+    size_t page_size;
+    size_t per_page;
+    size_t header_size;
+
+    /* pages with at least one free object, and pages without */
+    struct slab_page *partial;
+    struct slab_page *full;
+
+    size_t num_pages;
+    size_t count;
+};
+
+/**
+ * Round a size up to its class: multiples of 16 up to 128 bytes, then
+ * four classes between consecutive powers of 2.
+ */
+static size_t slab_size_class(size_t size) {
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    if (size <= 128) {
+        return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    }
+    size_t p = 128;
+    while (p < size) {
+        p <<= 1;
+    }
+    size_t step = p / 8;
+    return (size + step - 1) / step * step;
+}
+
+static void page_push(struct slab_page **head, struct slab_page *page) {
+    page->prev = NULL;
+    page->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = page;
+    }
+    *head = page;
+}
+
+static void page_remove(struct slab_page **head, struct slab_page *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *head = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+static void page_free_all(struct slab_page *page) {
+    while (page != NULL) {
+        struct slab_page *next = page->next;
+        free(page);
+        page = next;
+    }
+}
+
+int slab_init(slab_t **slab, size_t object_size) {
+    slab_t *s = calloc(1, sizeof(slab_t));
+    if (s == NULL) {
+        return -1;
+    }
+    s->object_size = slab_size_class(object_size);
+    s->header_size = (sizeof(struct slab_page) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    s->page_size = SLAB_MIN_PAGE;
+    while ((s->page_size - s->header_size) / s->object_size < SLAB_MIN_OBJECTS) {
+        s->page_size <<= 1;
+    }
+    s->per_page = (s->page_size - s->header_size) / s->object_size;
+    *slab = s;
+    return 0;
+}
+
+void *slab_alloc(slab_t *slab) {
+    struct slab_page *page = slab->partial;
+    if (page == NULL) {
+        /* Pages are aligned to their size so objects can find them */
+        void *mem;
+        if (posix_memalign(&mem, slab->page_size, slab->page_size) != 0) {
+            return NULL;
+        }
+        page = mem;
+        page->free = NULL;
+        page->live = 0;
+        page->carved = 0;
+        page_push(&slab->partial, page);
+        slab->num_pages++;
+    }
+
+    void *object;
+    if (page->free != NULL) {
+        object = page->free;
+        page->free = *(void **)object;
+    } else {
+        object = (char *)page + slab->header_size + page->carved * slab->object_size;
+        page->carved++;
+    }
+
+    page->live++;
+    slab->count++;
+    if (page->live == slab->per_page) {
+        page_remove(&slab->partial, page);
+        page_push(&slab->full, page);
+    }
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    struct slab_page *page = (struct slab_page *)((uintptr_t)object & ~(uintptr_t)(slab->page_size - 1));
+
+    if (page->live == slab->per_page) {
+        page_remove(&slab->full, page);
+        page_push(&slab->partial, page);
+    }
+    *(void **)object = page->free;
+    page->free = object;
+    page->live--;
+    slab->count--;
+}
+
+void slab_trim(slab_t *slab) {
+    struct slab_page *page = slab->partial;
+    while (page != NULL) {
+        struct slab_page *next = page->next;
+        if (page->live == 0) {
+            page_remove(&slab->partial, page);
+            free(page);
+            slab->num_pages--;
+        }
+        page = next;
+    }
+}
+
+size_t slab_object_size(slab_t *slab) {
+    return slab->object_size;
+}
+
+size_t slab_count(slab_t *slab) {
+    return slab->count;
+}
+
+size_t slab_memory(slab_t *slab) {
+    return slab->num_pages * slab->page_size;
+}
+
+void slab_destroy(slab_t *slab) {
+    if (slab == NULL) {
+        return;
+    }
+    page_free_all(slab->partial);
+    page_free_all(slab->full);
+    free(slab);
+}
@@ -0,0 +1,58 @@
+#ifndef STATSRELAY_SLAB_H
+#define STATSRELAY_SLAB_H
+
+#include <stddef.h>
+
+/**
+ * A pool of fixed size objects carved out of large aligned pages.
+ * Objects are rounded up to a size class so pools of similar objects
+ * pack the same way, and a page is found from any of its objects by
+ * masking the address, so freeing needs no lookup.
+ *
+ * Freed objects go back to their page; pages left with no live objects
+ * are only returned to the system by slab_trim() or slab_destroy(), so
+ * releasing many objects at once costs one free() per page.
+ */
+typedef struct slab slab_t;
+
+/**
+ * Create a pool for objects of object_size bytes. Returns 0 on success.
+ */
+int slab_init(slab_t **slab, size_t object_size);
+
+/**
+ * Allocate an uninitialized object, NULL if out of memory
+ */
+void *slab_alloc(slab_t *slab);
+
+/**
+ * Return an object to the pool it was allocated from
+ */
+void slab_free(slab_t *slab, void *object);
+
+/**
+ * Release pages holding no live objects
+ */
+void slab_trim(slab_t *slab);
+
+/**
+ * Size of the objects handed out, after rounding to a size class
+ */
+size_t slab_object_size(slab_t *slab);
+
+/**
+ * Number of live objects
+ */
+size_t slab_count(slab_t *slab);
+
+/**
+ * Bytes held by the pool, including free space in its pages
+ */
+size_t slab_memory(slab_t *slab);
+
+/**
+ * Release every page at once, live objects included
+ */
+void slab_destroy(slab_t *slab);
+
+#endif  // STATSRELAY_SLAB_H
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+#include "./blocklist.h"
+
+static void print_help(const char *argv0) {
+    printf("Usage: %s input.txt output.bl\n"
+            "Compile a list of metric names, one per line, into a blocklist\n"
+            "file that statsrelay maps directly into memory.\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    blocklist_t *bl;
+    if (blocklist_load(&bl, argv[1]) != 0) {
+        fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    if (blocklist_save(bl, argv[2]) != 0) {
+        fprintf(stderr, "failed to write %s\n", argv[2]);
+        blocklist_destroy(bl);
+        return 1;
+    }
+    printf("wrote %zu keys to %s\n", blocklist_size(bl), argv[2]);
+    blocklist_destroy(bl);
+    return 0;
+}
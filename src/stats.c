@@ -6,6 +6,8 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -14,7 +16,20 @@
 
 #include "stats.h"
 
+static const char *sampler_names[] = { "counter", "timer", "gauge", "set" };
+
+/* Seconds between adjustments of the backends' sampling shifts */
+#define SAMPLING_CONTROLLER_INTERVAL 1
+
+/* Seconds between samples of the backends' TCP_INFO */
+#define BACKEND_SAMPLE_INTERVAL 1
+
+/* Keys listed per group and backend by "top" unless asked otherwise */
+#define TOP_DEFAULT_KEYS 10
+
 // Forward declare
+static void stats_session_write(struct ev_loop *loop, struct ev_io *watcher, int events);
+void stats_session_destroy(stats_session_t *session);
 static void stats_write_to_backend(const char *line,
                    size_t len,
                    const char* key_buffer,
@@ -22,6 +37,26 @@ static void stats_write_to_backend(const char *line,
                    size_t key_len,
                    stats_backend_group_t* group);
 
+/* Append to a response, growing it as needed. Returns 0 on success. */
+static int response_append(buffer_t *out, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(buffer_tail(out), buffer_spacecount(out), format, args);
+        va_end(args);
+        if (len < 0) {
+            return -1;
+        }
+        if ((size_t)len < buffer_spacecount(out)) {
+            buffer_produced(out, len);
+            return 0;
+        }
+        if (buffer_expand(out) != 0) {
+            return -1;
+        }
+    }
+}
+
 // callback after bytes are sent
 static int stats_sent(void *tcpclient,
         enum tcpclient_event event,
@@ -77,18 +112,44 @@ static stats_backend_t *find_backend(stats_backend_t **backend_lists, size_t num
     return NULL;
 }
 
-static void initialize_sampler(sampler_t **sampler, ev_timer *watcher, stats_backend_group_t *group,
-            stats_server_t *server, int threshold, int window, int cardinality,
+/**
+ * Seconds until a sampler's window, or the window of its next slice,
+ * ends. Aggregated groups end their windows on multiples of the window
+ * since the epoch, so every relay flushes at the same moments.
+ */
+static double sampling_timeout(struct ev_loop *loop, stats_backend_group_t *group, double window) {
+    if (!group->aggregate_all || window <= 0) {
+        return window;
+    }
+    double timeout = window - fmod(ev_now(loop), window);
+    // Woken up just short of the boundary: it ends the next window instead
+    if (timeout < window * 0.01) {
+        timeout += window;
+    }
+    return timeout;
+}
+
+static void initialize_sampler(sampler_t **sampler, metric_type type, ev_timer *watcher,
+            stats_backend_group_t *group, stats_server_t *server, int threshold, int window, int cardinality,
             bool timer_flush_min_max, int reservoir_size, int hm_expiration_frequency, int hm_ttl, s_handler handler) {
 
-    int res = sampler_init(sampler, threshold, window, cardinality, reservoir_size, timer_flush_min_max,
-                           hm_expiration_frequency, hm_ttl);
+    if (group->sampler_table == NULL && sampler_table_init(&group->sampler_table) != 0) {
+        stats_error_log("sampler: failed to allocate the metric table");
+        return;
+    }
+
+    int res = sampler_init(sampler, group->sampler_table, type, threshold, window, cardinality,
+                           reservoir_size, timer_flush_min_max, hm_expiration_frequency, hm_ttl);
 
     if (res) {
         stats_error_log("sampler: loading failed with error %d", res);
+        return;
+    }
+    if (group->flush_slices > 1 && sampler_set_flush_slices(*sampler, group->flush_slices) != 0) {
+        stats_error_log("sampler: invalid flush_slices %d", group->flush_slices);
     }
     if (watcher != NULL) {
-        ev_timer_init(watcher, handler, window, 0);
+        ev_timer_init(watcher, handler, sampling_timeout(server->loop, group, sampler_flush_interval(*sampler)), 0);
         (*watcher).data = (void*)group;
         ev_timer_start(server->loop, watcher);
     }
@@ -186,6 +247,13 @@ static void* make_backend(const char *host_and_port, void *data, hashring_type_t
         stats_log("stats: alloc error creating backend");
         goto make_err;
     }
+    backend->top = NULL;
+    if (r_type != RING_MONITOR && server->config->top_keys > 0 &&
+            topkeys_init(&backend->top, server->config->top_keys) != 0) {
+        stats_log("stats: alloc error creating backend top keys");
+        free(backend);
+        goto make_err;
+    }
 
     if (tcpclient_init(&backend->client,
                 server->loop,
@@ -207,6 +275,10 @@ static void* make_backend(const char *host_and_port, void *data, hashring_type_t
     backend->relayed_lines = 0;
     backend->dropped_lines = 0;
     backend->failing = 0;
+    backend->sampling_shift = 0;
+    backend->last_queue_depth = 0;
+    backend->last_bytes_sent = 0;
+    backend->drain_rate = 0;
     backend->key = full_key;
     if (full_key_metrics != NULL && full_key_metrics[0] != '\0') {
         backend->metrics_key = full_key_metrics;
@@ -244,6 +316,7 @@ static void kill_backend(stats_backend_t *backend) {
         free(backend->key);
     }
     tcpclient_destroy(&backend->client);
+    topkeys_destroy(backend->top);
     free(backend);
 }
 
@@ -257,6 +330,15 @@ static void group_destroy(struct ev_loop *loop, stats_backend_group_t* group) {
         filter_free(group->ingress_blacklist);
         group->ingress_blacklist = NULL;
     }
+    if (group->filter_cache) {
+        filter_cache_destroy(group->filter_cache);
+        group->filter_cache = NULL;
+    }
+    if (group->blocklist) {
+        ev_stat_stop(loop, &group->blocklist_watcher);
+        blocklist_destroy(group->blocklist);
+        group->blocklist = NULL;
+    }
     if (group->count_sampler) {
         sampler_destroy(group->count_sampler);
         group->count_sampler = NULL;
@@ -272,12 +354,22 @@ static void group_destroy(struct ev_loop *loop, stats_backend_group_t* group) {
         group->gauge_sampler = NULL;
         ev_timer_stop(loop, &group->gauge_sampling_watcher);
     }
+    if (group->set_sampler) {
+        sampler_destroy(group->set_sampler);
+        group->set_sampler = NULL;
+        ev_timer_stop(loop, &group->set_sampling_watcher);
+    }
+    if (group->sampler_table) {
+        sampler_table_destroy(group->sampler_table);
+        group->sampler_table = NULL;
+    }
+    topkeys_destroy(group->top);
     free(group);
 }
 
 static int group_filter_create(char* input_filter, filter_t** group) {
     filter_t* filter;
-    int st = filter_re_create(&filter, input_filter, NULL);
+    int st = filter_create(&filter, input_filter, NULL);
     if (st != 0) {
         stats_error_log("filter creation failed");
         return st;
@@ -287,6 +379,67 @@ static int group_filter_create(char* input_filter, filter_t** group) {
     return 0;
 }
 
+/**
+ * The decision cache is created together with the filters it caches, so a
+ * rebuilt group can never answer from stale filter outcomes.
+ */
+static int group_filter_cache_create(struct additional_config* config, stats_backend_group_t* group) {
+    if (config->filter_cache_size <= 0) {
+        return 0;
+    }
+    if (group->ingress_blacklist == NULL && group->ingress_filter == NULL) {
+        return 0;
+    }
+    if (filter_cache_init(&group->filter_cache, config->filter_cache_size) != 0) {
+        stats_error_log("filter cache creation failed");
+        return -1;
+    }
+    stats_log("created filter decision cache with %zu entries",
+            filter_cache_capacity(group->filter_cache));
+    return 0;
+}
+
+/**
+ * Swap in the new blocklist when its file changes. A file that is removed
+ * or fails to load leaves the previous blocklist in place.
+ */
+static void blocklist_reload_handler(struct ev_loop *loop, ev_stat *watcher, int revents) {
+    stats_backend_group_t* group = (stats_backend_group_t*)watcher->data;
+    if (watcher->attr.st_nlink == 0) {
+        stats_log("blocklist %s was removed, keeping %zu keys",
+                group->blocklist_file, blocklist_size(group->blocklist));
+        return;
+    }
+
+    blocklist_t* blocklist;
+    if (blocklist_load(&blocklist, group->blocklist_file) != 0) {
+        stats_error_log("failed to reload blocklist %s, keeping %zu keys",
+                group->blocklist_file, blocklist_size(group->blocklist));
+        return;
+    }
+    blocklist_destroy(group->blocklist);
+    group->blocklist = blocklist;
+    stats_log("reloaded blocklist %s with %zu keys", group->blocklist_file, blocklist_size(blocklist));
+}
+
+static int group_blocklist_create(struct ev_loop *loop, struct additional_config* config,
+        stats_backend_group_t* group) {
+    if (config->blocklist_file == NULL) {
+        return 0;
+    }
+    if (blocklist_load(&group->blocklist, config->blocklist_file) != 0) {
+        stats_error_log("blocklist creation failed");
+        return -1;
+    }
+    group->blocklist_file = config->blocklist_file;
+    stats_log("loaded blocklist %s with %zu keys", group->blocklist_file, blocklist_size(group->blocklist));
+
+    ev_stat_init(&group->blocklist_watcher, blocklist_reload_handler, group->blocklist_file, 0.);
+    group->blocklist_watcher.data = group;
+    ev_stat_start(loop, &group->blocklist_watcher);
+    return 0;
+}
+
 static void group_prefix_create(struct additional_config* config, stats_backend_group_t* group) {
     group->prefix = config->prefix;
     if (group->prefix)
@@ -321,35 +474,58 @@ static void flush_cluster_stats(struct ev_loop *loop, struct ev_timer *watcher,
         goto reset_timer;
     }
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.bytes_recv_tcp:%" PRIu64 "|g\n",
-                server->bytes_recv_tcp));
+    response_append(response, "global.bytes_recv_tcp:%" PRIu64 "|g\n",
+            server->bytes_recv_tcp);
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.total_connections:%" PRIu64 "|g\n",
-                server->total_connections));
+    response_append(response, "global.total_connections:%" PRIu64 "|g\n",
+            server->total_connections);
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.bytes_recv_udp:%" PRIu64 "|g\n",
-                server->bytes_recv_udp));
+    response_append(response, "global.bytes_recv_udp:%" PRIu64 "|g\n",
+            server->bytes_recv_udp);
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.total_connections:%" PRIu64 "|g\n",
-                server->total_connections));
+    response_append(response, "global.total_connections:%" PRIu64 "|g\n",
+            server->total_connections);
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.last_reload.timestamp:%" PRIu64 "|g\n",
-                server->last_reload));
+    response_append(response, "global.last_reload.timestamp:%" PRIu64 "|g\n",
+            server->last_reload);
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global.malformed_lines:%" PRIu64 "|g\n",
-                server->malformed_lines));
+    response_append(response, "global.malformed_lines:%" PRIu64 "|g\n",
+            server->malformed_lines);
+
+    /* Quantiles over the stats interval, the histograms start afresh after */
+    if (server->config->latency_sample_every > 0) {
+        for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+            const char *name = latency_stage_name(stage);
+            response_append(response, "global.latency.%s.count:%" PRIu64 "|g\n",
+                    name, latency_count(stage));
+            response_append(response, "global.latency.%s.p50_ns:%" PRIu64 "|g\n",
+                    name, latency_quantile_ns(stage, 0.5));
+            response_append(response, "global.latency.%s.p99_ns:%" PRIu64 "|g\n",
+                    name, latency_quantile_ns(stage, 0.99));
+            response_append(response, "global.latency.%s.max_ns:%" PRIu64 "|g\n",
+                    name, latency_quantile_ns(stage, 1.0));
+        }
+        latency_reset();
+    }
+
+    for (int metric = 0; metric < LOOPSTATS_METRICS; metric++) {
+        const histogram_t *histogram = loopstats_histogram(metric);
+        const char *name = loopstats_name(metric);
+        const char *unit = loopstats_is_time(metric) ? "_ns" : "";
+        response_append(response, "global.loop.%s.count:%" PRIu64 "|g\n", name, histogram->count);
+        response_append(response, "global.loop.%s.p50%s:%" PRIu64 "|g\n",
+                name, unit, histogram_quantile(histogram, 0.5));
+        response_append(response, "global.loop.%s.p99%s:%" PRIu64 "|g\n",
+                name, unit, histogram_quantile(histogram, 0.99));
+        response_append(response, "global.loop.%s.max%s:%" PRIu64 "|g\n", name, unit, histogram->max);
+    }
+    loopstats_reset();
+
+    uint64_t udp_drops, udp_rx_queue;
+    if (server->udp != NULL && udpserver_socket_stats(server->udp, &udp_drops, &udp_rx_queue) == 0) {
+        response_append(response, "global.udp.drops:%" PRIu64 "|g\n", udp_drops);
+        response_append(response, "global.udp.rx_queue_bytes:%" PRIu64 "|g\n", udp_rx_queue);
+    }
 
     for (int i = 0; i < server->rings->size; i++) {
         stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
@@ -358,57 +534,97 @@ static void flush_cluster_stats(struct ev_loop *loop, struct ev_timer *watcher,
             // reduce the number of per-instances stats in wavefront
             // only track this metric when we have been actively
             // flagging metrics
-            buffer_produced(response,
-                            snprintf((char *) buffer_tail(response), buffer_spacecount(response),
-                                     "group_%i.flagged_lines:%"
-                                             PRIu64
-                                             "|g\n",
-                                     i, group->flagged_lines));
+            response_append(response, "group_%i.flagged_lines:%" PRIu64 "|g\n",
+                    i, group->flagged_lines);
             // send count to statsd monitor
             // cluster and reset the gauge
             group->flagged_lines = 0;
         }
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "group_%i.filtered_lines:%" PRIu64 "|g\n",
-                    i, group->filtered_lines));
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "group_%i.relayed_lines:%" PRIu64 "|g\n",
-                    i, group->relayed_lines));
-        buffer_produced(response,
-                        snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                                 "group_%i.rejected_lines:%" PRIu64 "|g\n",
-                                 i, group->rejected_lines));
+        response_append(response, "group_%i.filtered_lines:%" PRIu64 "|g\n",
+                i, group->filtered_lines);
+        response_append(response, "group_%i.relayed_lines:%" PRIu64 "|g\n",
+                i, group->relayed_lines);
+        response_append(response, "group_%i.rejected_lines:%" PRIu64 "|g\n",
+                i, group->rejected_lines);
+        if (group->blocklist) {
+            response_append(response, "group_%i.blocklisted_lines:%" PRIu64 "|g\n",
+                    i, group->blocklisted_lines);
+        }
+        if (group->filter_cache) {
+            response_append(response, "group_%i.filter_cache_hits:%" PRIu64 "|g\n",
+                    i, filter_cache_hits(group->filter_cache));
+            response_append(response, "group_%i.filter_cache_misses:%" PRIu64 "|g\n",
+                    i, filter_cache_misses(group->filter_cache));
+        }
+        sampler_t* samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                  group->set_sampler };
+        for (int j = 0; j < 4; j++) {
+            if (samplers[j] == NULL) {
+                continue;
+            }
+            response_append(response, "group_%i.%s_map_load_percent:%d|g\n",
+                    i, sampler_names[j], sampler_load_percent(samplers[j]));
+            response_append(response, "group_%i.%s_map_resize_percent:%d|g\n",
+                    i, sampler_names[j], sampler_resize_percent(samplers[j]));
+            response_append(response, "group_%i.%s_buckets:%zu|g\n",
+                    i, sampler_names[j], sampler_buckets(samplers[j]));
+            response_append(response, "group_%i.%s_sampling_keys:%d|g\n",
+                    i, sampler_names[j], sampler_active(samplers[j]));
+            response_append(response, "group_%i.%s_memory_bytes:%zu|g\n",
+                    i, sampler_names[j], sampler_memory(samplers[j]));
+        }
     }
 
     for (size_t i = 0; i < server->num_backends; i++) {
         backend = server->backend_list[i];
 
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend_%s.bytes_queued:%" PRIu64 "|g\n",
-                    backend->metrics_key, backend->bytes_queued));
+        response_append(response, "backend_%s.bytes_queued:%" PRIu64 "|g\n",
+                backend->metrics_key, backend->bytes_queued);
+
+        response_append(response, "backend_%s.bytes_sent:%" PRIu64 "|g\n",
+                backend->metrics_key, backend->bytes_sent);
 
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend_%s.bytes_sent:%" PRIu64 "|g\n",
-                    backend->metrics_key, backend->bytes_sent));
+        response_append(response, "backend_%s.relayed_lines:%" PRIu64 "|g\n",
+                backend->metrics_key, backend->relayed_lines);
 
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend_%s.relayed_lines:%" PRIu64 "|g\n",
-                    backend->metrics_key, backend->relayed_lines));
+        response_append(response, "backend_%s.dropped_lines:%" PRIu64 "|g\n",
+                backend->metrics_key, backend->dropped_lines);
 
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend_%s.dropped_lines:%" PRIu64 "|g\n",
-                    backend->metrics_key, backend->dropped_lines));
+        response_append(response, "backend_%s.failing.boolean:%i|c\n",
+                backend->metrics_key, backend->failing);
 
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend_%s.failing.boolean:%i|c\n",
-                    backend->metrics_key, backend->failing));
+        if (server->config->sampling_high_watermark > 0) {
+            response_append(response, "backend_%s.sampling_shift:%d|g\n",
+                    backend->metrics_key, backend->sampling_shift);
+        }
+
+        // the high water mark is over the stats interval
+        tcpclient_t *client = &backend->client;
+        response_append(response, "backend_%s.queue_bytes:%zu|g\n",
+                backend->metrics_key, buffer_datacount(&client->send_queue));
+        response_append(response, "backend_%s.queue_high_water_bytes:%zu|g\n",
+                backend->metrics_key, client->queue_high_water);
+        response_append(response, "backend_%s.queue_age_ms:%" PRIu64 "|g\n",
+                backend->metrics_key, (uint64_t)(tcpclient_queue_age(client) * 1000));
+        response_append(response, "backend_%s.sends:%" PRIu64 "|g\n",
+                backend->metrics_key, client->sends);
+        response_append(response, "backend_%s.send_eagain:%" PRIu64 "|g\n",
+                backend->metrics_key, client->send_eagain);
+        response_append(response, "backend_%s.connects:%" PRIu64 "|g\n",
+                backend->metrics_key, client->connects);
+        response_append(response, "backend_%s.disconnects:%" PRIu64 "|g\n",
+                backend->metrics_key, client->disconnects);
+        response_append(response, "backend_%s.tcp_rtt_us:%" PRIu32 "|g\n",
+                backend->metrics_key, client->tcp_info.rtt_us);
+        response_append(response, "backend_%s.tcp_rttvar_us:%" PRIu32 "|g\n",
+                backend->metrics_key, client->tcp_info.rttvar_us);
+        response_append(response, "backend_%s.tcp_retransmits:%" PRIu32 "|g\n",
+                backend->metrics_key, client->tcp_info.retransmits);
+        response_append(response, "backend_%s.tcp_unacked:%" PRIu32 "|g\n",
+                backend->metrics_key, client->tcp_info.unacked);
+        response_append(response, "backend_%s.tcp_cwnd:%" PRIu32 "|g\n",
+                backend->metrics_key, client->tcp_info.cwnd);
+        tcpclient_reset_high_water(client);
     }
 
     while (buffer_datacount(response) > 0) {
@@ -446,39 +662,123 @@ reset_timer:
 /*
  * Receive a line from the flusher and send it on
  */
-static void sampling_flush_cb(void* data, const char* key, const char* line, int len) {
-    hashring_hash_t hash = hashring_hash(key);
+static void sampling_flush_cb(void* data, const char* key, size_t key_len, uint32_t hash,
+        const char* line, int len) {
     stats_backend_group_t* group = (stats_backend_group_t*)data;
-    stats_write_to_backend(line, len, key, hash, strlen(key), group);
+    stats_write_to_backend(line, len, key, hash, key_len, group);
 }
 
 static void sampling_handler(struct ev_loop *loop, struct ev_timer* timer, int events) {
     stats_backend_group_t* group = (stats_backend_group_t*)timer->data;
 
-    sampler_flush(group->count_sampler, sampling_flush_cb, (void*)group);
+    bool timed = latency_sample();
+    uint64_t start = timed ? latency_ticks() : 0;
+    sampler_flush_slice(group->count_sampler, sampling_flush_cb, (void*)group);
+    if (timed) {
+        latency_record(LATENCY_FLUSH, start);
+    }
 
-    ev_timer_set(&group->counter_sampling_watcher, sampler_window(group->count_sampler), 0.0);
+    ev_timer_set(&group->counter_sampling_watcher, sampling_timeout(loop, group, sampler_flush_interval(group->count_sampler)), 0.0);
     ev_timer_start(loop, &group->counter_sampling_watcher);
 }
 
 static void timer_sampling_handler(struct ev_loop *loop, struct ev_timer* timer, int events) {
     stats_backend_group_t* group = (stats_backend_group_t*)timer->data;
 
-    sampler_flush(group->timer_sampler, sampling_flush_cb, (void*)group);
+    bool timed = latency_sample();
+    uint64_t start = timed ? latency_ticks() : 0;
+    sampler_flush_slice(group->timer_sampler, sampling_flush_cb, (void*)group);
+    if (timed) {
+        latency_record(LATENCY_FLUSH, start);
+    }
 
-    ev_timer_set(&group->timer_sampling_watcher, sampler_window(group->timer_sampler), 0.0);
+    ev_timer_set(&group->timer_sampling_watcher, sampling_timeout(loop, group, sampler_flush_interval(group->timer_sampler)), 0.0);
     ev_timer_start(loop, &group->timer_sampling_watcher);
 }
 
 static void gauge_sampling_handler(struct ev_loop *loop, struct ev_timer* timer, int events) {
     stats_backend_group_t* group = (stats_backend_group_t*)timer->data;
 
-    sampler_flush(group->gauge_sampler, sampling_flush_cb, (void*)group);
+    bool timed = latency_sample();
+    uint64_t start = timed ? latency_ticks() : 0;
+    sampler_flush_slice(group->gauge_sampler, sampling_flush_cb, (void*)group);
+    if (timed) {
+        latency_record(LATENCY_FLUSH, start);
+    }
 
-    ev_timer_set(&group->gauge_sampling_watcher, sampler_window(group->gauge_sampler), 0.0);
+    ev_timer_set(&group->gauge_sampling_watcher, sampling_timeout(loop, group, sampler_flush_interval(group->gauge_sampler)), 0.0);
     ev_timer_start(loop, &group->gauge_sampling_watcher);
 }
 
+static void set_sampling_handler(struct ev_loop *loop, struct ev_timer* timer, int events) {
+    stats_backend_group_t* group = (stats_backend_group_t*)timer->data;
+
+    bool timed = latency_sample();
+    uint64_t start = timed ? latency_ticks() : 0;
+    sampler_flush_slice(group->set_sampler, sampling_flush_cb, (void*)group);
+    if (timed) {
+        latency_record(LATENCY_FLUSH, start);
+    }
+
+    ev_timer_set(&group->set_sampling_watcher, sampling_timeout(loop, group, sampler_flush_interval(group->set_sampler)), 0.0);
+    ev_timer_start(loop, &group->set_sampling_watcher);
+}
+
+/* Sample the kernel's view of each backend connection */
+static void sample_backends(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+    stats_server_t *server = (stats_server_t *)watcher->data;
+    for (size_t i = 0; i < server->num_backends; i++) {
+        tcpclient_sample_tcp_info(&server->backend_list[i]->client);
+    }
+}
+
+/* End the top keys window of every group and backend */
+static void rotate_top_keys(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+    stats_server_t *server = (stats_server_t *)watcher->data;
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+        topkeys_rotate(group->top);
+    }
+    for (size_t i = 0; i < server->num_backends; i++) {
+        if (server->backend_list[i]->top != NULL) {
+            topkeys_rotate(server->backend_list[i]->top);
+        }
+    }
+    server->top_windows++;
+}
+
+void stats_adjust_sampling(stats_server_t *server) {
+    struct proto_config *config = server->config;
+    size_t high = config->max_send_queue * config->sampling_high_watermark;
+    size_t low = config->max_send_queue * config->sampling_low_watermark;
+
+    for (size_t i = 0; i < server->num_backends; i++) {
+        stats_backend_t *backend = server->backend_list[i];
+        size_t depth = buffer_datacount(&backend->client.send_queue);
+        backend->drain_rate = (backend->bytes_sent - backend->last_bytes_sent) / SAMPLING_CONTROLLER_INTERVAL;
+
+        int shift = backend->sampling_shift;
+        if (depth >= high && depth >= backend->last_queue_depth) {
+            if (shift < SAMPLING_MAX_SHIFT) {
+                shift++;
+            }
+        } else if (depth <= low && shift > 0) {
+            shift--;
+        }
+        if (shift != backend->sampling_shift) {
+            stats_log("stats: backend %s has %zu bytes queued, draining %" PRIu64 " bytes/s, "
+                      "sampling thresholds divided by %d", backend->key, depth, backend->drain_rate, 1 << shift);
+            backend->sampling_shift = shift;
+        }
+        backend->last_queue_depth = depth;
+        backend->last_bytes_sent = backend->bytes_sent;
+    }
+}
+
+static void adjust_sampling(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+    stats_adjust_sampling((stats_server_t *)watcher->data);
+}
+
 stats_server_t *stats_server_create(struct ev_loop *loop,
         struct proto_config *config,
         protocol_parser_t parser,
@@ -498,6 +798,7 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
     server->config = config;
     server->rings = statsrelay_list_new();
     server->monitor_ring = statsrelay_list_new();
+    latency_init(config->latency_sample_every);
     {
         /*
          * 1. Load the primary shard map from the configuration, if present
@@ -536,9 +837,26 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
             group_prefix_create(dupl, group);
 
             group->flagged_lines = 0;
+            group->flush_slices = dupl->flush_slices;
 
-            if (dupl->sampling_threshold > 0) {
-                initialize_sampler(&group->count_sampler, &group->counter_sampling_watcher, group, server,
+            if (dupl->aggregate_all) {
+                group->aggregate_all = true;
+                initialize_sampler(&group->count_sampler, METRIC_COUNTER, &group->counter_sampling_watcher, group, server,
+                        0, dupl->aggregate_window, dupl->max_counters,
+                        false, dupl->reservoir_size, dupl->hm_key_expiration_frequency_in_seconds,
+                        dupl->hm_key_ttl_in_seconds, sampling_handler);
+                // Every gauge gets a bucket here, so they expire like counters
+                initialize_sampler(&group->gauge_sampler, METRIC_GAUGE, &group->gauge_sampling_watcher, group, server,
+                        0, dupl->aggregate_window, dupl->max_gauges,
+                        false, -1, dupl->hm_key_expiration_frequency_in_seconds,
+                        dupl->hm_key_ttl_in_seconds, gauge_sampling_handler);
+                if (group->count_sampler == NULL || sampler_aggregate_all(group->count_sampler) != 0 ||
+                        group->gauge_sampler == NULL || sampler_aggregate_all(group->gauge_sampler) != 0) {
+                    stats_error_log("sampler: failed to enable aggregation");
+                    goto server_create_err;
+                }
+            } else if (dupl->sampling_threshold > 0) {
+                initialize_sampler(&group->count_sampler, METRIC_COUNTER, &group->counter_sampling_watcher, group, server,
                         dupl->sampling_threshold, dupl->sampling_window, dupl->max_counters,
                         false, dupl->reservoir_size, dupl->hm_key_expiration_frequency_in_seconds,
                         dupl->hm_key_ttl_in_seconds, sampling_handler);
@@ -546,21 +864,62 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
 
             if (dupl->timer_sampling_threshold > 0) {
                 // Timer sampler, will include a passive expiring map by default.
-                initialize_sampler(&group->timer_sampler, &group->timer_sampling_watcher, group, server,
+                initialize_sampler(&group->timer_sampler, METRIC_TIMER, &group->timer_sampling_watcher, group, server,
                         dupl->timer_sampling_threshold, dupl->timer_sampling_window, dupl->max_timers,
                         dupl->timer_flush_min_max, dupl->reservoir_size, dupl->hm_key_expiration_frequency_in_seconds,
                         dupl->hm_key_ttl_in_seconds, timer_sampling_handler);
+                if (dupl->timer_summary_sketch && group->timer_sampler != NULL &&
+                        sampler_use_sketch(group->timer_sampler, dupl->timer_sketch_points) != 0) {
+                    stats_error_log("sampler: failed to enable timer sketches");
+                    goto server_create_err;
+                }
             }
 
-            if (dupl->gauge_sampling_threshold > 0) {
+            if (dupl->gauge_sampling_threshold > 0 && !dupl->aggregate_all) {
                 // gauges, doesn't have hashmap expired key redemption
                 // pass in a desired ttl of -1 (never expire!).
 
-                initialize_sampler(&group->gauge_sampler, &group->gauge_sampling_watcher, group, server,
+                initialize_sampler(&group->gauge_sampler, METRIC_GAUGE, &group->gauge_sampling_watcher, group, server,
                                    dupl->gauge_sampling_threshold, dupl->gauge_sampling_window,
                                    dupl->max_gauges, false, -1, -1, -1, gauge_sampling_handler);
             }
 
+            if (dupl->set_sampling_threshold > 0) {
+                initialize_sampler(&group->set_sampler, METRIC_S, &group->set_sampling_watcher, group, server,
+                        dupl->set_sampling_threshold, dupl->set_sampling_window, dupl->max_sets,
+                        false, -1, dupl->hm_key_expiration_frequency_in_seconds,
+                        dupl->hm_key_ttl_in_seconds, set_sampling_handler);
+                if (dupl->set_flush_cardinality && group->set_sampler != NULL &&
+                        sampler_flush_set_cardinality(group->set_sampler) != 0) {
+                    stats_error_log("sampler: failed to relay set cardinality");
+                    goto server_create_err;
+                }
+            }
+
+            sampler_t* samplers[] = { group->count_sampler, group->timer_sampler,
+                                      group->gauge_sampler, group->set_sampler };
+            for (int j = 0; j < 4; j++) {
+                if (samplers[j] == NULL) {
+                    continue;
+                }
+                if (dupl->doorkeeper_keys > 0 && sampler_use_doorkeeper(samplers[j], dupl->doorkeeper_keys) != 0) {
+                    stats_error_log("sampler: failed to create %s doorkeeper", sampler_names[j]);
+                    goto server_create_err;
+                }
+                if (dupl->sampler_memory_budget > 0 &&
+                        sampler_set_memory_budget(samplers[j], dupl->sampler_memory_budget) != 0) {
+                    stats_error_log("sampler: failed to set %s memory budget", sampler_names[j]);
+                    goto server_create_err;
+                }
+            }
+
+            if (dupl->prefix_depth > 0 && group->sampler_table != NULL &&
+                    sampler_table_track_prefixes(group->sampler_table, dupl->prefix_depth,
+                                                 dupl->prefix_quota, dupl->prefix_tracker_size) != 0) {
+                stats_error_log("sampler: failed to track key prefixes");
+                goto server_create_err;
+            }
+
             if (dupl->ingress_blacklist != NULL) {
                 if (group_filter_create(dupl->ingress_blacklist, &group->ingress_blacklist) != 0)
                     goto server_create_err;
@@ -570,6 +929,12 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
                 if (group_filter_create(dupl->ingress_filter, &group->ingress_filter) != 0)
                     goto server_create_err;
             }
+
+            if (group_filter_cache_create(dupl, group) != 0)
+                goto server_create_err;
+
+            if (group_blocklist_create(loop, dupl, group) != 0)
+                goto server_create_err;
         }
 
         if (config->send_health_metrics) {
@@ -601,6 +966,12 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
                     goto server_create_err;
             }
 
+            if (group_filter_cache_create(stat, monitor_group) != 0)
+                goto server_create_err;
+
+            if (group_blocklist_create(loop, stat, monitor_group) != 0)
+                goto server_create_err;
+
             /**
              * Once initialized, lets kick off the timer
              */
@@ -614,11 +985,40 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
         }
     }
 
+    if (config->top_keys > 0) {
+        for (int i = 0; i < server->rings->size; i++) {
+            stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+            if (topkeys_init(&group->top, config->top_keys) != 0) {
+                stats_error_log("stats: failed to create top keys of group %d", i);
+                goto server_create_err;
+            }
+        }
+        ev_timer_init(&server->top_rotator, rotate_top_keys, config->top_window, config->top_window);
+        server->top_rotator.data = server;
+        ev_timer_start(server->loop, &server->top_rotator);
+    }
+    server->top_countdown = config->top_sample_every;
+    server->top_windows = 0;
+    server->top_started = time(NULL);
+
+    if (config->sampling_high_watermark > 0) {
+        ev_timer_init(&server->sampling_controller, adjust_sampling,
+                SAMPLING_CONTROLLER_INTERVAL, SAMPLING_CONTROLLER_INTERVAL);
+        server->sampling_controller.data = server;
+        ev_timer_start(server->loop, &server->sampling_controller);
+    }
+
+    ev_timer_init(&server->backend_sampler, sample_backends,
+            BACKEND_SAMPLE_INTERVAL, BACKEND_SAMPLE_INTERVAL);
+    server->backend_sampler.data = server;
+    ev_timer_start(server->loop, &server->backend_sampler);
+
     server->bytes_recv_udp = 0;
     server->bytes_recv_tcp = 0;
     server->malformed_lines = 0;
     server->total_connections = 0;
     server->last_reload = 0;
+    server->udp = NULL;
 
     server->parser = parser;
     server->validator = validator;
@@ -677,10 +1077,19 @@ void *stats_connection(int sd, void *ctx) {
         free(session);
         return NULL;
     }
+    if (buffer_init(&session->output) != 0) {
+        stats_log("stats: Unable to initialize buffer");
+        buffer_destroy(&session->buffer);
+        free(session);
+        return NULL;
+    }
 
     session->server = (stats_server_t *) ctx;
     session->server->total_connections++;
     session->sd = sd;
+    session->closing = false;
+    ev_io_init(&session->write_watcher, stats_session_write, sd, EV_WRITE);
+    session->write_watcher.data = session;
     return (void *) session;
 }
 
@@ -745,16 +1154,100 @@ static void stats_write_to_backend(const char *line,
     backend->relayed_lines++;
 }
 
+/*
+ * Run the blacklist and then the filter of a group over a key
+ */
+static filter_cache_decision group_filter_decide(stats_backend_group_t* group,
+        const char* key, size_t key_len) {
+    if (group->ingress_blacklist && filter_exec(group->ingress_blacklist, key, key_len)) {
+        return FILTER_CACHE_REJECTED;
+    }
+    if (group->ingress_filter && !filter_exec(group->ingress_filter, key, key_len)) {
+        return FILTER_CACHE_FILTERED;
+    }
+    return FILTER_CACHE_PASS;
+}
+
+/* Whether a group drops a line by its blocklist or filters, counting why */
+static bool group_drops_line(stats_backend_group_t *group, const char *key, size_t key_len, hashring_hash_t key_hash) {
+    if (group->blocklist && blocklist_contains(group->blocklist, key, key_len, key_hash)) {
+        stats_debug_log("blocklisted incoming line %s", key);
+        group->blocklisted_lines++;
+        return true;
+    }
+
+    if (group->ingress_blacklist || group->ingress_filter) {
+        filter_cache_decision decision;
+
+        if (group->filter_cache == NULL ||
+                !filter_cache_get(group->filter_cache, key, key_len, key_hash, &decision)) {
+            decision = group_filter_decide(group, key, key_len);
+            if (group->filter_cache != NULL) {
+                filter_cache_put(group->filter_cache, key, key_len, key_hash, decision);
+            }
+        }
+
+        if (decision == FILTER_CACHE_REJECTED) { /* incoming line matches the blacklist filter, drop! */
+            stats_debug_log("rejecting incoming line %s", key);
+            group->rejected_lines++;
+            return true;
+        }
+        if (decision == FILTER_CACHE_FILTERED) { /* Filter didn't match, don't process this backend */
+            group->filtered_lines++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Count a sampled line of len bytes in the top keys of its group and backend */
+static void group_count_top(stats_server_t *server, stats_backend_group_t *group,
+                            const char *key, size_t key_len, hashring_hash_t key_hash, size_t len) {
+    // each sampled line stands for top_sample_every of them
+    uint64_t lines = server->config->top_sample_every;
+    uint64_t bytes = lines * (len + 1);
+    topkeys_add(group->top, key, key_len, key_hash, lines, bytes);
+
+    stats_backend_t *backend = hashring_choose_fromhash(group->ring, key_hash, NULL);
+    if (backend != NULL && backend->top != NULL) {
+        topkeys_add(backend->top, key, key_len, key_hash, lines, bytes);
+    }
+}
+
 static int stats_relay_line(const char *line, size_t len, stats_server_t *ss, bool send_to_monitor_cluster) {
+    /* one in every latency_sample_every lines has its stages timed */
+    bool timed = latency_sample();
+    uint64_t start = 0;
+
+    /* and one in every top_sample_every is counted in the top keys */
+    bool top = false;
+    if (ss->config->top_keys > 0 && !send_to_monitor_cluster && --ss->top_countdown <= 0) {
+        ss->top_countdown = ss->config->top_sample_every;
+        top = true;
+    }
+
     validate_parsed_result_t parsed_result;
     if (ss->config->enable_validation && ss->validator != NULL) {
-        if (ss->validator(line, len, &parsed_result) != 0) {
+        if (timed) {
+            start = latency_ticks();
+        }
+        int invalid = ss->validator(line, len, &parsed_result);
+        if (timed) {
+            latency_record(LATENCY_VALIDATE, start);
+        }
+        if (invalid != 0) {
             return 1;
         }
     }
 
     static char key_buffer[KEY_BUFFER];
+    if (timed) {
+        start = latency_ticks();
+    }
     size_t key_len = ss->parser(line, len);
+    if (timed) {
+        latency_record(LATENCY_PARSE, start);
+    }
     if (key_len == 0) {
         ss->malformed_lines++;
         stats_log("stats: failed to find key: \"%s\"", line);
@@ -763,7 +1256,13 @@ static int stats_relay_line(const char *line, size_t len, stats_server_t *ss, bo
     memcpy(key_buffer, line, key_len);
     key_buffer[key_len] = '\0';
 
+    if (timed) {
+        start = latency_ticks();
+    }
     hashring_hash_t key_hash = hashring_hash(key_buffer);
+    if (timed) {
+        latency_record(LATENCY_HASH, start);
+    }
 
     size_t ring_size = send_to_monitor_cluster ? ss->monitor_ring->size : ss->rings->size;
     list_t ring_ptr = send_to_monitor_cluster ? ss->monitor_ring : ss->rings;
@@ -774,41 +1273,34 @@ static int stats_relay_line(const char *line, size_t len, stats_server_t *ss, bo
 
     for (int group_num = 0; group_num < ring_size; group_num++) {
         stats_backend_group_t* group = (stats_backend_group_t*)ring_ptr->data[group_num];
-        /* Check sampling result */
 
-        if (group->ingress_blacklist) {
-            bool res = filter_exec(group->ingress_blacklist, key_buffer, key_len);
-
-            if (res) { /* incoming line matches the blacklist filter, drop! */
-                stats_debug_log("rejecting incoming line %s", key_buffer);
-                group->rejected_lines++;
-                continue;
-            }
+        if (timed) {
+            start = latency_ticks();
         }
-
-        /* If we have a filter, lets run it */
-        if (group->ingress_filter) {
-            bool res = filter_exec(group->ingress_filter, key_buffer, key_len);
-            if (!res) { /* Filter didn't match, don't process this backend */
-                group->filtered_lines++;
-                continue;
-            }
+        bool dropped = group_drops_line(group, key_buffer, key_len, key_hash);
+        if (timed) {
+            latency_record(LATENCY_FILTER, start);
+        }
+        if (dropped) {
+            continue;
         }
 
+        /* Check sampling result */
         sampling_result r = SAMPLER_NOT_SAMPLING;
-        if (group->count_sampler) {
-            if (parsed_result.type == METRIC_COUNTER) {
-                r = sampler_consider_counter(group->count_sampler, key_buffer, &parsed_result);
+        if (group->sampler_table) {
+            if (timed) {
+                start = latency_ticks();
             }
-        }
-        if (group->timer_sampler) {
-            if (parsed_result.type == METRIC_TIMER) {
-                r = sampler_consider_timer(group->timer_sampler, key_buffer, &parsed_result);
+            int shift = 0;
+            if (ss->config->sampling_high_watermark > 0) {
+                stats_backend_t *backend = hashring_choose_fromhash(group->ring, key_hash, NULL);
+                if (backend != NULL) {
+                    shift = backend->sampling_shift;
+                }
             }
-        }
-        if (group->gauge_sampler) {
-            if (parsed_result.type == METRIC_GAUGE) {
-                r = sampler_consider_gauge(group->gauge_sampler, key_buffer, &parsed_result);
+            r = sampler_table_consider(group->sampler_table, key_buffer, key_len, key_hash, &parsed_result, shift);
+            if (timed) {
+                latency_record(LATENCY_SAMPLE, start);
             }
         }
         if (r == SAMPLER_FLAGGED) {
@@ -817,118 +1309,576 @@ static int stats_relay_line(const char *line, size_t len, stats_server_t *ss, bo
         } else if (r == SAMPLER_SAMPLING) {
             continue;
         }
+
+        if (top) {
+            group_count_top(ss, group, key_buffer, key_len, key_hash, len);
+        }
+
+        if (timed) {
+            start = latency_ticks();
+        }
         stats_write_to_backend(line, len, key_buffer, key_hash, key_len, group);
+        if (timed) {
+            latency_record(LATENCY_ENQUEUE, start);
+        }
     }
 
     return 0;
 }
 
-void stats_send_statistics(stats_session_t *session) {
-    stats_backend_t *backend;
-    ssize_t bytes_sent;
+/* Send as much of the session's pending output as the socket takes */
+static void stats_session_write(struct ev_loop *loop, struct ev_io *watcher, int events) {
+    stats_session_t *session = (stats_session_t *)watcher->data;
 
-    // TODO: this only needs to be allocated once, not every time we send
-    // statistics
-    buffer_t *response = create_buffer(MAX_UDP_LENGTH);
-    if (response == NULL) {
-        stats_log("failed to allocate send_statistics buffer");
-        return;
+    while (buffer_datacount(&session->output) > 0) {
+        ssize_t bytes_sent = send(session->sd, buffer_head(&session->output),
+                buffer_datacount(&session->output), MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                if (!ev_is_active(&session->write_watcher)) {
+                    ev_io_start(loop, &session->write_watcher);
+                }
+                return;
+            }
+            stats_log("stats: Error sending status response: %s", strerror(errno));
+            buffer_consume(&session->output, buffer_datacount(&session->output));
+            break;
+        }
+        buffer_consume(&session->output, bytes_sent);
     }
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global bytes_recv_udp gauge %" PRIu64 "\n",
-                session->server->bytes_recv_udp));
+    ev_io_stop(loop, &session->write_watcher);
+    buffer_realign(&session->output);
+    if (session->closing) {
+        stats_session_destroy(session);
+    }
+}
+
+/* Send what was appended to the session's output, without blocking */
+static void stats_session_send(stats_session_t *session) {
+    if (!ev_is_active(&session->write_watcher)) {
+        stats_session_write(session->server->loop, &session->write_watcher, EV_WRITE);
+    }
+}
+
+/**
+ * Walks the status of the server as "<scope> <name> <type> <value>"
+ * lines, or as a JSON object of scopes, each an object of names and
+ * values.
+ */
+typedef struct {
+    buffer_t *out;
+    bool json;
+    /* only backends whose key starts with this, NULL for everything */
+    const char *backend_prefix;
+    bool scope_open;
+    bool scope_empty;
+    char scope[KEY_BUFFER];
+} status_writer_t;
+
+static void status_append_json_string(buffer_t *out, const char *s) {
+    response_append(out, "\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            response_append(out, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            response_append(out, "\\u%04x", *s);
+        } else {
+            response_append(out, "%c", *s);
+        }
+    }
+    response_append(out, "\"");
+}
+
+static void status_begin(status_writer_t *w) {
+    w->scope_open = false;
+    if (w->json) {
+        response_append(w->out, "{");
+    }
+}
+
+static void status_scope(status_writer_t *w, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(w->scope, sizeof(w->scope), format, args);
+    va_end(args);
+
+    if (w->json) {
+        response_append(w->out, w->scope_open ? "},\n" : "\n");
+        status_append_json_string(w->out, w->scope);
+        response_append(w->out, ":{");
+    }
+    w->scope_open = true;
+    w->scope_empty = true;
+}
+
+static void status_add(status_writer_t *w, const char *type, int64_t value, const char *format, ...) {
+    char name[KEY_BUFFER];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+
+    if (w->json) {
+        if (!w->scope_empty) {
+            response_append(w->out, ",");
+        }
+        status_append_json_string(w->out, name);
+        response_append(w->out, ":%" PRId64, value);
+    } else {
+        response_append(w->out, "%s %s %s %" PRId64 "\n", w->scope, name, type, value);
+    }
+    w->scope_empty = false;
+}
+
+static void status_end(status_writer_t *w) {
+    if (w->json) {
+        response_append(w->out, w->scope_open ? "}\n}\n" : "}\n");
+    }
+    // the end of a response is marked by an empty line
+    response_append(w->out, "\n");
+}
+
+static void stats_write_status(stats_server_t *server, status_writer_t *w) {
+    status_begin(w);
+    if (w->backend_prefix == NULL) {
+        status_scope(w, "global");
+        status_add(w, "gauge", server->bytes_recv_udp, "bytes_recv_udp");
+        status_add(w, "gauge", server->bytes_recv_tcp, "bytes_recv_tcp");
+        status_add(w, "gauge", server->total_connections, "total_connections");
+        status_add(w, "timestamp", server->last_reload, "last_reload");
+        status_add(w, "gauge", server->malformed_lines, "malformed_lines");
+
+        if (server->config->latency_sample_every > 0) {
+            const double quantiles[] = { 0.5, 0.99, 0.999 };
+            const char *quantile_names[] = { "p50", "p99", "p999" };
+            for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+                const char *name = latency_stage_name(stage);
+                status_add(w, "gauge", latency_count(stage), "latency_%s_count", name);
+                for (int q = 0; q < 3; q++) {
+                    status_add(w, "gauge", latency_quantile_ns(stage, quantiles[q]),
+                            "latency_%s_%s_ns", name, quantile_names[q]);
+                }
+                status_add(w, "gauge", latency_quantile_ns(stage, 1.0), "latency_%s_max_ns", name);
+            }
+        }
+
+        for (int metric = 0; metric < LOOPSTATS_METRICS; metric++) {
+            const histogram_t *histogram = loopstats_histogram(metric);
+            const char *name = loopstats_name(metric);
+            const char *unit = loopstats_is_time(metric) ? "_ns" : "";
+            status_add(w, "gauge", histogram->count, "loop_%s_count", name);
+            status_add(w, "gauge", histogram_quantile(histogram, 0.5), "loop_%s_p50%s", name, unit);
+            status_add(w, "gauge", histogram_quantile(histogram, 0.99), "loop_%s_p99%s", name, unit);
+            status_add(w, "gauge", histogram->max, "loop_%s_max%s", name, unit);
+        }
+
+        uint64_t udp_drops, udp_rx_queue;
+        if (server->udp != NULL && udpserver_socket_stats(server->udp, &udp_drops, &udp_rx_queue) == 0) {
+            status_add(w, "counter", udp_drops, "udp_drops");
+            status_add(w, "gauge", udp_rx_queue, "udp_rx_queue_bytes");
+        }
+
+        for (int i = 0; i < server->rings->size; i++) {
+            stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+            status_scope(w, "group:%i", i);
+            status_add(w, "gauge", group->filtered_lines, "filtered_lines");
+            status_add(w, "gauge", group->flagged_lines, "flagged_lines");
+            status_add(w, "gauge", group->relayed_lines, "relayed_lines");
+            status_add(w, "gauge", group->rejected_lines, "rejected_lines");
+            if (group->blocklist) {
+                status_add(w, "gauge", group->blocklisted_lines, "blocklisted_lines");
+                status_add(w, "gauge", blocklist_size(group->blocklist), "blocklist_keys");
+            }
+            if (group->filter_cache) {
+                status_add(w, "gauge", filter_cache_hits(group->filter_cache), "filter_cache_hits");
+                status_add(w, "gauge", filter_cache_misses(group->filter_cache), "filter_cache_misses");
+            }
+            sampler_t* samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                      group->set_sampler };
+            for (int j = 0; j < 4; j++) {
+                if (samplers[j] == NULL) {
+                    continue;
+                }
+                const char *name = sampler_names[j];
+                status_add(w, "gauge", sampler_load_percent(samplers[j]), "%s_map_load_percent", name);
+                status_add(w, "gauge", sampler_resize_percent(samplers[j]), "%s_map_resize_percent", name);
+                status_add(w, "gauge", sampler_buckets(samplers[j]), "%s_buckets", name);
+                status_add(w, "gauge", sampler_active(samplers[j]), "%s_sampling_keys", name);
+                status_add(w, "gauge", sampler_memory(samplers[j]), "%s_memory_bytes", name);
+                status_add(w, "gauge", sampler_doorkeeper_lines(samplers[j]), "%s_doorkeeper_lines", name);
+                status_add(w, "gauge", sampler_evictions(samplers[j]), "%s_evictions", name);
+                if (server->config->sampling_high_watermark <= 0) {
+                    continue;
+                }
+                // the threshold in effect for the keys of each backend
+                list_t ring_backends = group->ring->backends;
+                for (int k = 0; k < ring_backends->size; k++) {
+                    stats_backend_t *ring_backend = ring_backends->data[k];
+                    bool seen = false;
+                    for (int l = 0; l < k && !seen; l++) {
+                        seen = ring_backends->data[l] == ring_backend;
+                    }
+                    if (seen) {
+                        continue;
+                    }
+                    status_add(w, "gauge", sampler_effective_threshold(samplers[j], ring_backend->sampling_shift),
+                            "%s_threshold.%s", name, ring_backend->metrics_key);
+                }
+            }
+        }
+    }
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global bytes_recv_tcp gauge %" PRIu64 "\n",
-                session->server->bytes_recv_tcp));
+    size_t prefix_len = w->backend_prefix != NULL ? strlen(w->backend_prefix) : 0;
+    for (size_t i = 0; i < server->num_backends; i++) {
+        stats_backend_t *backend = server->backend_list[i];
+        if (prefix_len > 0 && strncmp(backend->key, w->backend_prefix, prefix_len) != 0) {
+            continue;
+        }
+        status_scope(w, "backend:%s", backend->key);
+        status_add(w, "gauge", backend->bytes_queued, "bytes_queued");
+        status_add(w, "gauge", backend->bytes_sent, "bytes_sent");
+        status_add(w, "gauge", backend->relayed_lines, "relayed_lines");
+        status_add(w, "gauge", backend->dropped_lines, "dropped_lines");
+        status_add(w, "boolean", backend->failing, "failing");
+        if (server->config->sampling_high_watermark > 0) {
+            status_add(w, "gauge", backend->sampling_shift, "sampling_shift");
+            status_add(w, "gauge", backend->drain_rate, "drain_rate");
+        }
+        tcpclient_t *client = &backend->client;
+        status_add(w, "gauge", buffer_datacount(&client->send_queue), "queue_bytes");
+        status_add(w, "gauge", client->queue_high_water, "queue_high_water_bytes");
+        status_add(w, "gauge", (int64_t)(tcpclient_queue_age(client) * 1000), "queue_age_ms");
+        status_add(w, "counter", client->sends, "sends");
+        status_add(w, "counter", client->send_eagain, "send_eagain");
+        status_add(w, "counter", client->connects, "connects");
+        status_add(w, "counter", client->disconnects, "disconnects");
+        status_add(w, "gauge", client->tcp_info.rtt_us, "tcp_rtt_us");
+        status_add(w, "gauge", client->tcp_info.rttvar_us, "tcp_rttvar_us");
+        status_add(w, "counter", client->tcp_info.retransmits, "tcp_retransmits");
+        status_add(w, "gauge", client->tcp_info.unacked, "tcp_unacked");
+        status_add(w, "gauge", client->tcp_info.cwnd, "tcp_cwnd");
+    }
+    status_end(w);
+}
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global total_connections gauge %" PRIu64 "\n",
-                session->server->total_connections));
+/**
+ * Queue the status of the server on the session. The whole response is
+ * rendered at once, a consistent snapshot, and then sent as the socket
+ * becomes writable.
+ */
+static void stats_send_statistics(stats_session_t *session, bool json, const char *backend_prefix) {
+    status_writer_t writer = {
+        .out = &session->output,
+        .json = json,
+        .backend_prefix = backend_prefix,
+    };
+    stats_write_status(session->server, &writer);
+    stats_session_send(session);
+}
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global last_reload timestamp %" PRIu64 "\n",
-                session->server->last_reload));
+#define STATUS_PREFIXES_MAX 20
 
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                "global malformed_lines gauge %" PRIu64 "\n",
-                session->server->malformed_lines));
+static void stats_send_prefixes(stats_session_t *session) {
+    const topk_entry_t *prefixes[STATUS_PREFIXES_MAX];
 
     for (int i = 0; i < session->server->rings->size; i++) {
         stats_backend_group_t* group = (stats_backend_group_t*)session->server->rings->data[i];
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "group:%i filtered_lines gauge %" PRIu64 "\n",
-                    i, group->filtered_lines));
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "group:%i flagged_lines gauge %" PRIu64 "\n",
-                    i, group->flagged_lines));
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "group:%i relayed_lines gauge %" PRIu64 "\n",
-                    i, group->relayed_lines));
-        buffer_produced(response,
-                        snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                                 "group:%i rejected_lines gauge %" PRIu64 "\n",
-                                 i, group->rejected_lines));
-    }
-
-    for (size_t i = 0; i < session->server->num_backends; i++) {
-        backend = session->server->backend_list[i];
-
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend:%s bytes_queued gauge %" PRIu64 "\n",
-                    backend->key, backend->bytes_queued));
-
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend:%s bytes_sent gauge %" PRIu64 "\n",
-                    backend->key, backend->bytes_sent));
-
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend:%s relayed_lines gauge %" PRIu64 "\n",
-                    backend->key, backend->relayed_lines));
-
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend:%s dropped_lines gauge %" PRIu64 "\n",
-                    backend->key, backend->dropped_lines));
-
-        buffer_produced(response,
-                snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-                    "backend:%s failing boolean %i\n",
-                    backend->key, backend->failing));
-    }
-
-    buffer_produced(response,
-            snprintf((char *)buffer_tail(response), buffer_spacecount(response), "\n"));
+        if (group->sampler_table == NULL) {
+            continue;
+        }
+        size_t n = sampler_table_prefixes(group->sampler_table, prefixes, STATUS_PREFIXES_MAX);
+        for (size_t j = 0; j < n; j++) {
+            response_append(&session->output,
+                    "group:%i prefix %s keys %" PRIu64 " error %" PRIu64 " flagged_lines %" PRIu64 "\n",
+                    i, prefixes[j]->key, prefixes[j]->count, prefixes[j]->error, prefixes[j]->user);
+        }
+    }
+    response_append(&session->output, "\n");
+    stats_session_send(session);
+}
 
-    while (buffer_datacount(response) > 0) {
-        bytes_sent = send(session->sd, buffer_head(response), buffer_datacount(response), 0);
-        if (bytes_sent < 0) {
-            stats_log("stats: Error sending status response: %s", strerror(errno));
-            break;
+static void stats_write_top(buffer_t *out, const char *scope, topkeys_t *top,
+                            size_t max, double seconds) {
+    const topk_entry_t **entries = malloc(max * sizeof(topk_entry_t *));
+    if (entries == NULL) {
+        return;
+    }
+    const char *rankings[] = { "top_lines", "top_bytes" };
+    for (int by_bytes = 0; by_bytes < 2; by_bytes++) {
+        size_t n = topkeys_list(top, by_bytes, entries, max);
+        for (size_t i = 0; i < n; i++) {
+            response_append(out, "%s %s %s per_second %.1f error %.1f\n",
+                    scope, rankings[by_bytes], entries[i]->key,
+                    entries[i]->count / seconds, entries[i]->error / seconds);
         }
+    }
+    free(entries);
+}
 
-        if (bytes_sent == 0) {
-            stats_log("stats: Error sending status response: Client closed connection");
-            break;
+/**
+ * List the heaviest keys per group and backend, by lines and by bytes
+ * per second over the last top_window seconds. Counts are estimated from
+ * one in every top_sample_every lines, and overestimate a key's true
+ * rate by at most its error.
+ */
+static void stats_send_top(stats_session_t *session, size_t max) {
+    stats_server_t *server = session->server;
+    if (server->config->top_keys > 0) {
+        if (max == 0 || max > server->config->top_keys) {
+            max = server->config->top_keys;
+        }
+        double seconds = server->config->top_window;
+        if (server->top_windows == 0) {
+            // the first window is still in progress
+            seconds = difftime(time(NULL), server->top_started);
+            if (seconds < 1) {
+                seconds = 1;
+            }
+        }
+        response_append(&session->output, "top window %.0f sample_every %d\n",
+                seconds, server->config->top_sample_every);
+
+        char scope[KEY_BUFFER];
+        for (int i = 0; i < server->rings->size; i++) {
+            stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+            snprintf(scope, sizeof(scope), "group:%i", i);
+            stats_write_top(&session->output, scope, group->top, max, seconds);
         }
+        for (size_t i = 0; i < server->num_backends; i++) {
+            stats_backend_t *backend = server->backend_list[i];
+            if (backend->top == NULL) {
+                continue;
+            }
+            snprintf(scope, sizeof(scope), "backend:%s", backend->key);
+            stats_write_top(&session->output, scope, backend->top, max, seconds);
+        }
+    }
+    response_append(&session->output, "\n");
+    stats_session_send(session);
+}
 
-        buffer_consume(response, bytes_sent);
+static void metrics_family(buffer_t *out, const char *name, const char *type, const char *help) {
+    response_append(out, "# TYPE statsrelay_%s %s\n# HELP statsrelay_%s %s\n", name, type, name, help);
+}
+
+/* Upper bounds of the latency and loop histogram buckets exposed, in nanoseconds */
+static const uint64_t latency_bounds_ns[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000
+};
+
+/**
+ * Render the counters of the relay in the OpenMetrics text format. The
+ * event loop is single threaded, so the counters are read as they stand
+ * between two events, with nothing to lock.
+ */
+static void stats_render_metrics(stats_server_t *server, buffer_t *out) {
+    metrics_family(out, "bytes_recv", "counter", "Bytes received from clients.");
+    response_append(out, "statsrelay_bytes_recv_total{transport=\"udp\"} %" PRIu64 "\n", server->bytes_recv_udp);
+    response_append(out, "statsrelay_bytes_recv_total{transport=\"tcp\"} %" PRIu64 "\n", server->bytes_recv_tcp);
+    metrics_family(out, "connections", "counter", "TCP connections accepted.");
+    response_append(out, "statsrelay_connections_total %" PRIu64 "\n", server->total_connections);
+    metrics_family(out, "malformed_lines", "counter", "Lines without a key.");
+    response_append(out, "statsrelay_malformed_lines_total %" PRIu64 "\n", server->malformed_lines);
+    metrics_family(out, "last_reload_timestamp_seconds", "gauge", "Time of the last configuration load.");
+    response_append(out, "statsrelay_last_reload_timestamp_seconds %" PRIu64 "\n", (uint64_t)server->last_reload);
+
+    uint64_t udp_drops, udp_rx_queue;
+    if (server->udp != NULL && udpserver_socket_stats(server->udp, &udp_drops, &udp_rx_queue) == 0) {
+        metrics_family(out, "udp_drops", "counter", "Datagrams dropped by the kernel on the UDP listeners.");
+        response_append(out, "statsrelay_udp_drops_total %" PRIu64 "\n", udp_drops);
+        metrics_family(out, "udp_rx_queue_bytes", "gauge", "Bytes waiting in the receive buffers of the UDP listeners.");
+        response_append(out, "statsrelay_udp_rx_queue_bytes %" PRIu64 "\n", udp_rx_queue);
     }
-    delete_buffer(response);
+
+    metrics_family(out, "group_lines", "counter", "Lines seen by each group, by outcome.");
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+        response_append(out, "statsrelay_group_lines_total{group=\"%i\",outcome=\"relayed\"} %" PRIu64 "\n",
+                i, group->relayed_lines);
+        response_append(out, "statsrelay_group_lines_total{group=\"%i\",outcome=\"filtered\"} %" PRIu64 "\n",
+                i, group->filtered_lines);
+        response_append(out, "statsrelay_group_lines_total{group=\"%i\",outcome=\"rejected\"} %" PRIu64 "\n",
+                i, group->rejected_lines);
+        response_append(out, "statsrelay_group_lines_total{group=\"%i\",outcome=\"blocklisted\"} %" PRIu64 "\n",
+                i, group->blocklisted_lines);
+    }
+    metrics_family(out, "group_flagged_lines", "gauge",
+            "Lines flagged by each group's samplers since the last health metrics flush.");
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+        response_append(out, "statsrelay_group_flagged_lines{group=\"%i\"} %" PRIu64 "\n",
+                i, group->flagged_lines);
+    }
+    metrics_family(out, "filter_cache_lookups", "counter", "Filter cache lookups, by result.");
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+        if (group->filter_cache) {
+            response_append(out, "statsrelay_filter_cache_lookups_total{group=\"%i\",result=\"hit\"} %" PRIu64 "\n",
+                    i, filter_cache_hits(group->filter_cache));
+            response_append(out, "statsrelay_filter_cache_lookups_total{group=\"%i\",result=\"miss\"} %" PRIu64 "\n",
+                    i, filter_cache_misses(group->filter_cache));
+        }
+    }
+
+    static const char *sampler_families[][3] = {
+        { "sampler_buckets", "gauge", "Buckets held by each sampler." },
+        { "sampler_sampling_keys", "gauge", "Keys each sampler is sampling." },
+        { "sampler_memory_bytes", "gauge", "Bytes held by each sampler." },
+        { "sampler_map_load_percent", "gauge", "Load of each sampler's map." },
+        { "sampler_evictions", "counter", "Buckets evicted under each sampler's memory budget." },
+        { "sampler_doorkeeper_lines", "counter", "Lines of unseen keys passed on by each sampler's doorkeeper." },
+    };
+    for (int f = 0; f < 6; f++) {
+        metrics_family(out, sampler_families[f][0], sampler_families[f][1], sampler_families[f][2]);
+        const char *suffix = f >= 4 ? "_total" : "";
+        for (int i = 0; i < server->rings->size; i++) {
+            stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
+            sampler_t* samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                      group->set_sampler };
+            for (int j = 0; j < 4; j++) {
+                if (samplers[j] == NULL) {
+                    continue;
+                }
+                uint64_t value;
+                switch (f) {
+                    case 0: value = sampler_buckets(samplers[j]); break;
+                    case 1: value = sampler_active(samplers[j]); break;
+                    case 2: value = sampler_memory(samplers[j]); break;
+                    case 3: value = sampler_load_percent(samplers[j]); break;
+                    case 4: value = sampler_evictions(samplers[j]); break;
+                    default: value = sampler_doorkeeper_lines(samplers[j]); break;
+                }
+                response_append(out, "statsrelay_%s%s{group=\"%i\",sampler=\"%s\"} %" PRIu64 "\n",
+                        sampler_families[f][0], suffix, i, sampler_names[j], value);
+            }
+        }
+    }
+
+    static const char *backend_families[][3] = {
+        { "backend_bytes_queued", "counter", "Bytes queued for each backend." },
+        { "backend_bytes_sent", "counter", "Bytes sent to each backend." },
+        { "backend_relayed_lines", "counter", "Lines relayed to each backend." },
+        { "backend_dropped_lines", "counter", "Lines dropped on a full send queue." },
+        { "backend_queue_bytes", "gauge", "Bytes waiting in each backend's send queue." },
+        { "backend_failing", "gauge", "Whether each backend's send queue is full." },
+        { "backend_sampling_shift", "gauge", "Halvings of the sampling thresholds of each backend's keys." },
+        { "backend_queue_high_water_bytes", "gauge", "Deepest send queue since the last health metrics flush." },
+        { "backend_queue_age_milliseconds", "gauge", "Time the oldest byte of each send queue has waited." },
+        { "backend_tcp_rtt_microseconds", "gauge", "Smoothed round trip time of each backend connection." },
+        { "backend_tcp_unacked", "gauge", "Segments sent and not yet acknowledged." },
+        { "backend_tcp_cwnd", "gauge", "Congestion window of each backend connection, in segments." },
+        { "backend_sends", "counter", "send() calls on each backend connection." },
+        { "backend_send_eagain", "counter", "send() calls that found the socket buffer full." },
+        { "backend_connects", "counter", "Connections established to each backend." },
+        { "backend_disconnects", "counter", "Connections to each backend lost or dropped." },
+        { "backend_tcp_retransmits", "counter", "Segments retransmitted on the current connection." },
+    };
+    for (int f = 0; f < sizeof(backend_families) / sizeof(backend_families[0]); f++) {
+        metrics_family(out, backend_families[f][0], backend_families[f][1], backend_families[f][2]);
+        const char *suffix = strcmp(backend_families[f][1], "counter") == 0 ? "_total" : "";
+        for (size_t i = 0; i < server->num_backends; i++) {
+            stats_backend_t *backend = server->backend_list[i];
+            tcpclient_t *client = &backend->client;
+            uint64_t value;
+            switch (f) {
+                case 0: value = backend->bytes_queued; break;
+                case 1: value = backend->bytes_sent; break;
+                case 2: value = backend->relayed_lines; break;
+                case 3: value = backend->dropped_lines; break;
+                case 4: value = buffer_datacount(&client->send_queue); break;
+                case 5: value = backend->failing; break;
+                case 6: value = backend->sampling_shift; break;
+                case 7: value = client->queue_high_water; break;
+                case 8: value = tcpclient_queue_age(client) * 1000; break;
+                case 9: value = client->tcp_info.rtt_us; break;
+                case 10: value = client->tcp_info.unacked; break;
+                case 11: value = client->tcp_info.cwnd; break;
+                case 12: value = client->sends; break;
+                case 13: value = client->send_eagain; break;
+                case 14: value = client->connects; break;
+                case 15: value = client->disconnects; break;
+                default: value = client->tcp_info.retransmits; break;
+            }
+            response_append(out, "statsrelay_%s%s{backend=\"%s\"} %" PRIu64 "\n",
+                    backend_families[f][0], suffix, backend->key, value);
+        }
+    }
+
+    if (server->config->latency_sample_every > 0) {
+        metrics_family(out, "stage_latency_seconds", "histogram",
+                "Sampled time spent in each stage of the relay pipeline.");
+        for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+            const char *name = latency_stage_name(stage);
+            for (int b = 0; b < sizeof(latency_bounds_ns) / sizeof(latency_bounds_ns[0]); b++) {
+                response_append(out, "statsrelay_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                        name, latency_bounds_ns[b] / 1e9, latency_count_below_ns(stage, latency_bounds_ns[b]));
+            }
+            response_append(out, "statsrelay_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                    name, latency_count(stage));
+            response_append(out, "statsrelay_stage_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+                    name, latency_count(stage));
+            response_append(out, "statsrelay_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+                    name, latency_sum_ns(stage) / 1e9);
+            // the histograms start afresh after each health metrics flush
+            response_append(out, "statsrelay_stage_latency_seconds_created{stage=\"%s\"} %" PRIu64 "\n",
+                    name, (uint64_t)latency_since());
+        }
+    }
+
+    for (int metric = 0; metric < LOOPSTATS_METRICS; metric++) {
+        const histogram_t *histogram = loopstats_histogram(metric);
+        const char *name = loopstats_name(metric);
+        if (loopstats_is_time(metric)) {
+            response_append(out, "# TYPE statsrelay_loop_%s_seconds histogram\n", name);
+            response_append(out, "# HELP statsrelay_loop_%s_seconds Event loop %s time.\n", name, name);
+            for (int b = 0; b < sizeof(latency_bounds_ns) / sizeof(latency_bounds_ns[0]); b++) {
+                response_append(out, "statsrelay_loop_%s_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+                        name, latency_bounds_ns[b] / 1e9, histogram_count_below(histogram, latency_bounds_ns[b]));
+            }
+            response_append(out, "statsrelay_loop_%s_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, histogram->count);
+            response_append(out, "statsrelay_loop_%s_seconds_count %" PRIu64 "\n", name, histogram->count);
+            response_append(out, "statsrelay_loop_%s_seconds_sum %.9f\n", name, histogram->sum / 1e9);
+            response_append(out, "statsrelay_loop_%s_seconds_created %" PRIu64 "\n", name, (uint64_t)loopstats_since());
+        } else {
+            response_append(out, "# TYPE statsrelay_loop_%s histogram\n", name);
+            response_append(out, "# HELP statsrelay_loop_%s Event loop %s per iteration.\n", name, name);
+            for (uint64_t bound = 1; bound <= 1024; bound *= 2) {
+                response_append(out, "statsrelay_loop_%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                        name, bound, histogram_count_below(histogram, bound));
+            }
+            response_append(out, "statsrelay_loop_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, histogram->count);
+            response_append(out, "statsrelay_loop_%s_count %" PRIu64 "\n", name, histogram->count);
+            response_append(out, "statsrelay_loop_%s_sum %" PRIu64 "\n", name, histogram->sum);
+            response_append(out, "statsrelay_loop_%s_created %" PRIu64 "\n", name, (uint64_t)loopstats_since());
+        }
+    }
+
+    response_append(out, "# EOF\n");
+}
+
+int stats_http_handler(const char *path, buffer_t *body, const char **content_type, void *data) {
+    stats_server_t *server = (stats_server_t *)data;
+    if (strcmp(path, "/metrics") != 0) {
+        response_append(body, "not found\n");
+        return 404;
+    }
+    stats_render_metrics(server, body);
+    *content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    return 200;
 }
 
+/* status of the backends whose key starts with the rest of the line */
+#define STATUS_BACKEND "status backend "
+#define STATUS_BACKEND_LEN (sizeof(STATUS_BACKEND) - 1)
+#define STATUS_JSON_BACKEND "status json backend "
+#define STATUS_JSON_BACKEND_LEN (sizeof(STATUS_JSON_BACKEND) - 1)
+/* top keys, as many as the rest of the line says */
+#define TOP_KEYS "top "
+#define TOP_KEYS_LEN (sizeof(TOP_KEYS) - 1)
+
 static int stats_process_lines(stats_session_t *session) {
     char *head, *tail;
     size_t len;
@@ -950,7 +1900,21 @@ static int stats_process_lines(stats_session_t *session) {
         memcpy(line_buffer + len, "\n\0", 2);
 
         if (len == 6 && strcmp(line_buffer, "status\n") == 0) {
-            stats_send_statistics(session);
+            stats_send_statistics(session, false, NULL);
+        } else if (len == 11 && strcmp(line_buffer, "status json\n") == 0) {
+            stats_send_statistics(session, true, NULL);
+        } else if (len == 15 && strcmp(line_buffer, "status prefixes\n") == 0) {
+            stats_send_prefixes(session);
+        } else if (len == 3 && strcmp(line_buffer, "top\n") == 0) {
+            stats_send_top(session, TOP_DEFAULT_KEYS);
+        } else if (strncmp(line_buffer, TOP_KEYS, TOP_KEYS_LEN) == 0) {
+            stats_send_top(session, strtoul(line_buffer + TOP_KEYS_LEN, NULL, 10));
+        } else if (strncmp(line_buffer, STATUS_BACKEND, STATUS_BACKEND_LEN) == 0) {
+            line_buffer[len] = '\0';
+            stats_send_statistics(session, false, line_buffer + STATUS_BACKEND_LEN);
+        } else if (strncmp(line_buffer, STATUS_JSON_BACKEND, STATUS_JSON_BACKEND_LEN) == 0) {
+            line_buffer[len] = '\0';
+            stats_send_statistics(session, true, line_buffer + STATUS_JSON_BACKEND_LEN);
         } else if (stats_relay_line(line_buffer, len, session->server, false) != 0) {
             return 1;
         }
@@ -961,7 +1925,25 @@ static int stats_process_lines(stats_session_t *session) {
 }
 
 void stats_session_destroy(stats_session_t *session) {
+    if (!session->closing && buffer_datacount(&session->output) > 0) {
+        // The socket is closed along with the reading side, finish
+        // sending the status on a copy of it
+        int sd = dup(session->sd);
+        if (sd >= 0) {
+            session->sd = sd;
+            session->closing = true;
+            ev_io_stop(session->server->loop, &session->write_watcher);
+            ev_io_set(&session->write_watcher, sd, EV_WRITE);
+            ev_io_start(session->server->loop, &session->write_watcher);
+            return;
+        }
+    }
+    ev_io_stop(session->server->loop, &session->write_watcher);
+    if (session->closing) {
+        close(session->sd);
+    }
     buffer_destroy(&session->buffer);
+    buffer_destroy(&session->output);
     free(session);
 }
 
@@ -1071,7 +2053,130 @@ udp_recv_err:
 }
 
 
+/* "SRSS", then the version of the snapshot layout */
+#define SNAPSHOT_MAGIC 0x53525353
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t groups;
+};
+
+int stats_server_snapshot(stats_server_t *server, FILE *out) {
+    struct snapshot_header header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, server->rings->size };
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        return -1;
+    }
+
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t *group = (stats_backend_group_t *)server->rings->data[i];
+        sampler_t *samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                  group->set_sampler };
+        for (int j = 0; j < 4; j++) {
+            // Each sampler is preceded by its length, so a new master
+            // without that sampler can skip it
+            uint64_t length = 0;
+            long start = ftell(out);
+            if (start < 0 || fwrite(&length, sizeof(length), 1, out) != 1) {
+                return -1;
+            }
+            if (samplers[j] == NULL) {
+                continue;
+            }
+            if (sampler_snapshot(samplers[j], out) != 0) {
+                return -1;
+            }
+            long end = ftell(out);
+            length = end - start - sizeof(length);
+            if (end < 0 || fseek(out, start, SEEK_SET) != 0 ||
+                    fwrite(&length, sizeof(length), 1, out) != 1 || fseek(out, end, SEEK_SET) != 0) {
+                return -1;
+            }
+            stats_debug_log("snapshot: group %d %s sampler, %" PRIu64 " bytes", i, sampler_names[j], length);
+        }
+    }
+    return fflush(out) == 0 ? 0 : -1;
+}
+
+void stats_server_handed_over(stats_server_t *server) {
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t *group = (stats_backend_group_t *)server->rings->data[i];
+        sampler_t *samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                  group->set_sampler };
+        for (int j = 0; j < 4; j++) {
+            if (samplers[j] != NULL) {
+                sampler_handed_over(samplers[j]);
+            }
+        }
+    }
+}
+
+int stats_server_restore(stats_server_t *server, const char *data, size_t len) {
+    struct snapshot_header header;
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        stats_error_log("snapshot: unknown snapshot version, ignoring it");
+        return -1;
+    }
+    if (header.groups != server->rings->size) {
+        stats_error_log("snapshot: taken with %u groups, not %zu, ignoring it",
+                header.groups, server->rings->size);
+        return -1;
+    }
+
+    // Check the framing of every sampler before restoring any of them
+    size_t offset = sizeof(header);
+    for (int i = 0; i < server->rings->size * 4; i++) {
+        uint64_t length;
+        if (len - offset < sizeof(length)) {
+            stats_error_log("snapshot: truncated");
+            return -1;
+        }
+        memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+        if (len - offset < length) {
+            stats_error_log("snapshot: truncated");
+            return -1;
+        }
+        offset += length;
+    }
+
+    offset = sizeof(header);
+    for (int i = 0; i < server->rings->size; i++) {
+        stats_backend_group_t *group = (stats_backend_group_t *)server->rings->data[i];
+        sampler_t *samplers[] = { group->count_sampler, group->timer_sampler, group->gauge_sampler,
+                                  group->set_sampler };
+        for (int j = 0; j < 4; j++) {
+            uint64_t length;
+            memcpy(&length, data + offset, sizeof(length));
+            offset += sizeof(length);
+            if (length > 0 && samplers[j] != NULL) {
+                if (sampler_restore(samplers[j], data + offset, length) != length) {
+                    stats_error_log("snapshot: malformed group %d %s sampler", i, sampler_names[j]);
+                    return -1;
+                }
+                stats_log("snapshot: restored group %d %s sampler, %zu keys sampling", i,
+                        sampler_names[j], (size_t)sampler_active(samplers[j]));
+            }
+            offset += length;
+        }
+    }
+    return 0;
+}
+
 void stats_server_destroy(stats_server_t *server) {
+    if (server->config->sampling_high_watermark > 0) {
+        ev_timer_stop(server->loop, &server->sampling_controller);
+    }
+    ev_timer_stop(server->loop, &server->backend_sampler);
+    if (server->config->top_keys > 0) {
+        ev_timer_stop(server->loop, &server->top_rotator);
+    }
+
     for (int i = 0; i < server->rings->size; i++) {
         stats_backend_group_t* group = (stats_backend_group_t*)server->rings->data[i];
         group_destroy(server->loop, group);
@@ -8,12 +8,18 @@
 #include "validate.h"
 #include "json_config.h"
 
+#include "./blocklist.h"
 #include "./filter.h"
+#include "./filter_cache.h"
 #include "./hashring.h"
+#include "./latency.h"
+#include "./loopstats.h"
 #include "./buffer.h"
 #include "./log.h"
 #include "./stats.h"
 #include "./tcpclient.h"
+#include "./topkeys.h"
+#include "./udpserver.h"
 #include "./validate.h"
 #include "sampling.h"
 
@@ -22,6 +28,9 @@
 
 #define STATSD_MONITORING_FLUSH_INTERVAL 1
 
+/* At most this many halvings of a sampling threshold, 256 times fewer lines */
+#define SAMPLING_MAX_SHIFT 8
+
 /**
  * Opaque callback reference
  */
@@ -41,6 +50,17 @@ typedef struct {
 	uint64_t relayed_lines;
 	uint64_t dropped_lines;
 	int failing;
+
+	/** halvings of the sampling thresholds of keys sent here */
+	int sampling_shift;
+	/** queue depth and bytes sent at the last controller tick */
+	size_t last_queue_depth;
+	uint64_t last_bytes_sent;
+	/** bytes sent per second, as of the last controller tick */
+	uint64_t drain_rate;
+
+	/** heaviest keys sent here, NULL unless top_keys is set */
+	topkeys_t *top;
 } stats_backend_t;
 
 typedef struct {
@@ -51,8 +71,17 @@ typedef struct {
 
 	filter_t* ingress_filter;
 	filter_t* ingress_blacklist;
+	/** remembers blacklist/filter outcomes per key, NULL if disabled */
+	filter_cache_t* filter_cache;
+	/** exact keys to drop, NULL if no blocklist_file is configured */
+	blocklist_t* blocklist;
+	const char* blocklist_file;
+	ev_stat blocklist_watcher;
 	hashring_t ring;
 
+	/** buckets of all samplers below, keyed by metric name */
+	sampler_table_t* sampler_table;
+
 	sampler_t* count_sampler;
 
 	sampler_t* timer_sampler;
@@ -60,6 +89,8 @@ typedef struct {
 	/** just to keep track of unique gauges, no actual sampling */
 	sampler_t* gauge_sampler;
 
+	sampler_t* set_sampler;
+
 	/** dedicated event timer for timer sampling */
 	ev_timer timer_sampling_watcher;
 
@@ -69,11 +100,24 @@ typedef struct {
 	/** dedicated event timer for counter roll-ups */
 	ev_timer gauge_sampling_watcher;
 
+	/** dedicated event timer for set roll-ups */
+	ev_timer set_sampling_watcher;
+
+	/** counters and gauges are all aggregated, on wall clock aligned windows */
+	bool aggregate_all;
+
+	/** slices the samplers' keys are flushed in, spread over each window */
+	int flush_slices;
+
 	/* Stats */
 	uint64_t relayed_lines;
 	uint64_t filtered_lines;
 	uint64_t rejected_lines;
+	uint64_t blocklisted_lines;
 	uint64_t flagged_lines;
+
+	/** heaviest keys relayed by the group, NULL unless top_keys is set */
+	topkeys_t *top;
 } stats_backend_group_t;
 
 struct stats_server_t {
@@ -100,12 +144,34 @@ struct stats_server_t {
 
 	/** timer to flush health stats to central cluster **/
 	ev_timer stats_flusher;
+
+	/** adjusts the backends' sampling shifts, see sampling_high_watermark */
+	ev_timer sampling_controller;
+
+	/** samples the backends' TCP_INFO */
+	ev_timer backend_sampler;
+
+	/** the UDP listeners, for their drop counters, NULL until bound */
+	udpserver_t *udp;
+
+	/** ends the window of the top keys, see top_window */
+	ev_timer top_rotator;
+	/** lines left before the next one counted in the top keys */
+	int top_countdown;
+	/** top keys windows ended so far, and when the first one began */
+	uint64_t top_windows;
+	time_t top_started;
 };
 
 typedef struct {
 	struct stats_server_t *server;
 	buffer_t buffer;
 	int sd;
+	/** status responses waiting for the socket to be writable */
+	buffer_t output;
+	ev_io write_watcher;
+	/** the client is gone, free the session once output is sent */
+	bool closing;
 } stats_session_t;
 
 typedef struct stats_server_t stats_server_t;
@@ -121,8 +187,36 @@ static int stats_relay_line(const char *line, size_t len, stats_server_t *ss, bo
 
 size_t stats_num_backends(stats_server_t *server);
 
+/**
+ * One tick of the adaptive sampling controller: lower the sampling
+ * thresholds of keys routed to backends whose send queue is above the
+ * high watermark and not draining, one halving per tick, and raise them
+ * back one step per tick below the low watermark.
+ */
+void stats_adjust_sampling(stats_server_t *server);
+
 void stats_server_destroy(stats_server_t *server);
 
+/**
+ * Write the sampler state of every group to out, for a new master to
+ * pick up with stats_server_restore() on a hot restart. In window sums
+ * are written with it, see sampler_snapshot(). Returns 0 on success.
+ */
+int stats_server_snapshot(stats_server_t *server, FILE *out);
+
+/**
+ * Clear the in window sums of the last snapshot, once the new master has
+ * confirmed restoring it. Until then they are still flushed here.
+ */
+void stats_server_handed_over(stats_server_t *server);
+
+/**
+ * Load a snapshot of len bytes taken by stats_server_snapshot(). A
+ * snapshot from a different version or number of groups, or a truncated
+ * one, is ignored. Returns 0 on success.
+ */
+int stats_server_restore(stats_server_t *server, const char *data, size_t len);
+
 // ctx is a (void *) cast of the stats_server_t instance.
 void *stats_connection(int sd, void *ctx);
 
@@ -130,4 +224,10 @@ int stats_recv(int sd, void *data, void *ctx);
 
 int stats_udp_recv(int sd, void *data);
 
+/**
+ * Serve the counters of the relay in the OpenMetrics text format at
+ * /metrics, see httpserver_handler. data is the stats_server_t.
+ */
+int stats_http_handler(const char *path, buffer_t *body, const char **content_type, void *data);
+
 #endif  // STATSRELAY_STATS_H
@@ -1,5 +1,6 @@
 #include "tcpclient.h"
 #include "buffer.h"
+#include "latency.h"
 #include "log.h"
 
 #include <errno.h>
@@ -41,6 +42,45 @@ static void tcpclient_set_state(tcpclient_t *client, enum tcpclient_state state)
     client->state = state;
 }
 
+/* Account for bytes taken off the head of the send queue */
+static void tcpclient_dequeued(tcpclient_t *client, size_t len) {
+    client->dequeued += len;
+    if (buffer_datacount(&client->send_queue) == 0) {
+        client->mark_count = 0;
+        return;
+    }
+    // Drop the marks of bytes all gone, the head mark then covers the oldest byte
+    while (client->mark_count > 1 &&
+            client->marks[(client->mark_head + 1) % TCPCLIENT_AGE_MARKS].offset <= client->dequeued) {
+        client->mark_head = (client->mark_head + 1) % TCPCLIENT_AGE_MARKS;
+        client->mark_count--;
+    }
+}
+
+/* Account for bytes added to the tail of the send queue */
+static void tcpclient_enqueued(tcpclient_t *client, size_t len) {
+    ev_tstamp now = ev_now(client->loop);
+    if (client->mark_count == 0) {
+        client->mark_head = 0;
+    }
+    // When marks run out, newer bytes are taken to be as old as the last mark
+    if (client->mark_count == 0 ||
+            (client->mark_count < TCPCLIENT_AGE_MARKS &&
+             now - client->marks[(client->mark_head + client->mark_count - 1) % TCPCLIENT_AGE_MARKS].time
+                 >= TCPCLIENT_AGE_RESOLUTION)) {
+        tcpclient_mark_t *mark = &client->marks[(client->mark_head + client->mark_count) % TCPCLIENT_AGE_MARKS];
+        mark->offset = client->enqueued;
+        mark->time = now;
+        client->mark_count++;
+    }
+    client->enqueued += len;
+
+    size_t depth = buffer_datacount(&client->send_queue);
+    if (depth > client->queue_high_water) {
+        client->queue_high_water = depth;
+    }
+}
+
 static void tcpclient_connect_timeout(struct ev_loop *loop, struct ev_timer *watcher, int events) {
     tcpclient_t *client = (tcpclient_t *)watcher->data;
     if (client->connect_watcher.started) {
@@ -106,6 +146,17 @@ int tcpclient_init(tcpclient_t *client,
     client->connect_watcher.started = false;
     client->read_watcher.started = false;
     client->write_watcher.started = false;
+
+    client->sends = 0;
+    client->send_eagain = 0;
+    client->connects = 0;
+    client->disconnects = 0;
+    client->queue_high_water = 0;
+    client->enqueued = 0;
+    client->dequeued = 0;
+    client->mark_head = 0;
+    client->mark_count = 0;
+    memset(&client->tcp_info, 0, sizeof(client->tcp_info));
     return 0;
 }
 
@@ -140,6 +191,7 @@ static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, in
         }
         close(client->sd);
         free(buf);
+        client->disconnects++;
         tcpclient_set_state(client, STATE_BACKOFF);
         client->last_error = time(NULL);
         client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
@@ -152,6 +204,7 @@ static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, in
         ev_io_stop(client->loop, &client->write_watcher.watcher);
         close(client->sd);
         free(buf);
+        client->disconnects++;
         tcpclient_set_state(client, STATE_INIT);
         client->last_error = time(NULL);
         client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
@@ -172,14 +225,25 @@ static void tcpclient_write_event(struct ev_loop *loop, struct ev_io *watcher, i
     sendq = &client->send_queue;
     ssize_t buf_len = buffer_datacount(sendq);
     if (buf_len > 0) {
+        bool timed = latency_sample();
+        uint64_t start = timed ? latency_ticks() : 0;
         ssize_t send_len = send(client->sd, sendq->head, buf_len, 0);
+        if (timed) {
+            latency_record(LATENCY_WRITE, start);
+        }
+        client->sends++;
         stats_debug_log("tcpclient: sent %zd of %zd bytes to backend client %s via fd %d",
                 send_len, buf_len, client->name, client->sd);
+        if (send_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client->send_eagain++;
+            return;
+        }
         if (send_len < 0) {
             stats_error_log("tcpclient[%s]: Error from send: %s", client->name, strerror(errno));
             ev_io_stop(client->loop, &client->write_watcher.watcher);
             ev_io_stop(client->loop, &client->read_watcher.watcher);
             client->last_error = time(NULL);
+            client->disconnects++;
             tcpclient_set_state(client, STATE_BACKOFF);
             close(client->sd);
             /* consume the rest of any line at the buffer head to avoid sending truncated lines
@@ -188,7 +252,9 @@ static void tcpclient_write_event(struct ev_loop *loop, struct ev_io *watcher, i
                This is largely a hack as tcpclient is unaware of the underlying protocol framing
                and can't handle errant conditions on a frame by frame basis.
             */
+            size_t queued = buffer_datacount(sendq);
             buffer_consume_until(sendq, '\n');
+            tcpclient_dequeued(client, queued - buffer_datacount(sendq));
             client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
             return;
         } else {
@@ -197,6 +263,7 @@ static void tcpclient_write_event(struct ev_loop *loop, struct ev_io *watcher, i
                 stats_error_log("tcpclient[%s]: Unable to consume send queue", client->name);
                 return;
             }
+            tcpclient_dequeued(client, send_len);
             size_t qsize = buffer_datacount(&client->send_queue);
             if (client->failing && qsize < client->config->max_send_queue) {
                 stats_log("tcpclient[%s]: client recovered from full queue, send queue is now %zd bytes",
@@ -240,6 +307,7 @@ static void tcpclient_connected(struct ev_loop *loop, struct ev_io *watcher, int
     }
 
     tcpclient_set_state(client, STATE_CONNECTED);
+    client->connects++;
 
     // Setup events for recv
     client->read_watcher.started = true;
@@ -374,6 +442,7 @@ void tcpclient_disconnect(tcpclient_t *client) {
     ev_io_stop(client->loop, &client->read_watcher.watcher);
     ev_io_stop(client->loop, &client->write_watcher.watcher);
     close(client->sd);
+    client->disconnects++;
     tcpclient_set_state(client, STATE_INIT);
     client->last_error = time(NULL);
     client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
@@ -416,6 +485,7 @@ int tcpclient_sendall(tcpclient_t *client, const char *buf, size_t len) {
     }
     memcpy(buffer_tail(sendq), buf, len);
     buffer_produced(sendq, len);
+    tcpclient_enqueued(client, len);
 
     if (client->state == STATE_CONNECTED) {
         client->write_watcher.started = true;
@@ -424,6 +494,37 @@ int tcpclient_sendall(tcpclient_t *client, const char *buf, size_t len) {
     return 0;
 }
 
+double tcpclient_queue_age(tcpclient_t *client) {
+    if (client->mark_count == 0 || buffer_datacount(&client->send_queue) == 0) {
+        return 0;
+    }
+    return ev_now(client->loop) - client->marks[client->mark_head].time;
+}
+
+void tcpclient_reset_high_water(tcpclient_t *client) {
+    client->queue_high_water = buffer_datacount(&client->send_queue);
+}
+
+void tcpclient_sample_tcp_info(tcpclient_t *client) {
+    memset(&client->tcp_info, 0, sizeof(client->tcp_info));
+#ifdef TCP_INFO
+    if (client->state != STATE_CONNECTED || client->socktype != SOCK_STREAM) {
+        return;
+    }
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(client->sd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        stats_debug_log("tcpclient[%s]: Unable to get TCP_INFO: %s", client->name, strerror(errno));
+        return;
+    }
+    client->tcp_info.rtt_us = info.tcpi_rtt;
+    client->tcp_info.rttvar_us = info.tcpi_rttvar;
+    client->tcp_info.retransmits = info.tcpi_total_retrans;
+    client->tcp_info.unacked = info.tcpi_unacked;
+    client->tcp_info.cwnd = info.tcpi_snd_cwnd;
+#endif
+}
+
 void tcpclient_destroy(tcpclient_t *client) {
     if (client == NULL) {
         return;
@@ -20,6 +20,13 @@
 #define TCPCLIENT_RECV_BUFFER 65536
 #define TCPCLIENT_SEND_QUEUE 134217728	// 128MB
 #define TCPCLIENT_NAME_LEN 256
+/* Enqueue times kept to estimate the age of the send queue, at most one per resolution seconds */
+#ifndef TCPCLIENT_AGE_MARKS
+#define TCPCLIENT_AGE_MARKS 64
+#endif
+#ifndef TCPCLIENT_AGE_RESOLUTION
+#define TCPCLIENT_AGE_RESOLUTION 0.1
+#endif
 
 enum tcpclient_event {
     EVENT_CONNECTED,
@@ -48,6 +55,21 @@ typedef struct io_watcher_t {
     bool started;
 } io_watcher_t;
 
+/* Queue offset of the first byte enqueued at a time */
+typedef struct tcpclient_mark_t {
+    uint64_t offset;
+    ev_tstamp time;
+} tcpclient_mark_t;
+
+/* Kernel view of the connection, from TCP_INFO */
+typedef struct tcpclient_tcp_info_t {
+    uint32_t rtt_us;
+    uint32_t rttvar_us;
+    uint32_t retransmits;
+    uint32_t unacked;
+    uint32_t cwnd;
+} tcpclient_tcp_info_t;
+
 typedef struct tcpclient_t {
     tcpclient_callback callback_connect;
     tcpclient_callback callback_sent;
@@ -77,6 +99,23 @@ typedef struct tcpclient_t {
     int socktype;
 
     struct proto_config *config;
+
+    /* Stats */
+    uint64_t sends;
+    /* sends that found the socket buffer full */
+    uint64_t send_eagain;
+    uint64_t connects;
+    uint64_t disconnects;
+    /* deepest the send queue has been since tcpclient_reset_high_water() */
+    size_t queue_high_water;
+    /* bytes ever put on and taken off the send queue, sent or dropped */
+    uint64_t enqueued;
+    uint64_t dequeued;
+    tcpclient_mark_t marks[TCPCLIENT_AGE_MARKS];
+    int mark_head;
+    int mark_count;
+    /* as of the last tcpclient_sample_tcp_info() */
+    tcpclient_tcp_info_t tcp_info;
 } tcpclient_t;
 
 int tcpclient_init(tcpclient_t *client,
@@ -98,5 +137,19 @@ int tcpclient_sendall(tcpclient_t *client,
         const char *buf,
         size_t len);
 
+/**
+ * Seconds the oldest byte of the send queue has waited, to within
+ * TCPCLIENT_AGE_RESOLUTION. 0 if the queue is empty.
+ */
+double tcpclient_queue_age(tcpclient_t *client);
+
+void tcpclient_reset_high_water(tcpclient_t *client);
+
+/**
+ * Read the kernel's TCP_INFO for a connected TCP client into
+ * client->tcp_info, zeroed otherwise
+ */
+void tcpclient_sample_tcp_info(tcpclient_t *client);
+
 void tcpclient_destroy(tcpclient_t *client);
 #endif  // STATSRELAY_TCPCLIENT_H
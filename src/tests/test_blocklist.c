@@ -0,0 +1,147 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../blocklist.h"
+#include "../hashlib.h"
+
+static bool contains(blocklist_t *bl, const char *key) {
+    return blocklist_contains(bl, key, strlen(key), stats_hash_key(key, strlen(key)));
+}
+
+void test_parse() {
+    const char *text =
+        "# keys from the bad deploy\n"
+        "foo.bar.baz\n"
+        "\n"
+        "  spaced.key\t\r\n"
+        "foo.bar.baz\n"
+        "last.key";
+    blocklist_t *bl;
+    assert(blocklist_parse(&bl, text, strlen(text)) == 0);
+    assert(blocklist_size(bl) == 3);
+
+    assert(contains(bl, "foo.bar.baz"));
+    assert(contains(bl, "spaced.key"));
+    assert(contains(bl, "last.key"));
+    assert(!contains(bl, "foo.bar"));
+    assert(!contains(bl, "foo.bar.baz.qux"));
+    assert(!contains(bl, "# keys from the bad deploy"));
+    assert(!contains(bl, ""));
+
+    blocklist_destroy(bl);
+
+    assert(blocklist_parse(&bl, "", 0) == 0);
+    assert(blocklist_size(bl) == 0);
+    assert(!contains(bl, "anything"));
+    blocklist_destroy(bl);
+}
+
+/* Header words and slot layout of a compiled blocklist */
+enum { NUM_KEYS = 2, NUM_SLOTS = 3, BLOOM_WORDS = 4, BLOOM_HASHES = 5, HEADER_WORDS = 8, SLOT_WORDS = 4 };
+
+/**
+ * Copy a compiled file with a few of its words changed, and check the
+ * copy is refused
+ */
+static void check_rejected(const char *path, void (*corrupt)(uint32_t *words)) {
+    FILE *f = fopen(path, "r");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    uint32_t *words = malloc(size);
+    assert(fread(words, 1, size, f) == (size_t)size);
+    fclose(f);
+
+    corrupt(words);
+
+    char bad_path[64];
+    snprintf(bad_path, sizeof(bad_path), "%s.bad", path);
+    f = fopen(bad_path, "w");
+    assert(fwrite(words, 1, size, f) == (size_t)size);
+    fclose(f);
+    free(words);
+
+    blocklist_t *bl;
+    assert(blocklist_load(&bl, bad_path) != 0);
+    unlink(bad_path);
+}
+
+static uint32_t *slots_of(uint32_t *words) {
+    return words + HEADER_WORDS + 2 * words[BLOOM_WORDS];
+}
+
+static void fewer_keys(uint32_t *words) {
+    words[NUM_KEYS]--;
+}
+
+/* Every slot taken, so a probe for a missing key would never stop */
+static void full_slots(uint32_t *words) {
+    uint32_t *slots = slots_of(words);
+    for (uint32_t i = 0; i < words[NUM_SLOTS]; i++) {
+        if (slots[i * SLOT_WORDS + 2] == 0) {
+            slots[i * SLOT_WORDS + 2] = 1;
+        }
+    }
+}
+
+static void many_hashes(uint32_t *words) {
+    words[BLOOM_HASHES] = 0xffffffff;
+}
+
+void test_save_and_map() {
+    char text_path[] = "/tmp/test_blocklist_XXXXXX";
+    int fd = mkstemp(text_path);
+    assert(fd >= 0);
+    FILE *f = fdopen(fd, "w");
+    for (int i = 0; i < 10000; i++) {
+        fprintf(f, "bad.deploy.metric.%d\n", i);
+    }
+    fclose(f);
+
+    blocklist_t *text;
+    assert(blocklist_load(&text, text_path) == 0);
+    assert(blocklist_size(text) == 10000);
+
+    char bin_path[64];
+    snprintf(bin_path, sizeof(bin_path), "%s.bl", text_path);
+    assert(blocklist_save(text, bin_path) == 0);
+
+    blocklist_t *mapped;
+    assert(blocklist_load(&mapped, bin_path) == 0);
+    assert(blocklist_size(mapped) == 10000);
+
+    char key[64];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "bad.deploy.metric.%d", i);
+        assert(contains(text, key) == (i < 10000));
+        assert(contains(mapped, key) == (i < 10000));
+    }
+
+    blocklist_destroy(text);
+    blocklist_destroy(mapped);
+
+    /* Slots or Bloom probes that do not match the header are rejected */
+    check_rejected(bin_path, fewer_keys);
+    check_rejected(bin_path, full_slots);
+    check_rejected(bin_path, many_hashes);
+
+    /* A truncated compiled file is rejected rather than mapped */
+    assert(truncate(bin_path, 100) == 0);
+    assert(blocklist_load(&mapped, bin_path) != 0);
+
+    unlink(text_path);
+    unlink(bin_path);
+}
+
+int main(int argc, char **argv) {
+    test_parse();
+    test_save_and_map();
+    return 0;
+}
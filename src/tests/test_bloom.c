@@ -0,0 +1,57 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../bloom.h"
+#include "../hashmap.h"
+
+static bool check_add(bloom_t *bloom, const char *key) {
+    return bloom_check_add(bloom, hashmap_hash(key, strlen(key)));
+}
+
+void test_no_false_negatives() {
+    bloom_t *bloom;
+    assert(bloom_init(&bloom, 1000) == 0);
+    char key[64];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "app.requests.%d.count", i);
+        check_add(bloom, key);
+    }
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "app.requests.%d.count", i);
+        assert(check_add(bloom, key));
+    }
+
+    bloom_clear(bloom);
+    assert(!check_add(bloom, "app.requests.0.count"));
+    assert(check_add(bloom, "app.requests.0.count"));
+    bloom_destroy(bloom);
+}
+
+void test_false_positive_rate() {
+    bloom_t *bloom;
+    assert(bloom_init(&bloom, 10000) == 0);
+    char key[64];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "app.requests.%d.count", i);
+        check_add(bloom, key);
+    }
+    int false_positives = 0;
+    // probing adds the probed keys too, so keep them few
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "app.other.%d.count", i);
+        false_positives += check_add(bloom, key);
+    }
+    printf("bloom: %d false positives in 1000, %zu bytes\n", false_positives, bloom_memory(bloom));
+    // the filter holds more bits than needed, rounding up to a power of two
+    assert(false_positives < 20);
+    bloom_destroy(bloom);
+}
+
+int main(int argc, char** argv) {
+    test_no_false_negatives();
+    test_false_positive_rate();
+    return 0;
+}
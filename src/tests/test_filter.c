@@ -0,0 +1,101 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../filter.h"
+
+static const char *simple_patterns[] = {
+    "^foo\\.",
+    "^(foo\\.|bar\\.baz\\.|qux)",
+    "^(?:servers\\.(web|db)\\.|apps\\.)",
+    "\\.count$",
+    "(\\.p99|\\.p50)$",
+    "^exact\\.name$",
+    "^(a|b)\\.(c|d)$",
+    "^foo\\..*\\.bar$",
+    "^foo.*bar.*baz",
+    "baz",
+    "^.*\\.lower$",
+    "^$",
+    "^foo|\\.bar$|^exact$|mid.*dle",
+    NULL
+};
+
+static const char *complex_patterns[] = {
+    "^foo[0-9]+",
+    "^foo\\d",
+    "^fo?o",
+    "^f.o",
+    "(^foo|bar)",
+    "^(foo)+",
+    NULL
+};
+
+static const char *inputs[] = {
+    "", "foo", "foo.", "foo.bar", "foo.x.bar", "foo.bar.baz", "foobar",
+    "bar.baz.qux", "bar.baz", "qux", "quxx", "xqux",
+    "servers.web.cpu", "servers.db.cpu", "servers.cache.cpu", "apps.x",
+    "requests.count", "requests.counter", "latency.p99", "latency.p50", "latency.p95",
+    "exact.name", "exact.name.more", "exact", "a.c", "b.d", "a.d.e", "c.a",
+    "foo.anything.bar", "foo.bar.x", "fooXbarYbaz", "foobaz", "nobaz",
+    "x.lower", "lower", "middle", "mid.dle", "midle", "dlemid",
+    NULL
+};
+
+static void assert_same_as_pcre(const char *pattern) {
+    filter_t *rules;
+    filter_t *re;
+    assert(filter_rules_create(&rules, pattern, NULL) == 0);
+    assert(filter_re_create(&re, pattern, NULL) == 0);
+
+    for (int i = 0; inputs[i] != NULL; i++) {
+        bool expected = filter_exec(re, inputs[i], strlen(inputs[i]));
+        bool actual = filter_exec(rules, inputs[i], strlen(inputs[i]));
+        if (expected != actual) {
+            fprintf(stderr, "pattern '%s' input '%s': pcre %d rules %d\n",
+                    pattern, inputs[i], expected, actual);
+        }
+        assert(expected == actual);
+    }
+
+    filter_free(rules);
+    filter_free(re);
+}
+
+void test_rules_match_pcre() {
+    for (int i = 0; simple_patterns[i] != NULL; i++) {
+        assert_same_as_pcre(simple_patterns[i]);
+    }
+}
+
+void test_complex_falls_back() {
+    filter_t *filter;
+    for (int i = 0; complex_patterns[i] != NULL; i++) {
+        assert(filter_rules_create(&filter, complex_patterns[i], NULL) == 1);
+        assert(filter_create(&filter, complex_patterns[i], NULL) == 0);
+        filter_free(filter);
+    }
+    assert(filter_create(&filter, "^foo(", NULL) != 0);
+}
+
+void test_chain() {
+    filter_t *first;
+    filter_t *second;
+    assert(filter_create(&first, "^foo\\.", NULL) == 0);
+    assert(filter_create(&second, "\\.bar$", first) == 0);
+
+    assert(filter_exec(second, "foo.bar", 7) == true);
+    assert(filter_exec(second, "foo.baz", 7) == false);
+    assert(filter_exec(second, "qux.bar", 7) == false);
+
+    filter_free(second);
+}
+
+int main(int argc, char **argv) {
+    test_rules_match_pcre();
+    test_complex_falls_back();
+    test_chain();
+    return 0;
+}
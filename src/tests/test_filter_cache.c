@@ -0,0 +1,99 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../filter_cache.h"
+#include "../hashlib.h"
+
+static uint32_t key_hash(const char *key) {
+    return stats_hash_key(key, strlen(key));
+}
+
+void test_cache_hit_miss() {
+    filter_cache_t *cache;
+    assert(filter_cache_init(&cache, 16) == 0);
+    assert(filter_cache_capacity(cache) == 16);
+
+    const char *key = "foo.bar.baz";
+    filter_cache_decision d;
+
+    assert(filter_cache_get(cache, key, strlen(key), key_hash(key), &d) == false);
+    assert(filter_cache_misses(cache) == 1);
+
+    filter_cache_put(cache, key, strlen(key), key_hash(key), FILTER_CACHE_REJECTED);
+    assert(filter_cache_get(cache, key, strlen(key), key_hash(key), &d) == true);
+    assert(d == FILTER_CACHE_REJECTED);
+    assert(filter_cache_hits(cache) == 1);
+
+    filter_cache_destroy(cache);
+}
+
+void test_cache_verifies_key() {
+    filter_cache_t *cache;
+    assert(filter_cache_init(&cache, 16) == 0);
+
+    /* Same hash, different key: must not be answered from the cache */
+    filter_cache_put(cache, "foo", 3, 42, FILTER_CACHE_FILTERED);
+    filter_cache_decision d;
+    assert(filter_cache_get(cache, "bar", 3, 42, &d) == false);
+    assert(filter_cache_get(cache, "foo", 3, 42, &d) == true);
+    assert(d == FILTER_CACHE_FILTERED);
+
+    filter_cache_destroy(cache);
+}
+
+void test_cache_bounded() {
+    filter_cache_t *cache;
+    assert(filter_cache_init(&cache, 64) == 0);
+
+    char buf[100];
+    filter_cache_decision d;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key.%d", i);
+        filter_cache_put(cache, buf, strlen(buf), key_hash(buf), FILTER_CACHE_PASS);
+    }
+
+    int hits = 0;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key.%d", i);
+        if (filter_cache_get(cache, buf, strlen(buf), key_hash(buf), &d)) {
+            assert(d == FILTER_CACHE_PASS);
+            hits++;
+        }
+    }
+    assert(hits > 0);
+    assert(hits <= 64);
+
+    /* The most recently stored key is always present */
+    assert(filter_cache_get(cache, buf, strlen(buf), key_hash(buf), &d) == true);
+
+    filter_cache_clear(cache);
+    assert(filter_cache_get(cache, buf, strlen(buf), key_hash(buf), &d) == false);
+
+    filter_cache_destroy(cache);
+}
+
+void test_cache_long_keys_skipped() {
+    filter_cache_t *cache;
+    assert(filter_cache_init(&cache, 16) == 0);
+
+    char key[FILTER_CACHE_MAX_KEY_LEN + 2];
+    memset(key, 'a', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+
+    filter_cache_decision d;
+    filter_cache_put(cache, key, strlen(key), key_hash(key), FILTER_CACHE_PASS);
+    assert(filter_cache_get(cache, key, strlen(key), key_hash(key), &d) == false);
+
+    filter_cache_destroy(cache);
+}
+
+int main(int argc, char **argv) {
+    test_cache_hit_miss();
+    test_cache_verifies_key();
+    test_cache_bounded();
+    test_cache_long_keys_skipped();
+    return 0;
+}
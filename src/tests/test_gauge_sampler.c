@@ -13,7 +13,8 @@ const char* g1n = "foo";
 const char* g2 = "bar:2|g";
 const char* g2n = "bar";
 
-static void print_callback(void* data, const char* key, const char* line, int len) {
+static void print_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
     char* expect = (char*)data;
     printf(" Expect: %s Got: %s \n", expect, line);
     assert(strcmp(line, expect) == 0);
@@ -28,7 +29,7 @@ int main(int argc, char** argv) {
     assert(g2_res.type == METRIC_GAUGE);
 
     sampler_t *sampler = NULL;
-    sampler_init(&sampler, 10, 10, 10, 10, false, -1, -1);
+    sampler_init(&sampler, NULL, METRIC_GAUGE, 10, 10, 10, 10, false, -1, -1);
     assert(sampler != NULL);
 
     // the expiry timer watcher must not be initialized
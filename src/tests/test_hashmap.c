@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "../hashmap.h"
 
 static int print_callback(void* _s, const char* key, void* _value, void* metadata) {
@@ -243,6 +246,205 @@ void test_map_put_grow() {
     assert(res == 0);
 }
 
+static int delete_odd_callback(void* _s, const char* key, void* _value, void* metadata) {
+    int *v = (int *)_s;
+    *v += 1;
+    return ((long)_value & 1) ? HASHMAP_ITER_DELETE : HASHMAP_ITER_CONTINUE;
+}
+
+void test_map_iter_delete() {
+    hashmap *map;
+    int res = hashmap_init(64, &map);
+    assert(res == 0);
+
+    char buf[100];
+    void *out;
+    for (long i = 0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "test%ld", i);
+        assert(hashmap_put(map, (char*)buf, (void*)i, NULL) == 1);
+    }
+
+    // Every key is visited exactly once even as entries shift back
+    int val = 0;
+    assert(hashmap_iter(map, delete_odd_callback, (void*)&val) == 0);
+    assert(val == 1000);
+    assert(hashmap_size(map) == 500);
+
+    for (long i = 0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "test%ld", i);
+        assert(hashmap_get(map, (char*)buf, &out) == ((i & 1) ? -1 : 0));
+    }
+
+    res = hashmap_destroy(map);
+    assert(res == 0);
+}
+
+void test_map_long_keys() {
+    hashmap *map;
+    int res = hashmap_init(0, &map);
+    assert(res == 0);
+
+    char buf[200];
+    void *out;
+    for (long i = 0; i < 20000; i++) {
+        snprintf((char*)&buf, 200, "some.rather.long.metric.name.that.does.not.fit.inline.%ld", i);
+        assert(hashmap_put(map, (char*)buf, (void*)i, NULL) == 1);
+    }
+    assert(hashmap_compact(map) == 0);
+    // Deleting most keys lets the key arena compact, when asked to
+    for (long i = 0; i < 20000; i++) {
+        if (i % 10 != 0) {
+            snprintf((char*)&buf, 200, "some.rather.long.metric.name.that.does.not.fit.inline.%ld", i);
+            assert(hashmap_delete(map, (char*)buf) == 0);
+        }
+    }
+    assert(hashmap_size(map) == 2000);
+    assert(hashmap_compact(map) == 1);
+    assert(hashmap_compact(map) == 0);
+    for (long i = 0; i < 20000; i += 10) {
+        snprintf((char*)&buf, 200, "some.rather.long.metric.name.that.does.not.fit.inline.%ld", i);
+        assert(hashmap_get(map, (char*)buf, &out) == 0);
+        assert((long)out == i);
+    }
+
+    res = hashmap_destroy(map);
+    assert(res == 0);
+}
+
+void test_map_hashed() {
+    hashmap *map;
+    int res = hashmap_init(0, &map);
+    assert(res == 0);
+
+    // Colliding and zero hashes are told apart by the key
+    void *out;
+    assert(hashmap_put_hashed(map, "foo", 3, 0, (void*)1, NULL) == 1);
+    assert(hashmap_put_hashed(map, "bar", 3, 0, (void*)2, NULL) == 1);
+    assert(hashmap_put_hashed(map, "foo", 3, 0, (void*)3, NULL) == 0);
+    assert(hashmap_get_hashed(map, "foo", 3, 0, &out) == 0 && out == (void*)3);
+    assert(hashmap_get_hashed(map, "bar", 3, 0, &out) == 0 && out == (void*)2);
+    assert(hashmap_get_hashed(map, "baz", 3, 0, &out) == -1);
+    assert(hashmap_delete_hashed(map, "foo", 3, 0) == 0);
+    assert(hashmap_get_hashed(map, "bar", 3, 0, &out) == 0 && out == (void*)2);
+
+    // The plain API hashes with hashmap_hash
+    assert(hashmap_put(map, "qux", (void*)4, NULL) == 1);
+    assert(hashmap_get_hashed(map, "qux", 3, hashmap_hash("qux", 3), &out) == 0 && out == (void*)4);
+
+    // Deleting by value only removes the entry holding that value
+    assert(hashmap_put_hashed(map, "foo", 3, 0, (void*)5, NULL) == 1);
+    assert(hashmap_delete_value(map, 0, (void*)4) == -1);
+    assert(hashmap_delete_value(map, 0, (void*)5) == 0);
+    assert(hashmap_get_hashed(map, "foo", 3, 0, &out) == -1);
+    assert(hashmap_get_hashed(map, "bar", 3, 0, &out) == 0 && out == (void*)2);
+
+    res = hashmap_destroy(map);
+    assert(res == 0);
+}
+
+void test_map_incremental_resize() {
+    hashmap *map;
+    int res = hashmap_init(1024, &map);
+    assert(res == 0);
+    assert(hashmap_resize_progress(map) == 1.0);
+
+    char buf[100];
+    void *out;
+    bool saw_resize = false;
+    for (long i = 0; i < 100000; i++) {
+        snprintf((char*)&buf, 100, "test%ld", i);
+        assert(hashmap_put(map, (char*)buf, (void*)i, NULL) == 1);
+
+        double progress = hashmap_resize_progress(map);
+        assert(progress >= 0.0 && progress <= 1.0);
+        if (progress < 1.0) {
+            saw_resize = true;
+            // Every key is reachable and deletable mid-migration
+            for (long j = 0; j <= i; j += 97) {
+                snprintf((char*)&buf, 100, "test%ld", j);
+                assert(hashmap_get(map, (char*)buf, &out) == 0);
+                assert((long)out == j);
+            }
+            if (i % 3 == 0) {
+                snprintf((char*)&buf, 100, "test%ld", i);
+                assert(hashmap_delete(map, (char*)buf) == 0);
+                assert(hashmap_put(map, (char*)buf, (void*)i, NULL) == 1);
+            }
+        }
+        assert(hashmap_load_factor(map) <= 1.0);
+    }
+    assert(saw_resize);
+    assert(hashmap_size(map) == 100000);
+
+    int val = 0;
+    assert(hashmap_iter(map, print_callback, (void*)&val) == 0);
+    assert(val == 100000);
+
+    res = hashmap_destroy(map);
+    assert(res == 0);
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_map_benchmark() {
+    const int num_keys = 200000;
+    const int rounds = 10;
+    hashmap *map;
+    int res = hashmap_init(32768, &map);
+    assert(res == 0);
+
+    char (*keys)[64] = malloc(num_keys * sizeof(*keys));
+    uint32_t *hashes = malloc(num_keys * sizeof(uint32_t));
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(keys[i], 64, "servers.host-%d.requests.count", i);
+        hashes[i] = hashmap_hash(keys[i], strlen(keys[i]));
+    }
+
+    // Growth is incremental, so the slowest put stays close to the average
+    struct timespec start, put_start;
+    double worst_put = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_keys; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &put_start);
+        assert(hashmap_put(map, keys[i], (void*)(long)i, NULL) == 1);
+        double t = elapsed(&put_start);
+        if (t > worst_put) {
+            worst_put = t;
+        }
+    }
+    double put_time = elapsed(&start);
+
+    void *out;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            assert(hashmap_get(map, keys[i], &out) == 0);
+        }
+    }
+    double get_time = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            assert(hashmap_get_hashed(map, keys[i], strlen(keys[i]), hashes[i], &out) == 0);
+        }
+    }
+    double get_hashed_time = elapsed(&start);
+
+    printf("hashmap: %d keys, put %.0f ops/s (worst %.1f us), get %.0f ops/s, get_hashed %.0f ops/s\n",
+            num_keys, num_keys / put_time, worst_put * 1e6,
+            num_keys * rounds / get_time, num_keys * rounds / get_hashed_time);
+
+    free(keys);
+    free(hashes);
+    res = hashmap_destroy(map);
+    assert(res == 0);
+}
+
 int main(int argc, char **argv) {
 
     // 1. hashmap call with break
@@ -278,6 +480,21 @@ int main(int argc, char **argv) {
     // 11. put and get hashmap
     test_map_put_get();
 
+    // 12. delete while iterating
+    test_map_iter_delete();
+
+    // 13. keys stored outside the table
+    test_map_long_keys();
+
+    // 14. caller supplied hashes
+    test_map_hashed();
+
+    // 15. growth spread over puts
+    test_map_incremental_resize();
+
+    // 16. throughput
+    test_map_benchmark();
+
     return 0;
 }
 
@@ -0,0 +1,70 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../hll.h"
+
+/* splitmix64, a stand in for a well mixed member hash */
+static uint64_t mix(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void test_empty() {
+    hll_t hll;
+    hll_init(&hll);
+    assert(hll_count(&hll) == 0);
+}
+
+void test_duplicates() {
+    hll_t hll;
+    hll_init(&hll);
+    for (int round = 0; round < 100; round++) {
+        for (uint64_t i = 0; i < 50; i++) {
+            hll_add(&hll, mix(i));
+        }
+    }
+    // linear counting is nearly exact this far below the register count
+    assert(llabs((long long)hll_count(&hll) - 50) <= 2);
+}
+
+void test_accuracy() {
+    uint64_t sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        hll_t hll;
+        hll_init(&hll);
+        for (uint64_t i = 0; i < sizes[s]; i++) {
+            hll_add(&hll, mix(i + sizes[s] * 7));
+        }
+        double error = fabs((double)hll_count(&hll) - sizes[s]) / sizes[s];
+        printf("hll: %llu distinct, error %.4f\n", (unsigned long long)sizes[s], error);
+        // four standard errors
+        assert(error < 4 * 1.04 / sqrt(HLL_REGISTERS));
+    }
+}
+
+void test_merge() {
+    hll_t a, b, both;
+    hll_init(&a);
+    hll_init(&b);
+    hll_init(&both);
+    for (uint64_t i = 0; i < 20000; i++) {
+        hll_add(i < 12000 ? &a : &b, mix(i));
+        hll_add(&both, mix(i));
+    }
+    hll_merge(&a, &b);
+    assert(hll_count(&a) == hll_count(&both));
+}
+
+int main(int argc, char** argv) {
+    test_empty();
+    test_duplicates();
+    test_accuracy();
+    test_merge();
+    return 0;
+}
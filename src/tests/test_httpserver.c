@@ -0,0 +1,169 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "../httpserver.h"
+#include "../stats.h"
+
+static struct ev_loop *loop;
+static struct sockaddr_in server_addr;
+
+/* Send a request and run the loop until the server closes the connection */
+static char *http_request(const char *request, size_t len) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sd >= 0);
+    assert(connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0);
+    assert(fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) == 0);
+    assert(send(sd, request, len, 0) == (ssize_t)len);
+
+    size_t size = 1 << 16, got = 0;
+    char *response = malloc(size);
+    assert(response != NULL);
+    for (int i = 0; i < 10000; i++) {
+        ev_run(loop, EVRUN_NOWAIT);
+        ssize_t n = recv(sd, response + got, size - got - 1, 0);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            assert(errno == EAGAIN || errno == EWOULDBLOCK);
+            usleep(1000);
+            continue;
+        }
+        got += n;
+        if (got == size - 1) {
+            size *= 2;
+            response = realloc(response, size);
+            assert(response != NULL);
+        }
+    }
+    response[got] = '\0';
+    close(sd);
+    return response;
+}
+
+static char *http_get(const char *request) {
+    return http_request(request, strlen(request));
+}
+
+/* Check a response's status line, returning its body */
+static const char *http_body(const char *response, const char *status) {
+    assert(strncmp(response, status, strlen(status)) == 0);
+    const char *body = strstr(response, "\r\n\r\n");
+    assert(body != NULL);
+    body += 4;
+    const char *length = strstr(response, "Content-Length: ");
+    assert(length != NULL && length < body);
+    assert(strtoul(length + strlen("Content-Length: "), NULL, 10) == strlen(body));
+    return body;
+}
+
+/**
+ * Each line of an OpenMetrics exposition is a family's TYPE or HELP, or
+ * a sample of the last family declared, and the last line is # EOF.
+ */
+static void check_openmetrics(const char *body) {
+    size_t len = strlen(body);
+    assert(len >= 6 && strcmp(body + len - 6, "# EOF\n") == 0);
+
+    char family[256] = "";
+    int samples = 0;
+    const char *line = body;
+    while (strcmp(line, "# EOF\n") != 0) {
+        const char *end = strchr(line, '\n');
+        assert(end != NULL);
+        if (strncmp(line, "# TYPE ", 7) == 0) {
+            const char *name = line + 7;
+            const char *space = strchr(name, ' ');
+            assert(space != NULL && space < end && strncmp(name, "statsrelay_", 11) == 0);
+            snprintf(family, sizeof(family), "%.*s", (int)(space - name), name);
+        } else if (strncmp(line, "# HELP ", 7) == 0) {
+            assert(strncmp(line + 7, family, strlen(family)) == 0);
+        } else {
+            assert(family[0] != '\0' && strncmp(line, family, strlen(family)) == 0);
+            const char *value = line + strlen(family);
+            while (*value != ' ' && *value != '{') {
+                value++;
+            }
+            if (*value == '{') {
+                value = strchr(value, '}');
+                assert(value != NULL && value < end);
+                value++;
+            }
+            assert(*value == ' ');
+            char *parsed;
+            strtod(value + 1, &parsed);
+            assert(parsed == end);
+            samples++;
+        }
+        line = end + 1;
+    }
+    assert(samples > 0);
+}
+
+void test_http_paths() {
+    struct proto_config config;
+    memset(&config, 0, sizeof(config));
+
+    struct stats_server_t server;
+    memset(&server, 0, sizeof(server));
+    server.config = &config;
+    server.rings = statsrelay_list_new();
+
+    loop = ev_loop_new(0);
+    httpserver_t *http = httpserver_create(loop, &server, stats_http_handler);
+    assert(http != NULL);
+    unsetenv("STATSRELAY_LISTENER_HTTP_SD");
+    assert(httpserver_bind(http, "127.0.0.1:0", true) == 0);
+    // the listening socket is also handed to a new master on a hot restart
+    int sd = atoi(getenv("STATSRELAY_LISTENER_HTTP_SD"));
+    socklen_t addr_len = sizeof(server_addr);
+    assert(getsockname(sd, (struct sockaddr *)&server_addr, &addr_len) == 0);
+
+    char *response = http_get("GET /metrics HTTP/1.0\r\n\r\n");
+    const char *body = http_body(response, "HTTP/1.0 200 OK\r\n");
+    assert(strstr(response, "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n") != NULL);
+    check_openmetrics(body);
+    assert(strstr(body, "\nstatsrelay_connections_total 0\n") != NULL);
+    free(response);
+
+    response = http_get("GET /nothing HTTP/1.0\r\n\r\n");
+    http_body(response, "HTTP/1.0 404 Not Found\r\n");
+    free(response);
+
+    response = http_get("POST /metrics HTTP/1.0\r\n\r\n");
+    http_body(response, "HTTP/1.0 405 Method Not Allowed\r\n");
+    free(response);
+
+    response = http_get("\r\n\r\n");
+    http_body(response, "HTTP/1.0 400 Bad Request\r\n");
+    free(response);
+
+    // headers that never end within HTTP_REQUEST_MAX are refused
+    char request[HTTP_REQUEST_MAX + 16];
+    memset(request, 'x', sizeof(request));
+    memcpy(request, "GET /metrics HTTP/1.0\r\nX-Long: ", 31);
+    response = http_request(request, HTTP_REQUEST_MAX);
+    http_body(response, "HTTP/1.0 431 Request Header Fields Too Large\r\n");
+    free(response);
+
+    httpserver_destroy(http);
+    assert(fcntl(sd, F_GETFD) == -1 && errno == EBADF);
+    statsrelay_list_destroy(server.rings);
+    ev_loop_destroy(loop);
+}
+
+int main(int argc, char** argv) {
+    test_http_paths();
+    return 0;
+}
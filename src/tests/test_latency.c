@@ -0,0 +1,59 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "../histogram.h"
+#include "../latency.h"
+
+void test_sampling() {
+    latency_init(0);
+    for (int i = 0; i < 100; i++) {
+        assert(!latency_sample());
+    }
+
+    latency_init(10);
+    int sampled = 0;
+    for (int i = 0; i < 1000; i++) {
+        sampled += latency_sample();
+    }
+    assert(sampled == 100);
+}
+
+void test_quantiles() {
+    latency_init(1);
+    assert(latency_quantile_ns(LATENCY_PARSE, 0.5) == 0);
+
+    // record 1..1000 ticks ago, spread evenly
+    for (uint64_t i = 1; i <= 1000; i++) {
+        latency_record(LATENCY_PARSE, latency_ticks() - i * 1000);
+    }
+    assert(latency_count(LATENCY_PARSE) == 1000);
+    assert(latency_count(LATENCY_HASH) == 0);
+
+    uint64_t p50 = latency_quantile_ns(LATENCY_PARSE, 0.5);
+    uint64_t p99 = latency_quantile_ns(LATENCY_PARSE, 0.99);
+    uint64_t max = latency_quantile_ns(LATENCY_PARSE, 1.0);
+    printf("latency: p50 %llu p99 %llu max %llu\n",
+           (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)max);
+    assert(p50 > 0 && p50 <= p99 && p99 <= max);
+    // each quantile is within 1 / HISTOGRAM_SUB_BUCKETS of the true one
+    double ratio = (double)p99 / p50;
+    assert(ratio > 1.98 * (1 - 2.0 / HISTOGRAM_SUB_BUCKETS) && ratio < 1.98 * (1 + 2.0 / HISTOGRAM_SUB_BUCKETS));
+
+    assert(latency_count_below_ns(LATENCY_PARSE, 2 * max) == 1000);
+    uint64_t below = latency_count_below_ns(LATENCY_PARSE, p50);
+    assert(below >= 450 && below <= 550);
+    // the mean is close to the median
+    uint64_t mean = latency_sum_ns(LATENCY_PARSE) / 1000;
+    assert(mean > p50 * 0.9 && mean < p50 * 1.1);
+
+    latency_reset();
+    assert(latency_count(LATENCY_PARSE) == 0);
+}
+
+int main(int argc, char** argv) {
+    test_sampling();
+    test_quantiles();
+    return 0;
+}
@@ -0,0 +1,53 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../loopstats.h"
+
+static void block_loop(struct ev_loop *loop, ev_timer *w, int revents) {
+    // hold the loop past the first run of the probe
+    usleep(400000);
+}
+
+static void stop_loop(struct ev_loop *loop, ev_timer *w, int revents) {
+    ev_break(loop, EVBREAK_ALL);
+}
+
+void test_blocked_loop() {
+    struct ev_loop *loop = ev_loop_new(0);
+    loopstats_init(loop);
+
+    ev_timer blocker, stopper;
+    ev_timer_init(&blocker, block_loop, 0.01, 0);
+    ev_timer_start(loop, &blocker);
+    ev_timer_init(&stopper, stop_loop, 0.6, 0);
+    ev_timer_start(loop, &stopper);
+    ev_run(loop, 0);
+
+    const histogram_t *iteration = loopstats_histogram(LOOPSTATS_ITERATION);
+    const histogram_t *poll = loopstats_histogram(LOOPSTATS_POLL);
+    const histogram_t *lag = loopstats_histogram(LOOPSTATS_TIMER_LAG);
+    printf("loopstats: %llu iterations, max %llu ns, timer lag max %llu ns\n",
+           (unsigned long long)iteration->count, (unsigned long long)iteration->max,
+           (unsigned long long)lag->max);
+    assert(iteration->count >= 2);
+    assert(poll->count >= iteration->count);
+    assert(loopstats_histogram(LOOPSTATS_CALLBACKS)->max >= 1);
+    // the blocked iteration, and the probe due in the middle of it
+    assert(iteration->max >= 400000000ULL);
+    assert(lag->count >= 1);
+    assert(lag->max >= 100000000ULL && lag->max < 300000000ULL);
+    // the time blocked in the poll is a part of the iterations
+    assert(poll->sum <= iteration->sum + poll->max);
+
+    loopstats_reset();
+    assert(loopstats_histogram(LOOPSTATS_ITERATION)->count == 0);
+    ev_loop_destroy(loop);
+}
+
+int main(int argc, char** argv) {
+    test_blocked_loop();
+    return 0;
+}
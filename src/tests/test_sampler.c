@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "../sampling.h"
 #include "../validate.h"
 
@@ -13,12 +14,511 @@ const char* c1n = "foo";
 const char* c2 = "bar:2|c";
 const char* c2n = "bar";
 
-static void print_callback(void* data, const char* key, const char* line, int len) {
+static void print_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
     char* expect = (char*)data;
     printf(" Expect: %s Got: %s \n", expect, line);
     assert(strcmp(line, expect) == 0);
 }
 
+static void hash_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                          const char* line, int len) {
+    int* flushed = (int*)data;
+    assert(key_len == strlen(key));
+    assert(hash == hashmap_hash(key, key_len));
+    (*flushed)++;
+}
+
+/**
+ * Counter and gauge samplers sharing one table keep separate buckets
+ * and separate cardinality limits for the same name.
+ */
+static void test_shared_table(validate_parsed_result_t* counter, validate_parsed_result_t* gauge) {
+    sampler_table_t* table = NULL;
+    sampler_t* counters = NULL;
+    sampler_t* gauges = NULL;
+    assert(sampler_table_init(&table) == 0);
+    assert(sampler_init(&counters, table, METRIC_COUNTER, 1, 10, 1, 10, false, -1, -1) == 0);
+    assert(sampler_init(&gauges, table, METRIC_GAUGE, 1, 10, 2, 10, false, -1, -1) == 0);
+    assert(sampler_init(&counters, table, METRIC_COUNTER, 1, 10, 1, 10, false, -1, -1) != 0);
+
+    uint32_t foo = hashmap_hash("foo", 3);
+    uint32_t bar = hashmap_hash("bar", 3);
+    assert(sampler_table_consider(table, "foo", 3, foo, counter, 0) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_table_consider(table, "foo", 3, foo, gauge, 0) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_table_consider(table, "bar", 3, bar, counter, 0) == SAMPLER_FLAGGED);
+    assert(sampler_table_consider(table, "bar", 3, bar, gauge, 0) == SAMPLER_NOT_SAMPLING);
+
+    assert(sampler_table_consider(table, "foo", 3, foo, counter, 0) == SAMPLER_SAMPLING);
+    assert(sampler_is_sampling(counters, "foo", METRIC_COUNTER) == SAMPLER_SAMPLING);
+    assert(sampler_is_sampling(gauges, "foo", METRIC_GAUGE) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_buckets(counters) == 1);
+    assert(sampler_buckets(gauges) == 2);
+    assert(sampler_memory(counters) > 0);
+
+    int flushed = 0;
+    sampler_flush(counters, hash_callback, &flushed);
+    assert(flushed == 1);
+
+    sampler_destroy(counters);
+    assert(sampler_table_consider(table, "foo", 3, foo, counter, 0) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_table_consider(table, "foo", 3, foo, gauge, 0) == SAMPLER_SAMPLING);
+    sampler_destroy(gauges);
+    sampler_table_destroy(table);
+}
+
+/**
+ * A prefix over its quota has its new keys flagged, while other
+ * prefixes keep getting new keys in.
+ */
+static void test_prefix_quota(validate_parsed_result_t* counter) {
+    sampler_table_t* table = NULL;
+    sampler_t* sampler = NULL;
+    assert(sampler_table_init(&table) == 0);
+    assert(sampler_table_track_prefixes(table, 1, 2, 16) == 0);
+    assert(sampler_table_track_prefixes(table, 1, 2, 16) != 0);
+    assert(sampler_init(&sampler, table, METRIC_COUNTER, 10, 10, 100, 10, false, -1, -1) == 0);
+
+    const char* keys[] = { "a.x", "a.y", "a.z", "b.x" };
+    sampling_result expect[] = { SAMPLER_NOT_SAMPLING, SAMPLER_NOT_SAMPLING, SAMPLER_FLAGGED,
+                                 SAMPLER_NOT_SAMPLING };
+    for (int i = 0; i < 4; i++) {
+        uint32_t hash = hashmap_hash(keys[i], 3);
+        assert(sampler_table_consider(table, keys[i], 3, hash, counter, 0) == expect[i]);
+    }
+    // known keys of a full prefix still go through
+    assert(sampler_table_consider(table, "a.x", 3, hashmap_hash("a.x", 3), counter, 0)
+           == SAMPLER_NOT_SAMPLING);
+
+    const topk_entry_t* prefixes[4];
+    assert(sampler_table_prefixes(table, prefixes, 4) == 2);
+    assert(strcmp(prefixes[0]->key, "a") == 0);
+    assert(prefixes[0]->count == 2);
+    assert(prefixes[0]->user == 1);
+    assert(prefixes[1]->count == 1);
+
+    sampler_destroy(sampler);
+    sampler_table_destroy(table);
+}
+
+/**
+ * Behind a doorkeeper a key seen once takes no bucket, and is forgotten
+ * at the end of the window.
+ */
+static void test_doorkeeper(validate_parsed_result_t* counter) {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_COUNTER, 10, 10, 100, 10, false, -1, -1) == 0);
+    assert(sampler_use_doorkeeper(sampler, 100) == 0);
+    assert(sampler_use_doorkeeper(sampler, 100) != 0);
+
+    assert(sampler_consider_counter(sampler, "once", counter) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_buckets(sampler) == 0);
+    sampler_flush(sampler, NULL, NULL);
+    assert(sampler_consider_counter(sampler, "once", counter) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_buckets(sampler) == 0);
+    assert(sampler_consider_counter(sampler, "once", counter) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_buckets(sampler) == 1);
+    assert(sampler_doorkeeper_lines(sampler) == 2);
+    sampler_destroy(sampler);
+}
+
+/**
+ * A full sampler with a memory budget makes room for a new key by
+ * evicting a cold one, never a sampled one.
+ */
+static void test_eviction(validate_parsed_result_t* counter) {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_COUNTER, 2, 10, 3, 10, false, 1, 60) == 0);
+    assert(sampler_set_memory_budget(sampler, 1 << 20) == 0);
+
+    for (int i = 0; i < 3; i++) {
+        sampler_consider_counter(sampler, "hot", counter);
+    }
+    assert(sampler_is_sampling(sampler, "hot", METRIC_COUNTER) == SAMPLER_SAMPLING);
+    sampler_consider_counter(sampler, "cold", counter);
+    sampler_consider_counter(sampler, "warm", counter);
+    assert(sampler_buckets(sampler) == 3);
+
+    // the hand clears every reference bit, then takes the first cold key
+    assert(sampler_consider_counter(sampler, "new", counter) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_evictions(sampler) == 1);
+    assert(sampler_buckets(sampler) == 3);
+    assert(sampler_is_sampling(sampler, "hot", METRIC_COUNTER) == SAMPLER_SAMPLING);
+
+    // keys seen since the hand passed stay
+    sampler_consider_counter(sampler, "new", counter);
+    sampler_consider_counter(sampler, "warm", counter);
+    sampler_consider_counter(sampler, "cold", counter);
+    assert(sampler_buckets(sampler) == 3);
+    assert(sampler_evictions(sampler) == 2);
+
+    sampler_destroy(sampler);
+}
+
+/**
+ * Behind a doorkeeper, a full sampler only evicts for a key it admits:
+ * keys seen once leave the buckets alone.
+ */
+static void test_doorkeeper_eviction(validate_parsed_result_t* counter) {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_COUNTER, 10, 10, 3, 10, false, 1, 60) == 0);
+    assert(sampler_set_memory_budget(sampler, 1 << 20) == 0);
+    assert(sampler_use_doorkeeper(sampler, 1000) == 0);
+
+    const char* keys[] = { "a", "b", "c" };
+    for (int i = 0; i < 6; i++) {
+        sampler_consider_counter(sampler, keys[i % 3], counter);
+    }
+    assert(sampler_buckets(sampler) == 3);
+
+    char key[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "once%d", i);
+        assert(sampler_consider_counter(sampler, key, counter) == SAMPLER_NOT_SAMPLING);
+    }
+    assert(sampler_evictions(sampler) == 0);
+    assert(sampler_buckets(sampler) == 3);
+
+    // a key seen again is admitted, and makes room
+    assert(sampler_consider_counter(sampler, "once7", counter) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_evictions(sampler) == 1);
+    assert(sampler_buckets(sampler) == 3);
+    sampler_destroy(sampler);
+}
+
+/* Snapshot a sampler into memory */
+static char* snapshot(sampler_t* sampler, long* len) {
+    FILE* out = tmpfile();
+    assert(sampler_snapshot(sampler, out) == 0);
+    *len = ftell(out);
+    char* data = malloc(*len);
+    rewind(out);
+    assert(fread(data, 1, *len, out) == *len);
+    fclose(out);
+    return data;
+}
+
+/**
+ * A snapshot hands sampled keys and their sums over to a new sampler,
+ * leaving the old one with nothing to flush once the handover is done.
+ */
+static void test_snapshot(validate_parsed_result_t* counter) {
+    sampler_t* old = NULL;
+    sampler_t* new = NULL;
+    assert(sampler_init(&old, NULL, METRIC_COUNTER, 2, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_init(&new, NULL, METRIC_COUNTER, 2, 10, 10, 10, false, -1, -1) == 0);
+    for (int i = 0; i < 5; i++) {
+        sampler_consider_counter(old, "hot", counter);
+    }
+    sampler_consider_counter(old, "cold", counter);
+
+    long len;
+    char* data = snapshot(old, &len);
+    // the sums stay until the handover is confirmed
+    long again_len;
+    char* again = snapshot(old, &again_len);
+    assert(again_len == len && memcmp(again, data, len) == 0);
+    free(again);
+
+    // nothing is restored from a truncated snapshot
+    for (long cut = 0; cut < len; cut++) {
+        assert(sampler_restore(new, data, cut) == 0);
+        assert(sampler_buckets(new) == 0);
+    }
+    assert(sampler_restore(new, data, len) == len);
+    assert(sampler_buckets(new) == 2);
+
+    sampler_handed_over(old);
+    int flushed = 0;
+    sampler_flush(old, hash_callback, &flushed);
+    assert(flushed == 0);
+    assert(sampler_is_sampling(new, "hot", METRIC_COUNTER) == SAMPLER_SAMPLING);
+    assert(sampler_is_sampling(new, "cold", METRIC_COUNTER) == SAMPLER_NOT_SAMPLING);
+    // the lines counted before the snapshot add up with the ones after
+    sampler_consider_counter(new, "hot", counter);
+    sampler_flush(new, print_callback, "hot:1|c@0.25\n");
+
+    free(data);
+    sampler_destroy(old);
+    sampler_destroy(new);
+}
+
+/**
+ * Keys flushed in slices are each flushed once over the slices of a
+ * window, and spread over them.
+ */
+static void test_flush_slices(validate_parsed_result_t* counter) {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_COUNTER, 1, 8, 1000, 10, false, -1, -1) == 0);
+    assert(sampler_set_flush_slices(sampler, 0) != 0);
+    assert(sampler_set_flush_slices(sampler, 4) == 0);
+    assert(sampler_flush_interval(sampler) == 2.0);
+
+    char key[32];
+    for (int i = 0; i < 400; i++) {
+        snprintf(key, sizeof(key), "key.%d", i);
+        for (int j = 0; j < 3; j++) {
+            sampler_consider_counter(sampler, key, counter);
+        }
+    }
+    assert(sampler_active(sampler) == 400);
+
+    int total = 0;
+    for (int slice = 0; slice < 4; slice++) {
+        int flushed = 0;
+        sampler_flush_slice(sampler, hash_callback, &flushed);
+        assert(flushed > 50 && flushed < 150);
+        total += flushed;
+    }
+    assert(total == 400);
+    assert(sampler_set_flush_slices(sampler, 2) != 0);
+    sampler_destroy(sampler);
+}
+
+/**
+ * A backend falling behind halves the threshold of its keys, and keys
+ * sampled under the lower threshold stay sampled while it holds.
+ */
+static void test_threshold_shift(validate_parsed_result_t* counter) {
+    sampler_table_t* table = NULL;
+    sampler_t* sampler = NULL;
+    assert(sampler_table_init(&table) == 0);
+    assert(sampler_init(&sampler, table, METRIC_COUNTER, 8, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_effective_threshold(sampler, 0) == 8);
+    assert(sampler_effective_threshold(sampler, 2) == 2);
+    assert(sampler_effective_threshold(sampler, 10) == 1);
+
+    uint32_t foo = hashmap_hash("foo", 3);
+    for (int i = 0; i < 2; i++) {
+        assert(sampler_table_consider(table, "foo", 3, foo, counter, 2) == SAMPLER_NOT_SAMPLING);
+    }
+    assert(sampler_table_consider(table, "foo", 3, foo, counter, 2) == SAMPLER_SAMPLING);
+    sampler_update_flags(sampler);
+    assert(sampler_active(sampler) == 1);
+
+    /* Relaxed again, three lines a window are too few */
+    for (int i = 0; i < 3; i++) {
+        assert(sampler_table_consider(table, "foo", 3, foo, counter, 0) == SAMPLER_SAMPLING);
+    }
+    sampler_update_flags(sampler);
+    assert(sampler_active(sampler) == 0);
+
+    sampler_destroy(sampler);
+    sampler_table_destroy(table);
+}
+
+/**
+ * In aggregate_all mode every key is sampled from its first line:
+ * counters relay their sum, gauges their last value.
+ */
+static void test_aggregate_all(validate_parsed_result_t* counter, validate_parsed_result_t* gauge) {
+    sampler_t* counters = NULL;
+    sampler_t* gauges = NULL;
+    sampler_t* timers = NULL;
+    assert(sampler_init(&counters, NULL, METRIC_COUNTER, 10, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_init(&gauges, NULL, METRIC_GAUGE, 10, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_init(&timers, NULL, METRIC_TIMER, 10, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_aggregate_all(counters) == 0);
+    assert(sampler_aggregate_all(gauges) == 0);
+    assert(sampler_aggregate_all(timers) == -1);
+
+    validate_parsed_result_t value = *gauge;
+    for (int i = 1; i <= 3; i++) {
+        assert(sampler_consider_counter(counters, "foo", counter) == SAMPLER_SAMPLING);
+        value.value = i * 2;
+        assert(sampler_consider_gauge(gauges, "foo", &value) == SAMPLER_SAMPLING);
+    }
+    sampler_flush(counters, print_callback, "foo:1|c@0.333333\n");
+    sampler_flush(gauges, print_callback, "foo:6|g\n");
+
+    /* A key quiet for a window drops out, and comes back with its next line */
+    sampler_flush(counters, print_callback, "should not match\n");
+    assert(sampler_active(counters) == 0);
+    assert(sampler_consider_counter(counters, "foo", counter) == SAMPLER_SAMPLING);
+    sampler_flush(counters, print_callback, "foo:1|c@1\n");
+
+    sampler_destroy(counters);
+    sampler_destroy(gauges);
+    sampler_destroy(timers);
+}
+
+static void lines_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
+    strncat((char*)data, line, len + 1);
+}
+
+/* Consider a gauge line as the relay would */
+static sampling_result consider_gauge(sampler_t* sampler, const char* line) {
+    validate_parsed_result_t gauge;
+    assert(validate_statsd(line, strlen(line), &gauge) == 0);
+    assert(gauge.type == METRIC_GAUGE);
+    return sampler_consider_gauge(sampler, "foo", &gauge);
+}
+
+/**
+ * Relative (signed) gauge lines are summed apart from absolute ones and
+ * relayed as one signed line after the value, so none of them are lost.
+ */
+static void test_relative_gauges() {
+    sampler_t* gauges = NULL;
+    assert(sampler_init(&gauges, NULL, METRIC_GAUGE, 10, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_aggregate_all(gauges) == 0);
+
+    char lines[256] = "";
+    assert(consider_gauge(gauges, "foo:+5|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:-3|g") == SAMPLER_SAMPLING);
+    sampler_flush(gauges, lines_callback, lines);
+    assert(strcmp(lines, "foo:+2|g\n") == 0);
+
+    lines[0] = '\0';
+    assert(consider_gauge(gauges, "foo:10|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:+5|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:-3.5|g") == SAMPLER_SAMPLING);
+    sampler_flush(gauges, lines_callback, lines);
+    assert(strcmp(lines, "foo:10|g\nfoo:+1.5|g\n") == 0);
+
+    /* An absolute value overrides the changes before it */
+    lines[0] = '\0';
+    assert(consider_gauge(gauges, "foo:+5|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:7|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:-1|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:4|g") == SAMPLER_SAMPLING);
+    sampler_flush(gauges, lines_callback, lines);
+    assert(strcmp(lines, "foo:4|g\n") == 0);
+    sampler_destroy(gauges);
+
+    /* Averaging gauges keep the changes apart just the same */
+    gauges = NULL;
+    assert(sampler_init(&gauges, NULL, METRIC_GAUGE, 1, 10, 10, 10, false, -1, -1) == 0);
+    assert(consider_gauge(gauges, "foo:2|g") == SAMPLER_NOT_SAMPLING);
+    assert(consider_gauge(gauges, "foo:2|g") == SAMPLER_SAMPLING);
+    lines[0] = '\0';
+    assert(consider_gauge(gauges, "foo:4|g") == SAMPLER_SAMPLING);
+    assert(consider_gauge(gauges, "foo:-1|g") == SAMPLER_SAMPLING);
+    sampler_flush(gauges, lines_callback, lines);
+    assert(strcmp(lines, "foo:3|g\nfoo:-1|g\n") == 0);
+    sampler_destroy(gauges);
+}
+
+static void count_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
+    int* lines = (int*)data;
+    assert(strstr(line, "|s\n") != NULL);
+    (*lines)++;
+}
+
+static void gauge_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
+    assert(strstr(line, "|g\n") != NULL);
+    *(double*)data = strtod(line + key_len + 1, NULL);
+}
+
+/* Parse a set member line, as the relay would */
+static validate_parsed_result_t set_member(const char* line) {
+    validate_parsed_result_t member;
+    assert(validate_statsd(line, strlen(line), &member) == 0);
+    assert(member.type == METRIC_S);
+    return member;
+}
+
+static void members_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                             const char* line, int len) {
+    char* members = (char*)data;
+    assert(strstr(line, "|s\n") != NULL);
+    strncat(members, line, len + 1);
+}
+
+/**
+ * Sampled sets relay each distinct member once per window, as the text
+ * it was sent as, or their cardinality as a gauge if configured so.
+ */
+static void test_sets() {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_S, 1, 10, 10, 10, false, -1, -1) == 0);
+
+    validate_parsed_result_t member = set_member("users:1|s");
+    assert(sampler_consider_set(sampler, "users", &member) == SAMPLER_NOT_SAMPLING);
+    const char* lines[] = { "users:12345678901234567|s", "users:12345678901234568|s",
+                            "users:0.1|s", "users:7|s", "users:07|s", "users:7.0|s",
+                            "users:123abc|s", "users:123xyz|s" };
+    for (int i = 0; i < 100; i++) {
+        member = set_member(lines[i % 8]);
+        assert(sampler_consider_set(sampler, "users", &member) == SAMPLER_SAMPLING);
+    }
+    char members[1024] = "";
+    sampler_flush(sampler, members_callback, members);
+    assert(strcmp(members,
+                  "users:12345678901234567|s\nusers:12345678901234568|s\n"
+                  "users:0.1|s\nusers:7|s\nusers:07|s\nusers:7.0|s\n"
+                  "users:123abc|s\nusers:123xyz|s\n") == 0);
+
+    /* Past the exact members, further members are relayed as they come */
+    char line[64];
+    int relayed = 0;
+    for (int i = 0; i < 5000; i++) {
+        snprintf(line, sizeof(line), "users:%d|s", i % 1000);
+        member = set_member(line);
+        relayed += sampler_consider_set(sampler, "users", &member) == SAMPLER_NOT_SAMPLING;
+    }
+    int flushed = 0;
+    sampler_flush(sampler, count_callback, &flushed);
+    // the members kept were seen five times each, the rest relayed
+    assert(flushed > 0 && relayed == 5000 - 5 * flushed);
+    sampler_destroy(sampler);
+
+    sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_S, 1, 10, 10, 10, false, -1, -1) == 0);
+    assert(sampler_flush_set_cardinality(sampler) == 0);
+    for (int i = 0; i < 30; i++) {
+        snprintf(line, sizeof(line), "users:%d|s", i % 7);
+        member = set_member(line);
+        sampler_consider_set(sampler, "users", &member);
+    }
+    sampler_flush(sampler, print_callback, "users:7|g\n");
+
+    /* Past the exact members the count is estimated */
+    for (int i = 0; i < 5000; i++) {
+        snprintf(line, sizeof(line), "users:%d|s", i);
+        member = set_member(line);
+        assert(sampler_consider_set(sampler, "users", &member) == SAMPLER_SAMPLING);
+    }
+    double estimate = 0;
+    sampler_flush(sampler, gauge_callback, &estimate);
+    assert(estimate > 4500 && estimate < 5500);
+    sampler_destroy(sampler);
+}
+
+static void stop_loop(struct ev_loop* loop, ev_timer* timer, int events) {
+    ev_break(loop, EVBREAK_ALL);
+}
+
+/**
+ * Idle keys are reclaimed by the expiry timer, keys in sampling mode
+ * are kept.
+ */
+static void test_expiry(validate_parsed_result_t* counter) {
+    struct ev_loop* loop = ev_default_loop(0);
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_COUNTER, 1, 10, 10, 10, false, 1, 1) == 0);
+
+    assert(sampler_consider_counter(sampler, "idle", counter) == SAMPLER_NOT_SAMPLING);
+    for (int i = 0; i < 3; i++) {
+        sampler_consider_counter(sampler, "busy", counter);
+    }
+    assert(sampler_is_sampling(sampler, "busy", METRIC_COUNTER) == SAMPLER_SAMPLING);
+    assert(sampler_buckets(sampler) == 2);
+
+    ev_timer stop;
+    ev_timer_init(&stop, stop_loop, 3.5, 0);
+    ev_timer_start(loop, &stop);
+    ev_run(loop, 0);
+
+    assert(sampler_buckets(sampler) == 1);
+    assert(sampler_is_sampling(sampler, "busy", METRIC_COUNTER) == SAMPLER_SAMPLING);
+    assert(sampler_is_sampling(sampler, "idle", METRIC_COUNTER) == SAMPLER_NOT_SAMPLING);
+    sampler_destroy(sampler);
+}
+
 int main(int argc, char** argv) {
 
     validate_parsed_result_t c1_res, c2_res;
@@ -28,7 +528,7 @@ int main(int argc, char** argv) {
     assert(c2_res.type == METRIC_COUNTER);
 
     sampler_t *sampler = NULL;
-    sampler_init(&sampler, 10, 10, 10, 10, true, -1, -1);
+    sampler_init(&sampler, NULL, METRIC_COUNTER, 10, 10, 10, 10, true, -1, -1);
     assert(sampler != NULL);
 
     // the expiry timer watcher must not be initialized
@@ -76,6 +576,7 @@ int main(int argc, char** argv) {
 
     /* foo should still be sampling (it does so across two periods) - lets check */
     assert(sampler_is_sampling(sampler, c1n, METRIC_COUNTER) == SAMPLER_SAMPLING);
+    assert(sampler_active(sampler) == 1);
 
     /* Check with a counter thats not just 1 */
     for (int i = 0; i < 10; i++) {
@@ -99,6 +600,28 @@ int main(int argc, char** argv) {
 
     /* foo should now not be sampling */
     assert(sampler_is_sampling(sampler, c1n, METRIC_COUNTER) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_active(sampler) == 1);
+
+    /* Without events bar drops out of sampling after one quiet window */
+    sampler_update_flags(sampler);
+    assert(sampler_is_sampling(sampler, c2n, METRIC_COUNTER) == SAMPLER_NOT_SAMPLING);
+    assert(sampler_active(sampler) == 0);
+    sampler_destroy(sampler);
+
+    validate_parsed_result_t g_res;
+    validate_statsd("foo:1|g", 7, &g_res);
+    test_shared_table(&c1_res, &g_res);
+    test_threshold_shift(&c1_res);
+    test_prefix_quota(&c1_res);
+    test_doorkeeper(&c1_res);
+    test_doorkeeper_eviction(&c1_res);
+    test_eviction(&c1_res);
+    test_snapshot(&c1_res);
+    test_flush_slices(&c1_res);
+    test_aggregate_all(&c1_res, &g_res);
+    test_relative_gauges();
+    test_sets();
+    test_expiry(&c1_res);
 
     return 0;
 }
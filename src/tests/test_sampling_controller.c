@@ -0,0 +1,88 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <string.h>
+
+#include "../stats.h"
+
+#define QUEUE 1000
+
+static stats_backend_t backend;
+static stats_backend_t *backends[] = { &backend };
+
+/* Make the backend's send queue depth bytes deep */
+static void set_depth(size_t depth) {
+    buffer_consume(&backend.client.send_queue, buffer_datacount(&backend.client.send_queue));
+    buffer_realign(&backend.client.send_queue);
+    while (buffer_spacecount(&backend.client.send_queue) < depth) {
+        assert(buffer_expand(&backend.client.send_queue) == 0);
+    }
+    memset(buffer_tail(&backend.client.send_queue), 'x', depth);
+    buffer_produced(&backend.client.send_queue, depth);
+}
+
+void test_watermarks() {
+    struct proto_config config;
+    memset(&config, 0, sizeof(config));
+    config.max_send_queue = QUEUE;
+    config.sampling_high_watermark = 0.5;
+    config.sampling_low_watermark = 0.1;
+
+    struct stats_server_t server;
+    memset(&server, 0, sizeof(server));
+    server.config = &config;
+    server.backend_list = backends;
+    server.num_backends = 1;
+
+    memset(&backend, 0, sizeof(backend));
+    backend.key = "127.0.0.1:8125:tcp";
+    assert(buffer_init(&backend.client.send_queue) == 0);
+
+    // between the watermarks nothing changes
+    set_depth(300);
+    stats_adjust_sampling(&server);
+    assert(backend.sampling_shift == 0);
+
+    // above the high watermark and growing, one halving per tick
+    for (int tick = 1; tick <= 3; tick++) {
+        set_depth(500 + tick * 10);
+        stats_adjust_sampling(&server);
+        assert(backend.sampling_shift == tick);
+    }
+
+    // above the high watermark but draining, the shift holds
+    set_depth(520);
+    backend.bytes_sent = 200;
+    stats_adjust_sampling(&server);
+    assert(backend.sampling_shift == 3);
+    assert(backend.drain_rate == 200);
+
+    // held at the most halvings
+    for (int tick = 0; tick < 2 * SAMPLING_MAX_SHIFT; tick++) {
+        set_depth(600);
+        stats_adjust_sampling(&server);
+    }
+    assert(backend.sampling_shift == SAMPLING_MAX_SHIFT);
+
+    // back between the watermarks nothing changes
+    set_depth(300);
+    stats_adjust_sampling(&server);
+    assert(backend.sampling_shift == SAMPLING_MAX_SHIFT);
+
+    // below the low watermark, raised back one step per tick
+    set_depth(100);
+    stats_adjust_sampling(&server);
+    assert(backend.sampling_shift == SAMPLING_MAX_SHIFT - 1);
+    for (int tick = 0; tick < 2 * SAMPLING_MAX_SHIFT; tick++) {
+        set_depth(0);
+        stats_adjust_sampling(&server);
+    }
+    assert(backend.sampling_shift == 0);
+
+    buffer_destroy(&backend.client.send_queue);
+}
+
+int main(int argc, char** argv) {
+    test_watermarks();
+    return 0;
+}
@@ -0,0 +1,115 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../sketch.h"
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void assert_relative(double estimate, double exact, double error) {
+    assert(fabs(estimate - exact) <= error * exact);
+}
+
+void test_empty() {
+    sketch_t sketch;
+    sketch_init(&sketch);
+    assert(sketch_count(&sketch) == 0);
+    assert(sketch_quantile(&sketch, 0.5) == 0);
+}
+
+void test_accuracy() {
+    enum { N = 100000 };
+    static double values[N];
+    sketch_t sketch;
+    sketch_init(&sketch);
+
+    srand(42);
+    for (int i = 0; i < N; i++) {
+        /* latencies spread over four decades */
+        values[i] = pow(10, 4.0 * rand() / RAND_MAX) / 10;
+        sketch_add(&sketch, values[i]);
+    }
+    qsort(values, N, sizeof(double), compare_double);
+
+    assert(sketch_count(&sketch) == N);
+    assert(sketch_quantile(&sketch, 0) == values[0]);
+    assert(sketch_quantile(&sketch, 1) == values[N - 1]);
+
+    double qs[] = { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999 };
+    for (int i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        double exact = values[(int)(qs[i] * (N - 1))];
+        assert_relative(sketch_quantile(&sketch, qs[i]), exact, SKETCH_ALPHA);
+    }
+}
+
+void test_zero_and_negative() {
+    sketch_t sketch;
+    sketch_init(&sketch);
+    for (int i = 0; i < 50; i++) {
+        sketch_add(&sketch, 0);
+    }
+    sketch_add(&sketch, -3);
+    for (int i = 0; i < 49; i++) {
+        sketch_add(&sketch, 100);
+    }
+    assert(sketch_quantile(&sketch, 0) == -3);
+    assert(sketch_quantile(&sketch, 0.25) <= SKETCH_MIN_VALUE);
+    assert_relative(sketch_quantile(&sketch, 0.75), 100, SKETCH_ALPHA);
+}
+
+void test_collapse() {
+    sketch_t sketch;
+    sketch_init(&sketch);
+
+    /* Far more decades than the bins cover: the low end collapses */
+    for (int e = -12; e <= 12; e++) {
+        sketch_add(&sketch, pow(10, e));
+    }
+    assert(sketch.hi - sketch.lo < SKETCH_BINS);
+    assert(sketch_quantile(&sketch, 0) == 1e-12);
+    assert(sketch_quantile(&sketch, 1) == 1e12);
+    /* the high quantiles keep their accuracy */
+    assert_relative(sketch_quantile(&sketch, 23.0 / 24), 1e11, SKETCH_ALPHA);
+
+    /* and a value below the window lands in its lowest bin */
+    sketch_add(&sketch, 1e-15);
+    assert(sketch.hi - sketch.lo < SKETCH_BINS);
+    assert(sketch_count(&sketch) == 26);
+}
+
+void test_merge() {
+    sketch_t a, b, both;
+    sketch_init(&a);
+    sketch_init(&b);
+    sketch_init(&both);
+
+    for (int i = 1; i <= 1000; i++) {
+        sketch_add(i % 2 ? &a : &b, i);
+        sketch_add(&both, i);
+    }
+    sketch_merge(&a, &b);
+
+    assert(sketch_count(&a) == 1000);
+    assert(a.min == 1 && a.max == 1000);
+    for (double q = 0.05; q < 1; q += 0.05) {
+        assert(sketch_quantile(&a, q) == sketch_quantile(&both, q));
+    }
+
+    sketch_clear(&a);
+    assert(sketch_count(&a) == 0);
+}
+
+int main(int argc, char** argv) {
+    test_empty();
+    test_accuracy();
+    test_zero_and_negative();
+    test_collapse();
+    test_merge();
+    return 0;
+}
@@ -0,0 +1,82 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../slab.h"
+
+void test_size_classes() {
+    slab_t *slab;
+    size_t sizes[][2] = { {1, 16}, {17, 32}, {40, 48}, {129, 160}, {200, 224}, {1000, 1024} };
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        assert(slab_init(&slab, sizes[i][0]) == 0);
+        assert(slab_object_size(slab) == sizes[i][1]);
+        slab_destroy(slab);
+    }
+}
+
+void test_alloc_free() {
+    slab_t *slab;
+    assert(slab_init(&slab, 48) == 0);
+
+    enum { N = 10000 };
+    static char *objects[N];
+    for (int i = 0; i < N; i++) {
+        objects[i] = slab_alloc(slab);
+        assert(objects[i] != NULL);
+        memset(objects[i], i & 0xff, 48);
+    }
+    assert(slab_count(slab) == N);
+    size_t memory = slab_memory(slab);
+    assert(memory >= N * 48);
+
+    /* Objects never overlap */
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < 48; j++) {
+            assert((unsigned char)objects[i][j] == (i & 0xff));
+        }
+    }
+
+    /* Freed objects are reused before new pages are taken */
+    for (int i = 0; i < N; i += 2) {
+        slab_free(slab, objects[i]);
+    }
+    assert(slab_count(slab) == N / 2);
+    for (int i = 0; i < N; i += 2) {
+        objects[i] = slab_alloc(slab);
+    }
+    assert(slab_memory(slab) == memory);
+
+    /* Trimming releases only empty pages */
+    for (int i = 0; i < N; i++) {
+        slab_free(slab, objects[i]);
+    }
+    assert(slab_count(slab) == 0);
+    assert(slab_memory(slab) == memory);
+    slab_trim(slab);
+    assert(slab_memory(slab) == 0);
+
+    assert(slab_alloc(slab) != NULL);
+    slab_destroy(slab);
+}
+
+void test_large_objects() {
+    slab_t *slab;
+    assert(slab_init(&slab, 100000) == 0);
+    char *a = slab_alloc(slab);
+    char *b = slab_alloc(slab);
+    assert(a != NULL && b != NULL);
+    assert(a + slab_object_size(slab) <= b || b + slab_object_size(slab) <= a);
+    slab_free(slab, a);
+    assert(slab_alloc(slab) == a);
+    slab_destroy(slab);
+}
+
+int main(int argc, char **argv) {
+    test_size_classes();
+    test_alloc_free();
+    test_large_objects();
+    return 0;
+}
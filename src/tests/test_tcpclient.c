@@ -0,0 +1,185 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "../tcpclient.h"
+
+static struct ev_loop *loop;
+
+/* Let the loop clock move on by more than one age resolution */
+static void step() {
+    usleep((useconds_t)(TCPCLIENT_AGE_RESOLUTION * 1.5 * 1e6));
+    ev_now_update(loop);
+}
+
+/* Enqueue a line, returning the loop time it was enqueued at */
+static ev_tstamp send_line(tcpclient_t *client, const char *line) {
+    assert(tcpclient_sendall(client, line, strlen(line)) == 0);
+    return ev_now(loop);
+}
+
+static int listen_local(char *port, size_t port_len) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sd >= 0);
+    assert(bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(sd, 1) == 0);
+    assert(getsockname(sd, (struct sockaddr *)&addr, &len) == 0);
+    snprintf(port, port_len, "%d", ntohs(addr.sin_port));
+    return sd;
+}
+
+void test_queue_age() {
+    struct proto_config config;
+    memset(&config, 0, sizeof(config));
+    config.max_send_queue = TCPCLIENT_SEND_QUEUE;
+
+    char port[16];
+    int listener = listen_local(port, sizeof(port));
+
+    loop = ev_loop_new(0);
+    tcpclient_t client;
+    assert(tcpclient_init(&client, loop, NULL, "127.0.0.1", port, "tcp", &config) == 0);
+    assert(tcpclient_queue_age(&client) == 0);
+    assert(client.queue_high_water == 0);
+
+    // while connecting everything stays queued, one mark per step up
+    // to the ring size after which bytes share the last mark
+    ev_tstamp first = send_line(&client, "a\n");
+    assert(client.state == STATE_CONNECTING);
+    assert(tcpclient_queue_age(&client) == 0);
+    for (int i = 1; i < TCPCLIENT_AGE_MARKS + 2; i++) {
+        step();
+        send_line(&client, "a\n");
+    }
+    assert(client.mark_count == TCPCLIENT_AGE_MARKS);
+    assert(tcpclient_queue_age(&client) == ev_now(loop) - first);
+    assert(tcpclient_queue_age(&client) >= (TCPCLIENT_AGE_MARKS + 1) * TCPCLIENT_AGE_RESOLUTION);
+    size_t queued = (TCPCLIENT_AGE_MARKS + 2) * 2;
+    assert(client.enqueued == queued);
+    assert(client.queue_high_water == queued);
+
+    // more lines within one resolution share the last mark
+    send_line(&client, "a\n");
+    assert(client.mark_count == TCPCLIENT_AGE_MARKS);
+    queued += 2;
+
+    // once connected the queue drains, resetting the marks
+    for (int i = 0; i < 1000 && buffer_datacount(&client.send_queue) > 0; i++) {
+        ev_run(loop, EVRUN_NOWAIT);
+    }
+    assert(client.state == STATE_CONNECTED);
+    assert(buffer_datacount(&client.send_queue) == 0);
+    assert(client.dequeued == queued);
+    assert(client.mark_count == 0);
+    assert(tcpclient_queue_age(&client) == 0);
+    assert(client.queue_high_water == queued);
+    tcpclient_reset_high_water(&client);
+    assert(client.queue_high_water == 0);
+    int peer = accept(listener, NULL, NULL);
+    assert(peer >= 0);
+
+    // fill the socket so the next send would block; the peer never reads
+    int sndbuf = 4096;
+    assert(setsockopt(client.sd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    char junk[4096];
+    memset(junk, 'x', sizeof(junk));
+    while (send(client.sd, junk, sizeof(junk), 0) > 0) {
+    }
+    assert(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    // a blocked send is counted and leaves the queue and its age alone
+    step();
+    ev_tstamp t0 = send_line(&client, "line0\n");
+    size_t sends = client.sends;
+    ev_invoke(loop, &client.write_watcher.watcher, EV_WRITE);
+    assert(client.sends == sends + 1);
+    assert(client.send_eagain == 1);
+    assert(buffer_datacount(&client.send_queue) == 6);
+    assert(client.dequeued == queued);
+    assert(tcpclient_queue_age(&client) == ev_now(loop) - t0);
+    assert(client.queue_high_water == 6);
+
+    step();
+    ev_tstamp t1 = send_line(&client, "line1\n");
+    step();
+    ev_tstamp t2 = send_line(&client, "line2\n");
+    assert(client.mark_count == 3);
+    tcpclient_reset_high_water(&client);
+    assert(client.queue_high_water == 18);
+
+    // a failed send drops the line at the head, the age then runs from
+    // the next line's mark
+    assert(shutdown(client.sd, SHUT_WR) == 0);
+    ev_invoke(loop, &client.write_watcher.watcher, EV_WRITE);
+    assert(client.state == STATE_BACKOFF);
+    assert(client.send_eagain == 1);
+    assert(buffer_datacount(&client.send_queue) == 12);
+    assert(client.dequeued == queued + 6);
+    assert(client.mark_count == 2);
+    assert(tcpclient_queue_age(&client) == ev_now(loop) - t1);
+
+    // queued while backing off, the marks wrap around the ring
+    step();
+    ev_tstamp t3 = send_line(&client, "line3\n");
+    step();
+    ev_tstamp t4 = send_line(&client, "line4\n");
+    assert(client.mark_count == TCPCLIENT_AGE_MARKS);
+    assert((client.mark_head + client.mark_count - 1) % TCPCLIENT_AGE_MARKS < client.mark_head);
+    step();
+    send_line(&client, "line5\n");
+    assert(client.mark_count == TCPCLIENT_AGE_MARKS);
+    assert(tcpclient_queue_age(&client) == ev_now(loop) - t1);
+
+    // failed sends on the closed socket drop one line each, the head
+    // mark following across the wrap
+    ev_tstamp expect[] = { t2, t3, t4 };
+    for (int i = 0; i < 3; i++) {
+        ev_invoke(loop, &client.write_watcher.watcher, EV_WRITE);
+        assert(client.dequeued == queued + 6 * (i + 2));
+        assert(tcpclient_queue_age(&client) == ev_now(loop) - expect[i]);
+    }
+    assert(client.mark_head == 0);
+
+    // line5 shares line4's mark, so dropping line4 keeps the age
+    ev_invoke(loop, &client.write_watcher.watcher, EV_WRITE);
+    assert(client.mark_count == 1);
+    assert(tcpclient_queue_age(&client) == ev_now(loop) - t4);
+
+    // dropping the last line empties the queue and its marks
+    ev_invoke(loop, &client.write_watcher.watcher, EV_WRITE);
+    assert(buffer_datacount(&client.send_queue) == 0);
+    assert(client.dequeued == client.enqueued);
+    assert(client.mark_count == 0);
+    assert(tcpclient_queue_age(&client) == 0);
+    assert(client.queue_high_water == 30);
+
+    // the failed sends already closed the socket
+    client.sd = -1;
+    tcpclient_destroy(&client);
+    close(peer);
+    close(listener);
+    ev_loop_destroy(loop);
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    test_queue_age();
+    return 0;
+}
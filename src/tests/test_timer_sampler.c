@@ -1,8 +1,11 @@
 #undef NDEBUG
 
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include "../sampling.h"
 #include "../log.h"
 #include "../validate.h"
@@ -16,7 +19,8 @@ const char* t2n = "envoy.downstream_cx_length_ms";
 const char* t3 = "foo:12|ms|@0.2";
 const char* t3n = "foo";
 
-static void print_callback(void* data, const char* key, const char* line, int len) {
+static void print_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                           const char* line, int len) {
     char* expect = (char*)data;
     char* buffer = (char*)malloc(strlen(line) * sizeof(char) + 1);
 
@@ -34,6 +38,145 @@ static void print_callback(void* data, const char* key, const char* line, int le
     free(buffer);
 }
 
+#define DECILES 10
+
+struct reservoir_stats {
+    int samples;
+    int deciles[DECILES];
+    double range;
+};
+
+static void collect_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                             const char* line, int len) {
+    struct reservoir_stats* stats = (struct reservoir_stats*)data;
+    double value = strtod(line + key_len + 1, NULL);
+    int decile = (int)(value * DECILES / stats->range);
+    assert(decile >= 0 && decile < DECILES);
+    stats->deciles[decile]++;
+    stats->samples++;
+}
+
+/**
+ * Every window flushes exactly reservoir_size values, and across windows
+ * each part of the stream is equally likely to be sampled.
+ */
+static void test_reservoir_accuracy() {
+    const int reservoir_size = 100;
+    const int stream = 10000;
+    const int windows = 200;
+
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_TIMER, 1, 10, 10, reservoir_size, false, -1, -1) == 0);
+
+    validate_parsed_result_t parsed = { .value = 0, .type = METRIC_TIMER, .presampling_value = 1.0 };
+    struct reservoir_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.range = stream;
+
+    for (int w = 0; w < windows; w++) {
+        int before = stats.samples;
+        // a shuffled order keeps the upper/lower tracking from biasing the stream
+        for (int i = 0; i < stream; i++) {
+            parsed.value = (i * 7919) % stream;
+            sampler_consider_timer(sampler, "timer", &parsed);
+        }
+        sampler_flush(sampler, collect_callback, &stats);
+        assert(w == 0 || stats.samples - before == reservoir_size);
+    }
+
+    double expected = (double)stats.samples / DECILES;
+    double chi2 = 0;
+    for (int d = 0; d < DECILES; d++) {
+        chi2 += (stats.deciles[d] - expected) * (stats.deciles[d] - expected) / expected;
+    }
+    printf("reservoir chi-square over %d deciles: %.2f\n", DECILES, chi2);
+    // 9 degrees of freedom, p < 0.001
+    assert(chi2 < 27.88);
+
+    sampler_destroy(sampler);
+}
+
+static void discard_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                             const char* line, int len) {
+}
+
+struct sketch_lines {
+    int lines;
+    double min;
+    double max;
+    double rate;
+};
+
+static void sketch_callback(void* data, const char* key, size_t key_len, uint32_t hash,
+                            const char* line, int len) {
+    struct sketch_lines* out = (struct sketch_lines*)data;
+    char* end;
+    double value = strtod(line + key_len + 1, &end);
+    assert(strncmp(end, "|ms@", 4) == 0);
+    out->rate = strtod(end + 4, NULL);
+    if (out->lines == 0 || value < out->min) out->min = value;
+    if (out->lines == 0 || value > out->max) out->max = value;
+    out->lines++;
+}
+
+/**
+ * In sketch mode a sampled timer relays a fixed number of values per
+ * window, spanning its distribution, at a rate that preserves its count.
+ */
+static void test_sketch_summary() {
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_TIMER, 1, 10, 10, 100, true, -1, -1) == 0);
+    assert(sampler_use_sketch(sampler, 5) == 0);
+
+    validate_parsed_result_t parsed = { .value = 1, .type = METRIC_TIMER, .presampling_value = 1.0 };
+    // start sampling
+    for (int i = 0; i < 3; i++) {
+        sampler_consider_timer(sampler, "timer", &parsed);
+    }
+    sampler_flush(sampler, discard_callback, NULL);
+    assert(sampler_use_sketch(sampler, 5) == -1);
+
+    for (int i = 1; i <= 1000; i++) {
+        parsed.value = i;
+        assert(sampler_consider_timer(sampler, "timer", &parsed) == SAMPLER_SAMPLING);
+    }
+    struct sketch_lines out;
+    memset(&out, 0, sizeof(out));
+    sampler_flush(sampler, sketch_callback, &out);
+    assert(out.lines == 5);
+    assert(out.min == 1 && out.max == 1000);
+    assert(fabs(out.rate - 5.0 / 1000) < 1e-9);
+
+    // the sketch is reset every window
+    parsed.value = 7;
+    sampler_consider_timer(sampler, "timer", &parsed);
+    memset(&out, 0, sizeof(out));
+    sampler_flush(sampler, sketch_callback, &out);
+    assert(out.lines == 1 && out.min == 7 && out.rate == 1);
+
+    sampler_destroy(sampler);
+}
+
+static void test_reservoir_benchmark() {
+    const int values = 10000000;
+    sampler_t* sampler = NULL;
+    assert(sampler_init(&sampler, NULL, METRIC_TIMER, 1, 10, 10, 100, false, -1, -1) == 0);
+
+    validate_parsed_result_t parsed = { .value = 1, .type = METRIC_TIMER, .presampling_value = 1.0 };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < values; i++) {
+        parsed.value = i & 1023;
+        sampler_consider_timer(sampler, "timer", &parsed);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sampler_flush(sampler, discard_callback, NULL);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("sampled timer values: %.1f ns/value\n", ns / values);
+    sampler_destroy(sampler);
+}
+
 int main(int argc, char** argv) {
     validate_parsed_result_t t1_res, t2_res, t3_res;
     validate_statsd(t1, strlen(t1), &t1_res);
@@ -44,7 +187,7 @@ int main(int argc, char** argv) {
     assert(t3_res.type == METRIC_TIMER);
 
     sampler_t *sampler = NULL;
-    sampler_init(&sampler, 10, 10, 5, 10, true, 10, 10);
+    sampler_init(&sampler, NULL, METRIC_TIMER, 10, 10, 5, 10, true, 10, 10);
 
     assert(sampler != NULL);
 
@@ -122,5 +265,9 @@ int main(int argc, char** argv) {
     assert(is_expiry_watcher_active(sampler) == false);
     assert(is_expiry_watcher_pending(sampler) == false);
 
+    test_reservoir_accuracy();
+    test_sketch_summary();
+    test_reservoir_benchmark();
+
     return 0;
 }
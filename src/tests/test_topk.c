@@ -0,0 +1,127 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hashmap.h"
+#include "../topk.h"
+
+static topk_entry_t *add(topk_t *topk, const char *key, uint64_t delta) {
+    return topk_add(topk, key, strlen(key), hashmap_hash(key, strlen(key)), delta);
+}
+
+static void sub(topk_t *topk, const char *key, uint64_t delta) {
+    topk_sub(topk, key, strlen(key), hashmap_hash(key, strlen(key)), delta);
+}
+
+static topk_entry_t *find(topk_t *topk, const char *key) {
+    return topk_find(topk, key, strlen(key), hashmap_hash(key, strlen(key)));
+}
+
+void test_exact_below_capacity() {
+    topk_t *topk;
+    assert(topk_init(&topk, 8) == 0);
+    add(topk, "a", 5);
+    add(topk, "b", 1);
+    add(topk, "a", 2);
+    assert(find(topk, "a")->count == 7);
+    assert(find(topk, "a")->error == 0);
+    assert(find(topk, "c") == NULL);
+
+    sub(topk, "a", 3);
+    assert(find(topk, "a")->count == 4);
+    sub(topk, "b", 5);
+    assert(find(topk, "b")->count == 0);
+
+    const topk_entry_t *list[8];
+    assert(topk_list(topk, list, 8) == 2);
+    assert(strcmp(list[0]->key, "a") == 0);
+    topk_destroy(topk);
+}
+
+/**
+ * Keys heavier than total / capacity are always found, with counts
+ * bounding their true count from above by at most their error.
+ */
+void test_heavy_hitters() {
+    enum { KEYS = 5000, CAPACITY = 64 };
+    static uint64_t truth[KEYS];
+    topk_t *topk;
+    assert(topk_init(&topk, CAPACITY) == 0);
+
+    srand(7);
+    uint64_t total = 0;
+    char key[32];
+    for (int i = 0; i < 200000; i++) {
+        // a few heavy keys over a long tail
+        int k = rand() % 4 == 0 ? rand() % 8 : rand() % KEYS;
+        snprintf(key, sizeof(key), "team%d.service", k);
+        add(topk, key, 1);
+        truth[k]++;
+        total++;
+    }
+
+    for (int k = 0; k < KEYS; k++) {
+        snprintf(key, sizeof(key), "team%d.service", k);
+        topk_entry_t *entry = find(topk, key);
+        if (truth[k] > total / CAPACITY) {
+            assert(entry != NULL);
+        }
+        if (entry != NULL) {
+            assert(entry->count >= truth[k]);
+            assert(entry->count - entry->error <= truth[k]);
+        }
+    }
+
+    const topk_entry_t *list[8];
+    assert(topk_list(topk, list, 8) == 8);
+    for (int i = 0; i < 8; i++) {
+        assert(strncmp(list[i]->key, "team", 4) == 0);
+        assert(atoi(list[i]->key + 4) < 8);
+    }
+    printf("topk: %zu bytes for %d keys\n", topk_memory(topk), CAPACITY);
+    topk_destroy(topk);
+}
+
+/* Keys sharing a hash are still counted apart */
+void test_hash_collision() {
+    topk_t *topk;
+    assert(topk_init(&topk, 4) == 0);
+    topk_add(topk, "a", 1, 42, 5);
+    topk_add(topk, "b", 1, 42, 3);
+    topk_sub(topk, "b", 1, 42, 2);
+    assert(topk_find(topk, "a", 1, 42)->count == 5);
+    assert(topk_find(topk, "b", 1, 42)->count == 1);
+    topk_sub(topk, "c", 1, 42, 5);
+    assert(topk_find(topk, "a", 1, 42)->count == 5);
+    assert(topk_find(topk, "b", 1, 42)->count == 1);
+
+    const topk_entry_t *list[4];
+    assert(topk_list(topk, list, 4) == 2);
+    assert(strcmp(list[0]->key, "a") == 0);
+    assert(strcmp(list[1]->key, "b") == 0);
+    topk_destroy(topk);
+}
+
+void test_long_keys() {
+    topk_t *topk;
+    assert(topk_init(&topk, 4) == 0);
+    char key[200];
+    memset(key, 'x', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    add(topk, key, 1);
+    add(topk, key, 1);
+    assert(find(topk, key)->count == 2);
+    assert(find(topk, key)->key_len == TOPK_KEY_MAX);
+    topk_destroy(topk);
+}
+
+int main(int argc, char** argv) {
+    test_exact_below_capacity();
+    test_heavy_hitters();
+    test_hash_collision();
+    test_long_keys();
+    return 0;
+}
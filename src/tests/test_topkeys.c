@@ -0,0 +1,59 @@
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../hashmap.h"
+#include "../topkeys.h"
+
+static void add(topkeys_t *topkeys, const char *key, uint64_t lines, uint64_t bytes) {
+    topkeys_add(topkeys, key, strlen(key), hashmap_hash(key, strlen(key)), lines, bytes);
+}
+
+void test_rankings() {
+    topkeys_t *topkeys;
+    assert(topkeys_init(&topkeys, 8) == 0);
+    // many short lines against few long ones
+    add(topkeys, "short", 100, 1000);
+    add(topkeys, "long", 10, 5000);
+
+    const topk_entry_t *entries[8];
+    assert(topkeys_list(topkeys, false, entries, 8) == 2);
+    assert(strcmp(entries[0]->key, "short") == 0 && entries[0]->count == 100);
+    assert(topkeys_list(topkeys, true, entries, 8) == 2);
+    assert(strcmp(entries[0]->key, "long") == 0 && entries[0]->count == 5000);
+    topkeys_destroy(topkeys);
+}
+
+void test_windows() {
+    topkeys_t *topkeys;
+    assert(topkeys_init(&topkeys, 8) == 0);
+    const topk_entry_t *entries[8];
+
+    // the first window is listed while in progress
+    add(topkeys, "a", 1, 10);
+    assert(topkeys_list(topkeys, false, entries, 8) == 1);
+
+    // then the window last ended, not the one counted
+    topkeys_rotate(topkeys);
+    add(topkeys, "b", 5, 50);
+    assert(topkeys_list(topkeys, false, entries, 8) == 1);
+    assert(strcmp(entries[0]->key, "a") == 0);
+
+    topkeys_rotate(topkeys);
+    assert(topkeys_list(topkeys, true, entries, 8) == 1);
+    assert(strcmp(entries[0]->key, "b") == 0 && entries[0]->count == 50);
+
+    // ended windows are forgotten
+    topkeys_rotate(topkeys);
+    assert(topkeys_list(topkeys, false, entries, 8) == 0);
+    printf("topkeys: %zu bytes for 8 keys\n", topkeys_memory(topkeys));
+    topkeys_destroy(topkeys);
+}
+
+int main(int argc, char** argv) {
+    test_rankings();
+    test_windows();
+    return 0;
+}
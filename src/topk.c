@@ -0,0 +1,236 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+
+struct topk {
+    size_t capacity;
+    size_t size;
+    topk_entry_t *entries;
+
+    /* entry numbers in a min-heap on count, and each entry's heap position */
+    uint32_t *heap;
+    uint32_t *heap_pos;
+
+    /* open addressing index on hash, entry number + 1, 0 when empty */
+    uint32_t *index;
+    size_t index_mask;
+};
+
+static inline uint64_t heap_count(topk_t *topk, size_t pos) {
+    return topk->entries[topk->heap[pos]].count;
+}
+
+static void heap_swap(topk_t *topk, size_t a, size_t b) {
+    uint32_t entry = topk->heap[a];
+    topk->heap[a] = topk->heap[b];
+    topk->heap[b] = entry;
+    topk->heap_pos[topk->heap[a]] = a;
+    topk->heap_pos[topk->heap[b]] = b;
+}
+
+static void heap_up(topk_t *topk, size_t pos) {
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (heap_count(topk, parent) <= heap_count(topk, pos)) {
+            break;
+        }
+        heap_swap(topk, parent, pos);
+        pos = parent;
+    }
+}
+
+static void heap_down(topk_t *topk, size_t pos) {
+    for (;;) {
+        size_t smallest = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+        if (left < topk->size && heap_count(topk, left) < heap_count(topk, smallest)) {
+            smallest = left;
+        }
+        if (right < topk->size && heap_count(topk, right) < heap_count(topk, smallest)) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            break;
+        }
+        heap_swap(topk, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static inline size_t index_home(topk_t *topk, uint32_t hash) {
+    return hash & topk->index_mask;
+}
+
+static void index_insert(topk_t *topk, uint32_t entry) {
+    size_t slot = index_home(topk, topk->entries[entry].hash);
+    while (topk->index[slot] != 0) {
+        slot = (slot + 1) & topk->index_mask;
+    }
+    topk->index[slot] = entry + 1;
+}
+
+/* Remove an entry from the index, shifting back the entries after it */
+static void index_remove(topk_t *topk, uint32_t entry) {
+    size_t hole = index_home(topk, topk->entries[entry].hash);
+    while (topk->index[hole] != entry + 1) {
+        hole = (hole + 1) & topk->index_mask;
+    }
+
+    size_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & topk->index_mask;
+        if (topk->index[slot] == 0) {
+            break;
+        }
+        size_t home = index_home(topk, topk->entries[topk->index[slot] - 1].hash);
+        // An entry stays put if its home lies cyclically in (hole, slot]
+        bool stays = hole <= slot ? (home > hole && home <= slot) : (home > hole || home <= slot);
+        if (!stays) {
+            topk->index[hole] = topk->index[slot];
+            hole = slot;
+        }
+    }
+    topk->index[hole] = 0;
+}
+
+static void entry_set_key(topk_entry_t *entry, const char *key, size_t key_len, uint32_t hash) {
+    if (key_len > TOPK_KEY_MAX) {
+        key_len = TOPK_KEY_MAX;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
+    entry->key_len = key_len;
+    entry->hash = hash;
+}
+
+int topk_init(topk_t **topk, size_t capacity) {
+    if (capacity == 0 || capacity > UINT32_MAX / 2) {
+        return -1;
+    }
+    topk_t *t = calloc(1, sizeof(topk_t));
+    if (t == NULL) {
+        return -1;
+    }
+    size_t index_size = 1;
+    while (index_size < 2 * capacity) {
+        index_size <<= 1;
+    }
+    t->capacity = capacity;
+    t->index_mask = index_size - 1;
+    t->entries = calloc(capacity, sizeof(topk_entry_t));
+    t->heap = calloc(capacity, sizeof(uint32_t));
+    t->heap_pos = calloc(capacity, sizeof(uint32_t));
+    t->index = calloc(index_size, sizeof(uint32_t));
+    if (t->entries == NULL || t->heap == NULL || t->heap_pos == NULL || t->index == NULL) {
+        topk_destroy(t);
+        return -1;
+    }
+    *topk = t;
+    return 0;
+}
+
+topk_entry_t *topk_find(topk_t *topk, const char *key, size_t key_len, uint32_t hash) {
+    if (key_len > TOPK_KEY_MAX) {
+        key_len = TOPK_KEY_MAX;
+    }
+    size_t slot = index_home(topk, hash);
+    while (topk->index[slot] != 0) {
+        topk_entry_t *entry = &topk->entries[topk->index[slot] - 1];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & topk->index_mask;
+    }
+    return NULL;
+}
+
+topk_entry_t *topk_add(topk_t *topk, const char *key, size_t key_len, uint32_t hash, uint64_t delta) {
+    topk_entry_t *entry = topk_find(topk, key, key_len, hash);
+    if (entry != NULL) {
+        entry->count += delta;
+        heap_down(topk, topk->heap_pos[entry - topk->entries]);
+        return entry;
+    }
+
+    uint32_t n;
+    if (topk->size < topk->capacity) {
+        n = topk->size++;
+        entry = &topk->entries[n];
+        entry->count = 0;
+        topk->heap[n] = n;
+        topk->heap_pos[n] = n;
+    } else {
+        // Take over the slot of the smallest count
+        n = topk->heap[0];
+        entry = &topk->entries[n];
+        index_remove(topk, n);
+    }
+    entry->error = entry->count;
+    entry->count += delta;
+    entry->user = 0;
+    entry_set_key(entry, key, key_len, hash);
+    index_insert(topk, n);
+
+    heap_up(topk, topk->heap_pos[n]);
+    heap_down(topk, topk->heap_pos[n]);
+    return entry;
+}
+
+void topk_sub(topk_t *topk, const char *key, size_t key_len, uint32_t hash, uint64_t delta) {
+    topk_entry_t *entry = topk_find(topk, key, key_len, hash);
+    if (entry == NULL) {
+        return;
+    }
+    entry->count -= delta < entry->count ? delta : entry->count;
+    if (entry->error > entry->count) {
+        entry->error = entry->count;
+    }
+    heap_up(topk, topk->heap_pos[entry - topk->entries]);
+}
+
+static int compare_count(const void *a, const void *b) {
+    const topk_entry_t *x = *(const topk_entry_t * const *)a;
+    const topk_entry_t *y = *(const topk_entry_t * const *)b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+size_t topk_list(topk_t *topk, const topk_entry_t **entries, size_t max) {
+    const topk_entry_t **all = malloc(topk->size * sizeof(topk_entry_t *));
+    if (all == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < topk->size; i++) {
+        all[i] = &topk->entries[i];
+    }
+    qsort(all, topk->size, sizeof(topk_entry_t *), compare_count);
+
+    size_t n = topk->size < max ? topk->size : max;
+    memcpy(entries, all, n * sizeof(topk_entry_t *));
+    free(all);
+    return n;
+}
+
+void topk_clear(topk_t *topk) {
+    topk->size = 0;
+    memset(topk->index, 0, (topk->index_mask + 1) * sizeof(uint32_t));
+}
+
+size_t topk_memory(topk_t *topk) {
+    return sizeof(topk_t) +
+        topk->capacity * (sizeof(topk_entry_t) + 2 * sizeof(uint32_t)) +
+        (topk->index_mask + 1) * sizeof(uint32_t);
+}
+
+void topk_destroy(topk_t *topk) {
+    if (topk == NULL) {
+        return;
+    }
+    free(topk->entries);
+    free(topk->heap);
+    free(topk->heap_pos);
+    free(topk->index);
+    free(topk);
+}
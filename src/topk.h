@@ -0,0 +1,74 @@
+#ifndef STATSRELAY_TOPK_H
+#define STATSRELAY_TOPK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Heaviest keys of a stream in fixed memory, by the Space-Saving
+ * algorithm (Metwally, Agrawal and El Abbadi). A fixed number of keys
+ * are counted; a key not among them takes over the slot of the key
+ * with the smallest count, inheriting that count as its error. Any key
+ * whose true count exceeds the total over the capacity is guaranteed to
+ * be counted, and a count is never below the true count.
+ *
+ * Counts can be decremented as well, for streams of keys coming and
+ * going, at the cost of the guarantee for keys that were evicted.
+ */
+typedef struct topk topk_t;
+
+/* Longer keys are truncated, and still told apart by their hash */
+#define TOPK_KEY_MAX 64
+
+typedef struct topk_entry {
+    /* at least the true count, and at most error above it */
+    uint64_t count;
+    uint64_t error;
+    /* free for the caller, cleared when the slot goes to another key */
+    uint64_t user;
+    uint32_t hash;
+    uint32_t key_len;
+    char key[TOPK_KEY_MAX + 1];
+} topk_entry_t;
+
+/**
+ * Track up to capacity keys. Returns 0 on success.
+ */
+int topk_init(topk_t **topk, size_t capacity);
+
+/**
+ * Count a key delta more times. hash must be a hash of the whole key.
+ * Returns the key's entry.
+ */
+topk_entry_t *topk_add(topk_t *topk, const char *key, size_t key_len, uint32_t hash, uint64_t delta);
+
+/**
+ * Count a key delta fewer times, if it is tracked
+ */
+void topk_sub(topk_t *topk, const char *key, size_t key_len, uint32_t hash, uint64_t delta);
+
+/**
+ * The entry of a tracked key, NULL if it is not tracked
+ */
+topk_entry_t *topk_find(topk_t *topk, const char *key, size_t key_len, uint32_t hash);
+
+/**
+ * Fill entries with up to max tracked keys, the largest counts first.
+ * Returns the number filled in. The entries are valid until the next
+ * change to the tracker.
+ */
+size_t topk_list(topk_t *topk, const topk_entry_t **entries, size_t max);
+
+/**
+ * Forget every key, keeping the memory for the next ones
+ */
+void topk_clear(topk_t *topk);
+
+/**
+ * Bytes held by the tracker
+ */
+size_t topk_memory(topk_t *topk);
+
+void topk_destroy(topk_t *topk);
+
+#endif  // STATSRELAY_TOPK_H
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+
+#include "topkeys.h"
+
+struct topkeys {
+    /* the window in progress and the one before it */
+    topk_t *lines[2];
+    topk_t *bytes[2];
+    int current;
+    /* whether a window has ended yet */
+    bool rotated;
+};
+
+int topkeys_init(topkeys_t **topkeys, size_t capacity) {
+    topkeys_t *t = calloc(1, sizeof(topkeys_t));
+    if (t == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (topk_init(&t->lines[i], capacity) != 0 || topk_init(&t->bytes[i], capacity) != 0) {
+            topkeys_destroy(t);
+            return -1;
+        }
+    }
+    *topkeys = t;
+    return 0;
+}
+
+void topkeys_add(topkeys_t *topkeys, const char *key, size_t key_len, uint32_t hash,
+                 uint64_t lines, uint64_t bytes) {
+    topk_add(topkeys->lines[topkeys->current], key, key_len, hash, lines);
+    topk_add(topkeys->bytes[topkeys->current], key, key_len, hash, bytes);
+}
+
+void topkeys_rotate(topkeys_t *topkeys) {
+    topkeys->current ^= 1;
+    topk_clear(topkeys->lines[topkeys->current]);
+    topk_clear(topkeys->bytes[topkeys->current]);
+    topkeys->rotated = true;
+}
+
+size_t topkeys_list(topkeys_t *topkeys, bool by_bytes, const topk_entry_t **entries, size_t max) {
+    int listed = topkeys->rotated ? topkeys->current ^ 1 : topkeys->current;
+    return topk_list(by_bytes ? topkeys->bytes[listed] : topkeys->lines[listed], entries, max);
+}
+
+size_t topkeys_memory(topkeys_t *topkeys) {
+    size_t memory = sizeof(topkeys_t);
+    for (int i = 0; i < 2; i++) {
+        memory += topk_memory(topkeys->lines[i]) + topk_memory(topkeys->bytes[i]);
+    }
+    return memory;
+}
+
+void topkeys_destroy(topkeys_t *topkeys) {
+    if (topkeys == NULL) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        topk_destroy(topkeys->lines[i]);
+        topk_destroy(topkeys->bytes[i]);
+    }
+    free(topkeys);
+}
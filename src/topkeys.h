@@ -0,0 +1,50 @@
+#ifndef STATSRELAY_TOPKEYS_H
+#define STATSRELAY_TOPKEYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topk.h"
+
+/**
+ * Heaviest keys by lines and by bytes over tumbling windows, each in a
+ * Space-Saving sketch of fixed capacity (see topk.h). The keys of the
+ * window last ended are listed, or of the window in progress until the
+ * first one ends, while the next window is counted beside them.
+ */
+typedef struct topkeys topkeys_t;
+
+/**
+ * Track up to capacity keys per window and ranking. Returns 0 on
+ * success.
+ */
+int topkeys_init(topkeys_t **topkeys, size_t capacity);
+
+/**
+ * Count lines and bytes for a key in the window in progress. hash must
+ * be a hash of the whole key.
+ */
+void topkeys_add(topkeys_t *topkeys, const char *key, size_t key_len, uint32_t hash,
+                 uint64_t lines, uint64_t bytes);
+
+/**
+ * End the window in progress, it is the one listed from now on
+ */
+void topkeys_rotate(topkeys_t *topkeys);
+
+/**
+ * Fill entries with up to max keys of the listed window, the most lines
+ * or bytes first. Returns the number filled in. The entries are valid
+ * until the next change to the tracker.
+ */
+size_t topkeys_list(topkeys_t *topkeys, bool by_bytes, const topk_entry_t **entries, size_t max);
+
+/**
+ * Bytes held by the tracker
+ */
+size_t topkeys_memory(topkeys_t *topkeys);
+
+void topkeys_destroy(topkeys_t *topkeys);
+
+#endif  // STATSRELAY_TOPKEYS_H
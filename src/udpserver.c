@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <ev.h>
 
@@ -223,6 +224,60 @@ void udpserver_stop_accepting_connections(udpserver_t *server) {
     }
 }
 
+/* Add the drops and queued bytes of the sockets with the given inodes */
+static int udpserver_read_proc(const char *path, ino_t *inodes, int inodes_len,
+        uint64_t *drops, uint64_t *rx_queue) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[512];
+    // skip the header
+    if (fgets(line, sizeof(line), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long tx, rx, inode, drop;
+        // sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode ref pointer drops
+        if (sscanf(line, " %*s %*s %*s %*s %lx:%lx %*s %*s %*s %*s %lu %*s %*s %lu",
+                    &tx, &rx, &inode, &drop) != 4) {
+            continue;
+        }
+        for (int i = 0; i < inodes_len; i++) {
+            if (inodes[i] == inode) {
+                *drops += drop;
+                *rx_queue += rx;
+                break;
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int udpserver_socket_stats(udpserver_t *server, uint64_t *drops, uint64_t *rx_queue) {
+    ino_t inodes[MAX_UDP_HANDLERS];
+    int inodes_len = 0;
+    struct stat st;
+
+    *drops = 0;
+    *rx_queue = 0;
+    for (int i = 0; i < server->listeners_len; i++) {
+        if (fstat(server->listener_fds[i], &st) == 0) {
+            inodes[inodes_len++] = st.st_ino;
+        }
+    }
+    if (inodes_len == 0) {
+        return 0;
+    }
+
+    int err = udpserver_read_proc("/proc/net/udp", inodes, inodes_len, drops, rx_queue);
+    // there is no udp6 table without IPv6
+    udpserver_read_proc("/proc/net/udp6", inodes, inodes_len, drops, rx_queue);
+    return err;
+}
+
 void udpserver_destroy(udpserver_t *server) {
     free(server);
 }
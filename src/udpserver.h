@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <netdb.h>
 #include <ev.h>
 
@@ -19,4 +20,12 @@ void udpserver_destroy(udpserver_t *server);
 
 void udpserver_stop_accepting_connections(udpserver_t *server);
 
+/**
+ * Datagrams the kernel dropped for want of room in the receive buffers
+ * of the listening sockets, since they were opened, and the bytes
+ * waiting in those buffers now. Read from /proc/net/udp and udp6, matched
+ * on the sockets' inodes. Returns 0 on success.
+ */
+int udpserver_socket_stats(udpserver_t *server, uint64_t *drops, uint64_t *rx_queue);
+
 #endif
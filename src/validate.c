@@ -64,6 +64,8 @@ int validate_statsd(const char *line, size_t len, validate_parsed_result_t* resu
         stats_log("validate: Invalid line \"%.*s\" missing '|'", len, line);
         return 1;
     }
+    result->value_text = start;
+    result->value_len = end - start;
     start = end + 1;
     plen = len - (start - line);
 
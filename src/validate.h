@@ -19,6 +19,9 @@ typedef enum {
 
 typedef struct {
     double value;
+    /* the value as it appears in the line, a set member is this text */
+    const char *value_text;
+    size_t value_len;
     metric_type type;
     double presampling_value;
 } validate_parsed_result_t;
@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 import contextlib
+import json
 import signal
 import socket
 import subprocess
@@ -496,6 +497,28 @@ class StatsdTestCase(TestCase):
             self.assertEqual(backends[key]['bytes_queued'],
                              backends[key]['bytes_sent'] - 56)
 
+    def test_tcp_status_variants(self):
+        with self.generate_config('tcp') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('test:1|c\n')
+            self.check_recv(fd, 'test:1|c\ntest-1.test.suffix:1|c\n')
+
+            key = '127.0.0.1:%d:tcp' % (self.statsd_listener.getsockname()[1],)
+            sender.sendall('status json\n')
+            status = json.loads(sender.recv(65536))
+            self.assertEqual(status['global']['bytes_recv_tcp'], 21)
+            self.assertEqual(status['backend:' + key]['relayed_lines'], 2)
+
+            sender.sendall('status backend %s\n' % (key,))
+            status = sender.recv(65536)
+            sender.close()
+            lines = status.rstrip('\n').split('\n')
+            self.assertIn('backend:%s relayed_lines gauge 2' % (key,), lines)
+            for line in lines:
+                self.assertTrue(line.startswith('backend:' + key))
+
     def test_udp_listener(self):
         with self.generate_config('udp') as config_path:
             self.launch_process(config_path)